@@ -393,6 +393,7 @@ bool OBSApp::InitGlobalConfigDefaults()
 #else
 	config_set_default_string(globalConfig, "Video", "Renderer", "OpenGL");
 #endif
+	config_set_default_int(globalConfig, "Video", "RenderThreads", -1);
 
 	config_set_default_bool(globalConfig, "BasicWindow", "PreviewEnabled",
 				true);
@@ -3742,6 +3742,12 @@ int OBSBasic::ResetVideo()
 	}
 
 	if (ret == OBS_VIDEO_SUCCESS) {
+		int renderThreads = (int)config_get_int(
+			App()->GlobalConfig(), "Video", "RenderThreads");
+		obs_enter_graphics();
+		gs_set_render_threads(renderThreads);
+		obs_leave_graphics();
+
 		OBSBasicStats::InitializeValues();
 		OBSProjector::UpdateMultiviewProjectors();
 	}
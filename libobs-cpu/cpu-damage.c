@@ -0,0 +1,356 @@
+/******************************************************************************
+    Copyright (C) 2020 by thestr4ng3r
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include <math.h>
+#include <util/profiler.h>
+#include "cpu-subsystem.h"
+
+/*
+ * Damage tracking and partial recomposition.
+ *
+ * Every write to a texture bumps its version and records the written
+ * rectangle in a short history. A render target that is cleared with a color
+ * starts a recording: the following blits into it are only remembered. When
+ * the target is needed (read, staged, written otherwise, end of scene), the
+ * recorded draws are compared to those that produced the current contents.
+ * Only the area affected by changed draws or changed source regions is
+ * cleared and drawn again, clipped to that area.
+ *
+ * To keep this correct, anything reading a texture calls cpu_tex_before_read
+ * and anything writing it cpu_tex_before_write, which renders recordings
+ * that would otherwise observe the wrong contents.
+ */
+
+struct cpu_recorded_draw {
+	struct cpu_blit_params params; // blend, workers and clip are set on replay
+	struct cpu_blend_state blend;
+	bool blended;
+	uint64_t src_id;
+	uint64_t src_version;
+};
+
+struct cpu_recording {
+	bool pending;     // draws have been recorded but not rendered
+	bool valid;       // prev_draws/prev_color describe the contents
+	uint64_t version; // texture version after the last recomposition
+
+	struct vec4 color;
+	DARRAY(struct cpu_recorded_draw) draws;
+	struct vec4 prev_color;
+	DARRAY(struct cpu_recorded_draw) prev_draws;
+};
+
+static const char *recompose_name = "cpu_recompose";
+
+static inline bool rect_empty(const struct cpu_rect *r)
+{
+	return r->x0 >= r->x1 || r->y0 >= r->y1;
+}
+
+static inline int64_t rect_area(const struct cpu_rect *r)
+{
+	return rect_empty(r) ? 0 : (r->x1 - r->x0) * (r->y1 - r->y0);
+}
+
+static inline void rect_union(struct cpu_rect *dst, const struct cpu_rect *r)
+{
+	if(rect_empty(r))
+		return;
+	if(rect_empty(dst))
+	{
+		*dst = *r;
+		return;
+	}
+	if(r->x0 < dst->x0) dst->x0 = r->x0;
+	if(r->y0 < dst->y0) dst->y0 = r->y0;
+	if(r->x1 > dst->x1) dst->x1 = r->x1;
+	if(r->y1 > dst->y1) dst->y1 = r->y1;
+}
+
+static inline void rect_intersect(struct cpu_rect *dst, const struct cpu_rect *r)
+{
+	if(r->x0 > dst->x0) dst->x0 = r->x0;
+	if(r->y0 > dst->y0) dst->y0 = r->y0;
+	if(r->x1 < dst->x1) dst->x1 = r->x1;
+	if(r->y1 < dst->y1) dst->y1 = r->y1;
+}
+
+static inline struct cpu_rect tex_rect(const gs_texture_t *tex)
+{
+	struct cpu_rect r = { 0, 0, tex->width, tex->height };
+	return r;
+}
+
+static inline struct cpu_rect draw_dst_rect(const struct cpu_blit_params *params)
+{
+	struct cpu_rect r = {
+		params->dst_x,
+		params->dst_y,
+		params->dst_x + params->dst_width,
+		params->dst_y + params->dst_height
+	};
+	return r;
+}
+
+void cpu_tex_mark_damage(gs_texture_t *tex, const struct cpu_rect *rect)
+{
+	struct cpu_rect r = tex_rect(tex);
+	if(rect)
+		rect_intersect(&r, rect);
+
+	memmove(tex->damage + 1, tex->damage, sizeof(tex->damage) - sizeof(tex->damage[0]));
+	tex->version++;
+	tex->damage[0].version = tex->version;
+	tex->damage[0].rect = r;
+}
+
+/*
+ * Region of tex written after it was at the given version. Returns false if
+ * the history doesn't reach back that far.
+ */
+static bool cpu_tex_damage_since(const gs_texture_t *tex, uint64_t version, struct cpu_rect *out)
+{
+	memset(out, 0, sizeof(*out));
+	if(version > tex->version || tex->version - version > CPU_DAMAGE_HISTORY)
+		return false;
+	for(uint64_t i = 0; i < tex->version - version; i++)
+		rect_union(out, &tex->damage[i].rect);
+	return true;
+}
+
+/* area of the target covered by the given source region through draw */
+static struct cpu_rect map_src_rect(const struct cpu_blit_params *params, const struct cpu_rect *src_rect)
+{
+	// filter taps reach up to two source pixels away
+	double sx = (double)params->dst_width / (double)params->src_width;
+	double sy = (double)params->dst_height / (double)params->src_height;
+	double x0 = params->dst_x + ((double)(src_rect->x0 - 2) - params->src_x) * sx;
+	double x1 = params->dst_x + ((double)(src_rect->x1 + 2) - params->src_x) * sx;
+	double y0 = params->dst_y + ((double)(src_rect->y0 - 2) - params->src_y) * sy;
+	double y1 = params->dst_y + ((double)(src_rect->y1 + 2) - params->src_y) * sy;
+
+	struct cpu_rect r = {
+		(int64_t)floor(x0 < x1 ? x0 : x1),
+		(int64_t)floor(y0 < y1 ? y0 : y1),
+		(int64_t)ceil(x0 < x1 ? x1 : x0),
+		(int64_t)ceil(y0 < y1 ? y1 : y0)
+	};
+	struct cpu_rect dst = draw_dst_rect(params);
+	rect_intersect(&r, &dst);
+	return r;
+}
+
+static bool same_draw(const struct cpu_recorded_draw *a, const struct cpu_recorded_draw *b)
+{
+	const struct cpu_blit_params *pa = &a->params;
+	const struct cpu_blit_params *pb = &b->params;
+	if(a->src_id != b->src_id || a->blended != b->blended || pa->filter != pb->filter)
+		return false;
+	if(pa->src_x != pb->src_x || pa->src_y != pb->src_y || pa->src_width != pb->src_width || pa->src_height != pb->src_height)
+		return false;
+	if(pa->dst_x != pb->dst_x || pa->dst_y != pb->dst_y || pa->dst_width != pb->dst_width || pa->dst_height != pb->dst_height)
+		return false;
+	return !a->blended || memcmp(&a->blend, &b->blend, sizeof(a->blend)) == 0;
+}
+
+/* what has to be redrawn to turn the current contents into the recorded ones */
+static struct cpu_rect recording_damage(gs_texture_t *tex, struct cpu_recording *rec)
+{
+	struct cpu_rect full = tex_rect(tex);
+	struct cpu_rect damage = { 0 };
+
+	if(!rec->valid || rec->version != tex->version || rec->draws.num != rec->prev_draws.num
+	   || memcmp(&rec->color, &rec->prev_color, sizeof(rec->color)) != 0)
+		return full;
+
+	for(size_t i = 0; i < rec->draws.num; i++)
+	{
+		struct cpu_recorded_draw *cur = rec->draws.array + i;
+		struct cpu_recorded_draw *prev = rec->prev_draws.array + i;
+		struct cpu_rect r;
+
+		if(!same_draw(cur, prev))
+		{
+			r = draw_dst_rect(&cur->params);
+			rect_union(&damage, &r);
+			r = draw_dst_rect(&prev->params);
+			rect_union(&damage, &r);
+		}
+		else if(cur->src_version != prev->src_version)
+		{
+			struct cpu_rect src_damage;
+			if(!cpu_tex_damage_since(cur->params.src, prev->src_version, &src_damage))
+				r = draw_dst_rect(&cur->params);
+			else
+				r = map_src_rect(&cur->params, &src_damage);
+			rect_union(&damage, &r);
+		}
+	}
+
+	rect_intersect(&damage, &full);
+	return damage;
+}
+
+static void recording_remove_target(gs_device_t *device, gs_texture_t *tex)
+{
+	for(size_t i = 0; i < device->recording_targets.num; i++)
+	{
+		if(device->recording_targets.array[i] == tex)
+		{
+			da_erase(device->recording_targets, i);
+			return;
+		}
+	}
+}
+
+void cpu_recording_flush(gs_texture_t *tex)
+{
+	struct cpu_recording *rec = tex->recording;
+	if(!rec || !rec->pending)
+		return;
+
+	gs_device_t *device = tex->device;
+	rec->pending = false;
+	recording_remove_target(device, tex);
+
+	struct cpu_rect damage = recording_damage(tex, rec);
+	int64_t area = rect_area(&damage);
+	device->damage_stats.recomposed_pixels += (uint64_t)area;
+	device->damage_stats.target_pixels += (uint64_t)tex->width * tex->height;
+
+	if(area)
+	{
+		profile_start(recompose_name);
+
+		cpu_tex_prepare_write(tex, area < (int64_t)tex->width * tex->height);
+		cpu_fill_rect(tex, &damage, &rec->color);
+		for(size_t i = 0; i < rec->draws.num; i++)
+		{
+			struct cpu_recorded_draw *draw = rec->draws.array + i;
+			struct cpu_blit_params params = draw->params;
+			params.blend = draw->blended ? &draw->blend : NULL;
+			params.workers = device->workers;
+			params.clip = &damage;
+			cpu_blit_texture(params);
+		}
+		cpu_tex_mark_damage(tex, &damage);
+
+		profile_end(recompose_name);
+	}
+
+	rec->version = tex->version;
+	rec->valid = true;
+	rec->prev_color = rec->color;
+
+	// swap so both arrays keep their allocations
+	struct darray tmp = rec->prev_draws.da;
+	rec->prev_draws.da = rec->draws.da;
+	rec->draws.da = tmp;
+	da_resize(rec->draws, 0);
+}
+
+void cpu_recording_flush_all(gs_device_t *device)
+{
+	while(device->recording_targets.num)
+		cpu_recording_flush(device->recording_targets.array[0]);
+}
+
+void cpu_tex_before_read(gs_texture_t *tex)
+{
+	cpu_recording_flush(tex);
+}
+
+void cpu_tex_before_write(gs_texture_t *tex)
+{
+	gs_device_t *device = tex->device;
+	if(!device)
+		return;
+
+	cpu_recording_flush(tex);
+
+	// recordings that sample tex must be rendered while it still has the old contents
+	size_t i = 0;
+	while(i < device->recording_targets.num)
+	{
+		gs_texture_t *target = device->recording_targets.array[i];
+		struct cpu_recording *rec = target->recording;
+		bool reads = false;
+		for(size_t j = 0; j < rec->draws.num && !reads; j++)
+			reads = rec->draws.array[j].params.src == tex;
+		if(reads)
+			cpu_recording_flush(target);
+		else
+			i++;
+	}
+}
+
+void cpu_recording_begin(gs_device_t *device, gs_texture_t *tex, const struct vec4 *color)
+{
+	cpu_tex_before_write(tex);
+
+	if(!tex->recording)
+		tex->recording = bzalloc(sizeof(struct cpu_recording));
+
+	struct cpu_recording *rec = tex->recording;
+	rec->pending = true;
+	rec->color = *color;
+	da_push_back(device->recording_targets, &tex);
+}
+
+bool cpu_recording_add(gs_device_t *device, const struct cpu_blit_params *params)
+{
+	struct cpu_recording *rec = params->dst->recording;
+	if(!rec || !rec->pending)
+		return false;
+
+	struct cpu_recorded_draw *draw = da_push_back_new(rec->draws);
+	draw->params = *params;
+	draw->params.blend = NULL;
+	draw->params.workers = NULL;
+	draw->params.clip = NULL;
+	draw->blended = params->blend != NULL;
+	if(params->blend)
+		draw->blend = *params->blend;
+	draw->src_id = params->src->id;
+	draw->src_version = params->src->version;
+	return true;
+}
+
+void cpu_recording_free(gs_texture_t *tex)
+{
+	struct cpu_recording *rec = tex->recording;
+	if(!rec)
+		return;
+	if(rec->pending)
+		recording_remove_target(tex->device, tex);
+	da_free(rec->draws);
+	da_free(rec->prev_draws);
+	bfree(rec);
+	tex->recording = NULL;
+}
+
+void cpu_damage_log_stats(gs_device_t *device)
+{
+	if(!device->damage_stats.frames || !device->damage_stats.target_pixels)
+		return;
+
+	double percent = 100.0 * (double)device->damage_stats.recomposed_pixels
+			/ (double)device->damage_stats.target_pixels;
+	blog(LOG_INFO, "CPU Renderer recomposed %.1f%% of render target pixels "
+			"(%llu pixels per frame on average)", percent,
+			(unsigned long long)(device->damage_stats.recomposed_pixels / device->damage_stats.frames));
+}
@@ -1,133 +1,955 @@
 
+#include <algorithm>
+#include <math.h>
+#include <util/sse-intrin.h>
+
 #include "cpu-subsystem.h"
 
-template<size_t src_bpp, size_t dst_bpp, typename CopyOp>
-static void blit_with_op(const CopyOp &op, cpu_blit_params params)
+/* below this, waking up workers costs more than the rows themselves */
+#define CPU_MIN_BAND_ROWS 16
+
+template<typename F>
+static void run_bands(cpu_workers *workers, int64_t rows, const F &f)
 {
-	CPU_BLIT_PARAMS_UNPACK
+	cpu_workers_run(workers, rows, CPU_MIN_BAND_ROWS, [](void *param, int64_t begin, int64_t end) {
+		(*(const F *)param)(begin, end);
+	}, (void *)&f);
+}
+
+#define CPU_BILINEAR_SHIFT 8
+#define CPU_BILINEAR_ONE (1 << CPU_BILINEAR_SHIFT)
+
+/*
+ * Source sampling positions for one axis of a scaled blit, computed once per
+ * blit. For every output sample we store the tap indices (relative to lo, the
+ * first source index touched) and their weights:
+ *  - point:    1 tap
+ *  - bilinear: 1 tap, the second tap is implicitly index + 1 and weighted
+ *              by fweight (the row buffers carry one padding pixel for this)
+ *  - bicubic:  4 taps with float weights
+ */
+struct scale_axis
+{
+	int64_t count;
+	int64_t lo, hi;
+	int32_t *index;
+	uint16_t *fweight;
+	float *weight;
+};
+
+static inline size_t filter_taps(enum cpu_blit_filter filter)
+{
+	return filter == CPU_BLIT_FILTER_BICUBIC ? 4 : 1;
+}
+
+/* same kernel as bicubic_scale.effect (B=0, C=0.75) */
+static inline void bicubic_weights(float x, float *w)
+{
+	w[0] = ((-0.75f * x + 1.5f) * x - 0.75f) * x;
+	w[1] = (1.25f * x - 2.25f) * x * x + 1.0f;
+	w[2] = ((-1.25f * x + 1.5f) * x + 0.75f) * x;
+	w[3] = (0.75f * x - 0.75f) * x * x;
+}
+
+static inline int64_t clamp_index(int64_t i, int64_t size)
+{
+	return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
 
-	float scale_x = (float)src_width / (float)dst_width;
-	float scale_y = (float)src_height / (float)dst_height;
-	int64_t x, y;
-	for(y = 0; y < dst_height; y++)
-	{
-		int64_t dy = dst_y + y;
-		if(dy < 0 || dy >= dst->height)
-			continue;
-		int64_t sy = (int64_t)(y * scale_y) + src_y;
-		if (sy >= src->height)
-			sy = src->height - 1;
-		if (sy < 0)
-			sy = 0;
-		for(x = 0; x < dst_width; x++)
+static void scale_axis_build(scale_axis &axis, enum cpu_blit_filter filter, int64_t first, int64_t count,
+		int64_t dst_size, int64_t src_start, int64_t src_size, int64_t tex_size)
+{
+	size_t taps = filter_taps(filter);
+	double scale = (double)src_size / (double)dst_size;
+
+	axis.count = count;
+	axis.index = (int32_t *)bmalloc(sizeof(int32_t) * taps * count);
+	axis.fweight = filter == CPU_BLIT_FILTER_BILINEAR ? (uint16_t *)bmalloc(sizeof(uint16_t) * count) : NULL;
+	axis.weight = filter == CPU_BLIT_FILTER_BICUBIC ? (float *)bmalloc(sizeof(float) * 4 * count) : NULL;
+	axis.lo = tex_size - 1;
+	axis.hi = 0;
+
+	int64_t *abs_index = (int64_t *)bmalloc(sizeof(int64_t) * taps * count);
+	for(int64_t i = 0; i < count; i++)
+	{
+		double pos = (double)src_start + ((double)(first + i) + 0.5) * scale;
+		int64_t *idx = abs_index + i * taps;
+		switch(filter)
 		{
-			int64_t dx = dst_x + x;
-			if(dx < 0 || dx >= dst->width)
-				continue;
-			int64_t sx = (int64_t)(x * scale_x) + src_x;
-			if (sx >= src->width)
-				sx = src->width - 1;
-			if (sx < 0)
-				sx = 0;
-			// TODO: could optimize this for specific sizes
-			// TODO: blending
-			// TODO: interpolation
-			op(dst->data + (dy * dst->width + dx) * dst_bpp,
-				src->data + (sy * src->width + sx) * src_bpp);
+		case CPU_BLIT_FILTER_POINT:
+			idx[0] = clamp_index((int64_t)floor(pos), tex_size);
+			break;
+		case CPU_BLIT_FILTER_BILINEAR:
+		{
+			pos -= 0.5;
+			int64_t i0 = (int64_t)floor(pos);
+			double f = pos - (double)i0;
+			if(i0 < 0 || i0 >= tex_size - 1)
+			{
+				i0 = clamp_index(i0, tex_size);
+				f = 0.0;
+			}
+			idx[0] = i0;
+			axis.fweight[i] = (uint16_t)(f * CPU_BILINEAR_ONE + 0.5);
+			if(i0 + 1 < tex_size && i0 + 1 > axis.hi)
+				axis.hi = i0 + 1;
+			break;
+		}
+		case CPU_BLIT_FILTER_BICUBIC:
+		{
+			pos -= 0.5;
+			int64_t i1 = (int64_t)floor(pos);
+			bicubic_weights((float)(pos - (double)i1), axis.weight + i * 4);
+			for(int t = 0; t < 4; t++)
+				idx[t] = clamp_index(i1 - 1 + t, tex_size);
+			break;
 		}
+		}
+		for(size_t t = 0; t < taps; t++)
+		{
+			if(idx[t] < axis.lo)
+				axis.lo = idx[t];
+			if(idx[t] > axis.hi)
+				axis.hi = idx[t];
+		}
+	}
+
+	for(size_t i = 0; i < taps * (size_t)count; i++)
+		axis.index[i] = (int32_t)(abs_index[i] - axis.lo);
+	bfree(abs_index);
+}
+
+static void scale_axis_free(scale_axis &axis)
+{
+	bfree(axis.index);
+	bfree(axis.fweight);
+	bfree(axis.weight);
+}
+
+/* ------------------------------------------------------------------------- */
+/* row stores: convert a row of scaled source pixels into the dst format */
+
+typedef void (*row_store_fn)(uint8_t *dst, const uint8_t *src, size_t count);
+
+static void store_rgba_to_rgba(uint8_t *dst, const uint8_t *src, size_t count)
+{
+	memcpy(dst, src, count * 4);
+}
+
+static void store_bgrx_to_rgba(uint8_t *dst, const uint8_t *src, size_t count)
+{
+	const uint32_t *s = (const uint32_t *)src;
+	uint32_t *d = (uint32_t *)dst;
+	for(size_t i = 0; i < count; i++)
+	{
+		uint32_t p = s[i];
+		d[i] = ((p >> 16) & 0xff) | (p & 0xff00) | ((p & 0xff) << 16) | 0xff000000;
+	}
+}
+
+static void store_bgra_to_rgba(uint8_t *dst, const uint8_t *src, size_t count)
+{
+	const uint32_t *s = (const uint32_t *)src;
+	uint32_t *d = (uint32_t *)dst;
+	for(size_t i = 0; i < count; i++)
+	{
+		uint32_t p = s[i];
+		d[i] = ((p >> 16) & 0xff) | (p & 0xff00ff00) | ((p & 0xff) << 16);
+	}
+}
+
+static row_store_fn get_row_store(enum gs_color_format src, enum gs_color_format dst)
+{
+	// swapping red and blue goes both ways, used for RGBA onto the X11 window
+	if((dst == GS_BGRA || dst == GS_BGRX) && src == GS_RGBA)
+		return store_bgra_to_rgba;
+	if(dst != GS_RGBA)
+		return NULL;
+	switch(src)
+	{
+	case GS_RGBA:
+		return store_rgba_to_rgba;
+	case GS_BGRX:
+		return store_bgrx_to_rgba;
+	case GS_BGRA:
+		return store_bgra_to_rgba;
+	default:
+		return NULL;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* blending of an RGBA row onto an RGBA destination row */
+
+typedef void (*row_blend_fn)(uint8_t *dst, const uint8_t *src, size_t count, const cpu_blend_state *blend);
+
+/* x / 255 rounded, exact for x in [0, 255 * 255] */
+static inline uint32_t div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline __m128i div255_epi16(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static inline uint32_t blend_factor(enum gs_blend_type type, const uint8_t *s, const uint8_t *d, int c)
+{
+	switch(type)
+	{
+	case GS_BLEND_ZERO:
+		return 0;
+	case GS_BLEND_ONE:
+		return 255;
+	case GS_BLEND_SRCCOLOR:
+		return s[c];
+	case GS_BLEND_INVSRCCOLOR:
+		return 255 - s[c];
+	case GS_BLEND_SRCALPHA:
+		return s[3];
+	case GS_BLEND_INVSRCALPHA:
+		return 255 - s[3];
+	case GS_BLEND_DSTCOLOR:
+		return d[c];
+	case GS_BLEND_INVDSTCOLOR:
+		return 255 - d[c];
+	case GS_BLEND_DSTALPHA:
+		return d[3];
+	case GS_BLEND_INVDSTALPHA:
+		return 255 - d[3];
+	case GS_BLEND_SRCALPHASAT:
+		if(c == 3)
+			return 255;
+		return s[3] < 255 - d[3] ? s[3] : 255 - d[3];
+	}
+	return 0;
+}
+
+static inline void blend_pixel_generic(uint8_t *d, const uint8_t *s, const cpu_blend_state *blend)
+{
+	uint32_t out[4];
+	for(int c = 0; c < 4; c++)
+	{
+		enum gs_blend_type sf = c == 3 ? blend->src_a : blend->src_c;
+		enum gs_blend_type df = c == 3 ? blend->dest_a : blend->dest_c;
+		uint32_t v = div255(s[c] * blend_factor(sf, s, d, c)) + div255(d[c] * blend_factor(df, s, d, c));
+		out[c] = v > 255 ? 255 : v;
+	}
+	for(int c = 0; c < 4; c++)
+		d[c] = (uint8_t)out[c];
+}
+
+static void blend_row_generic(uint8_t *dst, const uint8_t *src, size_t count, const cpu_blend_state *blend)
+{
+	for(size_t i = 0; i < count; i++)
+		blend_pixel_generic(dst + i * 4, src + i * 4, blend);
+}
+
+static inline __m128i broadcast_alpha_epi16(__m128i p)
+{
+	p = _mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+	return _mm_shufflehi_epi16(p, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+/* premultiplied over: ONE, INVSRCALPHA for color and alpha */
+static inline __m128i blend_premultiplied_epi16(__m128i s, __m128i d)
+{
+	__m128i inv = _mm_sub_epi16(_mm_set1_epi16(255), broadcast_alpha_epi16(s));
+	return _mm_add_epi16(s, div255_epi16(_mm_mullo_epi16(d, inv)));
+}
+
+/* straight over: SRCALPHA, INVSRCALPHA for color, ONE, INVSRCALPHA for alpha */
+static inline __m128i blend_straight_epi16(__m128i s, __m128i d)
+{
+	const __m128i alpha_lanes = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	__m128i a = broadcast_alpha_epi16(s);
+	__m128i inv = _mm_sub_epi16(_mm_set1_epi16(255), a);
+	__m128i sf = _mm_or_si128(a, alpha_lanes);
+	// s * sf + d * inv can't exceed 255 * 255 in any lane
+	return div255_epi16(_mm_add_epi16(_mm_mullo_epi16(s, sf), _mm_mullo_epi16(d, inv)));
+}
+
+template<__m128i (*op)(__m128i, __m128i)>
+static void blend_row_simd(uint8_t *dst, const uint8_t *src, size_t count, const cpu_blend_state *blend)
+{
+	__m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for(; i + 4 <= count; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i * 4));
+		__m128i lo = op(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+		__m128i hi = op(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+		_mm_storeu_si128((__m128i *)(dst + i * 4), _mm_packus_epi16(lo, hi));
+	}
+	for(; i < count; i++)
+		blend_pixel_generic(dst + i * 4, src + i * 4, blend);
+}
+
+extern "C" bool cpu_blend_is_overwrite(const struct cpu_blend_state *blend)
+{
+	return blend->src_c == GS_BLEND_ONE && blend->dest_c == GS_BLEND_ZERO
+		&& blend->src_a == GS_BLEND_ONE && blend->dest_a == GS_BLEND_ZERO;
+}
+
+static row_blend_fn get_row_blend(const cpu_blend_state *blend)
+{
+	if(blend->src_a != GS_BLEND_ONE || blend->dest_a != GS_BLEND_INVSRCALPHA
+	   || blend->dest_c != GS_BLEND_INVSRCALPHA)
+		return blend_row_generic;
+	if(blend->src_c == GS_BLEND_ONE)
+		return blend_row_simd<blend_premultiplied_epi16>;
+	if(blend->src_c == GS_BLEND_SRCALPHA)
+		return blend_row_simd<blend_straight_epi16>;
+	return blend_row_generic;
+}
+
+/* ------------------------------------------------------------------------- */
+/* horizontal/vertical kernels, all operating on 4 byte pixels */
+
+static void point_row(uint8_t *out, const uint8_t *src_row, const scale_axis &xa)
+{
+	const uint32_t *s = (const uint32_t *)src_row + xa.lo;
+	uint32_t *d = (uint32_t *)out;
+	for(int64_t i = 0; i < xa.count; i++)
+		d[i] = s[xa.index[i]];
+}
+
+/* tmp = r0 * (1 - w) + r1 * w, in 8.8 fixed point, channels widened to 16 bit */
+static void bilinear_vertical(uint16_t *tmp, const uint8_t *r0, const uint8_t *r1, uint16_t w, size_t pixels)
+{
+	size_t bytes = pixels * 4;
+	size_t i = 0;
+	__m128i zero = _mm_setzero_si128();
+	__m128i w0 = _mm_set1_epi16((short)(CPU_BILINEAR_ONE - w));
+	__m128i w1 = _mm_set1_epi16((short)w);
+	__m128i round = _mm_set1_epi16(CPU_BILINEAR_ONE / 2);
+
+	for(; i + 16 <= bytes; i += 16)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(r0 + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(r1 + i));
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+				_mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+				_mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), CPU_BILINEAR_SHIFT);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), CPU_BILINEAR_SHIFT);
+		_mm_storeu_si128((__m128i *)(tmp + i), lo);
+		_mm_storeu_si128((__m128i *)(tmp + i + 8), hi);
+	}
+	for(; i < bytes; i++)
+		tmp[i] = (uint16_t)((r0[i] * (CPU_BILINEAR_ONE - w) + r1[i] * w + CPU_BILINEAR_ONE / 2) >> CPU_BILINEAR_SHIFT);
+}
+
+static void bilinear_horizontal(uint8_t *out, const uint16_t *tmp, const scale_axis &xa)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(CPU_BILINEAR_ONE / 2);
+	uint32_t *d = (uint32_t *)out;
+	for(int64_t i = 0; i < xa.count; i++)
+	{
+		short w = (short)xa.fweight[i];
+		short iw = (short)(CPU_BILINEAR_ONE - w);
+		__m128i weights = _mm_set_epi16(w, w, w, w, iw, iw, iw, iw);
+		__m128i p = _mm_loadu_si128((const __m128i *)(tmp + xa.index[i] * 4));
+		p = _mm_mullo_epi16(p, weights);
+		p = _mm_add_epi16(p, _mm_srli_si128(p, 8));
+		p = _mm_srli_epi16(_mm_add_epi16(p, round), CPU_BILINEAR_SHIFT);
+		d[i] = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(p, zero));
 	}
 }
 
+static inline __m128 load_pixel_ps(const uint8_t *p)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_cvtsi32_si128(*(const int32_t *)p);
+	v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+	return _mm_cvtepi32_ps(v);
+}
+
+static void bicubic_vertical(float *tmp, const uint8_t *const rows[4], const float *w, size_t pixels)
+{
+	__m128 w0 = _mm_set1_ps(w[0]);
+	__m128 w1 = _mm_set1_ps(w[1]);
+	__m128 w2 = _mm_set1_ps(w[2]);
+	__m128 w3 = _mm_set1_ps(w[3]);
+	for(size_t i = 0; i < pixels; i++)
+	{
+		__m128 sum = _mm_mul_ps(load_pixel_ps(rows[0] + i * 4), w0);
+		sum = _mm_add_ps(sum, _mm_mul_ps(load_pixel_ps(rows[1] + i * 4), w1));
+		sum = _mm_add_ps(sum, _mm_mul_ps(load_pixel_ps(rows[2] + i * 4), w2));
+		sum = _mm_add_ps(sum, _mm_mul_ps(load_pixel_ps(rows[3] + i * 4), w3));
+		_mm_storeu_ps(tmp + i * 4, sum);
+	}
+}
+
+static void bicubic_horizontal(uint8_t *out, const float *tmp, const scale_axis &xa)
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128 max = _mm_set1_ps(255.0f);
+	uint32_t *d = (uint32_t *)out;
+	for(int64_t i = 0; i < xa.count; i++)
+	{
+		const int32_t *idx = xa.index + i * 4;
+		const float *w = xa.weight + i * 4;
+		__m128 sum = _mm_mul_ps(_mm_loadu_ps(tmp + idx[0] * 4), _mm_set1_ps(w[0]));
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(tmp + idx[1] * 4), _mm_set1_ps(w[1])));
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(tmp + idx[2] * 4), _mm_set1_ps(w[2])));
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(tmp + idx[3] * 4), _mm_set1_ps(w[3])));
+		sum = _mm_min_ps(_mm_max_ps(sum, zero), max);
+		__m128i v = _mm_cvtps_epi32(sum);
+		v = _mm_packs_epi32(v, v);
+		d[i] = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct scale_job
+{
+	gs_texture_t *src;
+	gs_texture_t *dst;
+	enum cpu_blit_filter filter;
+	row_store_fn store;
+	row_blend_fn blend_fn;
+	const cpu_blend_state *blend;
+	int64_t dst_x0, dst_y0; // first written dst pixel
+	scale_axis xa, ya;
+};
+
+static void scale_rows(const scale_job &job, int64_t row_begin, int64_t row_end)
+{
+	const scale_axis &xa = job.xa;
+	const scale_axis &ya = job.ya;
+	size_t src_stride = (size_t)job.src->width * 4;
+	size_t span = (size_t)(xa.hi - xa.lo + 1);
+	const uint8_t *src_base = job.src->data + xa.lo * 4;
+	bool direct = job.store == store_rgba_to_rgba && !job.blend;
+	bool convert = job.store != store_rgba_to_rgba;
+
+	uint8_t *row = direct ? NULL : (uint8_t *)bmalloc((size_t)xa.count * 4);
+	uint8_t *rgba = convert && job.blend ? (uint8_t *)bmalloc((size_t)xa.count * 4) : NULL;
+	uint16_t *tmp16 = NULL;
+	float *tmpf = NULL;
+	if(job.filter == CPU_BLIT_FILTER_BILINEAR)
+	{
+		// one extra pixel so the implicit second tap never reads past the span
+		tmp16 = (uint16_t *)bmalloc((span + 1) * 4 * sizeof(uint16_t));
+	}
+	else if(job.filter == CPU_BLIT_FILTER_BICUBIC)
+	{
+		tmpf = (float *)bmalloc(span * 4 * sizeof(float));
+	}
+
+	for(int64_t y = row_begin; y < row_end; y++)
+	{
+		uint8_t *dst_row = job.dst->data + ((job.dst_y0 + y) * job.dst->width + job.dst_x0) * 4;
+		uint8_t *out = direct ? dst_row : row;
+
+		switch(job.filter)
+		{
+		case CPU_BLIT_FILTER_POINT:
+			point_row(out, job.src->data + (ya.lo + ya.index[y]) * src_stride, xa);
+			break;
+		case CPU_BLIT_FILTER_BILINEAR:
+		{
+			int64_t sy = ya.lo + ya.index[y];
+			int64_t sy1 = sy + 1 < job.src->height ? sy + 1 : sy;
+			bilinear_vertical(tmp16, src_base + sy * src_stride, src_base + sy1 * src_stride, ya.fweight[y], span);
+			memcpy(tmp16 + span * 4, tmp16 + (span - 1) * 4, 4 * sizeof(uint16_t));
+			bilinear_horizontal(out, tmp16, xa);
+			break;
+		}
+		case CPU_BLIT_FILTER_BICUBIC:
+		{
+			const uint8_t *rows[4];
+			for(int t = 0; t < 4; t++)
+				rows[t] = src_base + (ya.lo + ya.index[y * 4 + t]) * src_stride;
+			bicubic_vertical(tmpf, rows, ya.weight + y * 4, span);
+			bicubic_horizontal(out, tmpf, xa);
+			break;
+		}
+		}
+
+		if(job.blend)
+		{
+			if(convert)
+				job.store(rgba, row, (size_t)xa.count);
+			job.blend_fn(dst_row, convert ? rgba : row, (size_t)xa.count, job.blend);
+		}
+		else if(!direct)
+		{
+			job.store(dst_row, row, (size_t)xa.count);
+		}
+	}
+
+	bfree(row);
+	bfree(rgba);
+	bfree(tmp16);
+	bfree(tmpf);
+}
+
+static bool scale_job_init(scale_job &job, const cpu_blit_params &params)
+{
+	CPU_BLIT_PARAMS_UNPACK
+	enum cpu_blit_filter filter = params.filter;
+
+	if(dst_width <= 0 || dst_height <= 0 || src_width == 0 || src_height == 0)
+		return false;
+
+	job.store = get_row_store(src->color_format, dst->color_format);
+	if(!job.store)
+	{
+		blog(LOG_ERROR, "Can't blit between these formats");
+		return false;
+	}
+
+	// clip against the destination once instead of per pixel
+	int64_t clip_x0 = 0, clip_y0 = 0;
+	int64_t clip_x1 = dst->width, clip_y1 = dst->height;
+	if(params.clip)
+	{
+		clip_x0 = std::max(clip_x0, params.clip->x0);
+		clip_y0 = std::max(clip_y0, params.clip->y0);
+		clip_x1 = std::min(clip_x1, params.clip->x1);
+		clip_y1 = std::min(clip_y1, params.clip->y1);
+	}
+	int64_t x_begin = std::max(clip_x0 - dst_x, (int64_t)0);
+	int64_t y_begin = std::max(clip_y0 - dst_y, (int64_t)0);
+	int64_t x_end = std::min(clip_x1 - dst_x, dst_width);
+	int64_t y_end = std::min(clip_y1 - dst_y, dst_height);
+	if(x_begin >= x_end || y_begin >= y_end)
+		return false;
+
+	// 1:1 blits are exact with point sampling, don't waste time filtering
+	if(src_width == dst_width && src_height == dst_height)
+		filter = CPU_BLIT_FILTER_POINT;
+
+	job.src = src;
+	job.dst = dst;
+	job.filter = filter;
+	job.blend = params.blend;
+	job.blend_fn = params.blend ? get_row_blend(params.blend) : NULL;
+	job.dst_x0 = dst_x + x_begin;
+	job.dst_y0 = dst_y + y_begin;
+	scale_axis_build(job.xa, filter, x_begin, x_end - x_begin, dst_width, src_x, src_width, src->width);
+	scale_axis_build(job.ya, filter, y_begin, y_end - y_begin, dst_height, src_y, src_height, src->height);
+	return true;
+}
+
+static void scale_job_free(scale_job &job)
+{
+	scale_axis_free(job.xa);
+	scale_axis_free(job.ya);
+}
+
 extern "C" void cpu_blit_texture(struct cpu_blit_params params)
 {
 	CPU_BLIT_PARAMS_UNPACK
 
 	if(src_x == 0 && src_y == 0 && src_width == src->width && src_height == src->height
 	   && dst_x == 0 && dst_y == 0 && dst_width == dst->width && dst_height == dst->height
-	   && src->width == dst->width && src->height == dst->height)
+	   && src->width == dst->width && src->height == dst->height
+	   && src->color_format == dst->color_format && !params.blend && !params.clip)
 	{
 		// direct copy
 		memcpy(dst->data, src->data, cpu_tex_data_size (dst));
 		return;
 	}
 
-	switch(src->color_format)
+	scale_job job;
+	if(!scale_job_init(job, params))
+		return;
+	run_bands(params.workers, job.ya.count, [&job](int64_t begin, int64_t end) {
+		scale_rows(job, begin, end);
+	});
+	scale_job_free(job);
+}
+
+static inline uint8_t unorm_to_u8(float f)
+{
+	f = f * 255.0f + 0.5f;
+	return (uint8_t)(f < 0.0f ? 0.0f : (f > 255.0f ? 255.0f : f));
+}
+
+extern "C" void cpu_fill_rect(gs_texture_t *tex, const struct cpu_rect *rect, const struct vec4 *color)
+{
+	uint8_t r = unorm_to_u8(color->x);
+	uint8_t g = unorm_to_u8(color->y);
+	uint8_t b = unorm_to_u8(color->z);
+	uint8_t a = unorm_to_u8(color->w);
+	uint8_t px[4];
+	size_t bpp;
+	switch(tex->color_format)
 	{
 	case GS_RGBA:
-		switch(dst->color_format)
-		{
-		case GS_RGBA:
-			blit_with_op<4, 4>([](void *d, void *s){ *(uint32_t *)d = *(uint32_t *)s; }, params);
-			return;
-		}
+		px[0] = r; px[1] = g; px[2] = b; px[3] = a;
+		bpp = 4;
+		break;
+	case GS_BGRA:
+	case GS_BGRX:
+		px[0] = b; px[1] = g; px[2] = r; px[3] = a;
+		bpp = 4;
+		break;
+	case GS_R8G8:
+		px[0] = r; px[1] = g;
+		bpp = 2;
+		break;
+	case GS_R8:
+		px[0] = r;
+		bpp = 1;
+		break;
+	case GS_A8:
+		px[0] = a;
+		bpp = 1;
+		break;
+	default:
+		blog(LOG_ERROR, "Can't fill this format");
 		return;
+	}
+
+	int64_t x0 = std::max(rect->x0, (int64_t)0);
+	int64_t y0 = std::max(rect->y0, (int64_t)0);
+	int64_t x1 = std::min(rect->x1, (int64_t)tex->width);
+	int64_t y1 = std::min(rect->y1, (int64_t)tex->height);
+	if(x0 >= x1 || y0 >= y1)
+		return;
+
+	// build the first row, then copy it down
+	size_t stride = (size_t)tex->width * bpp;
+	size_t row_size = (size_t)(x1 - x0) * bpp;
+	uint8_t *first = tex->data + (size_t)y0 * stride + (size_t)x0 * bpp;
+	for(size_t i = 0; i < row_size; i += bpp)
+		memcpy(first + i, px, bpp);
+	for(int64_t y = y0 + 1; y < y1; y++)
+		memcpy(first + (size_t)(y - y0) * stride, first, row_size);
+}
+
+extern "C" void cpu_write_row(gs_texture_t *dst, int64_t x, int64_t y, const uint8_t *rgba, size_t count,
+		const struct cpu_blend_state *blend)
+{
+	if(x < 0 || y < 0 || y >= (int64_t)dst->height || x + (int64_t)count > (int64_t)dst->width)
+		return;
+
+	uint8_t *d = dst->data + ((size_t)y * dst->width + (size_t)x) * 4;
+	switch(dst->color_format)
+	{
+	case GS_RGBA:
+		if(blend)
+			get_row_blend(blend)(d, rgba, count, blend);
+		else
+			memcpy(d, rgba, count * 4);
+		break;
+	case GS_BGRA:
 	case GS_BGRX:
-		switch(dst->color_format)
+	{
+		// swapping red and blue is its own inverse, blending doesn't care about the order
+		uint8_t tmp[256 * 4];
+		while(count)
 		{
-		case GS_RGBA:
-			blit_with_op<4, 4>([](void *d, void *s){
-				uint8_t *ss = (uint8_t *)s;
-				uint8_t *dd = (uint8_t *)d;
-				dd[0] = ss[2];
-				dd[1] = ss[1];
-				dd[2] = ss[0];
-				dd[3] = 0xff;
-			}, params);
-			return;
+			size_t n = std::min(count, (size_t)256);
+			store_bgra_to_rgba(tmp, rgba, n);
+			if(blend)
+				get_row_blend(blend)(d, tmp, n, blend);
+			else
+				memcpy(d, tmp, n * 4);
+			d += n * 4;
+			rgba += n * 4;
+			count -= n;
 		}
-		return;
+		break;
 	}
+	default:
+		blog(LOG_ERROR, "Can't draw to this format");
+		break;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* RGBA -> NV12/I420/I444, all planes in one pass over the source */
+
+struct conv_coeffs
+{
+	__m128 r, g, b, offset;
+};
+
+/* scale folds in the averaging of chroma samples, values stay in 0..255 */
+static inline conv_coeffs make_coeffs(const vec4 &v, float scale)
+{
+	conv_coeffs c;
+	c.r = _mm_set1_ps(v.x * scale);
+	c.g = _mm_set1_ps(v.y * scale);
+	c.b = _mm_set1_ps(v.z * scale);
+	c.offset = _mm_set1_ps(v.w * 255.0f);
+	return c;
+}
+
+static inline __m128 apply_coeffs(const conv_coeffs &c, __m128 r, __m128 g, __m128 b)
+{
+	__m128 v = _mm_add_ps(_mm_mul_ps(r, c.r), c.offset);
+	v = _mm_add_ps(v, _mm_mul_ps(g, c.g));
+	return _mm_add_ps(v, _mm_mul_ps(b, c.b));
+}
 
-	blog(LOG_ERROR, "Can't blit between these formats");
+static inline uint8_t apply_coeffs_scalar(const vec4 &v, float scale, float r, float g, float b)
+{
+	float f = (r * v.x + g * v.y + b * v.z) * scale + v.w * 255.0f + 0.5f;
+	return (uint8_t)(f < 0.0f ? 0.0f : (f > 255.0f ? 255.0f : f));
 }
 
-template<size_t src_bpp, size_t dst_bpp, size_t res_div, typename CopyOp>
-static void format_convert_with_op(const CopyOp &op, gs_texture_t *src, gs_texture_t *dst)
+/* 4 RGBA pixels -> one float vector per channel */
+static inline void load_rgb4(const uint8_t *p, __m128 &r, __m128 &g, __m128 &b)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i px = _mm_loadu_si128((const __m128i *)p);
+	__m128i lo = _mm_unpacklo_epi8(px, zero);
+	__m128i hi = _mm_unpackhi_epi8(px, zero);
+	__m128 p0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+	__m128 p1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+	__m128 p2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+	__m128 p3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+	_MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+	r = p0;
+	g = p1;
+	b = p2;
+}
+
+static inline __m128i pack_u16(__m128 v)
+{
+	__m128i i = _mm_cvtps_epi32(v);
+	return _mm_packs_epi32(i, i);
+}
+
+static inline void store_u8x4(uint8_t *d, __m128 v)
+{
+	__m128i i = pack_u16(v);
+	int32_t out = _mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+	memcpy(d, &out, sizeof(out));
+}
+
+static inline void store_uv8x4(uint8_t *d, __m128 u, __m128 v)
+{
+	__m128i uv = _mm_unpacklo_epi16(pack_u16(u), pack_u16(v));
+	_mm_storel_epi64((__m128i *)d, _mm_packus_epi16(uv, uv));
+}
+
+/* sums of horizontally adjacent pairs of a and b: a0+a1, a2+a3, b0+b1, b2+b3 */
+static inline __m128 pair_sum(__m128 a, __m128 b)
+{
+	return _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+			_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+struct conv_job
+{
+	const cpu_conversion *conv;
+	uint8_t *planes[3];
+	size_t linesize[3];
+	vec4 vec[3];
+	int64_t width, height;
+};
+
+static void convert_rows_444(const conv_job &job, int64_t y_begin, int64_t y_end)
 {
-	size_t x, y;
-	for(y = 0; y < dst->height; y++)
+	conv_coeffs cy = make_coeffs(job.vec[0], 1.0f);
+	conv_coeffs cu = make_coeffs(job.vec[1], 1.0f);
+	conv_coeffs cv = make_coeffs(job.vec[2], 1.0f);
+	size_t src_stride = (size_t)job.conv->src->width * 4;
+
+	for(int64_t y = y_begin; y < y_end; y++)
 	{
-		size_t sy = y * res_div;
-		for(x = 0; x < dst->width; x++)
+		const uint8_t *s = job.conv->src->data + y * src_stride;
+		uint8_t *yp = job.planes[0] ? job.planes[0] + y * job.linesize[0] : NULL;
+		uint8_t *up = job.planes[1] ? job.planes[1] + y * job.linesize[1] : NULL;
+		uint8_t *vp = job.planes[2] ? job.planes[2] + y * job.linesize[2] : NULL;
+		int64_t x = 0;
+		for(; x + 4 <= job.width; x += 4)
+		{
+			__m128 r, g, b;
+			load_rgb4(s + x * 4, r, g, b);
+			if(yp)
+				store_u8x4(yp + x, apply_coeffs(cy, r, g, b));
+			if(up)
+				store_u8x4(up + x, apply_coeffs(cu, r, g, b));
+			if(vp)
+				store_u8x4(vp + x, apply_coeffs(cv, r, g, b));
+		}
+		for(; x < job.width; x++)
 		{
-			size_t sx = x * res_div;
-			op(dst->data + (y * dst->width + x) * dst_bpp,
-				src->data + (sy * src->width + sx) * src_bpp);
+			const uint8_t *p = s + x * 4;
+			if(yp)
+				yp[x] = apply_coeffs_scalar(job.vec[0], 1.0f, p[0], p[1], p[2]);
+			if(up)
+				up[x] = apply_coeffs_scalar(job.vec[1], 1.0f, p[0], p[1], p[2]);
+			if(vp)
+				vp[x] = apply_coeffs_scalar(job.vec[2], 1.0f, p[0], p[1], p[2]);
 		}
 	}
 }
 
-extern "C" void cpu_rgba_to_nv12_y(gs_texture_t *src, gs_texture_t *dst, struct vec4 color_vec0)
+/* rows are chroma rows here, each one covers two luma rows */
+template<bool nv12>
+static void convert_rows_420(const conv_job &job, int64_t cy_begin, int64_t cy_end)
 {
-	if(dst->width != src->width || dst->height != src->height)
+	conv_coeffs cy = make_coeffs(job.vec[0], 1.0f);
+	conv_coeffs cu = make_coeffs(job.vec[1], 0.25f);
+	conv_coeffs cv = make_coeffs(job.vec[2], 0.25f);
+	size_t src_stride = (size_t)job.conv->src->width * 4;
+	int64_t chroma_width = job.width / 2;
+	int64_t chroma_height = job.height / 2;
+
+	for(int64_t c = cy_begin; c < cy_end; c++)
 	{
-		blog(LOG_ERROR, "Resolution mismatch in NV12 Y conversion");
-		return;
+		int64_t y0 = c * 2;
+		int64_t y1 = y0 + 1 < job.height ? y0 + 1 : y0;
+		const uint8_t *s0 = job.conv->src->data + y0 * src_stride;
+		const uint8_t *s1 = job.conv->src->data + y1 * src_stride;
+		uint8_t *yp0 = job.planes[0] ? job.planes[0] + y0 * job.linesize[0] : NULL;
+		uint8_t *yp1 = job.planes[0] && y1 != y0 ? job.planes[0] + y1 * job.linesize[0] : NULL;
+		bool chroma = c < chroma_height;
+		uint8_t *up = chroma && job.planes[1] ? job.planes[1] + c * job.linesize[1] : NULL;
+		uint8_t *vp = chroma && job.planes[2] ? job.planes[2] + c * job.linesize[2] : NULL;
+
+		int64_t x = 0;
+		for(; x + 8 <= chroma_width * 2; x += 8)
+		{
+			__m128 r0, g0, b0, r1, g1, b1, r2, g2, b2, r3, g3, b3;
+			load_rgb4(s0 + x * 4, r0, g0, b0);
+			load_rgb4(s0 + x * 4 + 16, r1, g1, b1);
+			load_rgb4(s1 + x * 4, r2, g2, b2);
+			load_rgb4(s1 + x * 4 + 16, r3, g3, b3);
+			if(yp0)
+			{
+				store_u8x4(yp0 + x, apply_coeffs(cy, r0, g0, b0));
+				store_u8x4(yp0 + x + 4, apply_coeffs(cy, r1, g1, b1));
+			}
+			if(yp1)
+			{
+				store_u8x4(yp1 + x, apply_coeffs(cy, r2, g2, b2));
+				store_u8x4(yp1 + x + 4, apply_coeffs(cy, r3, g3, b3));
+			}
+			if(!up && !vp)
+				continue;
+
+			__m128 r = pair_sum(_mm_add_ps(r0, r2), _mm_add_ps(r1, r3));
+			__m128 g = pair_sum(_mm_add_ps(g0, g2), _mm_add_ps(g1, g3));
+			__m128 b = pair_sum(_mm_add_ps(b0, b2), _mm_add_ps(b1, b3));
+			if(nv12)
+			{
+				store_uv8x4(up + x, apply_coeffs(cu, r, g, b), apply_coeffs(cv, r, g, b));
+			}
+			else
+			{
+				if(up)
+					store_u8x4(up + x / 2, apply_coeffs(cu, r, g, b));
+				if(vp)
+					store_u8x4(vp + x / 2, apply_coeffs(cv, r, g, b));
+			}
+		}
+
+		for(; x < job.width; x++)
+		{
+			const uint8_t *p0 = s0 + x * 4;
+			const uint8_t *p1 = s1 + x * 4;
+			if(yp0)
+				yp0[x] = apply_coeffs_scalar(job.vec[0], 1.0f, p0[0], p0[1], p0[2]);
+			if(yp1)
+				yp1[x] = apply_coeffs_scalar(job.vec[0], 1.0f, p1[0], p1[1], p1[2]);
+			if((x & 1) || x / 2 >= chroma_width)
+				continue;
+
+			float r = (float)(p0[0] + p0[4] + p1[0] + p1[4]);
+			float g = (float)(p0[1] + p0[5] + p1[1] + p1[5]);
+			float b = (float)(p0[2] + p0[6] + p1[2] + p1[6]);
+			if(nv12 && up)
+			{
+				up[x] = apply_coeffs_scalar(job.vec[1], 0.25f, r, g, b);
+				up[x + 1] = apply_coeffs_scalar(job.vec[2], 0.25f, r, g, b);
+			}
+			else if(!nv12)
+			{
+				if(up)
+					up[x / 2] = apply_coeffs_scalar(job.vec[1], 0.25f, r, g, b);
+				if(vp)
+					vp[x / 2] = apply_coeffs_scalar(job.vec[2], 0.25f, r, g, b);
+			}
+		}
 	}
-	if(dst->color_format != GS_R8)
+}
+
+static bool check_plane(gs_texture_t *plane, uint32_t width, uint32_t height, enum gs_color_format format, const char *name)
+{
+	if(!plane)
+		return true;
+	if(plane->width != width || plane->height != height || plane->color_format != format)
+	{
+		blog(LOG_ERROR, "Invalid %s plane for format conversion: %ux%u", name, plane->width, plane->height);
+		return false;
+	}
+	return true;
+}
+
+extern "C" void cpu_convert_planes(cpu_workers *workers, const struct cpu_conversion *conv)
+{
+	gs_texture_t *src = conv->src;
+	if(src->color_format != GS_RGBA)
 	{
-		blog(LOG_ERROR, "Invalid dst format for NV12 Y conversion");
+		blog(LOG_ERROR, "Unsupported src format for format conversion");
 		return;
 	}
 
-	if(src->color_format == GS_RGBA)
+	uint32_t cw = conv->format == CPU_CONVERSION_I444 ? src->width : src->width / 2;
+	uint32_t ch = conv->format == CPU_CONVERSION_I444 ? src->height : src->height / 2;
+	bool valid = check_plane(conv->planes[0], src->width, src->height, GS_R8, "Y");
+	if(conv->format == CPU_CONVERSION_NV12)
 	{
-		vec3 dv;
-		dv.x = color_vec0.x;
-		dv.y = color_vec0.y;
-		dv.z = color_vec0.z;
-		float w = color_vec0.w;
-		format_convert_with_op<4, 1, 1>([dv, w](uint8_t *d, uint8_t *s){
-			vec3 rgb;
-			rgb.x = (float)s[0] / 255.0f;
-			rgb.y = (float)s[1] / 255.0f;
-			rgb.z = (float)s[2] / 255.0f;
-			d[0] = (uint8_t)((vec3_dot(&rgb, &dv) + w) * 255.0f);
-		}, src, dst);
+		valid = valid && check_plane(conv->planes[1], cw, ch, GS_R8G8, "UV")
+			&& !conv->planes[2];
 	}
 	else
 	{
-		blog(LOG_ERROR, "Unsupported dst format for NV12 Y conversion");
+		valid = valid && check_plane(conv->planes[1], cw, ch, GS_R8, "U")
+			&& check_plane(conv->planes[2], cw, ch, GS_R8, "V");
+	}
+	if(!valid)
 		return;
+
+	conv_job job;
+	job.conv = conv;
+	job.width = src->width;
+	job.height = src->height;
+	for(int i = 0; i < 3; i++)
+	{
+		gs_texture_t *plane = conv->planes[i];
+		job.planes[i] = plane ? plane->data : NULL;
+		job.linesize[i] = plane ? plane->width * gs_get_format_bpp(plane->color_format) / 8 : 0;
+		job.vec[i] = conv->color_vec[i];
 	}
-}
\ No newline at end of file
+
+	switch(conv->format)
+	{
+	case CPU_CONVERSION_NV12:
+		// the interleaved UV plane is written through the U pointer
+		job.planes[2] = NULL;
+		run_bands(workers, (job.height + 1) / 2, [&job](int64_t begin, int64_t end) {
+			convert_rows_420<true>(job, begin, end);
+		});
+		break;
+	case CPU_CONVERSION_I420:
+		run_bands(workers, (job.height + 1) / 2, [&job](int64_t begin, int64_t end) {
+			convert_rows_420<false>(job, begin, end);
+		});
+		break;
+	case CPU_CONVERSION_I444:
+		run_bands(workers, job.height, [&job](int64_t begin, int64_t end) {
+			convert_rows_444(job, begin, end);
+		});
+		break;
+	case CPU_CONVERSION_NONE:
+		break;
+	}
+}
@@ -0,0 +1,234 @@
+/******************************************************************************
+    Copyright (C) 2020 by thestr4ng3r
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include <stdlib.h>
+#include <util/profiler.h>
+#include "cpu-subsystem.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/*
+ * Texture memory pool.
+ *
+ * Sources recreate their textures whenever the frame format changes, texrenders
+ * and the platform blit create temporary targets, so texture memory is
+ * allocated and freed at frame rate. Released buffers are kept in a free list
+ * per size class and handed out again to the next texture of that class.
+ * Blocks that haven't been reused for a while, or that exceed the budget, are
+ * returned to the system.
+ *
+ * All memory is cache line aligned. Blocks of at least CPU_POOL_HUGE_PAGE are
+ * aligned to it and marked for transparent huge pages, which saves TLB misses
+ * when scanning full frames.
+ */
+
+#define CPU_POOL_ALIGNMENT 64
+#define CPU_POOL_HUGE_PAGE ((size_t)2 * 1024 * 1024)
+#define CPU_POOL_MAX_IDLE 300  // scenes a free block may stay unused
+#define CPU_POOL_DEFAULT_MB 512
+
+struct cpu_pool_block {
+	uint8_t *data;
+	size_t size;
+	uint64_t released; // scene counter at release
+};
+
+struct cpu_tex_pool {
+	pthread_mutex_t mutex;
+	DARRAY(struct cpu_pool_block) free_blocks; // oldest first
+	size_t free_bytes;
+	size_t max_free_bytes;
+	uint64_t scenes;
+
+	// statistics
+	uint64_t hits;
+	uint64_t misses;
+	size_t used_bytes;
+	size_t peak_bytes; // used and free
+};
+
+static const char *pool_alloc_name = "cpu_tex_pool_alloc";
+
+/*
+ * Rounds up to the size class: page granularity up to 64 KiB, above that four
+ * classes per power of two, so at most 25% of a block is wasted.
+ */
+static size_t pool_class_size(size_t size)
+{
+	if(size <= 65536)
+		return (size + 4095) & ~(size_t)4095;
+
+	size_t step = 65536 / 4;
+	while(step * 8 <= size)
+		step *= 2;
+	return (size + step - 1) & ~(step - 1);
+}
+
+static uint8_t *pool_block_alloc(size_t size)
+{
+	size_t alignment = size >= CPU_POOL_HUGE_PAGE ? CPU_POOL_HUGE_PAGE : CPU_POOL_ALIGNMENT;
+#ifdef _WIN32
+	return _aligned_malloc(size, alignment);
+#else
+	void *ptr;
+	if(posix_memalign(&ptr, alignment, size) != 0)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if(alignment == CPU_POOL_HUGE_PAGE)
+		madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	return ptr;
+#endif
+}
+
+static void pool_block_free(uint8_t *data)
+{
+#ifdef _WIN32
+	_aligned_free(data);
+#else
+	free(data);
+#endif
+}
+
+static void pool_evict(struct cpu_tex_pool *pool, size_t idx)
+{
+	struct cpu_pool_block *block = pool->free_blocks.array + idx;
+	pool->free_bytes -= block->size;
+	pool_block_free(block->data);
+	da_erase(pool->free_blocks, idx);
+}
+
+void cpu_tex_pool_create(gs_device_t *device)
+{
+	struct cpu_tex_pool *pool = bzalloc(sizeof(struct cpu_tex_pool));
+	pthread_mutex_init(&pool->mutex, NULL);
+
+	// can be overridden with OBS_CPU_TEXTURE_POOL_MB, 0 disables pooling
+	size_t mb = CPU_POOL_DEFAULT_MB;
+	const char *env = getenv("OBS_CPU_TEXTURE_POOL_MB");
+	if(env && *env)
+		mb = (size_t)strtoul(env, NULL, 10);
+	pool->max_free_bytes = mb * 1024 * 1024;
+
+	device->tex_pool = pool;
+}
+
+void cpu_tex_pool_destroy(gs_device_t *device)
+{
+	struct cpu_tex_pool *pool = device->tex_pool;
+	if(!pool)
+		return;
+
+	if(pool->hits + pool->misses)
+	{
+		blog(LOG_INFO, "CPU Renderer texture pool: %llu of %llu allocations reused, "
+				"peak %zu MiB, %zu MiB still in use",
+				(unsigned long long)pool->hits, (unsigned long long)(pool->hits + pool->misses),
+				pool->peak_bytes / (1024 * 1024), pool->used_bytes / (1024 * 1024));
+	}
+
+	while(pool->free_blocks.num)
+		pool_evict(pool, pool->free_blocks.num - 1);
+	da_free(pool->free_blocks);
+	pthread_mutex_destroy(&pool->mutex);
+	bfree(pool);
+	device->tex_pool = NULL;
+}
+
+struct cpu_tex_buffer *cpu_tex_buffer_create(gs_device_t *device, size_t size)
+{
+	struct cpu_tex_pool *pool = device->tex_pool;
+	struct cpu_tex_buffer *buf = bmalloc(sizeof(struct cpu_tex_buffer));
+	buf->refs = 1;
+	buf->pool = pool;
+	buf->size = pool_class_size(size ? size : 1);
+	buf->data = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	// newest first, its memory is most likely still cached
+	for(size_t i = pool->free_blocks.num; i > 0; i--)
+	{
+		struct cpu_pool_block *block = pool->free_blocks.array + i - 1;
+		if(block->size == buf->size)
+		{
+			buf->data = block->data;
+			pool->free_bytes -= block->size;
+			da_erase(pool->free_blocks, i - 1);
+			break;
+		}
+	}
+	if(buf->data)
+		pool->hits++;
+	else
+		pool->misses++;
+	pool->used_bytes += buf->size;
+	if(pool->used_bytes + pool->free_bytes > pool->peak_bytes)
+		pool->peak_bytes = pool->used_bytes + pool->free_bytes;
+	pthread_mutex_unlock(&pool->mutex);
+
+	if(!buf->data)
+	{
+		profile_start(pool_alloc_name);
+		buf->data = pool_block_alloc(buf->size);
+		profile_end(pool_alloc_name);
+		if(!buf->data)
+			bcrash("CPU Renderer failed to allocate %zu bytes of texture memory", buf->size);
+	}
+	return buf;
+}
+
+void cpu_tex_buffer_release(struct cpu_tex_buffer *buf)
+{
+	if(!buf || os_atomic_dec_long(&buf->refs) != 0)
+		return;
+
+	struct cpu_tex_pool *pool = buf->pool;
+	pthread_mutex_lock(&pool->mutex);
+	pool->used_bytes -= buf->size;
+	if(buf->size <= pool->max_free_bytes)
+	{
+		struct cpu_pool_block *block = da_push_back_new(pool->free_blocks);
+		block->data = buf->data;
+		block->size = buf->size;
+		block->released = pool->scenes;
+		pool->free_bytes += buf->size;
+		while(pool->free_bytes > pool->max_free_bytes)
+			pool_evict(pool, 0);
+	}
+	else
+	{
+		pool_block_free(buf->data);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	bfree(buf);
+}
+
+/* called once per scene, returns blocks that have been idle for too long */
+void cpu_tex_pool_trim(gs_device_t *device)
+{
+	struct cpu_tex_pool *pool = device->tex_pool;
+	pthread_mutex_lock(&pool->mutex);
+	pool->scenes++;
+	while(pool->free_blocks.num && pool->scenes - pool->free_blocks.array[0].released > CPU_POOL_MAX_IDLE)
+		pool_evict(pool, 0);
+	pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,3122 @@
+/******************************************************************************
+    Copyright (C) 2020 by thestr4ng3r
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include <math.h>
+#include <ctype.h>
+#include <util/dstr.h>
+#include <util/sse-intrin.h>
+#include <graphics/shader-parser.h>
+#include "cpu-subsystem.h"
+
+/*
+ * Shader programs for effects without a hand written implementation.
+ *
+ * Function bodies of the HLSL subset understood by shader-parser.c are
+ * compiled into a flat bytecode that works on scalar registers holding
+ * CPU_SHADER_LANES pixels each. Vectors and matrices are split into one
+ * register per component at compile time, so swizzles and member accesses
+ * cost nothing at runtime. Functions are inlined, if/else becomes
+ * predication with a lane mask and for loops with constant bounds are
+ * unrolled, which leaves the program without any jumps.
+ *
+ * Programs are cached per device by file name (which contains the effect
+ * file and technique) and source.
+ */
+
+#define CPU_SHADER_VECS 2
+#define CPU_SHADER_LANES (CPU_SHADER_VECS * 4)
+#define CPU_MAX_COMPONENTS 64
+#define CPU_MAX_ARGS 8
+#define CPU_MAX_UNROLL 256
+
+typedef union {
+	__m128 v[CPU_SHADER_VECS];
+	float f[CPU_SHADER_LANES];
+} cpu_reg;
+
+enum cpu_op {
+	CPU_OP_MOV,
+	CPU_OP_SEL, // d = c ? a : b
+	CPU_OP_ADD,
+	CPU_OP_SUB,
+	CPU_OP_MUL,
+	CPU_OP_DIV,
+	CPU_OP_MIN,
+	CPU_OP_MAX,
+	CPU_OP_LT,
+	CPU_OP_LE,
+	CPU_OP_EQ,
+	CPU_OP_NE,
+	CPU_OP_AND,
+	CPU_OP_OR,
+	CPU_OP_NOT,
+	CPU_OP_FLOOR,
+	CPU_OP_TRUNC,
+	CPU_OP_SQRT,
+	CPU_OP_POW,
+	CPU_OP_EXP,
+	CPU_OP_EXP2,
+	CPU_OP_LOG,
+	CPU_OP_LOG2,
+	CPU_OP_SIN,
+	CPU_OP_COS,
+	CPU_OP_TAN,
+	CPU_OP_FMOD,
+	CPU_OP_SAMPLE, // d..d+3 = texture c sampled with sampler e at (a, b)
+	CPU_OP_LOAD,   // d..d+3 = texel (a, b) of texture c
+	CPU_OP_KILL,   // discard lanes where a is set
+};
+
+struct cpu_instr {
+	uint16_t op;
+	uint16_t d, a, b, c, e;
+};
+
+struct cpu_const {
+	uint16_t reg;
+	float val;
+};
+
+struct cpu_uniform {
+	char *name;
+	enum gs_shader_param_type type;
+	bool is_int;
+	int components;
+	uint16_t reg;
+	int texture; // texture slot, -1 for values
+	DARRAY(uint8_t) default_val;
+};
+
+/* vertex attribute, varying or render target output */
+struct cpu_io {
+	char mapping[32];
+	int components;
+	uint16_t regs[16];
+};
+
+struct cpu_program {
+	long refs;
+	char *file;
+	uint64_t hash;
+	enum gs_shader_type type;
+
+	DARRAY(struct cpu_instr) code;
+	DARRAY(struct cpu_const) consts;
+	DARRAY(struct cpu_uniform) uniforms;
+	DARRAY(struct gs_sampler_info) samplers;
+	DARRAY(struct cpu_io) inputs;
+	DARRAY(struct cpu_io) outputs;
+	int num_textures;
+	uint32_t num_regs;
+	uint16_t kill_reg;
+	bool uses_kill;
+};
+
+/* ------------------------------------------------------------------------- */
+/* Compiler */
+
+enum ctok_kind { CTOK_END, CTOK_NAME, CTOK_NUM, CTOK_OP };
+
+struct ctok {
+	enum ctok_kind kind;
+	struct strref str;
+	char op[3];
+	float num;
+	bool is_int;
+};
+
+enum cbase { CT_VOID, CT_FLOAT, CT_INT, CT_BOOL, CT_STRUCT, CT_TEXTURE, CT_SAMPLER };
+
+struct ctype {
+	enum cbase base;
+	int rows, cols; // scalar 1x1, vector 1xN, matrix RxC
+	const struct shader_struct *st;
+};
+
+struct cval {
+	struct ctype type;
+	int n;
+	uint16_t regs[CPU_MAX_COMPONENTS];
+	bool lvalue;
+	bool is_const; // compile time constant, value in cval
+	float cval;
+	int index; // texture slot or sampler index
+};
+
+struct csymbol {
+	struct strref name;
+	struct cval val;
+};
+
+struct cfunc {
+	bool has_ret;
+	struct cval ret;
+	bool returned; // unconditionally, rest of the block is dead
+	int alive;     // lanes that haven't returned yet, -1 for all
+};
+
+struct compiler {
+	struct shader_parser *sp;
+	struct cpu_program *prog;
+	DARRAY(struct ctok) *func_toks; // per sp->funcs entry
+	const struct ctok *toks;
+	size_t pos;
+
+	DARRAY(struct csymbol) symbols; // locals
+	size_t scope_base;
+	DARRAY(struct csymbol) globals;
+
+	struct cfunc *fn;
+	int mask; // register with active lanes, -1 for all
+	int depth;
+	bool error;
+	struct dstr error_str;
+	uint32_t num_regs;
+};
+
+static void cerror(struct compiler *c, const char *format, ...)
+{
+	if(c->error)
+		return;
+	c->error = true;
+
+	va_list args;
+	va_start(args, format);
+	dstr_vprintf(&c->error_str, format, args);
+	va_end(args);
+}
+
+/* --- tokens --- */
+
+static const char *two_char_ops[] = {
+	"==", "!=", "<=", ">=", "&&", "||", "+=", "-=", "*=", "/=", "++", "--"
+};
+
+static void tokenize(const struct cf_token *tok, const struct cf_token *end, struct darray *out_da)
+{
+	DARRAY(struct ctok) out;
+	out.da = *out_da;
+
+	for(; tok < end && tok->type != CFTOKEN_NONE; tok++)
+	{
+		struct ctok t = { 0 };
+		t.str = tok->str;
+		switch(tok->type)
+		{
+		case CFTOKEN_NAME:
+			t.kind = CTOK_NAME;
+			break;
+		case CFTOKEN_NUM:
+		{
+			char buf[64];
+			size_t len = tok->str.len < sizeof(buf) - 1 ? tok->str.len : sizeof(buf) - 1;
+			memcpy(buf, tok->str.array, len);
+			buf[len] = 0;
+			t.kind = CTOK_NUM;
+			t.num = (float)strtod(buf, NULL);
+			t.is_int = !strchr(buf, '.') && !strchr(buf, 'e') && !strchr(buf, 'E');
+			break;
+		}
+		case CFTOKEN_OTHER:
+			t.kind = CTOK_OP;
+			t.op[0] = *tok->str.array;
+			if(tok + 1 < end && tok[1].type == CFTOKEN_OTHER && tok[1].str.array == tok->str.array + 1)
+			{
+				char pair[3] = { t.op[0], *tok[1].str.array, 0 };
+				for(size_t i = 0; i < sizeof(two_char_ops) / sizeof(two_char_ops[0]); i++)
+				{
+					if(!strcmp(pair, two_char_ops[i]))
+					{
+						t.op[1] = pair[1];
+						tok++;
+						break;
+					}
+				}
+			}
+			break;
+		default:
+			continue;
+		}
+		da_push_back(out, &t);
+	}
+
+	struct ctok end_tok = { 0 };
+	da_push_back(out, &end_tok);
+	*out_da = out.da;
+}
+
+static inline const struct ctok *cur(struct compiler *c)
+{
+	return c->toks + c->pos;
+}
+
+static inline void next(struct compiler *c)
+{
+	if(cur(c)->kind != CTOK_END)
+		c->pos++;
+}
+
+static inline bool tok_is(const struct ctok *t, const char *s)
+{
+	if(t->kind == CTOK_OP)
+		return !strcmp(t->op, s);
+	if(t->kind == CTOK_NAME)
+		return strref_cmp(&t->str, s) == 0;
+	return false;
+}
+
+static inline bool accept(struct compiler *c, const char *s)
+{
+	if(!tok_is(cur(c), s))
+		return false;
+	next(c);
+	return true;
+}
+
+static bool expect(struct compiler *c, const char *s)
+{
+	if(accept(c, s))
+		return true;
+	cerror(c, "expected '%s' near '%.*s'", s, (int)cur(c)->str.len, cur(c)->str.array);
+	return false;
+}
+
+/* skips a statement or block without compiling it */
+static void skip_statement(struct compiler *c)
+{
+	int depth = 0;
+	while(cur(c)->kind != CTOK_END)
+	{
+		if(tok_is(cur(c), "{"))
+			depth++;
+		else if(tok_is(cur(c), "}"))
+		{
+			if(--depth <= 0)
+			{
+				next(c);
+				return;
+			}
+		}
+		else if(tok_is(cur(c), ";") && depth == 0)
+		{
+			next(c);
+			return;
+		}
+		next(c);
+	}
+}
+
+/* --- types --- */
+
+static const struct shader_struct *find_struct(struct compiler *c, const char *name, size_t len)
+{
+	for(size_t i = 0; i < c->sp->structs.num; i++)
+	{
+		const struct shader_struct *st = c->sp->structs.array + i;
+		if(strlen(st->name) == len && !strncmp(st->name, name, len))
+			return st;
+	}
+	return NULL;
+}
+
+static bool parse_type_str(struct compiler *c, const char *name, size_t len, struct ctype *t)
+{
+	static const struct {
+		const char *prefix;
+		enum cbase base;
+	} bases[] = {
+		{"float", CT_FLOAT}, {"half", CT_FLOAT}, {"double", CT_FLOAT}, {"min16float", CT_FLOAT},
+		{"int", CT_INT}, {"uint", CT_INT}, {"min16int", CT_INT}, {"bool", CT_BOOL},
+	};
+
+	memset(t, 0, sizeof(*t));
+	t->rows = t->cols = 1;
+
+	if(len == 4 && !strncmp(name, "void", 4))
+	{
+		t->base = CT_VOID;
+		return true;
+	}
+	if(len >= 7 && !strncmp(name, "texture", 7))
+	{
+		t->base = CT_TEXTURE;
+		return true;
+	}
+	if((len == 7 && !strncmp(name, "sampler", 7)) || (len == 12 && !strncmp(name, "SamplerState", 12)))
+	{
+		t->base = CT_SAMPLER;
+		return true;
+	}
+
+	for(size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); i++)
+	{
+		size_t plen = strlen(bases[i].prefix);
+		if(len < plen || strncmp(name, bases[i].prefix, plen) != 0)
+			continue;
+		const char *rest = name + plen;
+		size_t rest_len = len - plen;
+		if(rest_len == 0)
+		{
+			t->base = bases[i].base;
+			return true;
+		}
+		if(rest_len == 1 && rest[0] >= '1' && rest[0] <= '4')
+		{
+			t->base = bases[i].base;
+			t->cols = rest[0] - '0';
+			return true;
+		}
+		if(rest_len == 3 && rest[0] >= '1' && rest[0] <= '4' && rest[1] == 'x' && rest[2] >= '1' && rest[2] <= '4')
+		{
+			t->base = bases[i].base;
+			t->rows = rest[0] - '0';
+			t->cols = rest[2] - '0';
+			return true;
+		}
+	}
+
+	const struct shader_struct *st = find_struct(c, name, len);
+	if(st)
+	{
+		t->base = CT_STRUCT;
+		t->st = st;
+		return true;
+	}
+	return false;
+}
+
+static inline bool parse_type_cstr(struct compiler *c, const char *name, struct ctype *t)
+{
+	return parse_type_str(c, name, strlen(name), t);
+}
+
+static int type_size(struct compiler *c, const struct ctype *t)
+{
+	switch(t->base)
+	{
+	case CT_VOID:
+	case CT_TEXTURE:
+	case CT_SAMPLER:
+		return 0;
+	case CT_STRUCT:
+	{
+		int size = 0;
+		for(size_t i = 0; i < t->st->vars.num; i++)
+		{
+			struct ctype mt;
+			if(!parse_type_cstr(c, t->st->vars.array[i].type, &mt))
+			{
+				cerror(c, "unknown type %s", t->st->vars.array[i].type);
+				return 0;
+			}
+			size += type_size(c, &mt);
+		}
+		return size;
+	}
+	default:
+		return t->rows * t->cols;
+	}
+}
+
+static inline bool is_numeric(const struct ctype *t)
+{
+	return t->base == CT_FLOAT || t->base == CT_INT || t->base == CT_BOOL;
+}
+
+static inline struct ctype scalar_type(enum cbase base)
+{
+	struct ctype t = { base, 1, 1, NULL };
+	return t;
+}
+
+static inline struct ctype vector_type(enum cbase base, int n)
+{
+	struct ctype t = { base, 1, n, NULL };
+	return t;
+}
+
+/* --- registers and instructions --- */
+
+static uint16_t alloc_regs(struct compiler *c, int n)
+{
+	uint32_t r = c->num_regs;
+	c->num_regs += (uint32_t)n;
+	if(c->num_regs > UINT16_MAX)
+	{
+		cerror(c, "shader too large");
+		return 0;
+	}
+	return (uint16_t)r;
+}
+
+static uint16_t const_reg(struct compiler *c, float val)
+{
+	struct cpu_program *prog = c->prog;
+	for(size_t i = 0; i < prog->consts.num; i++)
+	{
+		if(prog->consts.array[i].val == val && signbit(prog->consts.array[i].val) == signbit(val))
+			return prog->consts.array[i].reg;
+	}
+	struct cpu_const k = { alloc_regs(c, 1), val };
+	da_push_back(prog->consts, &k);
+	return k.reg;
+}
+
+static void emit(struct compiler *c, enum cpu_op op, uint16_t d, uint16_t a, uint16_t b, uint16_t cc, uint16_t e)
+{
+	struct cpu_instr in = { (uint16_t)op, d, a, b, cc, e };
+	da_push_back(c->prog->code, &in);
+}
+
+static uint16_t emit_tmp(struct compiler *c, enum cpu_op op, uint16_t a, uint16_t b)
+{
+	uint16_t d = alloc_regs(c, 1);
+	emit(c, op, d, a, b, 0, 0);
+	return d;
+}
+
+static void make_const_val(struct compiler *c, float v, enum cbase base, struct cval *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->type = scalar_type(base);
+	out->n = 1;
+	out->regs[0] = const_reg(c, v);
+	out->is_const = true;
+	out->cval = v;
+}
+
+static void alloc_val(struct compiler *c, const struct ctype *t, struct cval *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->type = *t;
+	out->n = type_size(c, t);
+	if(out->n > CPU_MAX_COMPONENTS)
+	{
+		cerror(c, "type too large");
+		out->n = 0;
+		return;
+	}
+	uint16_t base = alloc_regs(c, out->n);
+	for(int i = 0; i < out->n; i++)
+		out->regs[i] = base + i;
+}
+
+/* writes one component of a variable, respecting the lane mask */
+static void store_comp(struct compiler *c, uint16_t dst, uint16_t src)
+{
+	if(c->mask < 0)
+	{
+		if(dst != src)
+			emit(c, CPU_OP_MOV, dst, src, 0, 0, 0);
+	}
+	else
+	{
+		emit(c, CPU_OP_SEL, dst, src, dst, (uint16_t)c->mask, 0);
+	}
+}
+
+static bool regs_overlap(const struct cval *a, const struct cval *b)
+{
+	for(int i = 0; i < a->n; i++)
+		for(int j = 0; j < b->n; j++)
+			if(a->regs[i] == b->regs[j])
+				return true;
+	return false;
+}
+
+/* fresh registers holding the value, so later writes can't change it */
+static void copy_val(struct compiler *c, const struct cval *src, struct cval *out)
+{
+	struct cval v = *src;
+	uint16_t base = alloc_regs(c, src->n);
+	for(int i = 0; i < src->n; i++)
+	{
+		v.regs[i] = base + i;
+		emit(c, CPU_OP_MOV, v.regs[i], src->regs[i], 0, 0, 0);
+	}
+	v.lvalue = false;
+	v.is_const = false;
+	*out = v;
+}
+
+/* broadcasts scalars and truncates vectors to n components */
+static bool get_components(struct compiler *c, const struct cval *v, int n, uint16_t *regs)
+{
+	if(!is_numeric(&v->type) || v->n == 0)
+	{
+		cerror(c, "expected a numeric value");
+		return false;
+	}
+	for(int i = 0; i < n; i++)
+		regs[i] = v->n == 1 ? v->regs[0] : v->regs[i < v->n ? i : v->n - 1];
+	if(v->n != 1 && v->n < n)
+	{
+		cerror(c, "not enough components");
+		return false;
+	}
+	return true;
+}
+
+static void assign(struct compiler *c, const struct cval *dst, const struct cval *src_in)
+{
+	if(!dst->lvalue)
+	{
+		cerror(c, "assignment to something that isn't a variable");
+		return;
+	}
+
+	struct cval src = *src_in;
+	if(regs_overlap(dst, &src) && dst->n > 1)
+		copy_val(c, src_in, &src);
+
+	if(dst->type.base == CT_STRUCT || src.type.base == CT_STRUCT)
+	{
+		if(dst->type.st != src.type.st || dst->n != src.n)
+		{
+			cerror(c, "struct type mismatch in assignment");
+			return;
+		}
+		for(int i = 0; i < dst->n; i++)
+			store_comp(c, dst->regs[i], src.regs[i]);
+		return;
+	}
+
+	uint16_t regs[CPU_MAX_COMPONENTS];
+	if(!get_components(c, &src, dst->n, regs))
+		return;
+	for(int i = 0; i < dst->n; i++)
+	{
+		uint16_t r = regs[i];
+		if(dst->type.base == CT_INT && src.type.base == CT_FLOAT)
+			r = emit_tmp(c, CPU_OP_TRUNC, r, 0);
+		store_comp(c, dst->regs[i], r);
+	}
+}
+
+/* component-wise operation, broadcasting scalars */
+static void emit_binary(struct compiler *c, enum cpu_op op, const struct cval *a, const struct cval *b, enum cbase result_base, struct cval *out)
+{
+	int n;
+	struct ctype t;
+	if(a->n == 1)
+	{
+		n = b->n;
+		t = b->type;
+	}
+	else if(b->n == 1)
+	{
+		n = a->n;
+		t = a->type;
+	}
+	else
+	{
+		// HLSL truncates to the smaller vector
+		n = a->n < b->n ? a->n : b->n;
+		t = a->n < b->n ? a->type : b->type;
+	}
+
+	uint16_t ra[CPU_MAX_COMPONENTS], rb[CPU_MAX_COMPONENTS];
+	if(!get_components(c, a, n, ra) || !get_components(c, b, n, rb))
+		return;
+
+	memset(out, 0, sizeof(*out));
+	out->type = t;
+	out->type.base = result_base != CT_VOID ? result_base
+			: (a->type.base == CT_FLOAT || b->type.base == CT_FLOAT ? CT_FLOAT : a->type.base);
+	out->n = n;
+	for(int i = 0; i < n; i++)
+		out->regs[i] = emit_tmp(c, op, ra[i], rb[i]);
+
+	if(out->type.base == CT_INT && op == CPU_OP_DIV)
+	{
+		for(int i = 0; i < n; i++)
+			out->regs[i] = emit_tmp(c, CPU_OP_TRUNC, out->regs[i], 0);
+	}
+
+	if(a->is_const && b->is_const && n == 1)
+	{
+		// keep track of constants for loop bounds and indices
+		float x = a->cval, y = b->cval, r = 0.0f;
+		bool known = true;
+		switch(op)
+		{
+		case CPU_OP_ADD: r = x + y; break;
+		case CPU_OP_SUB: r = x - y; break;
+		case CPU_OP_MUL: r = x * y; break;
+		case CPU_OP_DIV: r = y != 0.0f ? x / y : 0.0f; break;
+		default: known = false; break;
+		}
+		if(known)
+		{
+			if(out->type.base == CT_INT)
+				r = truncf(r);
+			struct ctype rt = out->type;
+			make_const_val(c, r, rt.base, out);
+			out->type = rt;
+		}
+	}
+}
+
+static void emit_unary(struct compiler *c, enum cpu_op op, const struct cval *a, struct cval *out)
+{
+	if(!is_numeric(&a->type))
+	{
+		cerror(c, "expected a numeric value");
+		return;
+	}
+	*out = *a;
+	out->lvalue = false;
+	out->is_const = false;
+	for(int i = 0; i < a->n; i++)
+		out->regs[i] = emit_tmp(c, op, a->regs[i], 0);
+}
+
+static uint16_t emit_dot(struct compiler *c, const uint16_t *a, const uint16_t *b, int n)
+{
+	uint16_t sum = emit_tmp(c, CPU_OP_MUL, a[0], b[0]);
+	for(int i = 1; i < n; i++)
+		sum = emit_tmp(c, CPU_OP_ADD, sum, emit_tmp(c, CPU_OP_MUL, a[i], b[i]));
+	return sum;
+}
+
+/* --- symbols --- */
+
+static const struct cval *lookup(struct compiler *c, const struct strref *name)
+{
+	for(size_t i = c->symbols.num; i > c->scope_base; i--)
+	{
+		struct csymbol *s = c->symbols.array + i - 1;
+		if(strref_cmp_strref(&s->name, name) == 0)
+			return &s->val;
+	}
+	for(size_t i = 0; i < c->globals.num; i++)
+	{
+		struct csymbol *s = c->globals.array + i;
+		if(strref_cmp_strref(&s->name, name) == 0)
+			return &s->val;
+	}
+	return NULL;
+}
+
+static void declare(struct compiler *c, const struct strref *name, const struct cval *val)
+{
+	struct csymbol s;
+	s.name = *name;
+	s.val = *val;
+	da_push_back(c->symbols, &s);
+}
+
+static int find_func(struct compiler *c, const struct strref *name)
+{
+	for(size_t i = 0; i < c->sp->funcs.num; i++)
+	{
+		if(strref_cmp(name, c->sp->funcs.array[i].name) == 0)
+			return (int)i;
+	}
+	return -1;
+}
+
+/* --- expressions --- */
+
+static void parse_expr(struct compiler *c, struct cval *out);
+static void parse_block(struct compiler *c);
+static void parse_statement(struct compiler *c);
+static void compile_call(struct compiler *c, int func, struct cval *args, int num_args, struct cval *out);
+
+static int parse_args(struct compiler *c, struct cval *args, int max)
+{
+	int n = 0;
+	if(!expect(c, "("))
+		return 0;
+	if(accept(c, ")"))
+		return 0;
+	do
+	{
+		if(n == max)
+		{
+			cerror(c, "too many arguments");
+			return n;
+		}
+		parse_expr(c, args + n++);
+		if(c->error)
+			return n;
+	} while(accept(c, ","));
+	expect(c, ")");
+	return n;
+}
+
+static void construct(struct compiler *c, const struct ctype *t, struct cval *args, int num_args, struct cval *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->type = *t;
+	out->n = type_size(c, t);
+	if(t->base == CT_STRUCT || out->n == 0)
+	{
+		cerror(c, "can't construct this type");
+		return;
+	}
+
+	if(num_args == 1 && args[0].n == 1)
+	{
+		for(int i = 0; i < out->n; i++)
+			out->regs[i] = args[0].regs[0];
+	}
+	else
+	{
+		int n = 0;
+		for(int a = 0; a < num_args; a++)
+		{
+			if(!is_numeric(&args[a].type))
+			{
+				cerror(c, "expected a numeric value");
+				return;
+			}
+			for(int i = 0; i < args[a].n && n < out->n; i++)
+				out->regs[n++] = args[a].regs[i];
+		}
+		if(n < out->n)
+		{
+			cerror(c, "not enough components in constructor");
+			return;
+		}
+	}
+
+	if(t->base == CT_INT)
+	{
+		for(int i = 0; i < out->n; i++)
+			out->regs[i] = emit_tmp(c, CPU_OP_TRUNC, out->regs[i], 0);
+	}
+	else if(t->base == CT_BOOL)
+	{
+		uint16_t zero = const_reg(c, 0.0f);
+		for(int i = 0; i < out->n; i++)
+			out->regs[i] = emit_tmp(c, CPU_OP_NE, out->regs[i], zero);
+	}
+}
+
+static void mul_builtin(struct compiler *c, const struct cval *a, const struct cval *b, struct cval *out)
+{
+	bool am = a->type.rows > 1, bm = b->type.rows > 1;
+	memset(out, 0, sizeof(*out));
+
+	if(a->n == 1 || b->n == 1)
+	{
+		emit_binary(c, CPU_OP_MUL, a, b, CT_VOID, out);
+	}
+	else if(!am && !bm)
+	{
+		int n = a->n < b->n ? a->n : b->n;
+		out->type = scalar_type(CT_FLOAT);
+		out->n = 1;
+		out->regs[0] = emit_dot(c, a->regs, b->regs, n);
+	}
+	else if(!am && bm)
+	{
+		// row vector times matrix: dot products with the matrix rows
+		int rows = b->type.rows, cols = b->type.cols;
+		if(a->n != cols)
+		{
+			cerror(c, "mul: dimension mismatch");
+			return;
+		}
+		out->type = vector_type(CT_FLOAT, rows);
+		out->n = rows;
+		for(int j = 0; j < rows; j++)
+			out->regs[j] = emit_dot(c, a->regs, b->regs + j * cols, cols);
+	}
+	else if(am && !bm)
+	{
+		// matrix times column vector: sum of the rows weighted by the vector
+		int rows = a->type.rows, cols = a->type.cols;
+		if(b->n != rows)
+		{
+			cerror(c, "mul: dimension mismatch");
+			return;
+		}
+		out->type = vector_type(CT_FLOAT, cols);
+		out->n = cols;
+		for(int j = 0; j < cols; j++)
+		{
+			uint16_t col[4];
+			for(int i = 0; i < rows; i++)
+				col[i] = a->regs[i * cols + j];
+			out->regs[j] = emit_dot(c, b->regs, col, rows);
+		}
+	}
+	else
+	{
+		// both stored as rows, same convention as the vector cases above
+		int n = a->type.rows;
+		if(a->type.cols != n || b->type.rows != n || b->type.cols != n)
+		{
+			cerror(c, "mul: only square matrices of the same size are supported");
+			return;
+		}
+		out->type = a->type;
+		out->n = n * n;
+		for(int j = 0; j < n; j++)
+		{
+			for(int k = 0; k < n; k++)
+			{
+				uint16_t col[4], row[4];
+				for(int i = 0; i < n; i++)
+				{
+					col[i] = a->regs[i * n + k];
+					row[i] = b->regs[j * n + i];
+				}
+				out->regs[j * n + k] = emit_dot(c, row, col, n);
+			}
+		}
+	}
+}
+
+static void builtin_call(struct compiler *c, const struct strref *name, struct cval *args, int n, struct cval *out)
+{
+	static const struct {
+		const char *name;
+		enum cpu_op op;
+	} unary_ops[] = {
+		{"floor", CPU_OP_FLOOR}, {"trunc", CPU_OP_TRUNC}, {"sqrt", CPU_OP_SQRT},
+		{"exp", CPU_OP_EXP}, {"exp2", CPU_OP_EXP2}, {"log", CPU_OP_LOG}, {"log2", CPU_OP_LOG2},
+		{"sin", CPU_OP_SIN}, {"cos", CPU_OP_COS}, {"tan", CPU_OP_TAN},
+	};
+	static const struct {
+		const char *name;
+		enum cpu_op op;
+	} binary_ops[] = {
+		{"min", CPU_OP_MIN}, {"max", CPU_OP_MAX}, {"pow", CPU_OP_POW}, {"fmod", CPU_OP_FMOD},
+	};
+
+	for(size_t i = 0; i < sizeof(unary_ops) / sizeof(unary_ops[0]); i++)
+	{
+		if(strref_cmp(name, unary_ops[i].name) == 0)
+		{
+			if(n != 1)
+				goto wrong_args;
+			emit_unary(c, unary_ops[i].op, args, out);
+			return;
+		}
+	}
+	for(size_t i = 0; i < sizeof(binary_ops) / sizeof(binary_ops[0]); i++)
+	{
+		if(strref_cmp(name, binary_ops[i].name) == 0)
+		{
+			if(n != 2)
+				goto wrong_args;
+			emit_binary(c, binary_ops[i].op, args, args + 1, CT_VOID, out);
+			return;
+		}
+	}
+
+	struct cval zero, one, tmp, tmp2;
+	make_const_val(c, 0.0f, CT_FLOAT, &zero);
+	make_const_val(c, 1.0f, CT_FLOAT, &one);
+
+	if(strref_cmp(name, "mul") == 0)
+	{
+		if(n != 2)
+			goto wrong_args;
+		mul_builtin(c, args, args + 1, out);
+	}
+	else if(strref_cmp(name, "saturate") == 0)
+	{
+		if(n != 1)
+			goto wrong_args;
+		emit_binary(c, CPU_OP_MAX, args, &zero, CT_VOID, &tmp);
+		emit_binary(c, CPU_OP_MIN, &tmp, &one, CT_VOID, out);
+	}
+	else if(strref_cmp(name, "clamp") == 0)
+	{
+		if(n != 3)
+			goto wrong_args;
+		emit_binary(c, CPU_OP_MAX, args, args + 1, CT_VOID, &tmp);
+		emit_binary(c, CPU_OP_MIN, &tmp, args + 2, CT_VOID, out);
+	}
+	else if(strref_cmp(name, "abs") == 0)
+	{
+		if(n != 1)
+			goto wrong_args;
+		emit_binary(c, CPU_OP_SUB, &zero, args, CT_VOID, &tmp);
+		emit_binary(c, CPU_OP_MAX, args, &tmp, CT_VOID, out);
+	}
+	else if(strref_cmp(name, "frac") == 0)
+	{
+		if(n != 1)
+			goto wrong_args;
+		emit_unary(c, CPU_OP_FLOOR, args, &tmp);
+		emit_binary(c, CPU_OP_SUB, args, &tmp, CT_VOID, out);
+	}
+	else if(strref_cmp(name, "ceil") == 0)
+	{
+		if(n != 1)
+			goto wrong_args;
+		emit_binary(c, CPU_OP_SUB, &zero, args, CT_VOID, &tmp);
+		emit_unary(c, CPU_OP_FLOOR, &tmp, &tmp2);
+		emit_binary(c, CPU_OP_SUB, &zero, &tmp2, CT_VOID, out);
+	}
+	else if(strref_cmp(name, "round") == 0)
+	{
+		struct cval half;
+		if(n != 1)
+			goto wrong_args;
+		make_const_val(c, 0.5f, CT_FLOAT, &half);
+		emit_binary(c, CPU_OP_ADD, args, &half, CT_VOID, &tmp);
+		emit_unary(c, CPU_OP_FLOOR, &tmp, out);
+	}
+	else if(strref_cmp(name, "rsqrt") == 0 || strref_cmp(name, "rcp") == 0)
+	{
+		if(n != 1)
+			goto wrong_args;
+		if(strref_cmp(name, "rsqrt") == 0)
+			emit_unary(c, CPU_OP_SQRT, args, &tmp);
+		else
+			tmp = args[0];
+		emit_binary(c, CPU_OP_DIV, &one, &tmp, CT_FLOAT, out);
+	}
+	else if(strref_cmp(name, "sign") == 0)
+	{
+		if(n != 1)
+			goto wrong_args;
+		emit_binary(c, CPU_OP_LT, &zero, args, CT_FLOAT, &tmp);
+		emit_binary(c, CPU_OP_LT, args, &zero, CT_FLOAT, &tmp2);
+		emit_binary(c, CPU_OP_SUB, &tmp, &tmp2, CT_FLOAT, out);
+	}
+	else if(strref_cmp(name, "lerp") == 0)
+	{
+		struct cval diff;
+		if(n != 3)
+			goto wrong_args;
+		emit_binary(c, CPU_OP_SUB, args + 1, args, CT_VOID, &diff);
+		emit_binary(c, CPU_OP_MUL, &diff, args + 2, CT_VOID, &tmp);
+		emit_binary(c, CPU_OP_ADD, args, &tmp, CT_VOID, out);
+	}
+	else if(strref_cmp(name, "step") == 0)
+	{
+		if(n != 2)
+			goto wrong_args;
+		emit_binary(c, CPU_OP_LE, args, args + 1, CT_FLOAT, out);
+	}
+	else if(strref_cmp(name, "smoothstep") == 0)
+	{
+		struct cval range, t, three, two;
+		if(n != 3)
+			goto wrong_args;
+		make_const_val(c, 3.0f, CT_FLOAT, &three);
+		make_const_val(c, 2.0f, CT_FLOAT, &two);
+		emit_binary(c, CPU_OP_SUB, args + 1, args, CT_VOID, &range);
+		emit_binary(c, CPU_OP_SUB, args + 2, args, CT_VOID, &tmp);
+		emit_binary(c, CPU_OP_DIV, &tmp, &range, CT_FLOAT, &t);
+		emit_binary(c, CPU_OP_MAX, &t, &zero, CT_VOID, &tmp);
+		emit_binary(c, CPU_OP_MIN, &tmp, &one, CT_VOID, &t);
+		emit_binary(c, CPU_OP_MUL, &two, &t, CT_VOID, &tmp);
+		emit_binary(c, CPU_OP_SUB, &three, &tmp, CT_VOID, &tmp2);
+		emit_binary(c, CPU_OP_MUL, &t, &t, CT_VOID, &tmp);
+		emit_binary(c, CPU_OP_MUL, &tmp, &tmp2, CT_VOID, out);
+	}
+	else if(strref_cmp(name, "dot") == 0)
+	{
+		if(n != 2 || args[0].n != args[1].n)
+			goto wrong_args;
+		memset(out, 0, sizeof(*out));
+		out->type = scalar_type(CT_FLOAT);
+		out->n = 1;
+		out->regs[0] = emit_dot(c, args[0].regs, args[1].regs, args[0].n);
+	}
+	else if(strref_cmp(name, "length") == 0 || strref_cmp(name, "distance") == 0 || strref_cmp(name, "normalize") == 0)
+	{
+		struct cval v = args[0];
+		bool is_distance = strref_cmp(name, "distance") == 0;
+		if(n != (is_distance ? 2 : 1))
+			goto wrong_args;
+		if(is_distance)
+			emit_binary(c, CPU_OP_SUB, args, args + 1, CT_VOID, &v);
+		uint16_t len = emit_tmp(c, CPU_OP_SQRT, emit_dot(c, v.regs, v.regs, v.n), 0);
+		if(strref_cmp(name, "normalize") == 0)
+		{
+			memset(&tmp, 0, sizeof(tmp));
+			tmp.type = scalar_type(CT_FLOAT);
+			tmp.n = 1;
+			tmp.regs[0] = len;
+			emit_binary(c, CPU_OP_DIV, &v, &tmp, CT_FLOAT, out);
+		}
+		else
+		{
+			memset(out, 0, sizeof(*out));
+			out->type = scalar_type(CT_FLOAT);
+			out->n = 1;
+			out->regs[0] = len;
+		}
+	}
+	else if(strref_cmp(name, "cross") == 0)
+	{
+		if(n != 2 || args[0].n != 3 || args[1].n != 3)
+			goto wrong_args;
+		const uint16_t *a = args[0].regs, *b = args[1].regs;
+		memset(out, 0, sizeof(*out));
+		out->type = vector_type(CT_FLOAT, 3);
+		out->n = 3;
+		for(int i = 0; i < 3; i++)
+		{
+			int j = (i + 1) % 3, k = (i + 2) % 3;
+			out->regs[i] = emit_tmp(c, CPU_OP_SUB, emit_tmp(c, CPU_OP_MUL, a[j], b[k]), emit_tmp(c, CPU_OP_MUL, a[k], b[j]));
+		}
+	}
+	else if(strref_cmp(name, "any") == 0 || strref_cmp(name, "all") == 0)
+	{
+		enum cpu_op op = strref_cmp(name, "any") == 0 ? CPU_OP_OR : CPU_OP_AND;
+		if(n != 1 || !is_numeric(&args[0].type))
+			goto wrong_args;
+		uint16_t r = emit_tmp(c, CPU_OP_NE, args[0].regs[0], zero.regs[0]);
+		for(int i = 1; i < args[0].n; i++)
+			r = emit_tmp(c, op, r, args[0].regs[i]);
+		memset(out, 0, sizeof(*out));
+		out->type = scalar_type(CT_BOOL);
+		out->n = 1;
+		out->regs[0] = r;
+	}
+	else
+	{
+		cerror(c, "unsupported function %.*s", (int)name->len, name->array);
+	}
+	return;
+
+wrong_args:
+	cerror(c, "wrong arguments for %.*s", (int)name->len, name->array);
+}
+
+static void texture_method(struct compiler *c, const struct cval *tex, const struct ctok *method, struct cval *out)
+{
+	struct cval args[4];
+	int n = parse_args(c, args, 4);
+	if(c->error)
+		return;
+
+	alloc_val(c, &(struct ctype){CT_FLOAT, 1, 4, NULL}, out);
+	if(tok_is(method, "Sample") || tok_is(method, "SampleLevel") || tok_is(method, "SampleBias") || tok_is(method, "SampleGrad"))
+	{
+		// no mipmaps, so the level of detail arguments don't matter
+		if(n < 2 || args[0].type.base != CT_SAMPLER || args[1].n < 2)
+		{
+			cerror(c, "wrong arguments for %.*s", (int)method->str.len, method->str.array);
+			return;
+		}
+		emit(c, CPU_OP_SAMPLE, out->regs[0], args[1].regs[0], args[1].regs[1], (uint16_t)tex->index, (uint16_t)args[0].index);
+	}
+	else if(tok_is(method, "Load"))
+	{
+		if(n < 1 || args[0].n < 2)
+		{
+			cerror(c, "wrong arguments for Load");
+			return;
+		}
+		emit(c, CPU_OP_LOAD, out->regs[0], args[0].regs[0], args[0].regs[1], (uint16_t)tex->index, 0);
+	}
+	else
+	{
+		cerror(c, "unsupported texture method %.*s", (int)method->str.len, method->str.array);
+	}
+}
+
+static bool swizzle_index(char ch, int *index)
+{
+	const char *sets[] = { "xyzw", "rgba" };
+	for(int s = 0; s < 2; s++)
+	{
+		const char *p = strchr(sets[s], ch);
+		if(p && ch)
+		{
+			*index = (int)(p - sets[s]);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void member_access(struct compiler *c, struct cval *v, const struct ctok *name)
+{
+	if(v->type.base == CT_STRUCT)
+	{
+		int offset = 0;
+		for(size_t i = 0; i < v->type.st->vars.num; i++)
+		{
+			const struct shader_var *var = v->type.st->vars.array + i;
+			struct ctype mt;
+			parse_type_cstr(c, var->type, &mt);
+			int size = type_size(c, &mt);
+			if(strref_cmp(&name->str, var->name) == 0)
+			{
+				memmove(v->regs, v->regs + offset, sizeof(uint16_t) * size);
+				v->type = mt;
+				v->n = size;
+				v->is_const = false;
+				return;
+			}
+			offset += size;
+		}
+		cerror(c, "no member %.*s", (int)name->str.len, name->str.array);
+		return;
+	}
+
+	if(!is_numeric(&v->type) || v->type.rows > 1 || name->str.len > 4)
+	{
+		cerror(c, "invalid swizzle %.*s", (int)name->str.len, name->str.array);
+		return;
+	}
+
+	uint16_t regs[4];
+	int n = (int)name->str.len;
+	bool repeats = false;
+	for(int i = 0; i < n; i++)
+	{
+		int index;
+		if(!swizzle_index(name->str.array[i], &index) || index >= v->n)
+		{
+			cerror(c, "invalid swizzle %.*s", (int)name->str.len, name->str.array);
+			return;
+		}
+		regs[i] = v->regs[index];
+		for(int j = 0; j < i; j++)
+			repeats |= regs[j] == regs[i];
+	}
+	memcpy(v->regs, regs, sizeof(uint16_t) * n);
+	v->n = n;
+	v->type.cols = n;
+	v->lvalue = v->lvalue && !repeats;
+	v->is_const = v->is_const && n == 1;
+}
+
+static void parse_primary(struct compiler *c, struct cval *out)
+{
+	const struct ctok *t = cur(c);
+	memset(out, 0, sizeof(*out));
+
+	if(t->kind == CTOK_NUM)
+	{
+		make_const_val(c, t->num, t->is_int ? CT_INT : CT_FLOAT, out);
+		next(c);
+		return;
+	}
+
+	if(tok_is(t, "("))
+	{
+		next(c);
+		struct ctype cast;
+		const struct ctok *tn = cur(c);
+		if(tn->kind == CTOK_NAME && tok_is(tn + 1, ")") && parse_type_str(c, tn->str.array, tn->str.len, &cast))
+		{
+			next(c);
+			next(c);
+			struct cval v;
+			parse_primary(c, &v);
+			if(c->error)
+				return;
+			// casts from scalars broadcast, from vectors truncate
+			if(v.n > type_size(c, &cast))
+				v.n = type_size(c, &cast);
+			construct(c, &cast, &v, 1, out);
+			return;
+		}
+		parse_expr(c, out);
+		expect(c, ")");
+		return;
+	}
+
+	if(t->kind != CTOK_NAME)
+	{
+		cerror(c, "unexpected '%.*s'", (int)t->str.len, t->str.array);
+		return;
+	}
+
+	if(tok_is(t, "true") || tok_is(t, "false"))
+	{
+		make_const_val(c, tok_is(t, "true") ? 1.0f : 0.0f, CT_BOOL, out);
+		next(c);
+		return;
+	}
+
+	struct strref name = t->str;
+	next(c);
+
+	if(tok_is(cur(c), "("))
+	{
+		struct cval args[CPU_MAX_ARGS];
+		struct ctype ctor;
+		if(parse_type_str(c, name.array, name.len, &ctor))
+		{
+			int n = parse_args(c, args, CPU_MAX_ARGS);
+			if(!c->error)
+				construct(c, &ctor, args, n, out);
+			return;
+		}
+
+		int func = find_func(c, &name);
+		int n = parse_args(c, args, CPU_MAX_ARGS);
+		if(c->error)
+			return;
+		if(func >= 0)
+			compile_call(c, func, args, n, out);
+		else
+			builtin_call(c, &name, args, n, out);
+		return;
+	}
+
+	const struct cval *v = lookup(c, &name);
+	if(!v)
+	{
+		cerror(c, "unknown identifier %.*s", (int)name.len, name.array);
+		return;
+	}
+	*out = *v;
+}
+
+static void parse_postfix(struct compiler *c, struct cval *out)
+{
+	parse_primary(c, out);
+	while(!c->error)
+	{
+		if(accept(c, "."))
+		{
+			const struct ctok *name = cur(c);
+			if(name->kind != CTOK_NAME)
+			{
+				cerror(c, "expected a member name");
+				return;
+			}
+			next(c);
+			if(out->type.base == CT_TEXTURE)
+			{
+				struct cval tex = *out;
+				texture_method(c, &tex, name, out);
+			}
+			else
+			{
+				member_access(c, out, name);
+			}
+		}
+		else if(accept(c, "["))
+		{
+			struct cval index;
+			parse_expr(c, &index);
+			expect(c, "]");
+			if(c->error)
+				return;
+			if(!index.is_const)
+			{
+				cerror(c, "only constant indices are supported");
+				return;
+			}
+			int i = (int)index.cval;
+			int stride = out->type.rows > 1 ? out->type.cols : 1;
+			int count = out->type.rows > 1 ? out->type.rows : out->n;
+			if(i < 0 || i >= count || !is_numeric(&out->type))
+			{
+				cerror(c, "index out of range");
+				return;
+			}
+			memmove(out->regs, out->regs + i * stride, sizeof(uint16_t) * stride);
+			out->n = stride;
+			out->type = vector_type(out->type.base, stride);
+			out->is_const = false;
+		}
+		else if(tok_is(cur(c), "++") || tok_is(cur(c), "--"))
+		{
+			struct cval one, old, result;
+			enum cpu_op op = tok_is(cur(c), "++") ? CPU_OP_ADD : CPU_OP_SUB;
+			next(c);
+			copy_val(c, out, &old);
+			make_const_val(c, 1.0f, CT_INT, &one);
+			emit_binary(c, op, out, &one, CT_VOID, &result);
+			assign(c, out, &result);
+			*out = old;
+		}
+		else
+		{
+			break;
+		}
+	}
+}
+
+static void parse_unary(struct compiler *c, struct cval *out)
+{
+	if(accept(c, "-"))
+	{
+		struct cval v, zero;
+		parse_unary(c, &v);
+		if(c->error)
+			return;
+		make_const_val(c, 0.0f, v.type.base == CT_INT ? CT_INT : CT_FLOAT, &zero);
+		emit_binary(c, CPU_OP_SUB, &zero, &v, CT_VOID, out);
+		out->type = v.type;
+	}
+	else if(accept(c, "+"))
+	{
+		parse_unary(c, out);
+		out->lvalue = false;
+	}
+	else if(accept(c, "!"))
+	{
+		struct cval v;
+		parse_unary(c, &v);
+		if(c->error)
+			return;
+		emit_unary(c, CPU_OP_NOT, &v, out);
+		out->type.base = CT_BOOL;
+	}
+	else if(tok_is(cur(c), "++") || tok_is(cur(c), "--"))
+	{
+		struct cval v, one;
+		enum cpu_op op = tok_is(cur(c), "++") ? CPU_OP_ADD : CPU_OP_SUB;
+		next(c);
+		parse_unary(c, &v);
+		if(c->error)
+			return;
+		make_const_val(c, 1.0f, CT_INT, &one);
+		emit_binary(c, op, &v, &one, CT_VOID, out);
+		assign(c, &v, out);
+	}
+	else
+	{
+		parse_postfix(c, out);
+	}
+}
+
+struct binop {
+	const char *tok;
+	enum cpu_op op;
+	bool swap;
+	enum cbase result;
+};
+
+static const struct binop mul_ops[] = {
+	{"*", CPU_OP_MUL, false, CT_VOID}, {"/", CPU_OP_DIV, false, CT_VOID}, {"%", CPU_OP_FMOD, false, CT_VOID}, {NULL}
+};
+static const struct binop add_ops[] = {
+	{"+", CPU_OP_ADD, false, CT_VOID}, {"-", CPU_OP_SUB, false, CT_VOID}, {NULL}
+};
+static const struct binop rel_ops[] = {
+	{"<", CPU_OP_LT, false, CT_BOOL}, {"<=", CPU_OP_LE, false, CT_BOOL},
+	{">", CPU_OP_LT, true, CT_BOOL}, {">=", CPU_OP_LE, true, CT_BOOL}, {NULL}
+};
+static const struct binop eq_ops[] = {
+	{"==", CPU_OP_EQ, false, CT_BOOL}, {"!=", CPU_OP_NE, false, CT_BOOL}, {NULL}
+};
+static const struct binop and_ops[] = {
+	{"&&", CPU_OP_AND, false, CT_BOOL}, {NULL}
+};
+static const struct binop or_ops[] = {
+	{"||", CPU_OP_OR, false, CT_BOOL}, {NULL}
+};
+
+static const struct binop *binop_levels[] = { or_ops, and_ops, eq_ops, rel_ops, add_ops, mul_ops };
+#define NUM_BINOP_LEVELS (sizeof(binop_levels) / sizeof(binop_levels[0]))
+
+static void parse_binary(struct compiler *c, size_t level, struct cval *out)
+{
+	if(level == NUM_BINOP_LEVELS)
+	{
+		parse_unary(c, out);
+		return;
+	}
+
+	parse_binary(c, level + 1, out);
+	while(!c->error)
+	{
+		const struct binop *op = NULL;
+		for(const struct binop *o = binop_levels[level]; o->tok; o++)
+		{
+			if(tok_is(cur(c), o->tok))
+			{
+				op = o;
+				break;
+			}
+		}
+		if(!op)
+			return;
+		next(c);
+
+		struct cval rhs, lhs = *out;
+		parse_binary(c, level + 1, &rhs);
+		if(c->error)
+			return;
+		if(!is_numeric(&lhs.type) || !is_numeric(&rhs.type))
+		{
+			cerror(c, "operator %s needs numeric operands", op->tok);
+			return;
+		}
+		if(op->swap)
+			emit_binary(c, op->op, &rhs, &lhs, op->result, out);
+		else
+			emit_binary(c, op->op, &lhs, &rhs, op->result, out);
+	}
+}
+
+static void parse_expr(struct compiler *c, struct cval *out)
+{
+	parse_binary(c, 0, out);
+	if(c->error || !accept(c, "?"))
+		return;
+
+	struct cval cond = *out, a, b;
+	parse_expr(c, &a);
+	expect(c, ":");
+	parse_expr(c, &b);
+	if(c->error)
+		return;
+	if(!is_numeric(&cond.type) || !is_numeric(&a.type) || !is_numeric(&b.type))
+	{
+		cerror(c, "invalid operands for ?:");
+		return;
+	}
+
+	int n = a.n > b.n ? a.n : b.n;
+	uint16_t ra[CPU_MAX_COMPONENTS], rb[CPU_MAX_COMPONENTS], rc[CPU_MAX_COMPONENTS];
+	if(!get_components(c, &a, n, ra) || !get_components(c, &b, n, rb) || !get_components(c, &cond, n, rc))
+		return;
+
+	memset(out, 0, sizeof(*out));
+	out->type = a.n >= b.n ? a.type : b.type;
+	out->n = n;
+	for(int i = 0; i < n; i++)
+	{
+		out->regs[i] = alloc_regs(c, 1);
+		emit(c, CPU_OP_SEL, out->regs[i], ra[i], rb[i], rc[i], 0);
+	}
+}
+
+/* --- statements --- */
+
+static bool is_type_start(struct compiler *c)
+{
+	const struct ctok *t = cur(c);
+	struct ctype type;
+	if(tok_is(t, "const") || tok_is(t, "static") || tok_is(t, "uniform"))
+		return true;
+	// "float4 x" is a declaration, "float4(...)" an expression
+	return t->kind == CTOK_NAME && t[1].kind == CTOK_NAME && parse_type_str(c, t->str.array, t->str.len, &type);
+}
+
+static void parse_declaration(struct compiler *c)
+{
+	while(accept(c, "const") || accept(c, "static") || accept(c, "uniform"))
+		;
+
+	const struct ctok *tn = cur(c);
+	struct ctype type;
+	if(tn->kind != CTOK_NAME || !parse_type_str(c, tn->str.array, tn->str.len, &type))
+	{
+		cerror(c, "expected a type");
+		return;
+	}
+	next(c);
+
+	do
+	{
+		const struct ctok *name = cur(c);
+		if(name->kind != CTOK_NAME)
+		{
+			cerror(c, "expected a variable name");
+			return;
+		}
+		next(c);
+		if(tok_is(cur(c), "["))
+		{
+			cerror(c, "local arrays are not supported");
+			return;
+		}
+
+		struct cval var;
+		alloc_val(c, &type, &var);
+		var.lvalue = true;
+		if(accept(c, "="))
+		{
+			struct cval init;
+			parse_expr(c, &init);
+			if(c->error)
+				return;
+			// the variable is new, so no mask is needed
+			int mask = c->mask;
+			c->mask = -1;
+			assign(c, &var, &init);
+			c->mask = mask;
+		}
+		else
+		{
+			uint16_t zero = const_reg(c, 0.0f);
+			for(int i = 0; i < var.n; i++)
+				emit(c, CPU_OP_MOV, var.regs[i], zero, 0, 0, 0);
+		}
+		declare(c, &name->str, &var);
+	} while(!c->error && accept(c, ","));
+
+	expect(c, ";");
+}
+
+static void parse_if(struct compiler *c)
+{
+	struct cval cond;
+	expect(c, "(");
+	parse_expr(c, &cond);
+	expect(c, ")");
+	if(c->error)
+		return;
+	if(!is_numeric(&cond.type))
+	{
+		cerror(c, "if needs a numeric condition");
+		return;
+	}
+
+	int outer = c->mask;
+	int alive = c->fn->alive;
+	uint16_t zero = const_reg(c, 0.0f);
+	uint16_t cond_reg = emit_tmp(c, CPU_OP_NE, cond.regs[0], zero);
+
+	c->mask = outer < 0 ? cond_reg : emit_tmp(c, CPU_OP_AND, outer, cond_reg);
+	parse_statement(c);
+	c->fn->returned = false;
+
+	if(accept(c, "else"))
+	{
+		uint16_t not_cond = emit_tmp(c, CPU_OP_NOT, cond_reg, 0);
+		c->mask = outer < 0 ? not_cond : emit_tmp(c, CPU_OP_AND, outer, not_cond);
+		parse_statement(c);
+		c->fn->returned = false;
+	}
+
+	c->mask = outer;
+	if(c->fn->alive != alive)
+	{
+		// lanes that returned inside the branches are done
+		c->mask = outer < 0 ? c->fn->alive : emit_tmp(c, CPU_OP_AND, outer, (uint16_t)c->fn->alive);
+	}
+}
+
+static bool parse_const_int(struct compiler *c, int *out)
+{
+	struct cval v;
+	parse_expr(c, &v);
+	if(c->error)
+		return false;
+	if(!v.is_const)
+	{
+		cerror(c, "loop bounds must be constant");
+		return false;
+	}
+	*out = (int)v.cval;
+	return true;
+}
+
+/*
+ * for(int i = A; i < B; i++) with constant A and B is unrolled, the body is
+ * compiled once per iteration with i as a constant.
+ */
+static void parse_for(struct compiler *c)
+{
+	expect(c, "(");
+	if(!accept(c, "int"))
+		accept(c, "uint");
+
+	const struct ctok *var = cur(c);
+	if(var->kind != CTOK_NAME)
+	{
+		cerror(c, "unsupported for loop");
+		return;
+	}
+	next(c);
+
+	int start, limit, step = 1;
+	expect(c, "=");
+	if(!parse_const_int(c, &start) || !expect(c, ";"))
+		return;
+
+	if(!tok_is(cur(c), var->str.array) && strref_cmp_strref(&cur(c)->str, &var->str) != 0)
+	{
+		cerror(c, "unsupported for loop condition");
+		return;
+	}
+	next(c);
+	const struct ctok *cmp = cur(c);
+	next(c);
+	if(!parse_const_int(c, &limit) || !expect(c, ";"))
+		return;
+
+	if(strref_cmp_strref(&cur(c)->str, &var->str) == 0)
+	{
+		next(c);
+		if(accept(c, "++"))
+			step = 1;
+		else if(accept(c, "--"))
+			step = -1;
+		else if(accept(c, "+="))
+			parse_const_int(c, &step);
+		else if(accept(c, "-="))
+		{
+			parse_const_int(c, &step);
+			step = -step;
+		}
+		else
+			cerror(c, "unsupported for loop step");
+	}
+	else if(accept(c, "++") || accept(c, "--"))
+	{
+		step = tok_is(cur(c) - 1, "++") ? 1 : -1;
+		if(strref_cmp_strref(&cur(c)->str, &var->str) != 0)
+			cerror(c, "unsupported for loop step");
+		next(c);
+	}
+	expect(c, ")");
+	if(c->error)
+		return;
+	if(step == 0)
+	{
+		cerror(c, "for loop doesn't terminate");
+		return;
+	}
+
+	size_t body = c->pos;
+	int iterations = 0;
+	for(int i = start;; i += step)
+	{
+		bool run;
+		if(tok_is(cmp, "<"))
+			run = i < limit;
+		else if(tok_is(cmp, "<="))
+			run = i <= limit;
+		else if(tok_is(cmp, ">"))
+			run = i > limit;
+		else if(tok_is(cmp, ">="))
+			run = i >= limit;
+		else if(tok_is(cmp, "!="))
+			run = i != limit;
+		else
+		{
+			cerror(c, "unsupported for loop condition");
+			return;
+		}
+		if(!run)
+			break;
+		if(++iterations > CPU_MAX_UNROLL)
+		{
+			cerror(c, "for loop has too many iterations");
+			return;
+		}
+
+		size_t scope = c->symbols.num;
+		struct cval iv;
+		make_const_val(c, (float)i, CT_INT, &iv);
+		declare(c, &var->str, &iv);
+		c->pos = body;
+		parse_statement(c);
+		c->symbols.num = scope;
+		if(c->error || c->fn->returned)
+			return;
+	}
+
+	// no iterations at all, step over the body
+	if(!iterations)
+	{
+		c->pos = body;
+		skip_statement(c);
+	}
+}
+
+static void parse_return(struct compiler *c)
+{
+	struct cfunc *fn = c->fn;
+	struct cval v;
+	if(tok_is(cur(c), ";"))
+	{
+		memset(&v, 0, sizeof(v));
+	}
+	else
+	{
+		parse_expr(c, &v);
+		if(c->error)
+			return;
+	}
+	expect(c, ";");
+
+	if(c->mask < 0 && !fn->has_ret)
+	{
+		fn->ret = v;
+		fn->ret.lvalue = false;
+	}
+	else
+	{
+		if(!fn->has_ret)
+		{
+			alloc_val(c, &v.type, &fn->ret);
+			uint16_t zero = const_reg(c, 0.0f);
+			for(int i = 0; i < fn->ret.n; i++)
+				emit(c, CPU_OP_MOV, fn->ret.regs[i], zero, 0, 0, 0);
+		}
+		struct cval dst = fn->ret;
+		dst.lvalue = true;
+		assign(c, &dst, &v);
+	}
+	fn->has_ret = true;
+
+	if(c->mask < 0)
+	{
+		fn->returned = true;
+	}
+	else
+	{
+		uint16_t done = emit_tmp(c, CPU_OP_NOT, (uint16_t)c->mask, 0);
+		fn->alive = fn->alive < 0 ? done : emit_tmp(c, CPU_OP_AND, (uint16_t)fn->alive, done);
+		c->mask = const_reg(c, 0.0f);
+	}
+}
+
+static void parse_statement(struct compiler *c)
+{
+	if(c->error)
+		return;
+
+	if(tok_is(cur(c), "{"))
+	{
+		parse_block(c);
+	}
+	else if(accept(c, ";"))
+	{
+	}
+	else if(accept(c, "if"))
+	{
+		parse_if(c);
+	}
+	else if(accept(c, "for"))
+	{
+		parse_for(c);
+	}
+	else if(accept(c, "return"))
+	{
+		parse_return(c);
+	}
+	else if(accept(c, "discard"))
+	{
+		expect(c, ";");
+		c->prog->uses_kill = true;
+		emit(c, CPU_OP_KILL, 0, c->mask < 0 ? const_reg(c, 1.0f) : (uint16_t)c->mask, 0, 0, 0);
+	}
+	else if(tok_is(cur(c), "while") || tok_is(cur(c), "do") || tok_is(cur(c), "break")
+		|| tok_is(cur(c), "continue") || tok_is(cur(c), "switch"))
+	{
+		cerror(c, "unsupported statement %.*s", (int)cur(c)->str.len, cur(c)->str.array);
+	}
+	else if(is_type_start(c))
+	{
+		parse_declaration(c);
+	}
+	else
+	{
+		struct cval lhs, rhs, result;
+		parse_expr(c, &lhs);
+		if(c->error)
+			return;
+
+		const struct ctok *op = cur(c);
+		if(accept(c, "="))
+		{
+			parse_expr(c, &rhs);
+			if(!c->error)
+				assign(c, &lhs, &rhs);
+		}
+		else if(tok_is(op, "+=") || tok_is(op, "-=") || tok_is(op, "*=") || tok_is(op, "/="))
+		{
+			enum cpu_op ops[] = { CPU_OP_ADD, CPU_OP_SUB, CPU_OP_MUL, CPU_OP_DIV };
+			enum cpu_op bop = ops[strchr("+-*/", op->op[0]) - "+-*/"];
+			next(c);
+			parse_expr(c, &rhs);
+			if(c->error)
+				return;
+			emit_binary(c, bop, &lhs, &rhs, CT_VOID, &result);
+			assign(c, &lhs, &result);
+		}
+		expect(c, ";");
+	}
+}
+
+static void parse_block(struct compiler *c)
+{
+	if(!expect(c, "{"))
+		return;
+
+	size_t scope = c->symbols.num;
+	while(!c->error && !tok_is(cur(c), "}"))
+	{
+		if(cur(c)->kind == CTOK_END)
+		{
+			cerror(c, "unexpected end of function");
+			break;
+		}
+		if(c->fn->returned)
+		{
+			skip_statement(c);
+			continue;
+		}
+		parse_statement(c);
+	}
+	accept(c, "}");
+	c->symbols.num = scope;
+}
+
+static void compile_call(struct compiler *c, int func_index, struct cval *args, int num_args, struct cval *out)
+{
+	const struct shader_func *func = c->sp->funcs.array + func_index;
+	memset(out, 0, sizeof(*out));
+
+	if(++c->depth > 32)
+	{
+		cerror(c, "functions nested too deeply");
+		return;
+	}
+	if((size_t)num_args != func->params.num)
+	{
+		cerror(c, "wrong number of arguments for %s", func->name);
+		return;
+	}
+
+	// bind arguments by value
+	struct csymbol *params = bzalloc(sizeof(struct csymbol) * (num_args ? num_args : 1));
+	for(int i = 0; i < num_args && !c->error; i++)
+	{
+		const struct shader_var *p = func->params.array + i;
+		struct ctype pt;
+		if(!parse_type_cstr(c, p->type, &pt))
+		{
+			cerror(c, "unknown type %s", p->type);
+			break;
+		}
+		if(p->var_type == SHADER_VAR_OUT || p->var_type == SHADER_VAR_INOUT)
+		{
+			cerror(c, "out parameters are not supported");
+			break;
+		}
+
+		struct cval v;
+		if(pt.base == CT_TEXTURE || pt.base == CT_SAMPLER || pt.base == CT_STRUCT)
+		{
+			v = args[i];
+			if(v.lvalue)
+				copy_val(c, &args[i], &v);
+		}
+		else
+		{
+			alloc_val(c, &pt, &v);
+			int mask = c->mask;
+			c->mask = -1;
+			v.lvalue = true;
+			assign(c, &v, args + i);
+			c->mask = mask;
+		}
+		v.lvalue = true;
+		strref_set(&params[i].name, p->name, strlen(p->name));
+		params[i].val = v;
+	}
+
+	if(!c->error)
+	{
+		const struct ctok *toks = c->toks;
+		size_t pos = c->pos;
+		size_t scope_base = c->scope_base;
+		size_t num_symbols = c->symbols.num;
+		struct cfunc *outer_fn = c->fn;
+		int mask = c->mask;
+
+		c->scope_base = c->symbols.num;
+		for(int i = 0; i < num_args; i++)
+			da_push_back(c->symbols, params + i);
+
+		struct cfunc fn = { 0 };
+		fn.alive = -1;
+		c->fn = &fn;
+		c->toks = c->func_toks[func_index].array;
+		c->pos = 0;
+		parse_block(c);
+
+		c->toks = toks;
+		c->pos = pos;
+		c->scope_base = scope_base;
+		c->symbols.num = num_symbols;
+		c->fn = outer_fn;
+		c->mask = mask;
+
+		struct ctype rt;
+		if(!c->error && parse_type_cstr(c, func->return_type, &rt) && rt.base != CT_VOID && !fn.has_ret)
+			cerror(c, "%s doesn't return a value", func->name);
+		*out = fn.ret;
+		out->lvalue = false;
+	}
+
+	bfree(params);
+	c->depth--;
+}
+
+/* --- program setup --- */
+
+static void add_global(struct compiler *c, const char *name, const struct cval *val)
+{
+	struct csymbol s;
+	strref_set(&s.name, name, strlen(name));
+	s.val = *val;
+	da_push_back(c->globals, &s);
+}
+
+static void add_uniforms(struct compiler *c)
+{
+	struct cpu_program *prog = c->prog;
+
+	for(size_t i = 0; i < c->sp->params.num && !c->error; i++)
+	{
+		const struct shader_var *var = c->sp->params.array + i;
+		struct ctype t;
+		if(!parse_type_cstr(c, var->type, &t))
+		{
+			cerror(c, "unknown type %s", var->type);
+			return;
+		}
+		if(var->array_count)
+		{
+			cerror(c, "uniform arrays are not supported");
+			return;
+		}
+
+		struct cval v = { 0 };
+		v.type = t;
+		if(t.base == CT_TEXTURE)
+		{
+			v.index = prog->num_textures++;
+		}
+		else if(t.base == CT_SAMPLER)
+		{
+			cerror(c, "sampler uniforms are not supported");
+			return;
+		}
+		else
+		{
+			alloc_val(c, &t, &v);
+		}
+
+		if(var->var_type == SHADER_VAR_CONST && t.base != CT_TEXTURE)
+		{
+			// compile time constant, initialized with its default value
+			const float *def = (const float *)var->default_val.array;
+			size_t num = var->default_val.num / sizeof(float);
+			for(int k = 0; k < v.n; k++)
+			{
+				float val = k < (int)num ? def[k] : 0.0f;
+				if(t.base != CT_FLOAT && k < (int)num)
+					val = (float)((const int *)def)[k];
+				v.regs[k] = const_reg(c, val);
+			}
+		}
+		else
+		{
+			struct cpu_uniform u = { 0 };
+			u.name = bstrdup(var->name);
+			u.type = get_shader_param_type(var->type);
+			u.is_int = t.base == CT_INT || t.base == CT_BOOL;
+			u.components = v.n;
+			u.reg = v.n ? v.regs[0] : 0;
+			u.texture = t.base == CT_TEXTURE ? v.index : -1;
+			da_copy(u.default_val, var->default_val);
+			da_push_back(prog->uniforms, &u);
+		}
+		add_global(c, var->name, &v);
+	}
+
+	for(size_t i = 0; i < c->sp->samplers.num; i++)
+	{
+		struct gs_sampler_info info;
+		shader_sampler_convert(c->sp->samplers.array + i, &info);
+		da_push_back(prog->samplers, &info);
+
+		struct cval v = { 0 };
+		v.type = scalar_type(CT_SAMPLER);
+		v.index = (int)i;
+		add_global(c, c->sp->samplers.array[i].name, &v);
+	}
+}
+
+static void add_io(struct compiler *c, struct darray *list, const char *mapping, const uint16_t *regs, int n)
+{
+	DARRAY(struct cpu_io) ios;
+	ios.da = *list;
+	struct cpu_io io = { 0 };
+	for(size_t i = 0; mapping[i] && i < sizeof(io.mapping) - 1; i++)
+		io.mapping[i] = (char)toupper(mapping[i]);
+	io.components = n > 16 ? 16 : n;
+	memcpy(io.regs, regs, sizeof(uint16_t) * io.components);
+	da_push_back(ios, &io);
+	*list = ios.da;
+}
+
+/* inputs and outputs of main are described by the semantics of struct members */
+static void add_struct_io(struct compiler *c, struct darray *list, const struct cval *v)
+{
+	int offset = 0;
+	for(size_t i = 0; i < v->type.st->vars.num; i++)
+	{
+		const struct shader_var *var = v->type.st->vars.array + i;
+		struct ctype mt;
+		parse_type_cstr(c, var->type, &mt);
+		int size = type_size(c, &mt);
+		if(var->mapping)
+			add_io(c, list, var->mapping, v->regs + offset, size);
+		offset += size;
+	}
+}
+
+static bool compile_main(struct compiler *c, const struct shader_func *main_func)
+{
+	int func = (int)(main_func - c->sp->funcs.array);
+	struct cval args[CPU_MAX_ARGS];
+	int num_args = (int)main_func->params.num;
+	if(num_args > CPU_MAX_ARGS)
+	{
+		cerror(c, "too many parameters for main");
+		return false;
+	}
+
+	for(int i = 0; i < num_args; i++)
+	{
+		const struct shader_var *p = main_func->params.array + i;
+		struct ctype t;
+		if(!parse_type_cstr(c, p->type, &t))
+		{
+			cerror(c, "unknown type %s", p->type);
+			return false;
+		}
+		alloc_val(c, &t, args + i);
+		if(t.base == CT_STRUCT)
+			add_struct_io(c, &c->prog->inputs.da, args + i);
+		else if(p->mapping)
+			add_io(c, &c->prog->inputs.da, p->mapping, args[i].regs, args[i].n);
+	}
+
+	struct cval ret;
+	compile_call(c, func, args, num_args, &ret);
+	if(c->error)
+		return false;
+
+	if(ret.type.base == CT_STRUCT)
+		add_struct_io(c, &c->prog->outputs.da, &ret);
+	else if(is_numeric(&ret.type))
+		add_io(c, &c->prog->outputs.da, main_func->mapping ? main_func->mapping : "TARGET", ret.regs, ret.n);
+	return !c->error;
+}
+
+static void program_free(struct cpu_program *prog)
+{
+	if(!prog)
+		return;
+	for(size_t i = 0; i < prog->uniforms.num; i++)
+	{
+		bfree(prog->uniforms.array[i].name);
+		da_free(prog->uniforms.array[i].default_val);
+	}
+	da_free(prog->code);
+	da_free(prog->consts);
+	da_free(prog->uniforms);
+	da_free(prog->samplers);
+	da_free(prog->inputs);
+	da_free(prog->outputs);
+	bfree(prog->file);
+	bfree(prog);
+}
+
+static struct cpu_program *program_compile(const char *source, const char *file, enum gs_shader_type type)
+{
+	struct shader_parser sp;
+	struct compiler c = { 0 };
+	struct cpu_program *prog = bzalloc(sizeof(struct cpu_program));
+	prog->refs = 1;
+	prog->type = type;
+	prog->file = bstrdup(file);
+
+	shader_parser_init(&sp);
+	c.sp = &sp;
+	c.prog = prog;
+	c.mask = -1;
+	dstr_init(&c.error_str);
+
+	if(!shader_parse(&sp, source, file))
+	{
+		cerror(&c, "parsing failed");
+		goto done;
+	}
+
+	c.func_toks = bzalloc(sizeof(*c.func_toks) * (sp.funcs.num ? sp.funcs.num : 1));
+	const struct shader_func *main_func = NULL;
+	for(size_t i = 0; i < sp.funcs.num; i++)
+	{
+		tokenize(sp.funcs.array[i].start, sp.funcs.array[i].end, &c.func_toks[i].da);
+		if(!strcmp(sp.funcs.array[i].name, "main"))
+			main_func = sp.funcs.array + i;
+	}
+	if(!main_func)
+	{
+		cerror(&c, "no main function");
+		goto done;
+	}
+
+	prog->kill_reg = alloc_regs(&c, 1);
+	add_uniforms(&c);
+	if(!c.error)
+		compile_main(&c, main_func);
+
+done:
+	if(c.error)
+	{
+		blog(LOG_WARNING, "CPU Renderer can't run shader %s: %s", file, c.error_str.array);
+		program_free(prog);
+		prog = NULL;
+	}
+	else
+	{
+		prog->num_regs = c.num_regs;
+		blog(LOG_DEBUG, "CPU Renderer compiled %s: %zu instructions, %u registers",
+				file, prog->code.num, (unsigned)prog->num_regs);
+	}
+
+	if(c.func_toks)
+	{
+		for(size_t i = 0; i < sp.funcs.num; i++)
+			da_free(c.func_toks[i]);
+		bfree(c.func_toks);
+	}
+	da_free(c.symbols);
+	da_free(c.globals);
+	dstr_free(&c.error_str);
+	shader_parser_free(&sp);
+	return prog;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Cache */
+
+static uint64_t hash_str(const char *s)
+{
+	// FNV-1a
+	uint64_t h = 14695981039346656037ULL;
+	for(; s && *s; s++)
+		h = (h ^ (uint8_t)*s) * 1099511628211ULL;
+	return h;
+}
+
+struct cpu_program *cpu_program_get(gs_device_t *device, const char *source, const char *file, enum gs_shader_type type)
+{
+	if(!source || !file)
+		return NULL;
+
+	uint64_t hash = hash_str(source);
+	for(size_t i = 0; i < device->programs.num; i++)
+	{
+		struct cpu_program *prog = device->programs.array[i];
+		if(prog->hash == hash && prog->type == type && !strcmp(prog->file, file))
+		{
+			prog->refs++;
+			return prog;
+		}
+	}
+
+	struct cpu_program *prog = program_compile(source, file, type);
+	if(prog)
+	{
+		prog->hash = hash;
+		da_push_back(device->programs, &prog);
+	}
+	return prog;
+}
+
+void cpu_program_release(gs_device_t *device, struct cpu_program *prog)
+{
+	if(!prog || --prog->refs > 0)
+		return;
+	da_erase_item(device->programs, &prog);
+	program_free(prog);
+}
+
+/* ------------------------------------------------------------------------- */
+/* Uniform values */
+
+size_t cpu_program_num_uniforms(const struct cpu_program *prog)
+{
+	return prog ? prog->uniforms.num : 0;
+}
+
+int cpu_program_find_uniform(const struct cpu_program *prog, const char *name)
+{
+	for(size_t i = 0; prog && i < prog->uniforms.num; i++)
+	{
+		if(!strcmp(prog->uniforms.array[i].name, name))
+			return (int)i;
+	}
+	return -1;
+}
+
+enum gs_shader_param_type cpu_program_uniform_type(const struct cpu_program *prog, int uniform)
+{
+	return prog->uniforms.array[uniform].type;
+}
+
+void cpu_program_set_value(const struct cpu_program *prog, struct cpu_uniform_value *values, int uniform, const void *data, size_t size)
+{
+	const struct cpu_uniform *u = prog->uniforms.array + uniform;
+	struct cpu_uniform_value *v = values + uniform;
+
+	if(u->texture >= 0)
+	{
+		if(size >= sizeof(gs_texture_t *))
+			v->tex = *(gs_texture_t *const *)data;
+		return;
+	}
+
+	size_t count = size / sizeof(float);
+	if(count > (size_t)u->components)
+		count = (size_t)u->components;
+	for(size_t i = 0; i < count; i++)
+		v->data[i] = u->is_int ? (float)((const int *)data)[i] : ((const float *)data)[i];
+}
+
+void cpu_program_init_values(const struct cpu_program *prog, struct cpu_uniform_value *values)
+{
+	for(size_t i = 0; i < prog->uniforms.num; i++)
+	{
+		const struct cpu_uniform *u = prog->uniforms.array + i;
+		memset(values + i, 0, sizeof(*values));
+		if(u->default_val.num)
+			cpu_program_set_value(prog, values, (int)i, u->default_val.array, u->default_val.num);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* Execution */
+
+struct cpu_exec_env {
+	gs_texture_t *textures[16];
+	const struct gs_sampler_info *tex_samplers[16]; // sampler overrides per texture
+	const struct cpu_program *prog;
+};
+
+static inline float clampf(float x, float lo, float hi)
+{
+	return x < lo ? lo : (x > hi ? hi : x);
+}
+
+static inline int address(int i, int size, enum gs_address_mode mode, bool *border)
+{
+	switch(mode)
+	{
+	case GS_ADDRESS_WRAP:
+		i %= size;
+		return i < 0 ? i + size : i;
+	case GS_ADDRESS_MIRROR:
+	case GS_ADDRESS_MIRRORONCE:
+	{
+		int period = size * 2;
+		int m = i % period;
+		if(m < 0)
+			m += period;
+		if(mode == GS_ADDRESS_MIRRORONCE && (i < -size || i >= period))
+			m = i < 0 ? 0 : size - 1;
+		return m < size ? m : period - 1 - m;
+	}
+	case GS_ADDRESS_BORDER:
+		if(i < 0 || i >= size)
+		{
+			*border = true;
+			return 0;
+		}
+		return i;
+	case GS_ADDRESS_CLAMP:
+	default:
+		return i < 0 ? 0 : (i >= size ? size - 1 : i);
+	}
+}
+
+static void fetch(const gs_texture_t *tex, int x, int y, float *out)
+{
+	const float k = 1.0f / 255.0f;
+	size_t i = (size_t)y * tex->width + (size_t)x;
+	const uint8_t *p;
+	switch(tex->color_format)
+	{
+	case GS_RGBA:
+		p = tex->data + i * 4;
+		out[0] = p[0] * k; out[1] = p[1] * k; out[2] = p[2] * k; out[3] = p[3] * k;
+		break;
+	case GS_BGRA:
+		p = tex->data + i * 4;
+		out[0] = p[2] * k; out[1] = p[1] * k; out[2] = p[0] * k; out[3] = p[3] * k;
+		break;
+	case GS_BGRX:
+		p = tex->data + i * 4;
+		out[0] = p[2] * k; out[1] = p[1] * k; out[2] = p[0] * k; out[3] = 1.0f;
+		break;
+	case GS_R8G8:
+		p = tex->data + i * 2;
+		out[0] = p[0] * k; out[1] = p[1] * k; out[2] = 0.0f; out[3] = 1.0f;
+		break;
+	case GS_R8:
+		out[0] = tex->data[i] * k; out[1] = 0.0f; out[2] = 0.0f; out[3] = 1.0f;
+		break;
+	case GS_A8:
+		out[0] = 0.0f; out[1] = 0.0f; out[2] = 0.0f; out[3] = tex->data[i] * k;
+		break;
+	default:
+		out[0] = out[1] = out[2] = out[3] = 0.0f;
+		break;
+	}
+}
+
+static void fetch_addressed(const gs_texture_t *tex, const struct gs_sampler_info *info, int x, int y, float *out)
+{
+	bool border = false;
+	x = address(x, (int)tex->width, info->address_u, &border);
+	y = address(y, (int)tex->height, info->address_v, &border);
+	if(border)
+	{
+		uint32_t bc = info->border_color;
+		for(int i = 0; i < 4; i++)
+			out[i] = (float)((bc >> (i * 8)) & 0xFF) / 255.0f;
+		return;
+	}
+	fetch(tex, x, y, out);
+}
+
+static inline bool filter_is_point(enum gs_sample_filter filter)
+{
+	switch(filter)
+	{
+	case GS_FILTER_POINT:
+	case GS_FILTER_MIN_MAG_POINT_MIP_LINEAR:
+	case GS_FILTER_MIN_LINEAR_MAG_MIP_POINT:
+	case GS_FILTER_MIN_LINEAR_MAG_POINT_MIP_LINEAR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void sample(const gs_texture_t *tex, const struct gs_sampler_info *info, float u, float v, float *out)
+{
+	float x = u * (float)tex->width;
+	float y = v * (float)tex->height;
+
+	if(filter_is_point(info->filter))
+	{
+		fetch_addressed(tex, info, (int)floorf(x), (int)floorf(y), out);
+		return;
+	}
+
+	x -= 0.5f;
+	y -= 0.5f;
+	float fx = floorf(x), fy = floorf(y);
+	float wx = x - fx, wy = y - fy;
+	int x0 = (int)fx, y0 = (int)fy;
+	float t00[4], t10[4], t01[4], t11[4];
+	fetch_addressed(tex, info, x0, y0, t00);
+	fetch_addressed(tex, info, x0 + 1, y0, t10);
+	fetch_addressed(tex, info, x0, y0 + 1, t01);
+	fetch_addressed(tex, info, x0 + 1, y0 + 1, t11);
+	for(int i = 0; i < 4; i++)
+	{
+		float top = t00[i] + (t10[i] - t00[i]) * wx;
+		float bottom = t01[i] + (t11[i] - t01[i]) * wx;
+		out[i] = top + (bottom - top) * wy;
+	}
+}
+
+static inline __m128 floor_ps(__m128 x)
+{
+	__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+	return _mm_sub_ps(t, _mm_and_ps(_mm_cmplt_ps(x, t), _mm_set1_ps(1.0f)));
+}
+
+#define VEC_OP(expr) \
+	for(int k = 0; k < CPU_SHADER_VECS; k++) \
+	{ \
+		__m128 a = r[in->a].v[k], b = r[in->b].v[k]; \
+		(void)a; (void)b; \
+		r[in->d].v[k] = (expr); \
+	} \
+	break;
+
+#define LANE_OP(expr) \
+	for(int l = 0; l < CPU_SHADER_LANES; l++) \
+	{ \
+		float a = r[in->a].f[l], b = r[in->b].f[l]; \
+		(void)b; \
+		r[in->d].f[l] = (expr); \
+	} \
+	break;
+
+static void run(const struct cpu_program *prog, cpu_reg *r, const struct cpu_exec_env *env)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const struct cpu_instr *code = prog->code.array;
+	const struct cpu_instr *end = code + prog->code.num;
+
+	for(const struct cpu_instr *in = code; in < end; in++)
+	{
+		switch((enum cpu_op)in->op)
+		{
+		case CPU_OP_MOV:
+			r[in->d] = r[in->a];
+			break;
+		case CPU_OP_SEL:
+			for(int k = 0; k < CPU_SHADER_VECS; k++)
+			{
+				__m128 m = _mm_cmpneq_ps(r[in->c].v[k], zero);
+				r[in->d].v[k] = _mm_or_ps(_mm_and_ps(m, r[in->a].v[k]), _mm_andnot_ps(m, r[in->b].v[k]));
+			}
+			break;
+		case CPU_OP_ADD: VEC_OP(_mm_add_ps(a, b))
+		case CPU_OP_SUB: VEC_OP(_mm_sub_ps(a, b))
+		case CPU_OP_MUL: VEC_OP(_mm_mul_ps(a, b))
+		case CPU_OP_DIV: VEC_OP(_mm_div_ps(a, b))
+		case CPU_OP_MIN: VEC_OP(_mm_min_ps(a, b))
+		case CPU_OP_MAX: VEC_OP(_mm_max_ps(a, b))
+		case CPU_OP_LT: VEC_OP(_mm_and_ps(_mm_cmplt_ps(a, b), one))
+		case CPU_OP_LE: VEC_OP(_mm_and_ps(_mm_cmple_ps(a, b), one))
+		case CPU_OP_EQ: VEC_OP(_mm_and_ps(_mm_cmpeq_ps(a, b), one))
+		case CPU_OP_NE: VEC_OP(_mm_and_ps(_mm_cmpneq_ps(a, b), one))
+		case CPU_OP_AND: VEC_OP(_mm_and_ps(_mm_and_ps(_mm_cmpneq_ps(a, zero), _mm_cmpneq_ps(b, zero)), one))
+		case CPU_OP_OR: VEC_OP(_mm_and_ps(_mm_or_ps(_mm_cmpneq_ps(a, zero), _mm_cmpneq_ps(b, zero)), one))
+		case CPU_OP_NOT: VEC_OP(_mm_and_ps(_mm_cmpeq_ps(a, zero), one))
+		case CPU_OP_FLOOR: VEC_OP(floor_ps(a))
+		case CPU_OP_TRUNC: VEC_OP(_mm_cvtepi32_ps(_mm_cvttps_epi32(a)))
+		case CPU_OP_SQRT: VEC_OP(_mm_sqrt_ps(a))
+		case CPU_OP_POW: LANE_OP(powf(a, b))
+		case CPU_OP_EXP: LANE_OP(expf(a))
+		case CPU_OP_EXP2: LANE_OP(exp2f(a))
+		case CPU_OP_LOG: LANE_OP(logf(a))
+		case CPU_OP_LOG2: LANE_OP(log2f(a))
+		case CPU_OP_SIN: LANE_OP(sinf(a))
+		case CPU_OP_COS: LANE_OP(cosf(a))
+		case CPU_OP_TAN: LANE_OP(tanf(a))
+		case CPU_OP_FMOD: LANE_OP(fmodf(a, b))
+		case CPU_OP_SAMPLE:
+		case CPU_OP_LOAD:
+		{
+			const gs_texture_t *tex = in->c < 16 ? env->textures[in->c] : NULL;
+			const struct gs_sampler_info *info = NULL;
+			if(in->op == CPU_OP_SAMPLE)
+			{
+				info = in->c < 16 ? env->tex_samplers[in->c] : NULL;
+				if(!info)
+					info = prog->samplers.array + in->e;
+			}
+			for(int l = 0; l < CPU_SHADER_LANES; l++)
+			{
+				float texel[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+				if(tex && in->op == CPU_OP_SAMPLE)
+				{
+					sample(tex, info, r[in->a].f[l], r[in->b].f[l], texel);
+				}
+				else if(tex)
+				{
+					int x = (int)r[in->a].f[l], y = (int)r[in->b].f[l];
+					if(x >= 0 && y >= 0 && x < (int)tex->width && y < (int)tex->height)
+						fetch(tex, x, y, texel);
+				}
+				for(int i = 0; i < 4; i++)
+					r[in->d + i].f[l] = texel[i];
+			}
+			break;
+		}
+		case CPU_OP_KILL:
+			for(int k = 0; k < CPU_SHADER_VECS; k++)
+			{
+				__m128 m = _mm_cmpneq_ps(r[in->a].v[k], zero);
+				r[prog->kill_reg].v[k] = _mm_or_ps(r[prog->kill_reg].v[k], _mm_and_ps(m, one));
+			}
+			break;
+		}
+	}
+}
+
+static void init_env(struct cpu_exec_env *env, const gs_shader_t *shader)
+{
+	const struct cpu_program *prog = shader->program;
+	memset(env, 0, sizeof(*env));
+	env->prog = prog;
+	for(size_t i = 0; i < prog->uniforms.num; i++)
+	{
+		const struct cpu_uniform *u = prog->uniforms.array + i;
+		if(u->texture < 0 || u->texture >= 16)
+			continue;
+		env->textures[u->texture] = shader->values[i].tex;
+		if(shader->values[i].next_sampler)
+			env->tex_samplers[u->texture] = &shader->values[i].next_sampler->info;
+	}
+}
+
+static cpu_reg *alloc_registers(const gs_shader_t *shader)
+{
+	const struct cpu_program *prog = shader->program;
+	cpu_reg *r = bmalloc(sizeof(cpu_reg) * (prog->num_regs ? prog->num_regs : 1));
+
+	for(size_t i = 0; i < prog->consts.num; i++)
+	{
+		for(int k = 0; k < CPU_SHADER_VECS; k++)
+			r[prog->consts.array[i].reg].v[k] = _mm_set1_ps(prog->consts.array[i].val);
+	}
+	for(size_t i = 0; i < prog->uniforms.num; i++)
+	{
+		const struct cpu_uniform *u = prog->uniforms.array + i;
+		for(int c = 0; c < u->components; c++)
+			for(int k = 0; k < CPU_SHADER_VECS; k++)
+				r[u->reg + c].v[k] = _mm_set1_ps(shader->values[i].data[c]);
+	}
+	return r;
+}
+
+static const struct cpu_io *find_io(const struct darray *list, const char *mapping)
+{
+	const struct cpu_io *ios = list->array;
+	for(size_t i = 0; i < list->num; i++)
+	{
+		if(!strcmp(ios[i].mapping, mapping))
+			return ios + i;
+	}
+	return NULL;
+}
+
+static inline bool is_position(const char *mapping)
+{
+	return !strcmp(mapping, "POSITION") || !strcmp(mapping, "SV_POSITION");
+}
+
+/* --- vertex stage --- */
+
+#define CPU_MAX_VARYINGS 64
+
+/* pixel shader input components, in the order they are interpolated */
+struct cpu_varying_layout {
+	int num;
+	uint16_t ps_regs[CPU_MAX_VARYINGS];
+	int ps_comps[CPU_MAX_VARYINGS];    // component of a POSITION input, -1 otherwise
+	const struct cpu_io *vs_outputs[CPU_MAX_VARYINGS];
+	int vs_comps[CPU_MAX_VARYINGS];
+};
+
+/* vertex after the vertex shader, in screen space */
+struct cpu_vertex {
+	float x, y;
+	float inv_w;                  // for perspective correct interpolation
+	float vary[CPU_MAX_VARYINGS]; // divided by w
+};
+
+static void build_layout(const struct cpu_program *vs, const struct cpu_program *ps, struct cpu_varying_layout *layout)
+{
+	memset(layout, 0, sizeof(*layout));
+	for(size_t i = 0; i < ps->inputs.num; i++)
+	{
+		const struct cpu_io *in = ps->inputs.array + i;
+		bool pos = is_position(in->mapping);
+		const struct cpu_io *src = pos ? NULL : find_io(&vs->outputs.da, in->mapping);
+		for(int c = 0; c < in->components && layout->num < CPU_MAX_VARYINGS; c++)
+		{
+			int v = layout->num++;
+			layout->ps_regs[v] = in->regs[c];
+			layout->ps_comps[v] = pos ? c : -1;
+			layout->vs_outputs[v] = src && c < src->components ? src : NULL;
+			layout->vs_comps[v] = c;
+		}
+	}
+}
+
+static void load_attribute(cpu_reg *r, const struct cpu_io *io, const struct gs_vb_data *data, size_t first, size_t count)
+{
+	for(int l = 0; l < CPU_SHADER_LANES; l++)
+	{
+		// unused lanes repeat the last vertex
+		size_t v = first + ((size_t)l < count ? (size_t)l : count - 1);
+		float val[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+		if(is_position(io->mapping) && data->points)
+		{
+			memcpy(val, data->points[v].ptr, sizeof(float) * 3);
+		}
+		else if(!strcmp(io->mapping, "NORMAL") && data->normals)
+		{
+			memcpy(val, data->normals[v].ptr, sizeof(float) * 3);
+		}
+		else if(!strcmp(io->mapping, "TANGENT") && data->tangents)
+		{
+			memcpy(val, data->tangents[v].ptr, sizeof(float) * 3);
+		}
+		else if(!strcmp(io->mapping, "COLOR") && data->colors)
+		{
+			uint32_t color = data->colors[v];
+			for(int i = 0; i < 4; i++)
+				val[i] = (float)((color >> (i * 8)) & 0xFF) / 255.0f;
+		}
+		else if(!strncmp(io->mapping, "TEXCOORD", 8))
+		{
+			size_t unit = (size_t)atoi(io->mapping + 8);
+			if(unit < data->num_tex && data->tvarray[unit].array)
+			{
+				size_t width = data->tvarray[unit].width;
+				const float *tv = (const float *)data->tvarray[unit].array + v * width;
+				for(size_t i = 0; i < width && i < 4; i++)
+					val[i] = tv[i];
+			}
+		}
+		for(int c = 0; c < io->components && c < 4; c++)
+			r[io->regs[c]].f[l] = val[c];
+	}
+}
+
+/* runs the vertex shader on a batch of vertices per call, one per lane */
+static bool run_vertex_stage(gs_device_t *device, gs_shader_t *vs, const struct cpu_varying_layout *layout,
+		size_t start, size_t num, const struct matrix4 *viewproj, struct cpu_vertex *out)
+{
+	const struct cpu_program *prog = vs->program;
+	const struct gs_vb_data *data = device->vertex_buffer_cur->data;
+
+	const struct cpu_io *pos = NULL;
+	for(size_t i = 0; i < prog->outputs.num; i++)
+		if(is_position(prog->outputs.array[i].mapping))
+			pos = prog->outputs.array + i;
+	if(!pos || pos->components < 4)
+	{
+		blog(LOG_ERROR, "Vertex shader %s has no position output", vs->file);
+		return false;
+	}
+
+	int viewproj_uniform = cpu_program_find_uniform(prog, "ViewProj");
+	if(viewproj_uniform >= 0)
+	{
+		struct matrix4 t;
+		matrix4_transpose(&t, viewproj);
+		cpu_program_set_value(prog, vs->values, viewproj_uniform, &t, sizeof(t));
+	}
+
+	struct cpu_exec_env env;
+	init_env(&env, vs);
+	cpu_reg *r = alloc_registers(vs);
+
+	for(size_t first = 0; first < num; first += CPU_SHADER_LANES)
+	{
+		size_t count = num - first < CPU_SHADER_LANES ? num - first : CPU_SHADER_LANES;
+		for(size_t i = 0; i < prog->inputs.num; i++)
+			load_attribute(r, prog->inputs.array + i, data, start + first, count);
+		run(prog, r, &env);
+
+		for(size_t l = 0; l < count; l++)
+		{
+			struct cpu_vertex *v = out + first + l;
+			float w = r[pos->regs[3]].f[l];
+			// behind the eye, primitives using it are dropped
+			v->inv_w = w > 1e-6f ? 1.0f / w : 0.0f;
+
+			// same mapping as cpu_vertex_to_screen
+			float x = (r[pos->regs[0]].f[l] * v->inv_w + 1.0f) * 0.5f;
+			float y = (r[pos->regs[1]].f[l] * v->inv_w + 1.0f) * 0.5f;
+			v->x = x * (float)device->viewport.width + (float)device->viewport.x;
+			v->y = (1.0f - y) * (float)device->viewport.height + (float)device->viewport.y;
+
+			for(int i = 0; i < layout->num; i++)
+			{
+				const struct cpu_io *src = layout->vs_outputs[i];
+				v->vary[i] = src ? r[src->regs[layout->vs_comps[i]]].f[l] * v->inv_w : 0.0f;
+			}
+		}
+	}
+
+	bfree(r);
+	return true;
+}
+
+/* --- rasterizer --- */
+
+/*
+ * Triangles are rasterized with edge functions, evaluated for
+ * CPU_SHADER_LANES pixel centers at once. Pixels exactly on an edge follow the
+ * top-left rule, so triangles sharing an edge never touch a pixel twice.
+ */
+struct cpu_triangle {
+	struct cpu_vertex v[3];
+	float area;
+	float e_c[3], e_dx[3], e_dy[3]; // e = c + dx * x + dy * y, positive inside
+	bool top_left[3];
+	struct cpu_rect bounds;
+};
+
+struct raster_job {
+	gs_shader_t *ps;
+	gs_texture_t *dst;
+	const struct cpu_blend_state *blend;
+	const struct cpu_varying_layout *layout;
+	const struct cpu_io *target;
+	const struct cpu_triangle *tris;
+	size_t num_tris;
+	struct cpu_rect bounds; // union of all triangles
+	struct cpu_exec_env env;
+};
+
+static bool triangle_setup(struct cpu_triangle *t, const struct cpu_vertex *a, const struct cpu_vertex *b,
+		const struct cpu_vertex *c, enum gs_cull_mode cull, const struct cpu_rect *clip)
+{
+	if(a->inv_w <= 0.0f || b->inv_w <= 0.0f || c->inv_w <= 0.0f)
+		return false;
+
+	float area = (b->x - a->x) * (c->y - a->y) - (c->x - a->x) * (b->y - a->y);
+	if(area == 0.0f || isnan(area))
+		return false;
+
+	// clockwise on screen is counter-clockwise in GL window coordinates, the front face
+	if((cull == GS_BACK && area < 0.0f) || (cull == GS_FRONT && area > 0.0f))
+		return false;
+
+	t->v[0] = *a;
+	if(area > 0.0f)
+	{
+		t->v[1] = *b;
+		t->v[2] = *c;
+	}
+	else
+	{
+		t->v[1] = *c;
+		t->v[2] = *b;
+		area = -area;
+	}
+	t->area = area;
+
+	float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+	for(int e = 0; e < 3; e++)
+	{
+		// edge e is opposite of vertex e
+		const struct cpu_vertex *p = t->v + (e + 1) % 3;
+		const struct cpu_vertex *q = t->v + (e + 2) % 3;
+		float dx = q->x - p->x, dy = q->y - p->y;
+		t->e_dx[e] = -dy;
+		t->e_dy[e] = dx;
+		t->e_c[e] = dy * p->x - dx * p->y;
+		t->top_left[e] = dy < 0.0f || (dy == 0.0f && dx > 0.0f);
+
+		x0 = fminf(x0, t->v[e].x);
+		y0 = fminf(y0, t->v[e].y);
+		x1 = fmaxf(x1, t->v[e].x);
+		y1 = fmaxf(y1, t->v[e].y);
+	}
+
+	// pixels whose centers can be inside
+	t->bounds.x0 = (int64_t)floorf(x0 - 0.5f);
+	t->bounds.y0 = (int64_t)floorf(y0 - 0.5f);
+	t->bounds.x1 = (int64_t)ceilf(x1 + 0.5f);
+	t->bounds.y1 = (int64_t)ceilf(y1 + 0.5f);
+	if(t->bounds.x0 < clip->x0) t->bounds.x0 = clip->x0;
+	if(t->bounds.y0 < clip->y0) t->bounds.y0 = clip->y0;
+	if(t->bounds.x1 > clip->x1) t->bounds.x1 = clip->x1;
+	if(t->bounds.y1 > clip->y1) t->bounds.y1 = clip->y1;
+	return t->bounds.x0 < t->bounds.x1 && t->bounds.y0 < t->bounds.y1;
+}
+
+static inline __m128 lane_offsets(int k)
+{
+	return _mm_setr_ps(k * 4 + 0.5f, k * 4 + 1.5f, k * 4 + 2.5f, k * 4 + 3.5f);
+}
+
+/* coverage of CPU_SHADER_LANES pixels starting at (x, y), barycentric weights in w */
+static int coverage(const struct cpu_triangle *t, int64_t x, int64_t y, __m128 w[3][CPU_SHADER_VECS])
+{
+	const __m128 zero = _mm_setzero_ps();
+	int mask = 0;
+	float py = (float)y + 0.5f;
+	__m128 inv_area = _mm_set1_ps(1.0f / t->area);
+
+	for(int k = 0; k < CPU_SHADER_VECS; k++)
+	{
+		__m128 px = _mm_add_ps(_mm_set1_ps((float)x), lane_offsets(k));
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for(int e = 0; e < 3; e++)
+		{
+			__m128 v = _mm_add_ps(_mm_set1_ps(t->e_c[e] + t->e_dy[e] * py), _mm_mul_ps(_mm_set1_ps(t->e_dx[e]), px));
+			__m128 in = t->top_left[e] ? _mm_cmple_ps(zero, v) : _mm_cmplt_ps(zero, v);
+			inside = _mm_and_ps(inside, in);
+			w[e][k] = _mm_mul_ps(v, inv_area);
+		}
+		mask |= _mm_movemask_ps(inside) << (k * 4);
+	}
+	return mask;
+}
+
+static void shade_span(const struct raster_job *job, const struct cpu_triangle *t, cpu_reg *r, int64_t x, int64_t y,
+		__m128 w[3][CPU_SHADER_VECS])
+{
+	const struct cpu_varying_layout *layout = job->layout;
+
+	for(int k = 0; k < CPU_SHADER_VECS; k++)
+	{
+		__m128 inv_w = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(w[0][k], _mm_set1_ps(t->v[0].inv_w)),
+				_mm_mul_ps(w[1][k], _mm_set1_ps(t->v[1].inv_w))),
+				_mm_mul_ps(w[2][k], _mm_set1_ps(t->v[2].inv_w)));
+		__m128 pw = _mm_div_ps(_mm_set1_ps(1.0f), inv_w);
+
+		for(int i = 0; i < layout->num; i++)
+		{
+			__m128 val;
+			switch(layout->ps_comps[i])
+			{
+			case 0:
+				val = _mm_add_ps(_mm_set1_ps((float)x), lane_offsets(k));
+				break;
+			case 1:
+				val = _mm_set1_ps((float)y + 0.5f);
+				break;
+			case 2:
+				val = _mm_setzero_ps();
+				break;
+			case 3:
+				val = inv_w;
+				break;
+			default:
+				val = _mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(w[0][k], _mm_set1_ps(t->v[0].vary[i])),
+						_mm_mul_ps(w[1][k], _mm_set1_ps(t->v[1].vary[i]))),
+						_mm_mul_ps(w[2][k], _mm_set1_ps(t->v[2].vary[i])));
+				val = _mm_mul_ps(val, pw);
+				break;
+			}
+			r[layout->ps_regs[i]].v[k] = val;
+		}
+	}
+}
+
+static inline uint8_t to_unorm8(float f)
+{
+	return (uint8_t)(clampf(f, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+static void raster_rows(void *param, int64_t row_begin, int64_t row_end)
+{
+	struct raster_job *job = param;
+	const struct cpu_program *prog = job->ps->program;
+	const struct cpu_io *target = job->target;
+	int64_t y_begin = job->bounds.y0 + row_begin;
+	int64_t y_end = job->bounds.y0 + row_end;
+
+	cpu_reg *r = alloc_registers(job->ps);
+	uint8_t rgba[CPU_SHADER_LANES * 4];
+	__m128 w[3][CPU_SHADER_VECS];
+
+	// bands are disjoint rows, so every pixel still sees the triangles in order
+	for(size_t i = 0; i < job->num_tris; i++)
+	{
+		const struct cpu_triangle *t = job->tris + i;
+		int64_t y0 = t->bounds.y0 > y_begin ? t->bounds.y0 : y_begin;
+		int64_t y1 = t->bounds.y1 < y_end ? t->bounds.y1 : y_end;
+
+		for(int64_t y = y0; y < y1; y++)
+		{
+			for(int64_t x = t->bounds.x0; x < t->bounds.x1; x += CPU_SHADER_LANES)
+			{
+				int mask = coverage(t, x, y, w);
+				if(x + CPU_SHADER_LANES > t->bounds.x1)
+					mask &= (1 << (t->bounds.x1 - x)) - 1;
+				if(!mask)
+					continue;
+
+				shade_span(job, t, r, x, y, w);
+				if(prog->uses_kill)
+					memset(&r[prog->kill_reg], 0, sizeof(cpu_reg));
+				run(prog, r, &job->env);
+
+				for(int l = 0; l < CPU_SHADER_LANES; l++)
+				{
+					if(prog->uses_kill && r[prog->kill_reg].f[l] != 0.0f)
+						mask &= ~(1 << l);
+					uint8_t *p = rgba + l * 4;
+					for(int c = 0; c < 4; c++)
+						p[c] = c < target->components ? to_unorm8(r[target->regs[c]].f[l]) : 255;
+				}
+
+				// write runs of covered pixels
+				for(int l = 0; l < CPU_SHADER_LANES;)
+				{
+					if(!(mask & (1 << l)))
+					{
+						l++;
+						continue;
+					}
+					int end = l;
+					while(end < CPU_SHADER_LANES && (mask & (1 << end)))
+						end++;
+					cpu_write_row(job->dst, x + l, y, rgba + l * 4, (size_t)(end - l), job->blend);
+					l = end;
+				}
+			}
+		}
+	}
+
+	bfree(r);
+}
+
+/* --- primitive assembly --- */
+
+static void push_triangle(struct darray *tris, const struct cpu_vertex *a, const struct cpu_vertex *b,
+		const struct cpu_vertex *c, enum gs_cull_mode cull, const struct cpu_rect *clip)
+{
+	struct cpu_triangle t;
+	if(triangle_setup(&t, a, b, c, cull, clip))
+		darray_push_back(sizeof(struct cpu_triangle), tris, &t);
+}
+
+/* quad covering the pixels a line or point touches, never culled */
+static void push_quad(struct darray *tris, const struct cpu_vertex *a, const struct cpu_vertex *b,
+		const struct cpu_rect *clip)
+{
+	float dx = b->x - a->x, dy = b->y - a->y;
+	float len = sqrtf(dx * dx + dy * dy);
+	float ux = 0.5f, uy = 0.0f;
+	if(len > 0.0f)
+	{
+		ux = dx / len * 0.5f;
+		uy = dy / len * 0.5f;
+	}
+
+	// extend by half a pixel along the line and to both sides
+	struct cpu_vertex q[4] = { *a, *a, *b, *b };
+	q[0].x += -ux - uy; q[0].y += -uy + ux;
+	q[1].x += -ux + uy; q[1].y += -uy - ux;
+	q[2].x += ux - uy;  q[2].y += uy + ux;
+	q[3].x += ux + uy;  q[3].y += uy - ux;
+	push_triangle(tris, q + 0, q + 1, q + 2, GS_NEITHER, clip);
+	push_triangle(tris, q + 1, q + 3, q + 2, GS_NEITHER, clip);
+}
+
+static void assemble(struct darray *tris, enum gs_draw_mode mode, const struct cpu_vertex *v, size_t num,
+		enum gs_cull_mode cull, const struct cpu_rect *clip)
+{
+	switch(mode)
+	{
+	case GS_POINTS:
+		for(size_t i = 0; i < num; i++)
+			push_quad(tris, v + i, v + i, clip);
+		break;
+	case GS_LINES:
+		for(size_t i = 0; i + 1 < num; i += 2)
+			push_quad(tris, v + i, v + i + 1, clip);
+		break;
+	case GS_LINESTRIP:
+		for(size_t i = 0; i + 1 < num; i++)
+			push_quad(tris, v + i, v + i + 1, clip);
+		break;
+	case GS_TRIS:
+		for(size_t i = 0; i + 2 < num; i += 3)
+			push_triangle(tris, v + i, v + i + 1, v + i + 2, cull, clip);
+		break;
+	case GS_TRISTRIP:
+		// every other triangle has its winding flipped back
+		for(size_t i = 0; i + 2 < num; i++)
+		{
+			if(i & 1)
+				push_triangle(tris, v + i + 1, v + i, v + i + 2, cull, clip);
+			else
+				push_triangle(tris, v + i, v + i + 1, v + i + 2, cull, clip);
+		}
+		break;
+	}
+}
+
+bool cpu_program_draw(gs_device_t *device, gs_shader_t *vs, gs_shader_t *ps, gs_texture_t *dst,
+		enum gs_draw_mode mode, uint32_t start_vert, uint32_t num_verts,
+		const struct matrix4 *viewproj, const struct cpu_blend_state *blend, struct cpu_rect *drawn)
+{
+	struct cpu_varying_layout layout;
+	struct raster_job job = { 0 };
+	memset(drawn, 0, sizeof(*drawn));
+
+	job.target = find_io(&ps->program->outputs.da, "TARGET");
+	if(!job.target)
+		job.target = find_io(&ps->program->outputs.da, "SV_TARGET");
+	if(!job.target && ps->program->outputs.num)
+		job.target = ps->program->outputs.array;
+	if(!job.target)
+	{
+		blog(LOG_ERROR, "Pixel shader %s has no output", ps->file);
+		return false;
+	}
+
+	build_layout(vs->program, ps->program, &layout);
+	struct cpu_vertex *verts = bmalloc(sizeof(struct cpu_vertex) * num_verts);
+	if(!run_vertex_stage(device, vs, &layout, start_vert, num_verts, viewproj, verts))
+	{
+		bfree(verts);
+		return false;
+	}
+
+	// the viewport is the clip rectangle, like clipping to -1..1 in GL
+	struct cpu_rect clip = {
+		device->viewport.x, device->viewport.y,
+		(int64_t)device->viewport.x + device->viewport.width,
+		(int64_t)device->viewport.y + device->viewport.height
+	};
+	if(clip.x0 < 0) clip.x0 = 0;
+	if(clip.y0 < 0) clip.y0 = 0;
+	if(clip.x1 > (int64_t)dst->width) clip.x1 = dst->width;
+	if(clip.y1 > (int64_t)dst->height) clip.y1 = dst->height;
+
+	DARRAY(struct cpu_triangle) tris;
+	da_init(tris);
+	assemble(&tris.da, mode, verts, num_verts, device->cull_mode, &clip);
+	bfree(verts);
+
+	if(!tris.num)
+	{
+		da_free(tris);
+		return true;
+	}
+
+	job.bounds = tris.array[0].bounds;
+	for(size_t i = 1; i < tris.num; i++)
+	{
+		const struct cpu_rect *b = &tris.array[i].bounds;
+		if(b->x0 < job.bounds.x0) job.bounds.x0 = b->x0;
+		if(b->y0 < job.bounds.y0) job.bounds.y0 = b->y0;
+		if(b->x1 > job.bounds.x1) job.bounds.x1 = b->x1;
+		if(b->y1 > job.bounds.y1) job.bounds.y1 = b->y1;
+	}
+
+	job.ps = ps;
+	job.dst = dst;
+	job.blend = blend;
+	job.layout = &layout;
+	job.tris = tris.array;
+	job.num_tris = tris.num;
+	init_env(&job.env, ps);
+
+	cpu_workers_run(device->workers, job.bounds.y1 - job.bounds.y0, 16, raster_rows, &job);
+	*drawn = job.bounds;
+	da_free(tris);
+	return true;
+}
+
+void cpu_program_get_textures(const gs_shader_t *shader, gs_texture_t **textures, size_t *num)
+{
+	size_t n = 0;
+	for(size_t i = 0; shader->program && i < shader->program->uniforms.num; i++)
+	{
+		if(shader->program->uniforms.array[i].texture >= 0 && shader->values[i].tex && n < *num)
+			textures[n++] = shader->values[i].tex;
+	}
+	*num = n;
+}
@@ -15,9 +15,11 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 ******************************************************************************/
 
+#include <util/platform.h>
 #include <graphics/matrix3.h>
 #include <graphics/vec2.h>
 #include <graphics/graphics.h>
+#include <graphics/shader-parser.h>
 #include "cpu-subsystem.h"
 
 const char *device_get_name(void)
@@ -35,6 +37,24 @@ const char *device_preprocessor_name(void)
 	return "_CPU";
 }
 
+/*
+ * Number of worker threads for rendering besides the graphics thread itself,
+ * 0 renders single-threaded.  A negative count picks the default, which is
+ * OBS_CPU_RENDER_THREADS if set and one per remaining core otherwise.
+ */
+static size_t get_worker_count(int threads)
+{
+	if (threads >= 0)
+		return (size_t)threads;
+
+	const char *env = getenv("OBS_CPU_RENDER_THREADS");
+	if (env && *env)
+		return (size_t)strtoul(env, NULL, 10);
+
+	int cores = os_get_logical_cores();
+	return cores > 1 ? (size_t)(cores - 1) : 0;
+}
+
 int device_create(gs_device_t **p_device, uint32_t adapter)
 {
 	struct gs_device *device = bzalloc(sizeof(struct gs_device));
@@ -47,6 +67,18 @@ int device_create(gs_device_t **p_device, uint32_t adapter)
 	if (!device->plat)
 		goto fail;
 
+	// matches the initial blend state tracked by libobs/graphics
+	device->blending_enabled = true;
+	// GL doesn't cull until a cull mode is set either
+	device->cull_mode = GS_NEITHER;
+
+	cpu_tex_pool_create(device);
+
+	device->workers = cpu_workers_create(get_worker_count(-1));
+	if (!device->workers)
+		goto fail;
+	blog(LOG_INFO, "CPU Renderer using %zu worker threads", cpu_workers_count(device->workers));
+
 	blog(LOG_INFO, "CPU Renderer loaded.");
 
 	*p_device = device;
@@ -54,6 +86,7 @@ int device_create(gs_device_t **p_device, uint32_t adapter)
 
 fail:
 	blog(LOG_ERROR, "device_create (CPU) failed");
+	cpu_tex_pool_destroy(device);
 	bfree(device);
 
 	*p_device = NULL;
@@ -65,9 +98,26 @@ void device_destroy(gs_device_t *device)
 	if (!device) {
 		return;
 	}
+	cpu_damage_log_stats(device);
+	da_free(device->recording_targets);
+	da_free(device->programs);
+	cpu_workers_destroy(device->workers);
+	cpu_tex_pool_destroy(device);
 	bfree(device);
 }
 
+void device_set_render_threads(gs_device_t *device, int threads)
+{
+	size_t count = get_worker_count(threads);
+	if (device->workers && cpu_workers_count(device->workers) == count)
+		return;
+
+	// only the graphics thread runs draws, so nothing uses the old pool now
+	cpu_workers_destroy(device->workers);
+	device->workers = cpu_workers_create(count);
+	blog(LOG_INFO, "CPU Renderer using %zu worker threads", cpu_workers_count(device->workers));
+}
+
 static void log_unimplemented(const char *fcn_name)
 {
 	blog(LOG_ERROR, "%s is unimplemented.", fcn_name);
@@ -118,59 +168,93 @@ void device_load_indexbuffer(gs_device_t *device, gs_indexbuffer_t *ib)
 	device->index_buffer_cur = ib;
 }
 
-static gs_shader_t *create_shader(gs_device_t *device, const char *file)
+static void parse_shader_sampler(gs_shader_t *shader, const char *shader_str, const char *file)
+{
+	struct shader_parser parser;
+	shader_parser_init(&parser);
+	if(shader_str && shader_parse(&parser, shader_str, file) && parser.samplers.num)
+	{
+		shader_sampler_convert(parser.samplers.array, &shader->sampler);
+		shader->has_sampler = true;
+	}
+	shader_parser_free(&parser);
+}
+
+#define CPU_SHADER_FILE(effect, type, technique) \
+	"share/obs/libobs/" effect " (" type " shader, technique " technique ", pass 0)"
+
+static const struct {
+	const char *file;
+	enum cpu_shader_kind kind;
+} known_shaders[] = {
+	{CPU_SHADER_FILE("default.effect", "Vertex", "Draw"), CPU_SHADER_DEFAULT_DRAW_VERTEX},
+	{CPU_SHADER_FILE("default.effect", "Pixel", "Draw"), CPU_SHADER_DEFAULT_DRAW_FRAGMENT},
+	{CPU_SHADER_FILE("default.effect", "Vertex", "DrawAlphaDivide"), CPU_SHADER_DEFAULT_DRAW_ALPHA_DIVIDE_VERTEX},
+	{CPU_SHADER_FILE("default.effect", "Pixel", "DrawAlphaDivide"), CPU_SHADER_DEFAULT_DRAW_ALPHA_DIVIDE_FRAGMENT},
+	{CPU_SHADER_FILE("bicubic_scale.effect", "Vertex", "Draw"), CPU_SHADER_BICUBIC_DRAW_VERTEX},
+	{CPU_SHADER_FILE("bicubic_scale.effect", "Pixel", "Draw"), CPU_SHADER_BICUBIC_DRAW_FRAGMENT},
+	{CPU_SHADER_FILE("opaque.effect", "Vertex", "Draw"), CPU_SHADER_OPAQUE_VERTEX},
+	{CPU_SHADER_FILE("opaque.effect", "Pixel", "Draw"), CPU_SHADER_OPAQUE_FRAGMENT},
+	{CPU_SHADER_FILE("solid.effect", "Vertex", "Solid"), CPU_SHADER_SOLID_VERTEX},
+	{CPU_SHADER_FILE("solid.effect", "Pixel", "Solid"), CPU_SHADER_SOLID_FRAGMENT},
+	{CPU_SHADER_FILE("solid.effect", "Vertex", "SolidColored"), CPU_SHADER_SOLID_COLORED_VERTEX},
+	{CPU_SHADER_FILE("solid.effect", "Pixel", "SolidColored"), CPU_SHADER_SOLID_COLORED_FRAGMENT},
+	{CPU_SHADER_FILE("solid.effect", "Vertex", "Random"), CPU_SHADER_SOLID_RANDOM_VERTEX},
+	{CPU_SHADER_FILE("solid.effect", "Pixel", "Random"), CPU_SHADER_SOLID_RANDOM_FRAGMENT},
+	{CPU_SHADER_FILE("format_conversion.effect", "Vertex", "NV12_Y"), CPU_SHADER_FORMAT_CONVERSION_NV12_Y_VERTEX},
+	{CPU_SHADER_FILE("format_conversion.effect", "Pixel", "NV12_Y"), CPU_SHADER_FORMAT_CONVERSION_NV12_Y_FRAGMENT},
+	{CPU_SHADER_FILE("format_conversion.effect", "Vertex", "NV12_UV"), CPU_SHADER_FORMAT_CONVERSION_NV12_UV_VERTEX},
+	{CPU_SHADER_FILE("format_conversion.effect", "Pixel", "NV12_UV"), CPU_SHADER_FORMAT_CONVERSION_NV12_UV_FRAGMENT},
+	{CPU_SHADER_FILE("format_conversion.effect", "Vertex", "Planar_Y"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_Y_VERTEX},
+	{CPU_SHADER_FILE("format_conversion.effect", "Pixel", "Planar_Y"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_Y_FRAGMENT},
+	{CPU_SHADER_FILE("format_conversion.effect", "Vertex", "Planar_U"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_VERTEX},
+	{CPU_SHADER_FILE("format_conversion.effect", "Pixel", "Planar_U"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_FRAGMENT},
+	{CPU_SHADER_FILE("format_conversion.effect", "Vertex", "Planar_V"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_VERTEX},
+	{CPU_SHADER_FILE("format_conversion.effect", "Pixel", "Planar_V"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_FRAGMENT},
+	{CPU_SHADER_FILE("format_conversion.effect", "Vertex", "Planar_U_Left"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_LEFT_VERTEX},
+	{CPU_SHADER_FILE("format_conversion.effect", "Pixel", "Planar_U_Left"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_LEFT_FRAGMENT},
+	{CPU_SHADER_FILE("format_conversion.effect", "Vertex", "Planar_V_Left"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_LEFT_VERTEX},
+	{CPU_SHADER_FILE("format_conversion.effect", "Pixel", "Planar_V_Left"), CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_LEFT_FRAGMENT},
+};
+
+static gs_shader_t *create_shader(gs_device_t *device, const char *shader_str, const char *file, enum gs_shader_type type)
 {
 	gs_shader_t *r = bzalloc(sizeof(gs_shader_t));
 	r->device = device;
 	r->file = bstrdup (file);
-	if (!strcmp (file, "share/obs/libobs/default.effect (Vertex shader, technique Draw, pass 0)"))
-		r->kind = CPU_SHADER_DEFAULT_DRAW_VERTEX;
-	else if (!strcmp (file, "share/obs/libobs/default.effect (Pixel shader, technique Draw, pass 0)"))
-		r->kind = CPU_SHADER_DEFAULT_DRAW_FRAGMENT;
-	else if (!strcmp (file, "share/obs/libobs/default.effect (Vertex shader, technique DrawAlphaDivide, pass 0)"))
-		r->kind = CPU_SHADER_DEFAULT_DRAW_ALPHA_DIVIDE_VERTEX;
-	else if (!strcmp (file, "share/obs/libobs/default.effect (Pixel shader, technique DrawAlphaDivide, pass 0)"))
-		r->kind = CPU_SHADER_DEFAULT_DRAW_ALPHA_DIVIDE_FRAGMENT;
-	else if (!strcmp (file, "share/obs/libobs/opaque.effect (Vertex shader, technique Draw, pass 0)"))
-		r->kind = CPU_SHADER_OPAQUE_VERTEX;
-	else if (!strcmp (file, "share/obs/libobs/opaque.effect (Pixel shader, technique Draw, pass 0)"))
-		r->kind = CPU_SHADER_OPAQUE_FRAGMENT;
-	else if (!strcmp (file, "share/obs/libobs/solid.effect (Vertex shader, technique Solid, pass 0)"))
-		r->kind = CPU_SHADER_SOLID_VERTEX;
-	else if (!strcmp (file, "share/obs/libobs/solid.effect (Pixel shader, technique Solid, pass 0)"))
-		r->kind = CPU_SHADER_SOLID_FRAGMENT;
-	else if (!strcmp (file, "share/obs/libobs/solid.effect (Vertex shader, technique SolidColored, pass 0)"))
-		r->kind = CPU_SHADER_SOLID_COLORED_VERTEX;
-	else if (!strcmp (file, "share/obs/libobs/solid.effect (Pixel shader, technique SolidColored, pass 0)"))
-		r->kind = CPU_SHADER_SOLID_COLORED_FRAGMENT;
-	else if (!strcmp (file, "share/obs/libobs/solid.effect (Vertex shader, technique Random, pass 0)"))
-		r->kind = CPU_SHADER_SOLID_RANDOM_VERTEX;
-	else if (!strcmp (file, "share/obs/libobs/solid.effect (Pixel shader, technique Random, pass 0)"))
-		r->kind = CPU_SHADER_SOLID_RANDOM_FRAGMENT;
-	else if (!strcmp (file, "share/obs/libobs/format_conversion.effect (Vertex shader, technique NV12_Y, pass 0)"))
-		r->kind = CPU_SHADER_FORMAT_CONVERSION_NV12_Y_VERTEX;
-	else if (!strcmp (file, "share/obs/libobs/format_conversion.effect (Pixel shader, technique NV12_Y, pass 0)"))
-		r->kind = CPU_SHADER_FORMAT_CONVERSION_NV12_Y_FRAGMENT;
-	else if (!strcmp (file, "share/obs/libobs/format_conversion.effect (Vertex shader, technique NV12_UV, pass 0)"))
-		r->kind = CPU_SHADER_FORMAT_CONVERSION_NV12_UV_VERTEX;
-	else if (!strcmp (file, "share/obs/libobs/format_conversion.effect (Pixel shader, technique NV12_UV, pass 0)"))
-		r->kind = CPU_SHADER_FORMAT_CONVERSION_NV12_UV_FRAGMENT;
-	else
+	parse_shader_sampler(r, shader_str, file);
+	r->kind = CPU_SHADER_UNKNOWN;
+	for (size_t i = 0; i < sizeof(known_shaders) / sizeof(known_shaders[0]); i++)
 	{
-		blog(LOG_WARNING, "Shader unknown to CPU Subsystem: %s", file);
-		r->kind = CPU_SHADER_UNKNOWN;
+		if (!strcmp (file, known_shaders[i].file))
+		{
+			r->kind = known_shaders[i].kind;
+			break;
+		}
+	}
+
+	// also the fallback for known shaders that have no native draw
+	r->program = cpu_program_get(device, shader_str, file, type);
+	if (r->program)
+	{
+		size_t num = cpu_program_num_uniforms(r->program);
+		r->values = bzalloc(sizeof(struct cpu_uniform_value) * (num ? num : 1));
+		cpu_program_init_values(r->program, r->values);
 	}
+
+	if (r->kind == CPU_SHADER_UNKNOWN && !r->program)
+		blog(LOG_WARNING, "Shader unknown to CPU Subsystem: %s", file);
 	return r;
 }
 
 gs_shader_t *device_vertexshader_create(gs_device_t *device, const char *shader, const char *file, char **error_string)
 {
-	return create_shader(device, file);
+	return create_shader(device, shader, file, GS_SHADER_VERTEX);
 }
 
 gs_shader_t *device_pixelshader_create(gs_device_t *device, const char *shader, const char *file, char **error_string)
 {
-	return create_shader(device, file);
+	return create_shader(device, shader, file, GS_SHADER_PIXEL);
 }
 
 void device_load_vertexshader(gs_device_t *device, gs_shader_t *vertshader)
@@ -187,10 +271,18 @@ void gs_shader_destroy(gs_shader_t *shader)
 {
 	if(!shader)
 		return;
+	cpu_program_release(shader->device, shader->program);
+	bfree(shader->values);
 	bfree(shader->file);
 	bfree(shader);
 }
 
+static bool cpu_shader_is_format_conversion(enum cpu_shader_kind kind)
+{
+	return kind >= CPU_SHADER_FORMAT_CONVERSION_NV12_Y_VERTEX
+		&& kind <= CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_LEFT_FRAGMENT;
+}
+
 gs_sparam_t *gs_shader_get_param_by_name(gs_shader_t *shader, const char *name)
 {
 	gs_sparam_t *r = bzalloc(sizeof(gs_sparam_t));
@@ -198,13 +290,13 @@ gs_sparam_t *gs_shader_get_param_by_name(gs_shader_t *shader, const char *name)
 	r->shader = shader;
 	r->name = bstrdup(name);
 	r->kind = CPU_SHADER_PARAM_UNKNOWN;
-	if(shader->kind == CPU_SHADER_DEFAULT_DRAW_FRAGMENT)
+	r->uniform = cpu_program_find_uniform(shader->program, name);
+	if(shader->kind == CPU_SHADER_DEFAULT_DRAW_FRAGMENT || shader->kind == CPU_SHADER_BICUBIC_DRAW_FRAGMENT)
 	{
 		if(!strcmp(name, "image"))
 			r->kind = CPU_SHADER_PARAM_IMAGE;
 	}
-	else if(shader->kind == CPU_SHADER_FORMAT_CONVERSION_NV12_Y_FRAGMENT
-			|| shader->kind == CPU_SHADER_FORMAT_CONVERSION_NV12_UV_FRAGMENT)
+	else if(cpu_shader_is_format_conversion(shader->kind))
 	{
 		if(!strcmp(name, "image"))
 			r->kind = CPU_SHADER_PARAM_IMAGE;
@@ -216,7 +308,7 @@ gs_sparam_t *gs_shader_get_param_by_name(gs_shader_t *shader, const char *name)
 			r->kind = CPU_SHADER_PARAM_COLOR_VEC2;
 	}
 
-	if(r->kind == CPU_SHADER_PARAM_UNKNOWN)
+	if(r->kind == CPU_SHADER_PARAM_UNKNOWN && r->uniform < 0)
 	{
 		blog(LOG_WARNING, "Unknown param for shader %s: %s", shader->file, name);
 	}
@@ -237,13 +329,18 @@ void gs_shader_get_param_info(const gs_sparam_t *param, struct gs_shader_param_i
 		info->type = GS_SHADER_PARAM_VEC4;
 		break;
 	case CPU_SHADER_PARAM_UNKNOWN:
-		info->type = GS_SHADER_PARAM_UNKNOWN;
+		info->type = param->uniform >= 0
+				? cpu_program_uniform_type(param->shader->program, param->uniform)
+				: GS_SHADER_PARAM_UNKNOWN;
 		break;
 	}
 }
 
 void gs_shader_set_val(gs_sparam_t *param, const void *val, size_t size)
 {
+	if(param->uniform >= 0)
+		cpu_program_set_value(param->shader->program, param->shader->values, param->uniform, val, size);
+
 	switch(param->kind) {
 	case CPU_SHADER_PARAM_IMAGE:
 		param->device->params.image = *(gs_texture_t **)val;
@@ -264,19 +361,40 @@ void gs_shader_set_val(gs_sparam_t *param, const void *val, size_t size)
 
 void gs_shader_set_texture(gs_sparam_t *param, gs_texture_t *val)
 {
+	if(param->uniform >= 0)
+		cpu_program_set_value(param->shader->program, param->shader->values, param->uniform, &val, sizeof(val));
+
 	switch(param->kind) {
 	case CPU_SHADER_PARAM_IMAGE:
 		param->device->params.image = val;
 		break;
 	default:
+		if(param->uniform >= 0)
+			break;
 		blog(LOG_ERROR, "Tried to set texture to an invalid param %s", param->name);
 		break;
 	}
 }
 
+void gs_shader_set_next_sampler(gs_sparam_t *param, gs_samplerstate_t *sampler)
+{
+	if(param->kind == CPU_SHADER_PARAM_IMAGE)
+		param->device->params.next_sampler = sampler;
+	if(param->uniform >= 0)
+		param->shader->values[param->uniform].next_sampler = sampler;
+}
+
 gs_samplerstate_t *device_samplerstate_create(gs_device_t *device, const struct gs_sampler_info *info)
 {
-	return bzalloc(sizeof(gs_samplerstate_t));
+	gs_samplerstate_t *r = bzalloc(sizeof(gs_samplerstate_t));
+	r->info = *info;
+	return r;
+}
+
+void device_load_samplerstate(gs_device_t *device, gs_samplerstate_t *ss, int unit)
+{
+	if(unit == 0)
+		device->sampler_cur = ss;
 }
 
 void gs_samplerstate_destroy(gs_samplerstate_t *samplerstate)
@@ -284,22 +402,69 @@ void gs_samplerstate_destroy(gs_samplerstate_t *samplerstate)
 	bfree(samplerstate);
 }
 
-size_t cpu_tex_data_size(gs_texture_t *tex)
+static void cpu_flush_conversion_using(gs_texture_t *tex)
+{
+	struct cpu_conversion *conv;
+	if(!tex->device)
+		return;
+	conv = &tex->device->pending_conversion;
+	if(conv->src == tex || conv->planes[0] == tex || conv->planes[1] == tex || conv->planes[2] == tex)
+		cpu_flush_conversion(tex->device);
+}
+
+static inline void cpu_tex_buffer_addref(struct cpu_tex_buffer *buf)
 {
-	size_t bpp = gs_get_format_bpp(tex->color_format) / 8;
-	return bpp * tex->width * tex->height * tex->levels;
+	os_atomic_inc_long(&buf->refs);
+}
+
+/*
+ * Makes sure the memory behind tex->data is not aliased by a stage surface
+ * before it gets written. Buffers released by stage surfaces are reused, so
+ * in steady state this just flips between the texture's buffers. With
+ * preserve, the current contents are carried over for partial writes.
+ */
+void cpu_tex_prepare_write(gs_texture_t *tex, bool preserve)
+{
+	struct cpu_tex_buffer *cur = tex->buffers[0];
+	if(cur->refs == 1)
+		return;
+
+	size_t i;
+	for(i = 1; i < CPU_TEX_MAX_BUFFERS; i++)
+	{
+		if(!tex->buffers[i] || tex->buffers[i]->refs == 1)
+			break;
+	}
+	if(i == CPU_TEX_MAX_BUFFERS)
+	{
+		// all buffers are staged, let the stage surfaces keep the last one
+		i = CPU_TEX_MAX_BUFFERS - 1;
+		cpu_tex_buffer_release(tex->buffers[i]);
+		tex->buffers[i] = NULL;
+	}
+	if(!tex->buffers[i])
+		tex->buffers[i] = cpu_tex_buffer_create(tex->device, cpu_tex_data_size(tex));
+
+	tex->buffers[0] = tex->buffers[i];
+	tex->buffers[i] = cur;
+	tex->data = tex->buffers[0]->data;
+	if(preserve)
+		memcpy(tex->data, cur->data, cpu_tex_data_size(tex));
 }
 
 gs_texture_t *device_texture_create(gs_device_t *device, uint32_t width, uint32_t height, enum gs_color_format color_format, uint32_t levels, const uint8_t **data, uint32_t flags)
 {
 	gs_texture_t *r = bzalloc(sizeof(gs_texture_t));
+	r->device = device;
+	r->id = ++device->next_tex_id;
 	r->type = GS_TEXTURE_2D;
 	r->width = width;
 	r->height = height;
 	r->color_format = color_format;
 	r->levels = levels;
 	size_t size = cpu_tex_data_size(r);
-	r->data = bmalloc(size);
+	r->buffers[0] = cpu_tex_buffer_create(device, size);
+	r->data = r->buffers[0]->data;
 	if(data && *data)
 		memcpy(r->data, *data, size);
 	return r;
@@ -314,7 +479,11 @@ void gs_texture_destroy(gs_texture_t *tex)
 {
 	if(!tex)
 		return;
-	bfree(tex->data),
+	cpu_flush_conversion_using(tex);
+	cpu_tex_before_write(tex);
+	cpu_recording_free(tex);
+	for(size_t i = 0; i < CPU_TEX_MAX_BUFFERS; i++)
+		cpu_tex_buffer_release(tex->buffers[i]);
 	bfree(tex);
 }
 
@@ -336,6 +505,10 @@ uint32_t gs_texture_get_height(const gs_texture_t *tex)
 
 bool gs_texture_map(gs_texture_t *tex, uint8_t **ptr, uint32_t *linesize)
 {
+	cpu_flush_conversion_using(tex);
+	cpu_tex_before_write(tex);
+	cpu_tex_prepare_write(tex, true);
+	cpu_tex_mark_damage(tex, NULL);
 	*ptr = tex->data;
 	*linesize = tex->width * gs_get_format_bpp(tex->color_format) / 8;
 	return true;
@@ -353,7 +526,10 @@ enum gs_color_format gs_texture_get_color_format(const gs_texture_t *tex)
 gs_stagesurf_t *device_stagesurface_create(gs_device_t *device, uint32_t width, uint32_t height, enum gs_color_format color_format)
 {
 	gs_stagesurf_t *r = bzalloc(sizeof(gs_stagesurf_t));
-	r->tex = device_texture_create(device, width, height, color_format, 1, NULL, 0);
+	r->device = device;
+	r->width = width;
+	r->height = height;
+	r->color_format = color_format;
 	return r;
 }
 
@@ -361,12 +537,30 @@ void gs_stagesurface_destroy(gs_stagesurf_t *stagesurf)
 {
 	if(!stagesurf)
 		return;
+	cpu_tex_buffer_release(stagesurf->alias);
 	gs_texture_destroy(stagesurf->tex);
 	bfree(stagesurf);
 }
 
 void device_stage_texture(gs_device_t *device, gs_stagesurf_t *dst, gs_texture_t *src)
 {
+	cpu_flush_conversion(device);
+	cpu_tex_before_read(src);
+
+	cpu_tex_buffer_release(dst->alias);
+	dst->alias = NULL;
+
+	// render targets already live in system memory, just keep a reference
+	if(src->width == dst->width && src->height == dst->height && src->color_format == dst->color_format)
+	{
+		dst->alias = src->buffers[0];
+		cpu_tex_buffer_addref(dst->alias);
+		return;
+	}
+
+	if(!dst->tex)
+		dst->tex = device_texture_create(device, dst->width, dst->height, dst->color_format, 1, NULL, 0);
+
 	struct cpu_blit_params params = {
 		.src = src,
 		.dst = dst->tex,
@@ -377,34 +571,44 @@ void device_stage_texture(gs_device_t *device, gs_stagesurf_t *dst, gs_texture_t
 		.dst_x = 0,
 		.dst_y = 0,
 		.dst_width = dst->tex->width,
-		.dst_height = dst->tex->height
+		.dst_height = dst->tex->height,
+		.workers = device->workers
 	};
 	cpu_blit_texture(params);
 }
 
 uint32_t gs_stagesurface_get_width(const gs_stagesurf_t *stagesurf)
 {
-	return stagesurf->tex->width;
+	return stagesurf->width;
 }
 
 uint32_t gs_stagesurface_get_height(const gs_stagesurf_t *stagesurf)
 {
-	return stagesurf->tex->height;
+	return stagesurf->height;
 }
 
 enum gs_color_format gs_stagesurface_get_color_format(const gs_stagesurf_t *stagesurf)
 {
-	return stagesurf->tex->color_format;
+	return stagesurf->color_format;
 }
 
 bool gs_stagesurface_map(gs_stagesurf_t *stagesurf, uint8_t **data, uint32_t *linesize)
 {
-	return gs_texture_map(stagesurf->tex, data, linesize);
+	if(stagesurf->alias)
+	{
+		*data = stagesurf->alias->data;
+		*linesize = stagesurf->width * gs_get_format_bpp(stagesurf->color_format) / 8;
+		return true;
+	}
+	if(!stagesurf->tex)
+		return false;
+	*data = stagesurf->tex->data;
+	*linesize = stagesurf->tex->width * gs_get_format_bpp(stagesurf->tex->color_format) / 8;
+	return true;
 }
 
 void gs_stagesurface_unmap(gs_stagesurf_t *stagesurf)
 {
-	gs_texture_unmap(stagesurf->tex);
 }
 
 void device_begin_frame(gs_device_t *device)
@@ -417,6 +621,10 @@ void device_begin_scene(gs_device_t *device)
 
 void device_end_scene(gs_device_t *device)
 {
+	cpu_flush_conversion(device);
+	cpu_recording_flush_all(device);
+	device->damage_stats.frames++;
+	cpu_tex_pool_trim(device);
 }
 
 void device_flush(gs_device_t *device)
@@ -436,6 +644,11 @@ void device_blend_function_separate(gs_device_t *device, enum gs_blend_type src_
 	device->blend.dest_a = dest_a;
 }
 
+void device_blend_function(gs_device_t *device, enum gs_blend_type src, enum gs_blend_type dest)
+{
+	device_blend_function_separate(device, src, dest, src, dest);
+}
+
 void device_enable_depth_test(gs_device_t *device, bool enable)
 {
 	device->depth_test_enabled = enable;
@@ -446,6 +659,11 @@ void device_set_cull_mode(gs_device_t *device, enum gs_cull_mode mode)
 	device->cull_mode = mode;
 }
 
+enum gs_cull_mode device_get_cull_mode(const gs_device_t *device)
+{
+	return device->cull_mode;
+}
+
 void device_set_render_target(gs_device_t *device, gs_texture_t *tex, gs_zstencil_t *zstencil)
 {
 	device->render_target.tex = tex;
@@ -464,9 +682,16 @@ gs_zstencil_t *device_get_zstencil_target(const gs_device_t *device)
 
 void device_clear(gs_device_t *device, uint32_t clear_flags, const struct vec4 *color, float depth, uint8_t stencil)
 {
+	cpu_flush_conversion(device);
+
 	if((clear_flags & GS_CLEAR_COLOR) && device->render_target.tex)
 	{
-		// TODO
+		// filled in when the recorded draws are rendered
+		cpu_recording_begin(device, device->render_target.tex, color);
+	}
+	else if((clear_flags & GS_CLEAR_COLOR) && device->swapchain_cur)
+	{
+		cpu_platform_clear(device->swapchain_cur, color);
 	}
 
 	if((clear_flags & GS_CLEAR_DEPTH) && device->render_target.zstencil)
@@ -550,6 +775,91 @@ static void cpu_vertex_to_screen(gs_device_t *device, int64_t *x_out, int64_t *y
 	*y_out = (int64_t)((1.0f - v.y) * (float)device->viewport.height) + (int64_t)device->viewport.y;
 }
 
+static enum cpu_blit_filter cpu_blit_filter_from_sampler(enum gs_sample_filter filter, bool minify)
+{
+	switch(filter)
+	{
+	case GS_FILTER_POINT:
+	case GS_FILTER_MIN_MAG_POINT_MIP_LINEAR:
+		return CPU_BLIT_FILTER_POINT;
+	case GS_FILTER_MIN_POINT_MAG_LINEAR_MIP_POINT:
+	case GS_FILTER_MIN_POINT_MAG_MIP_LINEAR:
+		return minify ? CPU_BLIT_FILTER_POINT : CPU_BLIT_FILTER_BILINEAR;
+	case GS_FILTER_MIN_LINEAR_MAG_MIP_POINT:
+	case GS_FILTER_MIN_LINEAR_MAG_POINT_MIP_LINEAR:
+		return minify ? CPU_BLIT_FILTER_BILINEAR : CPU_BLIT_FILTER_POINT;
+	default:
+		return CPU_BLIT_FILTER_BILINEAR;
+	}
+}
+
+/*
+ * Sampler precedence follows the GL backend: a sampler set for the next draw
+ * through the effect wins over the one declared in the shader, which in turn
+ * wins over gs_load_samplerstate.
+ */
+static enum cpu_blit_filter cpu_draw_get_filter(gs_device_t *device, const struct cpu_blit_params *params)
+{
+	gs_shader_t *frag = device->fragment_shader_cur;
+	const struct gs_sampler_info *info = NULL;
+
+	if(device->params.next_sampler)
+		info = &device->params.next_sampler->info;
+	else if(frag->has_sampler)
+		info = &frag->sampler;
+	else if(device->sampler_cur)
+		info = &device->sampler_cur->info;
+	device->params.next_sampler = NULL;
+
+	if(frag->kind == CPU_SHADER_BICUBIC_DRAW_FRAGMENT)
+		return CPU_BLIT_FILTER_BICUBIC;
+	if(!info)
+		return CPU_BLIT_FILTER_POINT;
+
+	bool minify = llabs(params->dst_width) * llabs(params->dst_height)
+			< llabs(params->src_width) * llabs(params->src_height);
+	return cpu_blit_filter_from_sampler(info->filter, minify);
+}
+
+static inline bool nearly_equal(float a, float b)
+{
+	return fabsf(a - b) < 0.01f;
+}
+
+/*
+ * Whether the draw is a sprite as drawn by gs_draw_sprite and friends: a
+ * screen aligned rectangle with matching texture coordinates. Anything else
+ * (rotated items, other primitives) goes through the rasterizer.
+ */
+static bool cpu_draw_is_blit(gs_device_t *device, enum gs_draw_mode draw_mode, uint32_t start_vert, uint32_t num_verts)
+{
+	gs_vertbuffer_t *vbo = device->vertex_buffer_cur;
+	if(!vbo || vbo->data->num != 4 || !vbo->data->points || draw_mode != GS_TRISTRIP
+		|| start_vert != 0 || (num_verts != 0 && num_verts != 4)
+		|| vbo->data->num_tex != 1 || !vbo->data->tvarray || vbo->data->tvarray[0].width != 2)
+		return false;
+
+	struct matrix4 mvp;
+	gs_matrix_get(&mvp);
+	matrix4_mul(&mvp, &mvp, &device->cur_proj);
+
+	struct vec4 p[4];
+	for(int i = 0; i < 4; i++)
+	{
+		vec4_from_vec3(&p[i], &vbo->data->points[i]);
+		vec4_transform(&p[i], &p[i], &mvp);
+		if(p[i].w <= 0.0f)
+			return false;
+		vec4_divf(&p[i], &p[i], p[i].w);
+	}
+
+	// corners 0, 1 on one edge, 2, 3 on the opposite one
+	const struct vec2 *uv = vbo->data->tvarray[0].array;
+	return nearly_equal(p[0].y, p[1].y) && nearly_equal(p[2].y, p[3].y)
+		&& nearly_equal(p[0].x, p[2].x) && nearly_equal(p[1].x, p[3].x)
+		&& uv[0].y == uv[1].y && uv[2].y == uv[3].y && uv[0].x == uv[2].x && uv[1].x == uv[3].x;
+}
+
 static void cpu_draw_blit(gs_device_t *device, enum gs_draw_mode draw_mode, uint32_t start_vert, uint32_t num_verts)
 {
 	gs_texture_t *src = device->params.image;
@@ -558,6 +868,7 @@ static void cpu_draw_blit(gs_device_t *device, enum gs_draw_mode draw_mode, uint
 		blog(LOG_ERROR, "No texture bound");
 		return;
 	}
+	cpu_tex_before_read(src);
 
 	gs_texture_t *dst = device->render_target.tex;
 
@@ -576,6 +887,7 @@ static void cpu_draw_blit(gs_device_t *device, enum gs_draw_mode draw_mode, uint
 	struct cpu_blit_params params = { 0 };
 	params.src = src;
 	params.dst = dst;
+	params.workers = device->workers;
 
 	cpu_vertex_to_screen(device, &params.dst_x, &params.dst_y, &vbo->data->points[0]);
 	int64_t dst_x1, dst_y1;
@@ -591,11 +903,23 @@ static void cpu_draw_blit(gs_device_t *device, enum gs_draw_mode draw_mode, uint
 	params.src_y = uv_min.y;
 	params.src_width = uv_max.x - uv_min.x;
 	params.src_height = uv_max.y - uv_min.y;
+	params.filter = cpu_draw_get_filter(device, &params);
+	if(device->blending_enabled && !cpu_blend_is_overwrite(&device->blend))
+		params.blend = &device->blend;
 
 	if(dst)
 	{
 		// texture -> texture
+		if(cpu_recording_add(device, &params))
+			return;
+		cpu_tex_before_write(dst);
+		bool covers_dst = !params.blend && params.dst_x <= 0 && params.dst_y <= 0
+				&& params.dst_x + params.dst_width >= (int64_t)dst->width
+				&& params.dst_y + params.dst_height >= (int64_t)dst->height;
+		cpu_tex_prepare_write(dst, !covers_dst);
 		cpu_blit_texture(params);
+		struct cpu_rect written = { params.dst_x, params.dst_y, params.dst_x + params.dst_width, params.dst_y + params.dst_height };
+		cpu_tex_mark_damage(dst, &written);
 	}
 	else
 	{
@@ -605,6 +929,42 @@ static void cpu_draw_blit(gs_device_t *device, enum gs_draw_mode draw_mode, uint
 
 }
 
+void cpu_flush_conversion(gs_device_t *device)
+{
+	struct cpu_conversion *conv = &device->pending_conversion;
+	if(conv->format == CPU_CONVERSION_NONE)
+		return;
+	for(int i = 0; i < conv->num_planes; i++)
+	{
+		if(conv->planes[i])
+		{
+			cpu_tex_before_write(conv->planes[i]);
+			cpu_tex_prepare_write(conv->planes[i], false);
+		}
+	}
+	cpu_convert_planes(device->workers, conv);
+	for(int i = 0; i < conv->num_planes; i++)
+	{
+		if(conv->planes[i])
+			cpu_tex_mark_damage(conv->planes[i], NULL);
+	}
+	memset(conv, 0, sizeof(*conv));
+}
+
+static inline bool cpu_conversion_continues(gs_device_t *device, gs_texture_t *src, int num_planes, bool planar)
+{
+	struct cpu_conversion *conv = &device->pending_conversion;
+	return conv->src == src && conv->num_planes == num_planes
+		&& (conv->format == CPU_CONVERSION_NV12) != planar;
+}
+
+/*
+ * The planes of an output frame arrive as separate draws (Y, then UV or U and
+ * V), see render_convert_texture. Instead of walking the source once per
+ * plane, remember the planes and convert them together once the last one is
+ * drawn. Anything else touching the device in between flushes what has been
+ * collected so far.
+ */
 static void cpu_draw_format_conversion(gs_device_t *device, enum gs_draw_mode draw_mode, uint32_t start_vert, uint32_t num_verts)
 {
 	gs_texture_t *src = device->params.image;
@@ -620,15 +980,134 @@ static void cpu_draw_format_conversion(gs_device_t *device, enum gs_draw_mode dr
 		blog(LOG_ERROR, "No render target bound for format conversion");
 		return;
 	}
+	cpu_tex_before_read(src);
 
-	if(device->vertex_shader_cur->kind == CPU_SHADER_FORMAT_CONVERSION_NV12_Y_VERTEX)
+	struct cpu_conversion *conv = &device->pending_conversion;
+	switch(device->vertex_shader_cur->kind)
 	{
-		cpu_rgba_to_nv12_y(src, dst, device->params.color_vec0);
+	case CPU_SHADER_FORMAT_CONVERSION_NV12_Y_VERTEX:
+	case CPU_SHADER_FORMAT_CONVERSION_PLANAR_Y_VERTEX:
+		cpu_flush_conversion(device);
+		// I420 and I444 share the Y plane, the U plane tells them apart
+		conv->format = device->vertex_shader_cur->kind == CPU_SHADER_FORMAT_CONVERSION_NV12_Y_VERTEX
+				? CPU_CONVERSION_NV12 : CPU_CONVERSION_I444;
+		conv->src = src;
+		conv->planes[0] = dst;
+		conv->color_vec[0] = device->params.color_vec0;
+		conv->num_planes = 1;
+		break;
+	case CPU_SHADER_FORMAT_CONVERSION_NV12_UV_VERTEX:
+		if(!cpu_conversion_continues(device, src, 1, false))
+		{
+			cpu_flush_conversion(device);
+			conv->format = CPU_CONVERSION_NV12;
+			conv->src = src;
+		}
+		conv->planes[1] = dst;
+		conv->color_vec[1] = device->params.color_vec1;
+		conv->color_vec[2] = device->params.color_vec2;
+		conv->num_planes = 2;
+		cpu_flush_conversion(device);
+		break;
+	case CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_VERTEX:
+	case CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_LEFT_VERTEX:
+		if(!cpu_conversion_continues(device, src, 1, true))
+		{
+			cpu_flush_conversion(device);
+			conv->src = src;
+		}
+		conv->format = device->vertex_shader_cur->kind == CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_LEFT_VERTEX
+				? CPU_CONVERSION_I420 : CPU_CONVERSION_I444;
+		conv->planes[1] = dst;
+		conv->color_vec[1] = device->params.color_vec1;
+		conv->num_planes = 2;
+		break;
+	case CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_VERTEX:
+	case CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_LEFT_VERTEX:
+	{
+		enum cpu_conversion_format format = device->vertex_shader_cur->kind == CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_LEFT_VERTEX
+				? CPU_CONVERSION_I420 : CPU_CONVERSION_I444;
+		if(!cpu_conversion_continues(device, src, 2, true) || conv->format != format)
+		{
+			cpu_flush_conversion(device);
+			conv->format = format;
+			conv->src = src;
+		}
+		conv->planes[2] = dst;
+		conv->color_vec[2] = device->params.color_vec2;
+		conv->num_planes = 3;
+		cpu_flush_conversion(device);
+		break;
+	}
+	default:
+		blog(LOG_ERROR, "Unimplemented format conversion: %s", device->vertex_shader_cur->file);
+		break;
+	}
+}
+
+/* any other shader pair, run through the interpreter in cpu-shader.c */
+static void cpu_draw_program(gs_device_t *device, enum gs_draw_mode draw_mode, uint32_t start_vert, uint32_t num_verts)
+{
+	gs_shader_t *vert = device->vertex_shader_cur;
+	gs_shader_t *frag = device->fragment_shader_cur;
+	gs_texture_t *dst = device->render_target.tex;
+	gs_vertbuffer_t *vbo = device->vertex_buffer_cur;
+
+	if(!vbo || !vbo->data->points)
+	{
+		blog(LOG_ERROR, "No vertex buffer for %s", frag->file);
+		return;
 	}
-	else if(device->vertex_shader_cur->kind == CPU_SHADER_FORMAT_CONVERSION_NV12_UV_VERTEX)
+	if(!num_verts)
+		num_verts = (uint32_t)vbo->data->num;
+	if(start_vert + (size_t)num_verts > vbo->data->num)
 	{
-		blog(LOG_ERROR, "TODO: Convert UV: %u %u -> %u %u", src->width, src->height, dst->width, dst->height);
+		blog(LOG_ERROR, "Draw exceeds the vertex buffer");
+		return;
 	}
+
+	gs_texture_t *textures[16];
+	size_t num_textures = sizeof(textures) / sizeof(textures[0]);
+	cpu_program_get_textures(frag, textures, &num_textures);
+	for(size_t i = 0; i < num_textures; i++)
+		cpu_tex_before_read(textures[i]);
+
+	if(dst)
+	{
+		cpu_tex_before_write(dst);
+		cpu_tex_prepare_write(dst, true);
+	}
+	else if(device->swapchain_cur)
+	{
+		dst = cpu_platform_back_buffer(device->swapchain_cur);
+		if(!dst)
+		{
+			blog(LOG_ERROR, "CPU Renderer can only run %s on the swapchain with MIT-SHM", frag->file);
+			return;
+		}
+	}
+	else
+	{
+		blog(LOG_ERROR, "No render target");
+		return;
+	}
+
+	struct matrix4 mvp;
+	gs_matrix_get(&mvp);
+	matrix4_mul(&mvp, &mvp, &device->cur_proj);
+
+	const struct cpu_blend_state *blend = NULL;
+	if(device->blending_enabled && !cpu_blend_is_overwrite(&device->blend))
+		blend = &device->blend;
+
+	struct cpu_rect drawn;
+	bool ok = cpu_program_draw(device, vert, frag, dst, draw_mode, start_vert, num_verts, &mvp, blend, &drawn);
+	if(ok && dst == device->render_target.tex)
+		cpu_tex_mark_damage(dst, &drawn);
+
+	// like the sampler set through the effect for the native draws, only for one draw
+	for(size_t i = 0; i < cpu_program_num_uniforms(frag->program); i++)
+		frag->values[i].next_sampler = NULL;
 }
 
 void device_draw(gs_device_t *device, enum gs_draw_mode draw_mode, uint32_t start_vert, uint32_t num_verts)
@@ -645,11 +1124,20 @@ void device_draw(gs_device_t *device, enum gs_draw_mode draw_mode, uint32_t star
 		return;
 	}
 
-	if(vert->kind == CPU_SHADER_DEFAULT_DRAW_VERTEX && frag->kind == CPU_SHADER_DEFAULT_DRAW_FRAGMENT)
+	if(!cpu_shader_is_format_conversion(vert->kind))
+		cpu_flush_conversion(device);
+
+	bool blit_shaders = (vert->kind == CPU_SHADER_DEFAULT_DRAW_VERTEX && frag->kind == CPU_SHADER_DEFAULT_DRAW_FRAGMENT)
+		|| (vert->kind == CPU_SHADER_BICUBIC_DRAW_VERTEX && frag->kind == CPU_SHADER_BICUBIC_DRAW_FRAGMENT);
+
+	if(blit_shaders && cpu_draw_is_blit(device, draw_mode, start_vert, num_verts))
 		cpu_draw_blit(device, draw_mode, start_vert, num_verts);
-	else if((vert->kind == CPU_SHADER_FORMAT_CONVERSION_NV12_Y_VERTEX && frag->kind == CPU_SHADER_FORMAT_CONVERSION_NV12_Y_FRAGMENT)
-		|| (vert->kind == CPU_SHADER_FORMAT_CONVERSION_NV12_UV_VERTEX && frag->kind == CPU_SHADER_FORMAT_CONVERSION_NV12_UV_FRAGMENT))
+	else if(cpu_shader_is_format_conversion(vert->kind) && frag->kind == vert->kind + 1)
 		cpu_draw_format_conversion(device, draw_mode, start_vert, num_verts);
+	else if(vert->program && frag->program)
+		cpu_draw_program(device, draw_mode, start_vert, num_verts);
+	else if(blit_shaders)
+		blog(LOG_ERROR, "This doesn't look like a blit, no idea what to do");
 	else if(vert->kind == CPU_SHADER_UNKNOWN || frag->kind == CPU_SHADER_UNKNOWN)
 		blog(LOG_ERROR, "Vertex or Fragment Shader unknown: %s + %s", vert->file, frag->file);
 	else
@@ -710,7 +1198,8 @@ void device_resize(gs_device_t *device, uint32_t cx, uint32_t cy)
 
 void device_present(gs_device_t *device)
 {
-	// TODO
+	if(device->swapchain_cur)
+		cpu_platform_present(device->swapchain_cur);
 }
 
 
@@ -720,7 +1209,6 @@ uint32_t device_get_height(const gs_device_t *device) { UNIMPLEMENTED_RET(0) }
 gs_timer_t *device_timer_create(gs_device_t *device) { UNIMPLEMENTED_RET(NULL) }
 gs_timer_range_t *device_timer_range_create(gs_device_t *device) { UNIMPLEMENTED_RET(NULL) }
 void device_load_texture(gs_device_t *device, gs_texture_t *tex, int unit) { UNIMPLEMENTED }
-void device_load_samplerstate(gs_device_t *device, gs_samplerstate_t *ss, int unit) { UNIMPLEMENTED }
 void device_load_default_samplerstate(gs_device_t *device, bool b_3d, int unit) { UNIMPLEMENTED }
 gs_shader_t *device_get_vertex_shader(const gs_device_t *device) { UNIMPLEMENTED_RET(NULL) }
 gs_shader_t *device_get_pixel_shader(const gs_device_t *device) { UNIMPLEMENTED_RET(NULL) }
@@ -728,11 +1216,9 @@ static bool get_tex_dimensions(gs_texture_t *tex, uint32_t *width, uint32_t *hei
 void device_set_cube_render_target(gs_device_t *device, gs_texture_t *cubetex, int side, gs_zstencil_t *zstencil) { UNIMPLEMENTED }
 void device_copy_texture_region(gs_device_t *device, gs_texture_t *dst, uint32_t dst_x, uint32_t dst_y, gs_texture_t *src, uint32_t src_x, uint32_t src_y, uint32_t src_w, uint32_t src_h) { UNIMPLEMENTED }
 void device_copy_texture(gs_device_t *device, gs_texture_t *dst, gs_texture_t *src) { UNIMPLEMENTED }
-enum gs_cull_mode device_get_cull_mode(const gs_device_t *device) { UNIMPLEMENTED_RET(GS_BACK) }
 void device_enable_stencil_test(gs_device_t *device, bool enable) { UNIMPLEMENTED }
 void device_enable_stencil_write(gs_device_t *device, bool enable) { UNIMPLEMENTED }
 void device_enable_color(gs_device_t *device, bool red, bool green, bool blue, bool alpha) { UNIMPLEMENTED }
-void device_blend_function(gs_device_t *device, enum gs_blend_type src, enum gs_blend_type dest) { UNIMPLEMENTED }
 void device_depth_function(gs_device_t *device, enum gs_depth_test test) { UNIMPLEMENTED }
 void device_stencil_function(gs_device_t *device, enum gs_stencil_side side, enum gs_depth_test test) { UNIMPLEMENTED }
 void device_stencil_op(gs_device_t *device, enum gs_stencil_side side, enum gs_stencil_op_type fail, enum gs_stencil_op_type zfail, enum gs_stencil_op_type zpass) { UNIMPLEMENTED }
@@ -37,6 +37,8 @@ enum cpu_shader_kind {
 	CPU_SHADER_DEFAULT_DRAW_FRAGMENT,
 	CPU_SHADER_DEFAULT_DRAW_ALPHA_DIVIDE_VERTEX,
 	CPU_SHADER_DEFAULT_DRAW_ALPHA_DIVIDE_FRAGMENT,
+	CPU_SHADER_BICUBIC_DRAW_VERTEX,
+	CPU_SHADER_BICUBIC_DRAW_FRAGMENT,
 	CPU_SHADER_OPAQUE_VERTEX,
 	CPU_SHADER_OPAQUE_FRAGMENT,
 	CPU_SHADER_SOLID_VERTEX,
@@ -49,12 +51,37 @@ enum cpu_shader_kind {
 	CPU_SHADER_FORMAT_CONVERSION_NV12_Y_FRAGMENT,
 	CPU_SHADER_FORMAT_CONVERSION_NV12_UV_VERTEX,
 	CPU_SHADER_FORMAT_CONVERSION_NV12_UV_FRAGMENT,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_Y_VERTEX,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_Y_FRAGMENT,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_VERTEX,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_FRAGMENT,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_VERTEX,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_FRAGMENT,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_LEFT_VERTEX,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_U_LEFT_FRAGMENT,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_LEFT_VERTEX,
+	CPU_SHADER_FORMAT_CONVERSION_PLANAR_V_LEFT_FRAGMENT,
+};
+
+struct cpu_program;
+
+/* value of a uniform of a cpu_program, vectors and matrices as floats */
+struct cpu_uniform_value {
+	float data[16];
+	gs_texture_t *tex;
+	gs_samplerstate_t *next_sampler;
 };
 
 struct gs_shader {
 	struct gs_device *device;
 	enum cpu_shader_kind kind;
 	char *file;
+	bool has_sampler;
+	struct gs_sampler_info sampler; // first sampler_state declared in the shader
+
+	// interpreted program for shaders without a native implementation, see cpu-shader.c
+	struct cpu_program *program;
+	struct cpu_uniform_value *values; // one per uniform of program
 };
 
 enum cpu_shader_param_kind {
@@ -70,13 +97,44 @@ struct gs_shader_param {
 	struct gs_shader *shader;
 	char *name;
 	enum cpu_shader_param_kind kind;
+	int uniform; // index into shader->program's uniforms, -1 if none
 };
 
 struct gs_sampler_state {
+	struct gs_sampler_info info;
+};
+
+/*
+ * Texture memory is refcounted so stage surfaces can alias it instead of
+ * copying. A texture that is about to be written while a stage surface still
+ * references its memory switches to another buffer first (see
+ * cpu_tex_prepare_write), keeping the staged contents intact.
+ */
+struct cpu_tex_buffer {
+	volatile long refs;
+	uint8_t *data;
+	size_t size; // of the pool block behind data, see cpu-pool.c
+	struct cpu_tex_pool *pool;
+};
+
+#define CPU_TEX_MAX_BUFFERS 3
+
+struct cpu_rect {
+	int64_t x0, y0; // inclusive
+	int64_t x1, y1; // exclusive
+};
+
+#define CPU_DAMAGE_HISTORY 4
 
+struct cpu_damage {
+	uint64_t version; // texture version this write produced
+	struct cpu_rect rect;
 };
 
+struct cpu_recording;
+
 struct gs_texture {
+	gs_device_t *device;
 	enum gs_texture_type type;
 	uint32_t width;
 	uint32_t height;
@@ -84,10 +142,22 @@ struct gs_texture {
 	enum gs_color_format color_format;
 
 	uint8_t *data; // size = (gs_get_format_bpp(color_format) / 8) * width * height * levels;
+	struct cpu_tex_buffer *buffers[CPU_TEX_MAX_BUFFERS]; // buffers[0] backs data
+
+	// damage tracking, see cpu-damage.c
+	uint64_t id;      // unique per device, unlike the pointer
+	uint64_t version; // bumped on every write
+	struct cpu_damage damage[CPU_DAMAGE_HISTORY]; // latest writes, newest first
+	struct cpu_recording *recording;
 };
 
 struct gs_stage_surface {
-	gs_texture_t *tex;
+	gs_device_t *device;
+	uint32_t width;
+	uint32_t height;
+	enum gs_color_format color_format;
+	struct cpu_tex_buffer *alias; // memory of the staged texture
+	gs_texture_t *tex;            // own copy if the staged texture didn't match
 };
 
 struct gs_swap_chain {
@@ -96,16 +166,37 @@ struct gs_swap_chain {
 	struct cpu_windowinfo *wi;
 };
 
+struct cpu_blend_state {
+	enum gs_blend_type src_c;
+	enum gs_blend_type dest_c;
+	enum gs_blend_type src_a;
+	enum gs_blend_type dest_a;
+};
+
+enum cpu_conversion_format {
+	CPU_CONVERSION_NONE,
+	CPU_CONVERSION_NV12,
+	CPU_CONVERSION_I420,
+	CPU_CONVERSION_I444
+};
+
+/*
+ * RGBA -> YUV output conversion. libobs draws one plane at a time, the device
+ * collects the planes here and converts them all in a single pass over src.
+ */
+struct cpu_conversion {
+	enum cpu_conversion_format format;
+	gs_texture_t *src;
+	gs_texture_t *planes[3];  // NULL planes are skipped
+	struct vec4 color_vec[3]; // Y, U, V
+	int num_planes;           // planes collected so far
+};
+
 struct gs_device {
 	uint32_t width;
 	uint32_t height;
 	struct cpu_platform *plat;
-	struct {
-		enum gs_blend_type src_c;
-		enum gs_blend_type dest_c;
-		enum gs_blend_type src_a;
-		enum gs_blend_type dest_a;
-	} blend;
+	struct cpu_blend_state blend;
 	bool blending_enabled;
 	bool depth_test_enabled;
 	enum gs_cull_mode cull_mode;
@@ -126,21 +217,46 @@ struct gs_device {
 	gs_vertbuffer_t *vertex_buffer_cur;
 	gs_indexbuffer_t *index_buffer_cur;
 	gs_swapchain_t *swapchain_cur;
+	gs_samplerstate_t *sampler_cur;
+	struct cpu_workers *workers;
 	struct {
 		gs_texture_t *image;
+		gs_samplerstate_t *next_sampler;
 
 		// format conversion
 		struct vec4 color_vec0;
 		struct vec4 color_vec1;
 		struct vec4 color_vec2;
 	} params;
+	struct cpu_conversion pending_conversion;
+
+	uint64_t next_tex_id;
+	DARRAY(gs_texture_t *) recording_targets; // targets with draws not rendered yet
+	struct {
+		uint64_t frames;
+		uint64_t recomposed_pixels;
+		uint64_t target_pixels;
+	} damage_stats;
+
+	DARRAY(struct cpu_program *) programs; // compiled shaders, shared between equal sources
+	struct cpu_tex_pool *tex_pool;
+};
+
+enum cpu_blit_filter {
+	CPU_BLIT_FILTER_POINT,
+	CPU_BLIT_FILTER_BILINEAR,
+	CPU_BLIT_FILTER_BICUBIC
 };
 
 struct cpu_blit_params {
 	gs_texture_t *src;
 	gs_texture_t *dst;
-	int64_t src_x, src_y, src_width, src_height;
+	int64_t src_x, src_y, src_width, src_height; // src_width/height < 0 means flipped
 	int64_t dst_x, dst_y, dst_width, dst_height;
+	enum cpu_blit_filter filter;
+	const struct cpu_blend_state *blend; // NULL to overwrite dst
+	struct cpu_workers *workers; // NULL to run on the calling thread only
+	const struct cpu_rect *clip; // NULL to only clip against dst
 };
 
 #define CPU_BLIT_PARAMS_UNPACK \
@@ -155,15 +271,66 @@ struct cpu_blit_params {
 	int64_t dst_width = params.dst_width; \
 	int64_t dst_height = params.dst_height;
 
-size_t cpu_tex_data_size(gs_texture_t *tex);
+typedef void (*cpu_band_fn)(void *param, int64_t row_begin, int64_t row_end);
+
+struct cpu_workers *cpu_workers_create(size_t num_threads);
+void cpu_workers_destroy(struct cpu_workers *workers);
+size_t cpu_workers_count(const struct cpu_workers *workers);
+void cpu_workers_run(struct cpu_workers *workers, int64_t rows, int64_t min_band_rows, cpu_band_fn fn, void *param);
+EXPORT void device_set_render_threads(gs_device_t *device, int threads);
+
+static inline size_t cpu_tex_data_size(gs_texture_t *tex)
+{
+	size_t bpp = gs_get_format_bpp(tex->color_format) / 8;
+	return bpp * tex->width * tex->height * tex->levels;
+}
+
+void cpu_tex_prepare_write(gs_texture_t *tex, bool preserve);
+bool cpu_blend_is_overwrite(const struct cpu_blend_state *blend);
 void cpu_blit_texture(struct cpu_blit_params params);
+void cpu_fill_rect(gs_texture_t *tex, const struct cpu_rect *rect, const struct vec4 *color);
+void cpu_write_row(gs_texture_t *dst, int64_t x, int64_t y, const uint8_t *rgba, size_t count,
+		const struct cpu_blend_state *blend);
+
+void cpu_tex_mark_damage(gs_texture_t *tex, const struct cpu_rect *rect);
+void cpu_tex_before_read(gs_texture_t *tex);
+void cpu_tex_before_write(gs_texture_t *tex);
+void cpu_recording_begin(gs_device_t *device, gs_texture_t *tex, const struct vec4 *color);
+bool cpu_recording_add(gs_device_t *device, const struct cpu_blit_params *params);
+void cpu_recording_flush(gs_texture_t *tex);
+void cpu_recording_flush_all(gs_device_t *device);
+void cpu_recording_free(gs_texture_t *tex);
+void cpu_damage_log_stats(gs_device_t *device);
+
+void cpu_tex_pool_create(gs_device_t *device);
+void cpu_tex_pool_destroy(gs_device_t *device);
+void cpu_tex_pool_trim(gs_device_t *device);
+struct cpu_tex_buffer *cpu_tex_buffer_create(gs_device_t *device, size_t size);
+void cpu_tex_buffer_release(struct cpu_tex_buffer *buf);
+
+struct cpu_program *cpu_program_get(gs_device_t *device, const char *source, const char *file, enum gs_shader_type type);
+void cpu_program_release(gs_device_t *device, struct cpu_program *prog);
+size_t cpu_program_num_uniforms(const struct cpu_program *prog);
+int cpu_program_find_uniform(const struct cpu_program *prog, const char *name);
+enum gs_shader_param_type cpu_program_uniform_type(const struct cpu_program *prog, int uniform);
+void cpu_program_init_values(const struct cpu_program *prog, struct cpu_uniform_value *values);
+void cpu_program_set_value(const struct cpu_program *prog, struct cpu_uniform_value *values, int uniform,
+		const void *data, size_t size);
+void cpu_program_get_textures(const gs_shader_t *shader, gs_texture_t **textures, size_t *num);
+bool cpu_program_draw(gs_device_t *device, gs_shader_t *vs, gs_shader_t *ps, gs_texture_t *dst,
+		enum gs_draw_mode mode, uint32_t start_vert, uint32_t num_verts,
+		const struct matrix4 *viewproj, const struct cpu_blend_state *blend, struct cpu_rect *drawn);
 bool cpu_platform_init_swapchain(struct gs_swap_chain *swap);
 void cpu_platform_fini_swapchain(struct gs_swap_chain *swap);
 void cpu_platform_resize_swapchain(struct gs_swap_chain *swap, uint32_t width, uint32_t height);
 struct cpu_platform *cpu_platform_create(gs_device_t *device, uint32_t adapter);
 void cpu_platform_destroy(struct cpu_platform *plat);
 void cpu_platform_blit(struct gs_device *device, struct cpu_blit_params params);
-void cpu_rgba_to_nv12_y(gs_texture_t *src, gs_texture_t *dst, struct vec4 color_vec0);
+void cpu_platform_clear(struct gs_swap_chain *swap, const struct vec4 *color);
+void cpu_platform_present(struct gs_swap_chain *swap);
+gs_texture_t *cpu_platform_back_buffer(struct gs_swap_chain *swap);
+void cpu_flush_conversion(gs_device_t *device);
+void cpu_convert_planes(struct cpu_workers *workers, const struct cpu_conversion *conv);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,152 @@
+/******************************************************************************
+    Copyright (C) 2020 by thestr4ng3r
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include <util/platform.h>
+#include "cpu-subsystem.h"
+
+/*
+ * Persistent pool of worker threads that split a draw into horizontal bands.
+ * The calling (graphics) thread takes part in the work as well, so a pool
+ * with zero workers simply runs everything inline.
+ */
+
+struct cpu_workers {
+	DARRAY(pthread_t) threads;
+	os_sem_t *start;
+	os_sem_t *done;
+	volatile bool stop;
+
+	/* current job, only touched by cpu_workers_run between start/done */
+	cpu_band_fn fn;
+	void *param;
+	int64_t rows;
+	int64_t band_rows;
+	long num_bands;
+	volatile long next_band;
+};
+
+static void run_bands(struct cpu_workers *workers)
+{
+	long band;
+	while ((band = os_atomic_inc_long(&workers->next_band) - 1) < workers->num_bands)
+	{
+		int64_t begin = band * workers->band_rows;
+		int64_t end = begin + workers->band_rows;
+		if (end > workers->rows)
+			end = workers->rows;
+		workers->fn(workers->param, begin, end);
+	}
+}
+
+static void *worker_thread(void *data)
+{
+	struct cpu_workers *workers = data;
+
+	os_set_thread_name("libobs-cpu: worker");
+
+	for (;;)
+	{
+		os_sem_wait(workers->start);
+		if (workers->stop)
+			break;
+		run_bands(workers);
+		os_sem_post(workers->done);
+	}
+
+	return NULL;
+}
+
+struct cpu_workers *cpu_workers_create(size_t num_threads)
+{
+	struct cpu_workers *workers = bzalloc(sizeof(struct cpu_workers));
+
+	if (os_sem_init(&workers->start, 0) != 0 || os_sem_init(&workers->done, 0) != 0)
+		goto fail;
+
+	for (size_t i = 0; i < num_threads; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker_thread, workers) != 0)
+		{
+			blog(LOG_WARNING, "Failed to create CPU Renderer worker %zu", i);
+			break;
+		}
+		da_push_back(workers->threads, &thread);
+	}
+
+	return workers;
+
+fail:
+	cpu_workers_destroy(workers);
+	return NULL;
+}
+
+void cpu_workers_destroy(struct cpu_workers *workers)
+{
+	if (!workers)
+		return;
+
+	workers->stop = true;
+	for (size_t i = 0; i < workers->threads.num; i++)
+		os_sem_post(workers->start);
+	for (size_t i = 0; i < workers->threads.num; i++)
+		pthread_join(workers->threads.array[i], NULL);
+
+	da_free(workers->threads);
+	os_sem_destroy(workers->start);
+	os_sem_destroy(workers->done);
+	bfree(workers);
+}
+
+size_t cpu_workers_count(const struct cpu_workers *workers)
+{
+	return workers ? workers->threads.num : 0;
+}
+
+void cpu_workers_run(struct cpu_workers *workers, int64_t rows, int64_t min_band_rows, cpu_band_fn fn, void *param)
+{
+	size_t num_threads = cpu_workers_count(workers);
+	if (rows <= 0)
+		return;
+	if (!num_threads || rows < 2 * min_band_rows)
+	{
+		fn(param, 0, rows);
+		return;
+	}
+
+	/* a few bands per thread so uneven rows still balance out */
+	int64_t band_rows = (rows + (int64_t)(num_threads + 1) * 4 - 1) / ((int64_t)(num_threads + 1) * 4);
+	if (band_rows < min_band_rows)
+		band_rows = min_band_rows;
+
+	workers->fn = fn;
+	workers->param = param;
+	workers->rows = rows;
+	workers->band_rows = band_rows;
+	workers->num_bands = (long)((rows + band_rows - 1) / band_rows);
+	workers->next_band = 0;
+
+	size_t wake = (size_t)workers->num_bands - 1;
+	if (wake > num_threads)
+		wake = num_threads;
+
+	for (size_t i = 0; i < wake; i++)
+		os_sem_post(workers->start);
+	run_bands(workers);
+	for (size_t i = 0; i < wake; i++)
+		os_sem_wait(workers->done);
+}
@@ -20,18 +20,52 @@
 
 #include <xcb/xcb.h>
 #include <xcb/xcb_image.h>
+#ifdef HAVE_XCB_SHM
+#include <xcb/shm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif
 
 #include <stdio.h>
 
 #include "cpu-subsystem.h"
 
+/*
+ * With MIT-SHM, each swapchain has two window sized buffers in shared memory.
+ * Draws go straight into the back buffer, device_present hands it to the
+ * server and switches to the other one. A buffer is only drawn again after
+ * the server sent the completion event for it. Without MIT-SHM (remote
+ * displays, missing extension) every draw is sent with xcb_put_image.
+ */
+
+#define CPU_SWAP_BUFFERS 2
+
+struct cpu_shm_buffer {
+#ifdef HAVE_XCB_SHM
+	xcb_shm_seg_t seg;
+	int shmid;
+#endif
+	gs_texture_t tex; // wraps the shared memory
+	bool busy;        // presented, server hasn't finished reading it
+};
+
 struct cpu_platform {
 	Display *display;
+	bool has_shm;
+	uint8_t shm_completion; // response type of completion events
+	DARRAY(struct cpu_windowinfo *) windows;
 };
 
 struct cpu_windowinfo {
 	xcb_window_t window;
 	xcb_gcontext_t foreground;
+	uint32_t width;
+	uint32_t height;
+
+	bool use_shm;
+	struct cpu_shm_buffer buffers[CPU_SWAP_BUFFERS];
+	int back;
+	bool dirty; // back buffer was drawn since the last present
 };
 
 static int x_error_handler(Display *display, XErrorEvent *error)
@@ -132,6 +166,21 @@ struct cpu_platform *cpu_platform_create(gs_device_t *device, uint32_t adapter)
 	XSetErrorHandler(x_error_handler);
 
 	plat->display = display;
+	plat->has_shm = false;
+	da_init(plat->windows);
+
+#ifdef HAVE_XCB_SHM
+	xcb_connection_t *xcb_conn = XGetXCBConnection(display);
+	xcb_shm_query_version_reply_t *shm_version =
+			xcb_shm_query_version_reply(xcb_conn, xcb_shm_query_version(xcb_conn), NULL);
+	const xcb_query_extension_reply_t *shm_ext = xcb_get_extension_data(xcb_conn, &xcb_shm_id);
+	if (shm_version && shm_ext && shm_ext->present) {
+		plat->has_shm = true;
+		plat->shm_completion = shm_ext->first_event + XCB_SHM_COMPLETION;
+	}
+	free(shm_version);
+#endif
+	blog(LOG_INFO, "CPU Renderer presenting %s MIT-SHM", plat->has_shm ? "with" : "without");
 
 	goto success;
 
@@ -145,8 +194,159 @@ fail_display_open:
 
 void cpu_platform_destroy(struct cpu_platform *plat)
 {
+	if (!plat)
+		return;
+	da_free(plat->windows);
+	if (plat->display)
+		XCloseDisplay(plat->display);
+	bfree(plat);
+}
+
+/* ------------------------------------------------------------------------- */
+/* MIT-SHM buffers */
+
+static void shm_buffer_free(xcb_connection_t *xcb_conn, struct cpu_shm_buffer *buf)
+{
+	if (!buf->tex.data)
+		return;
+#ifdef HAVE_XCB_SHM
+	// requests are ordered, so the server is done with pending puts before detaching
+	xcb_shm_detach(xcb_conn, buf->seg);
+	shmdt(buf->tex.data);
+#endif
+	memset(buf, 0, sizeof(*buf));
+}
+
+static bool shm_buffer_init(xcb_connection_t *xcb_conn, gs_device_t *device, struct cpu_shm_buffer *buf,
+		uint32_t width, uint32_t height)
+{
+#ifdef HAVE_XCB_SHM
+	memset(buf, 0, sizeof(*buf));
+	buf->shmid = shmget(IPC_PRIVATE, (size_t)width * height * 4, IPC_CREAT | 0600);
+	if (buf->shmid == -1)
+		return false;
+
+	void *data = shmat(buf->shmid, NULL, 0);
+	if (data == (void *)-1) {
+		shmctl(buf->shmid, IPC_RMID, NULL);
+		return false;
+	}
+
+	buf->seg = xcb_generate_id(xcb_conn);
+	xcb_generic_error_t *error = xcb_request_check(xcb_conn,
+			xcb_shm_attach_checked(xcb_conn, buf->seg, buf->shmid, false));
+	// both sides are attached (or failed), the segment goes away with the last detach
+	shmctl(buf->shmid, IPC_RMID, NULL);
+	if (error) {
+		free(error);
+		shmdt(data);
+		return false;
+	}
+
+	buf->tex.device = device;
+	buf->tex.type = GS_TEXTURE_2D;
+	buf->tex.width = width;
+	buf->tex.height = height;
+	buf->tex.levels = 1;
+	buf->tex.color_format = GS_BGRX;
+	buf->tex.data = data;
+	return true;
+#else
+	UNUSED_PARAMETER(xcb_conn);
+	UNUSED_PARAMETER(device);
+	UNUSED_PARAMETER(buf);
+	UNUSED_PARAMETER(width);
+	UNUSED_PARAMETER(height);
+	return false;
+#endif
+}
+
+static void handle_event(struct cpu_platform *plat, xcb_generic_event_t *event)
+{
+#ifdef HAVE_XCB_SHM
+	if ((event->response_type & ~0x80) != plat->shm_completion)
+		return;
+
+	xcb_shm_seg_t seg = ((xcb_shm_completion_event_t *)event)->shmseg;
+	for (size_t i = 0; i < plat->windows.num; i++) {
+		struct cpu_windowinfo *wi = plat->windows.array[i];
+		for (int b = 0; b < CPU_SWAP_BUFFERS; b++) {
+			if (wi->buffers[b].tex.data && wi->buffers[b].seg == seg)
+				wi->buffers[b].busy = false;
+		}
+	}
+#else
+	UNUSED_PARAMETER(plat);
+	UNUSED_PARAMETER(event);
+#endif
+}
+
+/* waits until the server has finished reading the back buffer */
+static void wait_back_buffer(struct cpu_platform *plat, struct cpu_windowinfo *wi)
+{
+	xcb_connection_t *xcb_conn = XGetXCBConnection(plat->display);
+	xcb_generic_event_t *event;
+
+	while ((event = xcb_poll_for_event(xcb_conn))) {
+		handle_event(plat, event);
+		free(event);
+	}
+
+	while (wi->buffers[wi->back].busy) {
+		event = xcb_wait_for_event(xcb_conn);
+		if (!event) {
+			// connection is gone, nobody is reading anymore
+			wi->buffers[wi->back].busy = false;
+			break;
+		}
+		handle_event(plat, event);
+		free(event);
+	}
+}
+
+/*
+ * Back buffer to draw the next frame into, reallocated when the window size
+ * changed. Returns NULL if the swapchain doesn't use MIT-SHM.
+ */
+static gs_texture_t *get_back_buffer(struct gs_swap_chain *swap)
+{
+	struct cpu_platform *plat = swap->device->plat;
+	struct cpu_windowinfo *wi = swap->wi;
+	if (!wi->use_shm || !wi->width || !wi->height)
+		return NULL;
+
+	xcb_connection_t *xcb_conn = XGetXCBConnection(plat->display);
+	struct cpu_shm_buffer *buf = &wi->buffers[wi->back];
+	if (buf->tex.width != wi->width || buf->tex.height != wi->height) {
+		for (int b = 0; b < CPU_SWAP_BUFFERS; b++)
+			shm_buffer_free(xcb_conn, &wi->buffers[b]);
+		for (int b = 0; b < CPU_SWAP_BUFFERS; b++) {
+			if (!shm_buffer_init(xcb_conn, swap->device, &wi->buffers[b], wi->width, wi->height)) {
+				blog(LOG_WARNING, "CPU Renderer failed to attach MIT-SHM segment, "
+						"falling back to xcb_put_image");
+				for (int f = 0; f < CPU_SWAP_BUFFERS; f++)
+					shm_buffer_free(xcb_conn, &wi->buffers[f]);
+				wi->use_shm = false;
+				return NULL;
+			}
+		}
+		wi->back = 0;
+		buf = &wi->buffers[0];
+	}
+
+	wait_back_buffer(plat, wi);
+	return &buf->tex;
 }
 
+gs_texture_t *cpu_platform_back_buffer(struct gs_swap_chain *swap)
+{
+	gs_texture_t *back = get_back_buffer(swap);
+	if (back)
+		swap->wi->dirty = true;
+	return back;
+}
+
+
 bool cpu_platform_init_swapchain(struct gs_swap_chain *swap)
 {
 	Display *display = swap->device->plat->display;
@@ -179,9 +379,13 @@ bool cpu_platform_init_swapchain(struct gs_swap_chain *swap)
 	xcb_map_window(xcb_conn, wid);
 	xcb_flush(xcb_conn);
 
-	swap->wi = bmalloc(sizeof(struct cpu_windowinfo));
+	swap->wi = bzalloc(sizeof(struct cpu_windowinfo));
 	swap->wi->window = wid;
 	swap->wi->foreground = foreground;
+	swap->wi->width = geometry->width;
+	swap->wi->height = geometry->height;
+	swap->wi->use_shm = swap->device->plat->has_shm;
+	da_push_back(swap->device->plat->windows, &swap->wi);
 
 	status = true;
 beach:
@@ -191,8 +395,18 @@ beach:
 
 void cpu_platform_fini_swapchain(struct gs_swap_chain *swap)
 {
-	// TODO: more cleanup?
+	struct cpu_platform *plat = swap->device->plat;
+	if (!swap->wi)
+		return;
+
+	xcb_connection_t *xcb_conn = XGetXCBConnection(plat->display);
+	for (int b = 0; b < CPU_SWAP_BUFFERS; b++)
+		shm_buffer_free(xcb_conn, &swap->wi->buffers[b]);
+	xcb_flush(xcb_conn);
+
+	da_erase_item(plat->windows, &swap->wi);
 	bfree(swap->wi);
+	swap->wi = NULL;
 }
 
 void cpu_platform_resize_swapchain(struct gs_swap_chain *swap, uint32_t width, uint32_t height)
@@ -202,6 +416,41 @@ void cpu_platform_resize_swapchain(struct gs_swap_chain *swap, uint32_t width, u
 	xcb_window_t window = swap->wi->window;
 	uint32_t values[2] = { width, height };
 	xcb_configure_window (xcb_conn, window, XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values);
+
+	// buffers are reallocated on the next draw
+	swap->wi->width = width;
+	swap->wi->height = height;
+}
+
+void cpu_platform_clear(struct gs_swap_chain *swap, const struct vec4 *color)
+{
+	gs_texture_t *back = get_back_buffer(swap);
+	if (!back)
+		return;
+
+	struct cpu_rect rect = { 0, 0, back->width, back->height };
+	cpu_fill_rect(back, &rect, color);
+	swap->wi->dirty = true;
+}
+
+void cpu_platform_present(struct gs_swap_chain *swap)
+{
+	xcb_connection_t *xcb_conn = XGetXCBConnection(swap->device->plat->display);
+
+#ifdef HAVE_XCB_SHM
+	struct cpu_windowinfo *wi = swap->wi;
+	struct cpu_shm_buffer *buf = &wi->buffers[wi->back];
+	if (wi->use_shm && wi->dirty && buf->tex.data) {
+		xcb_shm_put_image(xcb_conn, wi->window, wi->foreground, buf->tex.width, buf->tex.height,
+				0, 0, buf->tex.width, buf->tex.height, 0, 0, 24, XCB_IMAGE_FORMAT_Z_PIXMAP,
+				true, buf->seg, 0);
+		buf->busy = true;
+		wi->back = (wi->back + 1) % CPU_SWAP_BUFFERS;
+		wi->dirty = false;
+	}
+#endif
+
+	xcb_flush(xcb_conn);
 }
 
 void cpu_platform_blit(struct gs_device *device, struct cpu_blit_params params)
@@ -224,11 +473,23 @@ void cpu_platform_blit(struct gs_device *device, struct cpu_blit_params params)
 	if(dst_width <= 0 || dst_height <= 0)
 		return;
 
-	params.dst = device_texture_create(device, dst_width, dst_height, src->color_format, 1, NULL, 0);
+	gs_texture_t *back = get_back_buffer(swap);
+	if(back)
+	{
+		// scale straight into shared memory, sent on present
+		params.dst = back;
+		cpu_blit_texture(params);
+		swap->wi->dirty = true;
+		return;
+	}
+
+	params.dst = device_texture_create(device, dst_width, dst_height, GS_BGRX, 1, NULL, 0);
 	if(!params.dst)
 		return;
 	params.dst_x = 0;
 	params.dst_y = 0;
+	// the temporary texture has no previous contents to blend with
+	params.blend = NULL;
 	cpu_blit_texture(params);
 
 	Display *display = swap->device->plat->display;
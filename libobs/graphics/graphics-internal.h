@@ -261,6 +261,7 @@ struct gs_exports {
 					   gs_samplerstate_t *sampler);
 
 	bool (*device_nv12_available)(gs_device_t *device);
+	void (*device_set_render_threads)(gs_device_t *device, int threads);
 
 	void (*device_debug_marker_begin)(gs_device_t *device,
 					  const char *markername,
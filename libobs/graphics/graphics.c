@@ -2684,6 +2684,16 @@ bool gs_nv12_available(void)
 		thread_graphics->device);
 }
 
+void gs_set_render_threads(int threads)
+{
+	if (!gs_valid("gs_set_render_threads"))
+		return;
+
+	if (thread_graphics->exports.device_set_render_threads)
+		thread_graphics->exports.device_set_render_threads(
+			thread_graphics->device, threads);
+}
+
 void gs_debug_marker_begin(const float color[4], const char *markername)
 {
 	if (!gs_valid("gs_debug_marker_begin"))
@@ -800,6 +800,13 @@ EXPORT bool gs_timer_range_get_data(gs_timer_range_t *range, bool *disjoint,
 
 EXPORT bool gs_nv12_available(void);
 
+/**
+ * Sets the number of worker threads a software renderer uses besides the
+ * graphics thread, -1 picks one per core.  Devices that render on the GPU
+ * ignore this.
+ */
+EXPORT void gs_set_render_threads(int threads);
+
 #define GS_USE_DEBUG_MARKERS 0
 #if GS_USE_DEBUG_MARKERS
 static const float GS_DEBUG_COLOR_DEFAULT[] = {0.5f, 0.5f, 0.5f, 1.0f};
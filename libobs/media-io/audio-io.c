@@ -25,6 +25,7 @@
 #include "../util/profiler.h"
 
 #include "audio-io.h"
+#include "audio-math.h"
 #include "audio-resampler.h"
 
 extern profiler_name_store_t *obs_get_profiler_name_store(void);
@@ -69,6 +70,8 @@ struct audio_output {
 	void *input_param;
 	pthread_mutex_t input_mutex;
 	struct audio_mix mixes[MAX_AUDIO_MIXES];
+
+	size_t catch_up_ticks; /* audio thread only */
 };
 
 /* ------------------------------------------------------------------------- */
@@ -177,17 +180,8 @@ static inline void clamp_audio_output(struct audio_output *audio, size_t bytes)
 		if (!mix->inputs.num)
 			continue;
 
-		for (size_t plane = 0; plane < audio->planes; plane++) {
-			float *mix_data = mix->buffer[plane];
-			float *mix_end = &mix_data[float_size];
-
-			while (mix_data < mix_end) {
-				float val = *mix_data;
-				val = (val > 1.0f) ? 1.0f : val;
-				val = (val < -1.0f) ? -1.0f : val;
-				*(mix_data++) = val;
-			}
-		}
+		for (size_t plane = 0; plane < audio->planes; plane++)
+			clamp_audio_plane(mix->buffer[plane], float_size);
 	}
 }
 
@@ -273,6 +267,12 @@ static void *audio_thread(void *param)
 
 			input_and_output(audio, audio_time, prev_time);
 			prev_time = audio_time;
+
+			while (audio->catch_up_ticks) {
+				audio->catch_up_ticks--;
+				input_and_output(audio, audio_time,
+						 audio_time);
+			}
 		}
 
 		profile_end(audio_thread_name);
@@ -468,6 +468,12 @@ const struct audio_output_info *audio_output_get_info(const audio_t *audio)
 	return audio ? &audio->info : NULL;
 }
 
+void audio_output_catch_up(audio_t *audio)
+{
+	if (audio)
+		audio->catch_up_ticks++;
+}
+
 bool audio_output_active(const audio_t *audio)
 {
 	if (!audio)
@@ -228,6 +228,11 @@ EXPORT void audio_output_disconnect(audio_t *video, size_t mix_idx,
 
 EXPORT bool audio_output_active(const audio_t *audio);
 
+/* only callable from the input callback: has it called once more as soon as
+ * it returns, with an empty time range (start_ts == end_ts), so it can output
+ * a tick it had buffered without waiting for a new one */
+EXPORT void audio_output_catch_up(audio_t *audio);
+
 EXPORT size_t audio_output_get_block_size(const audio_t *audio);
 EXPORT size_t audio_output_get_planes(const audio_t *audio);
 EXPORT size_t audio_output_get_channels(const audio_t *audio);
@@ -18,6 +18,7 @@
 #pragma once
 
 #include "../util/c99defs.h"
+#include "../util/sse-intrin.h"
 #include <math.h>
 
 #ifdef _MSC_VER
@@ -38,6 +39,45 @@ static inline float db_to_mul(const float db)
 	return isfinite((double)db) ? powf(10.0f, db / 20.0f) : 0.0f;
 }
 
+/* adds count samples of aud to mix, neither needs to be aligned */
+static inline void mix_audio_plane(float *mix, const float *aud, size_t count)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8) {
+		__m128 mix0 = _mm_loadu_ps(mix + i);
+		__m128 mix1 = _mm_loadu_ps(mix + i + 4);
+		mix0 = _mm_add_ps(mix0, _mm_loadu_ps(aud + i));
+		mix1 = _mm_add_ps(mix1, _mm_loadu_ps(aud + i + 4));
+		_mm_storeu_ps(mix + i, mix0);
+		_mm_storeu_ps(mix + i + 4, mix1);
+	}
+
+	for (; i < count; i++)
+		mix[i] += aud[i];
+}
+
+/* clamps count samples to [-1, 1] */
+static inline void clamp_audio_plane(float *data, size_t count)
+{
+	const __m128 min_val = _mm_set1_ps(-1.0f);
+	const __m128 max_val = _mm_set1_ps(1.0f);
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 val = _mm_loadu_ps(data + i);
+		val = _mm_min_ps(_mm_max_ps(val, min_val), max_val);
+		_mm_storeu_ps(data + i, val);
+	}
+
+	for (; i < count; i++) {
+		float val = data[i];
+		val = (val > 1.0f) ? 1.0f : val;
+		val = (val < -1.0f) ? -1.0f : val;
+		data[i] = val;
+	}
+}
+
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
@@ -200,6 +200,32 @@ void convert_uyvx_to_i444(const uint8_t *input, uint32_t in_linesize,
 	}
 }
 
+/* writes 16 pixels, a, b and c are the first three bytes of each pixel, the
+ * fourth one is 0 */
+static FORCE_INLINE void store_16_pixels(uint32_t *output, __m128i a,
+					 __m128i b, __m128i c)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i ab_lo = _mm_unpacklo_epi8(a, b);
+	__m128i ab_hi = _mm_unpackhi_epi8(a, b);
+	__m128i c_lo = _mm_unpacklo_epi8(c, zero);
+	__m128i c_hi = _mm_unpackhi_epi8(c, zero);
+
+	_mm_storeu_si128((__m128i *)output, _mm_unpacklo_epi16(ab_lo, c_lo));
+	_mm_storeu_si128((__m128i *)(output + 4),
+			 _mm_unpackhi_epi16(ab_lo, c_lo));
+	_mm_storeu_si128((__m128i *)(output + 8),
+			 _mm_unpacklo_epi16(ab_hi, c_hi));
+	_mm_storeu_si128((__m128i *)(output + 12),
+			 _mm_unpackhi_epi16(ab_hi, c_hi));
+}
+
+/* duplicates each of the low 8 bytes for two horizontal pixels */
+static FORCE_INLINE __m128i upsample_chroma(__m128i chroma)
+{
+	return _mm_unpacklo_epi8(chroma, chroma);
+}
+
 void decompress_420(const uint8_t *const input[], const uint32_t in_linesize[],
 		    uint32_t start_y, uint32_t end_y, uint8_t *output,
 		    uint32_t out_linesize)
@@ -221,7 +247,26 @@ void decompress_420(const uint8_t *const input[], const uint32_t in_linesize[],
 		output0 = (uint32_t *)(output + y * 2 * out_linesize);
 		output1 = (uint32_t *)((uint8_t *)output0 + out_linesize);
 
-		for (x = 0; x < width_d2; x++) {
+		for (x = 0; x + 8 <= width_d2; x += 8) {
+			__m128i u = upsample_chroma(
+				_mm_loadl_epi64((const __m128i *)chroma0));
+			__m128i v = upsample_chroma(
+				_mm_loadl_epi64((const __m128i *)chroma1));
+
+			store_16_pixels(output0, v, u,
+					_mm_loadu_si128((const __m128i *)lum0));
+			store_16_pixels(output1, v, u,
+					_mm_loadu_si128((const __m128i *)lum1));
+
+			chroma0 += 8;
+			chroma1 += 8;
+			lum0 += 16;
+			lum1 += 16;
+			output0 += 16;
+			output1 += 16;
+		}
+
+		for (; x < width_d2; x++) {
 			uint32_t out;
 			out = (*(chroma0++) << 8) | *(chroma1++);
 
@@ -243,6 +288,8 @@ void decompress_nv12(const uint8_t *const input[], const uint32_t in_linesize[],
 	uint32_t height_d2 = end_y / 2;
 	uint32_t y;
 
+	__m128i byte_mask = _mm_set1_epi16(0x00FF);
+
 	for (y = start_y_d2; y < height_d2; y++) {
 		const uint16_t *chroma;
 		register const uint8_t *lum0, *lum1;
@@ -255,7 +302,28 @@ void decompress_nv12(const uint8_t *const input[], const uint32_t in_linesize[],
 		output0 = (uint32_t *)(output + y * 2 * out_linesize);
 		output1 = (uint32_t *)((uint8_t *)output0 + out_linesize);
 
-		for (x = 0; x < width_d2; x++) {
+		for (x = 0; x + 8 <= width_d2; x += 8) {
+			__m128i uv = _mm_loadu_si128((const __m128i *)chroma);
+			__m128i u = _mm_and_si128(uv, byte_mask);
+			__m128i v = _mm_srli_epi16(uv, 8);
+			u = upsample_chroma(_mm_packus_epi16(u, u));
+			v = upsample_chroma(_mm_packus_epi16(v, v));
+
+			store_16_pixels(output0,
+					_mm_loadu_si128((const __m128i *)lum0),
+					u, v);
+			store_16_pixels(output1,
+					_mm_loadu_si128((const __m128i *)lum1),
+					u, v);
+
+			chroma += 8;
+			lum0 += 16;
+			lum1 += 16;
+			output0 += 16;
+			output1 += 16;
+		}
+
+		for (; x < width_d2; x++) {
 			uint32_t out = *(chroma++) << 8;
 
 			*(output0++) = *(lum0++) | out;
@@ -278,41 +346,43 @@ void decompress_422(const uint8_t *input, uint32_t in_linesize,
 	register const uint32_t *input32_end;
 	register uint32_t *output32;
 
-	if (leading_lum) {
-		for (y = start_y; y < end_y; y++) {
-			input32 = (const uint32_t *)(input + y * in_linesize);
-			input32_end = input32 + width_d2;
-			output32 = (uint32_t *)(output + y * out_linesize);
+	/* the second pixel of each pair gets the second luma value in place
+	 * of the first one */
+	uint32_t keep_bits = leading_lum ? 0xFFFFFF00 : 0xFFFF00FF;
+	uint32_t lum_bits = leading_lum ? 0x000000FF : 0x0000FF00;
+	__m128i keep_mask = _mm_set1_epi32((int)keep_bits);
+	__m128i lum_mask = _mm_set1_epi32((int)lum_bits);
+
+	for (y = start_y; y < end_y; y++) {
+		input32 = (const uint32_t *)(input + y * in_linesize);
+		input32_end = input32 + (width_d2 & ~3);
+		output32 = (uint32_t *)(output + y * out_linesize);
+
+		while (input32 < input32_end) {
+			__m128i dw = _mm_loadu_si128((const __m128i *)input32);
+			__m128i dw2 = _mm_or_si128(
+				_mm_and_si128(dw, keep_mask),
+				_mm_and_si128(_mm_srli_epi32(dw, 16), lum_mask));
+
+			_mm_storeu_si128((__m128i *)output32,
+					 _mm_unpacklo_epi32(dw, dw2));
+			_mm_storeu_si128((__m128i *)(output32 + 4),
+					 _mm_unpackhi_epi32(dw, dw2));
+
+			output32 += 8;
+			input32 += 4;
+		}
 
-			while (input32 < input32_end) {
-				register uint32_t dw = *input32;
+		input32_end += width_d2 & 3;
 
-				output32[0] = dw;
-				dw &= 0xFFFFFF00;
-				dw |= (uint8_t)(dw >> 16);
-				output32[1] = dw;
+		while (input32 < input32_end) {
+			register uint32_t dw = *input32;
 
-				output32 += 2;
-				input32++;
-			}
-		}
-	} else {
-		for (y = start_y; y < end_y; y++) {
-			input32 = (const uint32_t *)(input + y * in_linesize);
-			input32_end = input32 + width_d2;
-			output32 = (uint32_t *)(output + y * out_linesize);
-
-			while (input32 < input32_end) {
-				register uint32_t dw = *input32;
-
-				output32[0] = dw;
-				dw &= 0xFFFF00FF;
-				dw |= (dw >> 16) & 0xFF00;
-				output32[1] = dw;
-
-				output32 += 2;
-				input32++;
-			}
+			output32[0] = dw;
+			output32[1] = (dw & keep_bits) | ((dw >> 16) & lum_bits);
+
+			output32 += 2;
+			input32++;
 		}
 	}
 }
@@ -195,22 +195,128 @@ void video_frame_init(struct video_frame *frame, enum video_format format,
 	}
 }
 
+#define SLICE_MIN_BYTES (256 * 1024)
+#define MAX_SLICES 64
+
+struct plane_slice {
+	const struct video_plane_copy *plane;
+	uint32_t y;
+	uint32_t lines;
+};
+
+static void copy_plane_lines(const struct video_plane_copy *plane, uint32_t y,
+			     uint32_t lines)
+{
+	uint8_t *dst = plane->dst + (size_t)y * plane->dst_linesize;
+	const uint8_t *src = plane->src + (size_t)y * plane->src_linesize;
+
+	if (plane->width == plane->dst_linesize &&
+	    plane->width == plane->src_linesize) {
+		memcpy(dst, src, (size_t)plane->width * lines);
+		return;
+	}
+
+	for (uint32_t i = 0; i < lines; i++) {
+		memcpy(dst, src, plane->width);
+		dst += plane->dst_linesize;
+		src += plane->src_linesize;
+	}
+}
+
+static void copy_slice_task(void *param, size_t idx)
+{
+	struct plane_slice *slices = param;
+	copy_plane_lines(slices[idx].plane, slices[idx].y, slices[idx].lines);
+}
+
+void video_planes_copy(task_scheduler_t *sched,
+		       const struct video_plane_copy *planes, size_t num_planes)
+{
+	struct plane_slice slices[MAX_SLICES];
+	size_t num_slices = 0;
+	size_t total = 0;
+
+	for (size_t i = 0; i < num_planes; i++)
+		total += (size_t)planes[i].width * planes[i].height;
+
+	/* a couple of slices per thread, so uneven ones even out */
+	size_t threads = task_scheduler_num_threads(sched) + 1;
+	size_t slice_bytes = total / (threads * 2);
+	if (slice_bytes < SLICE_MIN_BYTES)
+		slice_bytes = SLICE_MIN_BYTES;
+
+	if (threads == 1 || total < SLICE_MIN_BYTES * 2)
+		goto serial;
+
+	for (size_t i = 0; i < num_planes; i++) {
+		const struct video_plane_copy *plane = &planes[i];
+		size_t line_bytes = plane->width ? plane->width : 1;
+		uint32_t lines = (uint32_t)(slice_bytes / line_bytes);
+		if (!lines)
+			lines = 1;
+
+		for (uint32_t y = 0; y < plane->height; y += lines) {
+			if (num_slices == MAX_SLICES)
+				goto serial;
+
+			struct plane_slice *slice = &slices[num_slices++];
+			slice->plane = plane;
+			slice->y = y;
+			slice->lines = plane->height - y < lines
+					       ? plane->height - y
+					       : lines;
+		}
+	}
+
+	task_scheduler_run(sched, "video_planes_copy", num_slices,
+			   copy_slice_task, slices);
+	return;
+
+serial:
+	for (size_t i = 0; i < num_planes; i++)
+		copy_plane_lines(&planes[i], 0, planes[i].height);
+}
+
+static void add_plane(struct video_plane_copy *planes, size_t *num_planes,
+		      struct video_frame *dst, const struct video_frame *src,
+		      size_t plane, uint32_t lines)
+{
+	struct video_plane_copy *copy = &planes[(*num_planes)++];
+	copy->dst = dst->data[plane];
+	copy->src = src->data[plane];
+	copy->dst_linesize = src->linesize[plane];
+	copy->src_linesize = src->linesize[plane];
+	copy->width = src->linesize[plane];
+	copy->height = lines;
+}
+
 void video_frame_copy(struct video_frame *dst, const struct video_frame *src,
 		      enum video_format format, uint32_t cy)
 {
+	video_frame_copy_parallel(dst, src, format, cy, NULL);
+}
+
+void video_frame_copy_parallel(struct video_frame *dst,
+			       const struct video_frame *src,
+			       enum video_format format, uint32_t cy,
+			       task_scheduler_t *sched)
+{
+	struct video_plane_copy planes[MAX_AV_PLANES];
+	size_t num = 0;
+
 	switch (format) {
 	case VIDEO_FORMAT_NONE:
 		return;
 
 	case VIDEO_FORMAT_I420:
-		memcpy(dst->data[0], src->data[0], src->linesize[0] * cy);
-		memcpy(dst->data[1], src->data[1], src->linesize[1] * cy / 2);
-		memcpy(dst->data[2], src->data[2], src->linesize[2] * cy / 2);
+		add_plane(planes, &num, dst, src, 0, cy);
+		add_plane(planes, &num, dst, src, 1, cy / 2);
+		add_plane(planes, &num, dst, src, 2, cy / 2);
 		break;
 
 	case VIDEO_FORMAT_NV12:
-		memcpy(dst->data[0], src->data[0], src->linesize[0] * cy);
-		memcpy(dst->data[1], src->data[1], src->linesize[1] * cy / 2);
+		add_plane(planes, &num, dst, src, 0, cy);
+		add_plane(planes, &num, dst, src, 1, cy / 2);
 		break;
 
 	case VIDEO_FORMAT_Y800:
@@ -222,29 +328,31 @@ void video_frame_copy(struct video_frame *dst, const struct video_frame *src,
 	case VIDEO_FORMAT_BGRX:
 	case VIDEO_FORMAT_BGR3:
 	case VIDEO_FORMAT_AYUV:
-		memcpy(dst->data[0], src->data[0], src->linesize[0] * cy);
+		add_plane(planes, &num, dst, src, 0, cy);
 		break;
 
 	case VIDEO_FORMAT_I444:
 	case VIDEO_FORMAT_I422:
-		memcpy(dst->data[0], src->data[0], src->linesize[0] * cy);
-		memcpy(dst->data[1], src->data[1], src->linesize[1] * cy);
-		memcpy(dst->data[2], src->data[2], src->linesize[2] * cy);
+		add_plane(planes, &num, dst, src, 0, cy);
+		add_plane(planes, &num, dst, src, 1, cy);
+		add_plane(planes, &num, dst, src, 2, cy);
 		break;
 
 	case VIDEO_FORMAT_I40A:
-		memcpy(dst->data[0], src->data[0], src->linesize[0] * cy);
-		memcpy(dst->data[1], src->data[1], src->linesize[1] * cy / 2);
-		memcpy(dst->data[2], src->data[2], src->linesize[2] * cy / 2);
-		memcpy(dst->data[3], src->data[3], src->linesize[3] * cy);
+		add_plane(planes, &num, dst, src, 0, cy);
+		add_plane(planes, &num, dst, src, 1, cy / 2);
+		add_plane(planes, &num, dst, src, 2, cy / 2);
+		add_plane(planes, &num, dst, src, 3, cy);
 		break;
 
 	case VIDEO_FORMAT_I42A:
 	case VIDEO_FORMAT_YUVA:
-		memcpy(dst->data[0], src->data[0], src->linesize[0] * cy);
-		memcpy(dst->data[1], src->data[1], src->linesize[1] * cy);
-		memcpy(dst->data[2], src->data[2], src->linesize[2] * cy);
-		memcpy(dst->data[3], src->data[3], src->linesize[3] * cy);
+		add_plane(planes, &num, dst, src, 0, cy);
+		add_plane(planes, &num, dst, src, 1, cy);
+		add_plane(planes, &num, dst, src, 2, cy);
+		add_plane(planes, &num, dst, src, 3, cy);
 		break;
 	}
+
+	video_planes_copy(sched, planes, num);
 }
@@ -18,6 +18,7 @@
 #pragma once
 
 #include "../util/bmem.h"
+#include "../util/task-scheduler.h"
 #include "video-io.h"
 
 struct video_frame {
@@ -58,3 +59,28 @@ static inline void video_frame_destroy(struct video_frame *frame)
 EXPORT void video_frame_copy(struct video_frame *dst,
 			     const struct video_frame *src,
 			     enum video_format format, uint32_t height);
+
+/** Same as video_frame_copy, but split up to run on the task scheduler */
+EXPORT void video_frame_copy_parallel(struct video_frame *dst,
+				      const struct video_frame *src,
+				      enum video_format format,
+				      uint32_t height, task_scheduler_t *sched);
+
+/* one plane to copy, width is in bytes */
+struct video_plane_copy {
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t dst_linesize;
+	uint32_t src_linesize;
+	uint32_t width;
+	uint32_t height;
+};
+
+/**
+ * Copies the planes in slices of lines on the task scheduler.  Copies too
+ * small to be worth splitting, or without a scheduler, run on the calling
+ * thread.
+ */
+EXPORT void video_planes_copy(task_scheduler_t *sched,
+			      const struct video_plane_copy *planes,
+			      size_t num_planes);
@@ -22,6 +22,7 @@
 #include "../util/profiler.h"
 #include "../util/threading.h"
 #include "../util/darray.h"
+#include "../util/circlebuf.h"
 
 #include "format-conversion.h"
 #include "video-io.h"
@@ -30,37 +31,86 @@
 
 extern profiler_name_store_t *obs_get_profiler_name_store(void);
 
-#define MAX_CONVERT_BUFFERS 3
 #define MAX_CACHE_SIZE 16
 
 struct cached_frame_info {
 	struct video_data frame;
-	int skipped;
-	int count;
+	uint64_t seq;        /* changes whenever the slot is filled */
+	volatile long count; /* outputs left */
+	volatile long refs;  /* queued to or used by input threads */
 };
 
-struct video_input {
+/* a slot can be filled again once it's output and no input uses it */
+static inline bool slot_free(struct cached_frame_info *cfi)
+{
+	return os_atomic_load_long(&cfi->count) == 0 &&
+	       os_atomic_load_long(&cfi->refs) == 0;
+}
+
+/* a frame converted by a scale group, shared by all of its inputs.  it is
+ * converted lazily by the first input that needs it, so that happens on the
+ * input's own thread if it has one. */
+struct video_scaled_frame {
+	struct video_frame frame;
+	struct video_data src; /* valid while not converted yet */
+	uint64_t seq;          /* source slot fill */
+	bool converted;
+	bool success;
+	volatile long refs;
+};
+
+/* inputs with the same conversion share one scaler, so each frame is only
+ * converted once no matter how many encoders use that conversion */
+struct video_scale_group {
 	struct video_scale_info conversion;
 	video_scaler_t *scaler;
-	struct video_frame frame[MAX_CONVERT_BUFFERS];
-	int cur_frame;
+	pthread_mutex_t mutex; /* the scaler is not thread safe */
+	size_t users;
+
+	DARRAY(struct video_scaled_frame *) frames;
+	struct video_scaled_frame *last; /* newest, video thread owned */
+};
+
+struct queued_frame {
+	struct video_data frame;
+	struct cached_frame_info *slot;
+	struct video_scaled_frame *scaled;
+	uint32_t skipped; /* frames skipped right before this one */
+};
+
+struct video_output;
+
+struct video_input {
+	struct video_output *video;
+	struct video_scale_info conversion;
+	struct video_scale_group *group;
 
 	void (*callback)(void *param, struct video_data *frame);
+	void (*skip_callback)(void *param, uint32_t frames);
 	void *param;
-};
 
-static inline void video_input_free(struct video_input *input)
-{
-	for (size_t i = 0; i < MAX_CONVERT_BUFFERS; i++)
-		video_frame_free(&input->frame[i]);
-	video_scaler_destroy(input->scaler);
-}
+	/* inputs connected with video_output_connect_threaded get the frames
+	 * on their own thread, through a bounded queue.  if the queue is
+	 * full, the frame is skipped for this input only, and the input is
+	 * told about it before its next frame. */
+	bool threaded;
+	uint32_t pending_skips; /* guarded by queue_mutex */
+	pthread_t thread;
+	os_sem_t *queue_sem;
+	pthread_mutex_t queue_mutex;
+	struct circlebuf queue;
+	size_t max_queued;
+	volatile bool stop;
+	bool detached; /* disconnected from its own thread, frees itself */
+	volatile long skipped_frames;
+	volatile long total_frames;
+	const char *profile_name;
+};
 
 struct video_output {
 	struct video_output_info info;
 
 	pthread_t thread;
-	pthread_mutex_t data_mutex;
 	bool stop;
 
 	os_sem_t *update_semaphore;
@@ -71,12 +121,26 @@ struct video_output {
 	bool initialized;
 
 	pthread_mutex_t input_mutex;
-	DARRAY(struct video_input) inputs;
-
-	size_t available_frames;
-	size_t first_added;
-	size_t last_added;
+	DARRAY(struct video_input *) inputs;
+	DARRAY(struct video_scale_group *) scale_groups;
+	volatile long detached_inputs;
+
+	/* single producer (video_output_lock_frame/unlock_frame), single
+	 * consumer (the video thread) ring of cache slots to output.  head
+	 * and tail only ever increase, entry i is queued[i % cache_size].
+	 * slots are not output in a fixed order, input threads may still
+	 * hold older ones. */
+	volatile long head; /* next frame to output, consumer owned */
+	volatile long tail; /* next frame to queue, producer owned */
+	size_t queued[MAX_CACHE_SIZE];
 	struct cached_frame_info cache[MAX_CACHE_SIZE];
+	size_t locked_slot; /* producer owned */
+	size_t last_slot;   /* producer owned, newest queued slot */
+	uint64_t fill_seq;  /* producer owned */
+
+	/* contention statistics */
+	volatile long ring_full;   /* frames duplicated, no free slot */
+	volatile long cas_retries; /* slot updates racing the other side */
 
 	volatile bool raw_active;
 	volatile long gpu_refs;
@@ -84,87 +148,408 @@ struct video_output {
 
 /* ------------------------------------------------------------------------- */
 
-static inline bool scale_video_output(struct video_input *input,
-				      struct video_data *data)
+static inline bool same_conversion(const struct video_scale_info *a,
+				   const struct video_scale_info *b)
 {
-	bool success = true;
+	return a->format == b->format && a->width == b->width &&
+	       a->height == b->height && a->range == b->range &&
+	       a->colorspace == b->colorspace;
+}
 
-	if (input->scaler) {
-		struct video_frame *frame;
+static struct video_scale_group *
+scale_group_acquire(struct video_output *video,
+		    const struct video_scale_info *conversion)
+{
+	struct video_scale_group *group;
 
-		if (++input->cur_frame == MAX_CONVERT_BUFFERS)
-			input->cur_frame = 0;
+	for (size_t i = 0; i < video->scale_groups.num; i++) {
+		group = video->scale_groups.array[i];
+		if (same_conversion(&group->conversion, conversion)) {
+			group->users++;
+			return group;
+		}
+	}
 
-		frame = &input->frame[input->cur_frame];
+	struct video_scale_info from = {.format = video->info.format,
+					.width = video->info.width,
+					.height = video->info.height,
+					.range = video->info.range,
+					.colorspace = video->info.colorspace};
+
+	group = bzalloc(sizeof(*group));
+	group->conversion = *conversion;
+
+	int ret = video_scaler_create(&group->scaler, conversion, &from,
+				      VIDEO_SCALE_FAST_BILINEAR);
+	if (ret != VIDEO_SCALER_SUCCESS) {
+		if (ret == VIDEO_SCALER_BAD_CONVERSION)
+			blog(LOG_ERROR, "video_input_init: Bad "
+					"scale conversion type");
+		else
+			blog(LOG_ERROR, "video_input_init: Failed to "
+					"create scaler");
+
+		bfree(group);
+		return NULL;
+	}
 
-		success = video_scaler_scale(input->scaler, frame->data,
-					     frame->linesize,
-					     (const uint8_t *const *)data->data,
-					     data->linesize);
+	pthread_mutex_init(&group->mutex, NULL);
+	group->users = 1;
+	da_push_back(video->scale_groups, &group);
+	return group;
+}
 
-		if (success) {
-			for (size_t i = 0; i < MAX_AV_PLANES; i++) {
-				data->data[i] = frame->data[i];
-				data->linesize[i] = frame->linesize[i];
+static void scale_group_release(struct video_output *video,
+				struct video_scale_group *group)
+{
+	if (!group)
+		return;
+
+	pthread_mutex_lock(&video->input_mutex);
+
+	if (--group->users == 0) {
+		da_erase_item(video->scale_groups, &group);
+
+		for (size_t i = 0; i < group->frames.num; i++) {
+			struct video_scaled_frame *sf = group->frames.array[i];
+			video_frame_free(&sf->frame);
+			bfree(sf);
+		}
+		da_free(group->frames);
+
+		video_scaler_destroy(group->scaler);
+		pthread_mutex_destroy(&group->mutex);
+		bfree(group);
+	}
+
+	pthread_mutex_unlock(&video->input_mutex);
+}
+
+/* called from the video thread, the returned frame is referenced */
+static struct video_scaled_frame *
+scaled_frame_acquire(struct video_scale_group *group,
+		     struct cached_frame_info *slot)
+{
+	struct video_scaled_frame *sf = group->last;
+
+	/* repeated outputs of a slot use the same converted frame */
+	if (!sf || sf->seq != slot->seq) {
+		sf = NULL;
+
+		for (size_t i = 0; i < group->frames.num; i++) {
+			if (!os_atomic_load_long(&group->frames.array[i]->refs)) {
+				sf = group->frames.array[i];
+				break;
 			}
-		} else {
+		}
+
+		if (!sf) {
+			sf = bzalloc(sizeof(*sf));
+			video_frame_init(&sf->frame, group->conversion.format,
+					 group->conversion.width,
+					 group->conversion.height);
+			da_push_back(group->frames, &sf);
+		}
+
+		sf->src = slot->frame;
+		sf->seq = slot->seq;
+		sf->converted = false;
+		group->last = sf;
+	}
+
+	os_atomic_inc_long(&sf->refs);
+	return sf;
+}
+
+static inline void scaled_frame_release(struct video_scaled_frame *sf)
+{
+	if (sf)
+		os_atomic_dec_long(&sf->refs);
+}
+
+/* the source slot must still be referenced by the caller */
+static bool scaled_frame_get(struct video_scale_group *group,
+			     struct video_scaled_frame *sf,
+			     struct video_data *data)
+{
+	pthread_mutex_lock(&group->mutex);
+
+	if (!sf->converted) {
+		sf->success = video_scaler_scale(
+			group->scaler, sf->frame.data, sf->frame.linesize,
+			(const uint8_t *const *)sf->src.data, sf->src.linesize);
+		sf->converted = true;
+
+		if (!sf->success)
 			blog(LOG_WARNING, "video-io: Could not scale frame!");
+	}
+
+	pthread_mutex_unlock(&group->mutex);
+
+	if (sf->success) {
+		for (size_t i = 0; i < MAX_AV_PLANES; i++) {
+			data->data[i] = sf->frame.data[i];
+			data->linesize[i] = sf->frame.linesize[i];
 		}
 	}
 
-	return success;
+	return sf->success;
 }
 
-static inline bool video_output_cur_frame(struct video_output *video)
+static inline void output_input_frame(struct video_input *input,
+				      struct video_data *frame,
+				      struct video_scaled_frame *sf)
 {
-	struct cached_frame_info *frame_info;
-	bool complete;
-	bool skipped;
+	if (!sf || scaled_frame_get(input->group, sf, frame))
+		input->callback(input->param, frame);
+}
 
-	/* -------------------------------- */
+static inline struct cached_frame_info *queued_slot(struct video_output *video,
+						   long idx)
+{
+	size_t slot = video->queued[(unsigned long)idx % video->info.cache_size];
+	return &video->cache[slot];
+}
+
+/* ------------------------------------------------------------------------- */
+/* input threads */
+
+static void queue_input_frame(struct video_input *input,
+			      const struct video_data *frame,
+			      struct cached_frame_info *slot)
+{
+	struct queued_frame qf = {*frame, slot, NULL, 0};
+	bool queued = false;
+
+	os_atomic_inc_long(&input->total_frames);
+
+	pthread_mutex_lock(&input->queue_mutex);
+	if (input->queue.size / sizeof(qf) < input->max_queued) {
+		os_atomic_inc_long(&slot->refs);
+		if (input->group)
+			qf.scaled = scaled_frame_acquire(input->group, slot);
+		qf.skipped = input->pending_skips;
+		input->pending_skips = 0;
+		circlebuf_push_back(&input->queue, &qf, sizeof(qf));
+		queued = true;
+	} else {
+		input->pending_skips++;
+	}
+	pthread_mutex_unlock(&input->queue_mutex);
+
+	if (queued)
+		os_sem_post(input->queue_sem);
+	else
+		os_atomic_inc_long(&input->skipped_frames);
+}
+
+static void free_detached_input(struct video_input *input);
+
+static void *input_thread(void *param)
+{
+	struct video_input *input = param;
+
+	os_set_thread_name("video-io: input thread");
+
+	while (os_sem_wait(input->queue_sem) == 0) {
+		struct queued_frame qf;
+
+		if (os_atomic_load_bool(&input->stop))
+			break;
+
+		pthread_mutex_lock(&input->queue_mutex);
+		circlebuf_pop_front(&input->queue, &qf, sizeof(qf));
+		pthread_mutex_unlock(&input->queue_mutex);
+
+		profile_start(input->profile_name);
+		if (qf.skipped && input->skip_callback)
+			input->skip_callback(input->param, qf.skipped);
+		output_input_frame(input, &qf.frame, qf.scaled);
+		profile_end(input->profile_name);
+
+		scaled_frame_release(qf.scaled);
+		os_atomic_dec_long(&qf.slot->refs);
+
+		profile_reenable_thread();
+	}
+
+	if (input->detached)
+		free_detached_input(input);
+	return NULL;
+}
+
+static bool start_input_thread(struct video_output *video,
+			       struct video_input *input)
+{
+	/* keep enough of the cache free for the other inputs */
+	input->max_queued = video->info.cache_size / 3;
+	if (input->max_queued < 1)
+		input->max_queued = 1;
+
+	input->profile_name = profile_store_name(
+		obs_get_profiler_name_store(), "video_input_thread(%s)",
+		video->info.name);
+
+	if (pthread_mutex_init(&input->queue_mutex, NULL) != 0)
+		return false;
+	if (os_sem_init(&input->queue_sem, 0) != 0) {
+		pthread_mutex_destroy(&input->queue_mutex);
+		return false;
+	}
+	if (pthread_create(&input->thread, NULL, input_thread, input) != 0) {
+		os_sem_destroy(input->queue_sem);
+		pthread_mutex_destroy(&input->queue_mutex);
+		return false;
+	}
+
+	input->threaded = true;
+	return true;
+}
+
+static void free_input_queue(struct video_input *input)
+{
+	struct queued_frame qf;
+
+	/* give back the slots of frames that were never delivered */
+	while (input->queue.size) {
+		circlebuf_pop_front(&input->queue, &qf, sizeof(qf));
+		scaled_frame_release(qf.scaled);
+		os_atomic_dec_long(&qf.slot->refs);
+	}
+
+	long skipped = os_atomic_load_long(&input->skipped_frames);
+	if (skipped)
+		blog(LOG_INFO,
+		     "video-io: Input thread skipped %ld/%ld frames "
+		     "because it fell behind",
+		     skipped, os_atomic_load_long(&input->total_frames));
+
+	circlebuf_free(&input->queue);
+	os_sem_destroy(input->queue_sem);
+	pthread_mutex_destroy(&input->queue_mutex);
+}
+
+static void stop_input_thread(struct video_input *input)
+{
+	os_atomic_set_bool(&input->stop, true);
+	os_sem_post(input->queue_sem);
+	pthread_join(input->thread, NULL);
+
+	free_input_queue(input);
+}
+
+static void free_detached_input(struct video_input *input)
+{
+	struct video_output *video = input->video;
+
+	free_input_queue(input);
+	scale_group_release(video, input->group);
+	bfree(input);
+
+	os_atomic_dec_long(&video->detached_inputs);
+}
+
+static inline void video_input_free(struct video_output *video,
+				    struct video_input *input)
+{
+	if (input->threaded) {
+		/* an input can be disconnected from its own callback, say
+		 * when its encoder fails.  the thread can't join itself and
+		 * still has to return from the callback, so it frees the
+		 * input once it gets back to its loop */
+		if (pthread_equal(pthread_self(), input->thread)) {
+			input->detached = true;
+			os_atomic_inc_long(&video->detached_inputs);
+			os_atomic_set_bool(&input->stop, true);
+			os_sem_post(input->queue_sem);
+			pthread_detach(input->thread);
+			return;
+		}
+
+		stop_input_thread(input);
+	}
+
+	scale_group_release(video, input->group);
+	bfree(input);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* decrements if greater than zero, returns the previous value */
+static long dec_positive(struct video_output *video, volatile long *val)
+{
+	for (;;) {
+		long cur = os_atomic_load_long(val);
+		if (cur <= 0)
+			return cur;
+		if (os_atomic_compare_swap_long(val, cur, cur - 1))
+			return cur;
+		os_atomic_inc_long(&video->cas_retries);
+	}
+}
+
+static void add_long(struct video_output *video, volatile long *val, long add)
+{
+	for (;;) {
+		long cur = os_atomic_load_long(val);
+		if (os_atomic_compare_swap_long(val, cur, cur + add))
+			return;
+		os_atomic_inc_long(&video->cas_retries);
+	}
+}
 
-	pthread_mutex_lock(&video->data_mutex);
+/* adds to a slot still waiting to be output, fails if it is done already */
+static bool add_if_pending(struct video_output *video, volatile long *val,
+			   long add)
+{
+	for (;;) {
+		long cur = os_atomic_load_long(val);
+		if (cur <= 0)
+			return false;
+		if (os_atomic_compare_swap_long(val, cur, cur + add))
+			return true;
+		os_atomic_inc_long(&video->cas_retries);
+	}
+}
 
-	frame_info = &video->cache[video->first_added];
+static inline bool video_output_cur_frame(struct video_output *video)
+{
+	struct cached_frame_info *frame_info;
+	bool complete;
 
-	pthread_mutex_unlock(&video->data_mutex);
+	frame_info = queued_slot(video, os_atomic_load_long(&video->head));
 
 	/* -------------------------------- */
 
 	pthread_mutex_lock(&video->input_mutex);
 
 	for (size_t i = 0; i < video->inputs.num; i++) {
-		struct video_input *input = video->inputs.array + i;
+		struct video_input *input = video->inputs.array[i];
 		struct video_data frame = frame_info->frame;
 
-		if (scale_video_output(input, &frame))
-			input->callback(input->param, &frame);
+		if (input->threaded) {
+			queue_input_frame(input, &frame, frame_info);
+		} else {
+			struct video_scaled_frame *sf = NULL;
+			if (input->group)
+				sf = scaled_frame_acquire(input->group,
+							  frame_info);
+
+			output_input_frame(input, &frame, sf);
+			scaled_frame_release(sf);
+		}
 	}
 
 	pthread_mutex_unlock(&video->input_mutex);
 
 	/* -------------------------------- */
 
-	pthread_mutex_lock(&video->data_mutex);
-
 	frame_info->frame.timestamp += video->frame_time;
-	complete = --frame_info->count == 0;
-	skipped = frame_info->skipped > 0;
-
-	if (complete) {
-		if (++video->first_added == video->info.cache_size)
-			video->first_added = 0;
-
-		if (++video->available_frames == video->info.cache_size)
-			video->last_added = video->first_added;
-	} else if (skipped) {
-		--frame_info->skipped;
-		os_atomic_inc_long(&video->skipped_frames);
-	}
 
-	pthread_mutex_unlock(&video->data_mutex);
-
-	/* -------------------------------- */
+	/* hands the slot back to the producer */
+	complete = dec_positive(video, &frame_info->count) <= 1;
+	if (complete)
+		os_atomic_inc_long(&video->head);
 
 	return complete;
 }
@@ -218,7 +603,7 @@ static inline void init_cache(struct video_output *video)
 				 video->info.height);
 	}
 
-	video->available_frames = video->info.cache_size;
+	video->last_slot = video->info.cache_size - 1;
 }
 
 int video_output_open(video_t **video, struct video_output_info *info)
@@ -242,8 +627,6 @@ int video_output_open(video_t **video, struct video_output_info *info)
 		goto fail;
 	if (pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) != 0)
 		goto fail;
-	if (pthread_mutex_init(&out->data_mutex, &attr) != 0)
-		goto fail;
 	if (pthread_mutex_init(&out->input_mutex, &attr) != 0)
 		goto fail;
 	if (os_sem_init(&out->update_semaphore, 0) != 0)
@@ -270,14 +653,20 @@ void video_output_close(video_t *video)
 	video_output_stop(video);
 
 	for (size_t i = 0; i < video->inputs.num; i++)
-		video_input_free(&video->inputs.array[i]);
+		video_input_free(video, video->inputs.array[i]);
 	da_free(video->inputs);
 
+	/* inputs that disconnected themselves still use the scale groups and
+	 * cache until their threads are done */
+	while (os_atomic_load_long(&video->detached_inputs))
+		os_sleep_ms(1);
+
+	da_free(video->scale_groups);
+
 	for (size_t i = 0; i < video->info.cache_size; i++)
 		video_frame_free((struct video_frame *)&video->cache[i]);
 
 	os_sem_destroy(video->update_semaphore);
-	pthread_mutex_destroy(&video->data_mutex);
 	pthread_mutex_destroy(&video->input_mutex);
 	bfree(video);
 }
@@ -288,7 +677,7 @@ static size_t video_get_input_idx(const video_t *video,
 				  void *param)
 {
 	for (size_t i = 0; i < video->inputs.num; i++) {
-		struct video_input *input = video->inputs.array + i;
+		struct video_input *input = video->inputs.array[i];
 		if (input->callback == callback && input->param == param)
 			return i;
 	}
@@ -302,32 +691,8 @@ static inline bool video_input_init(struct video_input *input,
 	if (input->conversion.width != video->info.width ||
 	    input->conversion.height != video->info.height ||
 	    input->conversion.format != video->info.format) {
-		struct video_scale_info from = {.format = video->info.format,
-						.width = video->info.width,
-						.height = video->info.height,
-						.range = video->info.range,
-						.colorspace =
-							video->info.colorspace};
-
-		int ret = video_scaler_create(&input->scaler,
-					      &input->conversion, &from,
-					      VIDEO_SCALE_FAST_BILINEAR);
-		if (ret != VIDEO_SCALER_SUCCESS) {
-			if (ret == VIDEO_SCALER_BAD_CONVERSION)
-				blog(LOG_ERROR, "video_input_init: Bad "
-						"scale conversion type");
-			else
-				blog(LOG_ERROR, "video_input_init: Failed to "
-						"create scaler");
-
-			return false;
-		}
-
-		for (size_t i = 0; i < MAX_CONVERT_BUFFERS; i++)
-			video_frame_init(&input->frame[i],
-					 input->conversion.format,
-					 input->conversion.width,
-					 input->conversion.height);
+		input->group = scale_group_acquire(video, &input->conversion);
+		return input->group != NULL;
 	}
 
 	return true;
@@ -337,11 +702,15 @@ static inline void reset_frames(video_t *video)
 {
 	os_atomic_set_long(&video->skipped_frames, 0);
 	os_atomic_set_long(&video->total_frames, 0);
+	os_atomic_set_long(&video->ring_full, 0);
+	os_atomic_set_long(&video->cas_retries, 0);
 }
 
-bool video_output_connect(
-	video_t *video, const struct video_scale_info *conversion,
-	void (*callback)(void *param, struct video_data *frame), void *param)
+static bool
+connect_input(video_t *video, const struct video_scale_info *conversion,
+	      bool threaded,
+	      void (*callback)(void *param, struct video_data *frame),
+	      void (*skip_callback)(void *param, uint32_t frames), void *param)
 {
 	bool success = false;
 
@@ -351,26 +720,30 @@ bool video_output_connect(
 	pthread_mutex_lock(&video->input_mutex);
 
 	if (video_get_input_idx(video, callback, param) == DARRAY_INVALID) {
-		struct video_input input;
-		memset(&input, 0, sizeof(input));
+		struct video_input *input = bzalloc(sizeof(*input));
 
-		input.callback = callback;
-		input.param = param;
+		input->video = video;
+		input->callback = callback;
+		input->skip_callback = skip_callback;
+		input->param = param;
 
 		if (conversion) {
-			input.conversion = *conversion;
+			input->conversion = *conversion;
 		} else {
-			input.conversion.format = video->info.format;
-			input.conversion.width = video->info.width;
-			input.conversion.height = video->info.height;
+			input->conversion.format = video->info.format;
+			input->conversion.width = video->info.width;
+			input->conversion.height = video->info.height;
 		}
 
-		if (input.conversion.width == 0)
-			input.conversion.width = video->info.width;
-		if (input.conversion.height == 0)
-			input.conversion.height = video->info.height;
+		if (input->conversion.width == 0)
+			input->conversion.width = video->info.width;
+		if (input->conversion.height == 0)
+			input->conversion.height = video->info.height;
+
+		success = video_input_init(input, video);
+		if (success && threaded)
+			success = start_input_thread(video, input);
 
-		success = video_input_init(&input, video);
 		if (success) {
 			if (video->inputs.num == 0) {
 				if (!os_atomic_load_long(&video->gpu_refs)) {
@@ -379,6 +752,8 @@ bool video_output_connect(
 				os_atomic_set_bool(&video->raw_active, true);
 			}
 			da_push_back(video->inputs, &input);
+		} else {
+			video_input_free(video, input);
 		}
 	}
 
@@ -387,6 +762,22 @@ bool video_output_connect(
 	return success;
 }
 
+bool video_output_connect(
+	video_t *video, const struct video_scale_info *conversion,
+	void (*callback)(void *param, struct video_data *frame), void *param)
+{
+	return connect_input(video, conversion, false, callback, NULL, param);
+}
+
+bool video_output_connect_threaded(
+	video_t *video, const struct video_scale_info *conversion,
+	void (*callback)(void *param, struct video_data *frame),
+	void (*skip_callback)(void *param, uint32_t frames), void *param)
+{
+	return connect_input(video, conversion, true, callback, skip_callback,
+			     param);
+}
+
 static void log_skipped(video_t *video)
 {
 	long skipped = os_atomic_load_long(&video->skipped_frames);
@@ -402,6 +793,14 @@ static void log_skipped(video_t *video)
 		     "%ld/%ld (%0.1f%%)",
 		     video->skipped_frames, video->total_frames,
 		     percentage_skipped);
+
+	long ring_full = os_atomic_load_long(&video->ring_full);
+	long cas_retries = os_atomic_load_long(&video->cas_retries);
+	if (ring_full || cas_retries)
+		blog(LOG_INFO,
+		     "Video frame cache was full %ld times, "
+		     "%ld contended slot updates",
+		     ring_full, cas_retries);
 }
 
 void video_output_disconnect(video_t *video,
@@ -412,11 +811,13 @@ void video_output_disconnect(video_t *video,
 	if (!video || !callback)
 		return;
 
+	struct video_input *input = NULL;
+
 	pthread_mutex_lock(&video->input_mutex);
 
 	size_t idx = video_get_input_idx(video, callback, param);
 	if (idx != DARRAY_INVALID) {
-		video_input_free(video->inputs.array + idx);
+		input = video->inputs.array[idx];
 		da_erase(video->inputs, idx);
 
 		if (video->inputs.num == 0) {
@@ -428,6 +829,11 @@ void video_output_disconnect(video_t *video,
 	}
 
 	pthread_mutex_unlock(&video->input_mutex);
+
+	/* outside of the lock, the input thread may still be in the callback
+	 * and the other inputs shouldn't have to wait for it */
+	if (input)
+		video_input_free(video, input);
 }
 
 bool video_output_active(const video_t *video)
@@ -442,41 +848,78 @@ const struct video_output_info *video_output_get_info(const video_t *video)
 	return video ? &video->info : NULL;
 }
 
+static size_t find_free_slot(struct video_output *video)
+{
+	/* round robin, so every slot gets reused equally often */
+	for (size_t i = 1; i <= video->info.cache_size; i++) {
+		size_t slot = (video->last_slot + i) % video->info.cache_size;
+		if (slot_free(&video->cache[slot]))
+			return slot;
+	}
+
+	return DARRAY_INVALID;
+}
+
+/* publishes the slot to the video thread */
+static void queue_slot(struct video_output *video, size_t slot)
+{
+	long tail = os_atomic_load_long(&video->tail);
+	video->queued[(unsigned long)tail % video->info.cache_size] = slot;
+	video->last_slot = slot;
+	os_atomic_inc_long(&video->tail);
+	os_sem_post(video->update_semaphore);
+}
+
 bool video_output_lock_frame(video_t *video, struct video_frame *frame,
 			     int count, uint64_t timestamp)
 {
 	struct cached_frame_info *cfi;
-	bool locked;
 
 	if (!video)
 		return false;
 
-	pthread_mutex_lock(&video->data_mutex);
-
-	if (video->available_frames == 0) {
-		video->cache[video->last_added].count += count;
-		video->cache[video->last_added].skipped += count;
-		locked = false;
-
-	} else {
-		if (video->available_frames != video->info.cache_size) {
-			if (++video->last_added == video->info.cache_size)
-				video->last_added = 0;
+	for (;;) {
+		long tail = os_atomic_load_long(&video->tail);
+		long head = os_atomic_load_long(&video->head);
+		unsigned long queued = (unsigned long)tail - (unsigned long)head;
+		bool ring_full = queued >= video->info.cache_size;
+
+		size_t slot = ring_full ? DARRAY_INVALID : find_free_slot(video);
+		if (slot != DARRAY_INVALID) {
+			cfi = &video->cache[slot];
+			cfi->frame.timestamp = timestamp;
+			cfi->seq = ++video->fill_seq;
+			os_atomic_set_long(&cfi->count, count);
+			video->locked_slot = slot;
+
+			memcpy(frame, &cfi->frame, sizeof(*frame));
+			return true;
 		}
 
-		cfi = &video->cache[video->last_added];
-		cfi->frame.timestamp = timestamp;
-		cfi->count = count;
-		cfi->skipped = 0;
+		/* no free slot, output the newest queued frame again.  if the
+		 * video thread finished it in the meantime and the other
+		 * slots are still used by input threads, queue it once more.
+		 * slots are only filled by this thread, so its contents are
+		 * still intact.  repeats are counted as skipped right here,
+		 * once they're certain to be output, as counting them per
+		 * pass would race the video thread completing the slot. */
+		cfi = &video->cache[video->last_slot];
+		if (add_if_pending(video, &cfi->count, count)) {
+			add_long(video, &video->skipped_frames, count);
+			os_atomic_inc_long(&video->ring_full);
+			return false;
+		}
 
-		memcpy(frame, &cfi->frame, sizeof(*frame));
+		if (!ring_full) {
+			add_long(video, &video->skipped_frames, count);
+			os_atomic_set_long(&cfi->count, count);
+			queue_slot(video, video->last_slot);
+			os_atomic_inc_long(&video->ring_full);
+			return false;
+		}
 
-		locked = true;
+		/* the video thread is about to advance, try again */
 	}
-
-	pthread_mutex_unlock(&video->data_mutex);
-
-	return locked;
 }
 
 void video_output_unlock_frame(video_t *video)
@@ -484,12 +927,7 @@ void video_output_unlock_frame(video_t *video)
 	if (!video)
 		return;
 
-	pthread_mutex_lock(&video->data_mutex);
-
-	video->available_frames--;
-	os_sem_post(video->update_semaphore);
-
-	pthread_mutex_unlock(&video->data_mutex);
+	queue_slot(video, video->locked_slot);
 }
 
 uint64_t video_output_get_frame_time(const video_t *video)
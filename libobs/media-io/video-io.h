@@ -236,6 +236,21 @@ EXPORT bool
 video_output_connect(video_t *video, const struct video_scale_info *conversion,
 		     void (*callback)(void *param, struct video_data *frame),
 		     void *param);
+
+/**
+ * Like video_output_connect, but the callback runs on a thread of its own, so
+ * slow consumers like encoders don't hold up each other or the video thread.
+ * Frames are queued to that thread, if it falls too far behind, frames are
+ * skipped for it alone.  skip_callback, if not NULL, is called on that thread
+ * with the number of frames skipped right before the frame that follows them,
+ * so the consumer can keep its timeline in step with the other outputs.
+ * The input may be disconnected from within its own callback, e.g. when an
+ * encoder fails; it then stops and cleans up once the callback returns.
+ */
+EXPORT bool video_output_connect_threaded(
+	video_t *video, const struct video_scale_info *conversion,
+	void (*callback)(void *param, struct video_data *frame),
+	void (*skip_callback)(void *param, uint32_t frames), void *param);
 EXPORT void video_output_disconnect(video_t *video,
 				    void (*callback)(void *param,
 						     struct video_data *frame),
@@ -16,6 +16,7 @@
 ******************************************************************************/
 
 #include <inttypes.h>
+#include "media-io/audio-math.h"
 #include "obs-internal.h"
 
 struct ts_info {
@@ -25,18 +26,51 @@ struct ts_info {
 
 #define DEBUG_AUDIO 0
 #define MAX_BUFFERING_TICKS 45
+#define BUFFERING_SHRINK_WINDOW 10000000000ULL /* 10 seconds */
 
+/* adds the source to this tick's render order once, returns its index */
+static size_t list_audio_source(struct obs_core_audio *audio,
+				obs_source_t *source)
+{
+	if (source->audio_render_tick == audio->render_tick)
+		return source->audio_render_idx;
+
+	obs_source_t *s = obs_source_get_ref(source);
+	if (!s)
+		return DARRAY_INVALID;
+
+	size_t level = 0;
+	source->audio_render_tick = audio->render_tick;
+	source->audio_render_idx = audio->render_order.num;
+	da_push_back(audio->render_order, &s);
+	da_push_back(audio->render_levels, &level);
+	return source->audio_render_idx;
+}
+
+/* a source's level is one above the highest of the sources it mixes, so all
+ * sources of a level are independent of each other.  the tree is enumerated
+ * children first, so the child's level is final by the time it's mixed into
+ * the parent. */
 static void push_audio_tree(obs_source_t *parent, obs_source_t *source, void *p)
 {
 	struct obs_core_audio *audio = p;
+	size_t child = list_audio_source(audio, source);
 
-	if (da_find(audio->render_order, &source, 0) == DARRAY_INVALID) {
-		obs_source_t *s = obs_source_get_ref(source);
-		if (s)
-			da_push_back(audio->render_order, &s);
-	}
+	if (!parent || child == DARRAY_INVALID)
+		return;
+
+	struct audio_tree_edge edge = {list_audio_source(audio, parent), child};
+	if (edge.parent == DARRAY_INVALID)
+		return;
 
-	UNUSED_PARAMETER(parent);
+	da_push_back(audio->render_edges, &edge);
+
+	size_t level = audio->render_levels.array[child] + 1;
+	if (audio->render_levels.array[edge.parent] < level) {
+		audio->render_levels.array[edge.parent] = level;
+		if (audio->top_render_level < level)
+			audio->top_render_level = level;
+	}
 }
 
 static inline size_t convert_time_to_frames(size_t sample_rate, uint64_t t)
@@ -46,7 +80,8 @@ static inline size_t convert_time_to_frames(size_t sample_rate, uint64_t t)
 
 static inline void mix_audio(struct audio_output_data *mixes,
 			     obs_source_t *source, size_t channels,
-			     size_t sample_rate, struct ts_info *ts)
+			     size_t sample_rate, struct ts_info *ts,
+			     uint32_t mixers)
 {
 	size_t total_floats = AUDIO_OUTPUT_FRAMES;
 	size_t start_point = 0;
@@ -63,18 +98,19 @@ static inline void mix_audio(struct audio_output_data *mixes,
 		total_floats -= start_point;
 	}
 
+	/* the source's output buffers of mixes it isn't assigned to, or that
+	 * have no outputs, are silent */
+	mixers &= source->audio_mixers;
+
 	for (size_t mix_idx = 0; mix_idx < MAX_AUDIO_MIXES; mix_idx++) {
-		for (size_t ch = 0; ch < channels; ch++) {
-			register float *mix = mixes[mix_idx].data[ch];
-			register float *aud =
-				source->audio_output_buf[mix_idx][ch];
-			register float *end;
+		if ((mixers & (1 << mix_idx)) == 0)
+			continue;
 
-			mix += start_point;
-			end = aud + total_floats;
+		for (size_t ch = 0; ch < channels; ch++) {
+			float *mix = mixes[mix_idx].data[ch];
+			float *aud = source->audio_output_buf[mix_idx][ch];
 
-			while (aud < end)
-				*(mix++) += *(aud++);
+			mix_audio_plane(mix + start_point, aud, total_floats);
 		}
 	}
 }
@@ -251,6 +287,7 @@ static void add_audio_buffering(struct obs_core_audio *audio,
 	ticks = (int)((frames + AUDIO_OUTPUT_FRAMES - 1) / AUDIO_OUTPUT_FRAMES);
 
 	audio->total_buffering_ticks += ticks;
+	audio->slack_window_start = 0;
 
 	if (audio->total_buffering_ticks >= MAX_BUFFERING_TICKS) {
 		ticks -= audio->total_buffering_ticks - MAX_BUFFERING_TICKS;
@@ -373,6 +410,194 @@ static inline const char *calc_min_ts(struct obs_core_data *data,
 	return buffering_name;
 }
 
+/* push_audio_tree already leveled every edge as it came in.  that only goes
+ * wrong if a source gained children after it was mixed into a parent, which
+ * takes a scene changing between two enumerations of the same tick, so this
+ * normally finds nothing to fix in its single pass */
+static void fix_render_levels(struct obs_core_audio *audio)
+{
+	size_t *levels = audio->render_levels.array;
+	bool changed = true;
+
+	while (changed) {
+		changed = false;
+
+		for (size_t i = 0; i < audio->render_edges.num; i++) {
+			struct audio_tree_edge *edge =
+				audio->render_edges.array + i;
+			size_t level = levels[edge->child] + 1;
+
+			if (levels[edge->parent] < level) {
+				levels[edge->parent] = level;
+				if (audio->top_render_level < level)
+					audio->top_render_level = level;
+				changed = true;
+			}
+		}
+	}
+}
+
+/* sorts the render order by level, counting sort since levels are few */
+static void sort_render_levels(struct obs_core_audio *audio)
+{
+	size_t num_levels = audio->top_render_level + 1;
+	size_t *starts;
+
+	da_resize(audio->level_starts, num_levels + 1);
+	starts = audio->level_starts.array;
+	memset(starts, 0, sizeof(size_t) * (num_levels + 1));
+
+	for (size_t i = 0; i < audio->render_levels.num; i++)
+		starts[audio->render_levels.array[i] + 1]++;
+	for (size_t level = 0; level < num_levels; level++)
+		starts[level + 1] += starts[level];
+
+	da_resize(audio->render_batch, audio->render_order.num);
+	for (size_t i = 0; i < audio->render_order.num; i++) {
+		size_t level = audio->render_levels.array[i];
+		audio->render_batch.array[starts[level]++] =
+			audio->render_order.array[i];
+	}
+
+	/* the placement moved every start to the next level's start */
+	memmove(starts + 1, starts, sizeof(size_t) * num_levels);
+	starts[0] = 0;
+}
+
+struct render_audio_params {
+	obs_source_t **sources;
+	uint32_t mixers;
+	size_t channels;
+	size_t sample_rate;
+	size_t size;
+};
+
+static void render_audio_task(void *param, size_t idx)
+{
+	struct render_audio_params *params = param;
+	obs_source_audio_render(params->sources[idx], params->mixers,
+				params->channels, params->sample_rate,
+				params->size);
+}
+
+static const char *render_audio_sources_name = "render_audio_sources";
+
+static void render_audio_sources(struct obs_core_audio *audio,
+				 uint32_t mixers, size_t channels,
+				 size_t sample_rate, size_t size)
+{
+	fix_render_levels(audio);
+	sort_render_levels(audio);
+
+	profile_start(render_audio_sources_name);
+
+	for (size_t level = 0; level <= audio->top_render_level; level++) {
+		size_t begin = audio->level_starts.array[level];
+		size_t end = audio->level_starts.array[level + 1];
+
+		struct render_audio_params params = {
+			audio->render_batch.array + begin, mixers, channels,
+			sample_rate, size};
+
+		task_scheduler_run(obs->task_scheduler,
+				   render_audio_sources_name, end - begin,
+				   render_audio_task, &params);
+	}
+
+	profile_end(render_audio_sources_name);
+}
+
+/* how far the source's buffered audio reaches past the current mix */
+static inline int64_t source_audio_slack(struct obs_source *source,
+					 size_t sample_rate,
+					 const struct ts_info *ts)
+{
+	if (source->audio_pending)
+		return 0;
+
+	size_t frames = source->audio_input_buf[0].size / sizeof(float);
+	uint64_t end = source->audio_ts + audio_frames_to_ns(sample_rate,
+							      frames);
+	return (int64_t)(end - ts->end);
+}
+
+static void discard_audio_sources(struct obs_core_audio *audio,
+				  size_t channels, size_t sample_rate,
+				  struct ts_info *ts, int64_t *min_slack)
+{
+	struct obs_core_data *data = &obs->data;
+	struct obs_source *source;
+
+	pthread_mutex_lock(&data->audio_sources_mutex);
+
+	source = data->first_audio_source;
+	while (source) {
+		pthread_mutex_lock(&source->audio_buf_mutex);
+
+		if (source->audio_ts && !source->info.audio_render) {
+			int64_t slack =
+				source_audio_slack(source, sample_rate, ts);
+			if (slack < *min_slack)
+				*min_slack = slack;
+		}
+
+		discard_audio(audio, source, channels, sample_rate, ts);
+		pthread_mutex_unlock(&source->audio_buf_mutex);
+
+		source = (struct obs_source *)source->next_audio_source;
+	}
+
+	pthread_mutex_unlock(&data->audio_sources_mutex);
+}
+
+/* gives up a tick of buffering if every source stayed at least a tick ahead
+ * of the mix for the whole window.  rather than skipping a tick, which would
+ * leave a gap in the output and shift audio against video in encoders that
+ * count samples, the next buffered tick is output right away, so timestamps
+ * stay continuous and no source audio is lost. */
+static void update_audio_buffering(struct obs_core_audio *audio,
+				   size_t sample_rate, const struct ts_info *ts,
+				   int64_t min_slack)
+{
+	uint64_t tick_ns = audio_frames_to_ns(sample_rate, AUDIO_OUTPUT_FRAMES);
+
+	if (!audio->total_buffering_ticks || audio->buffering_wait_ticks) {
+		audio->slack_window_start = 0;
+		return;
+	}
+
+	if (!audio->slack_window_start) {
+		audio->slack_window_start = ts->start;
+		audio->slack_window_min = min_slack;
+		return;
+	}
+
+	if (min_slack < audio->slack_window_min)
+		audio->slack_window_min = min_slack;
+
+	if (ts->start - audio->slack_window_start < BUFFERING_SHRINK_WINDOW)
+		return;
+
+	if (audio->slack_window_min < (int64_t)tick_ns) {
+		audio->slack_window_start = 0;
+		return;
+	}
+
+	if (audio->buffered_timestamps.size < sizeof(struct ts_info))
+		return;
+
+	audio_output_catch_up(audio->audio);
+
+	audio->total_buffering_ticks--;
+	audio->slack_window_start = 0;
+
+	blog(LOG_INFO,
+	     "removing %d milliseconds of audio buffering, total "
+	     "audio buffering is now %d milliseconds",
+	     (int)(tick_ns / 1000000),
+	     (int)(audio->total_buffering_ticks * tick_ns / 1000000));
+}
+
 static inline void release_audio_sources(struct obs_core_audio *audio)
 {
 	for (size_t i = 0; i < audio->render_order.num; i++)
@@ -394,8 +619,19 @@ bool audio_callback(void *param, uint64_t start_ts_in, uint64_t end_ts_in,
 
 	da_resize(audio->render_order, 0);
 	da_resize(audio->root_nodes, 0);
+	da_resize(audio->render_edges, 0);
+	da_resize(audio->render_levels, 0);
+	audio->top_render_level = 0;
+	audio->render_tick++;
+
+	/* an empty range is a catch up tick, which only outputs what was
+	 * already buffered */
+	if (start_ts_in != end_ts_in)
+		circlebuf_push_back(&audio->buffered_timestamps, &ts,
+				    sizeof(ts));
+	else if (!audio->buffered_timestamps.size)
+		return false;
 
-	circlebuf_push_back(&audio->buffered_timestamps, &ts, sizeof(ts));
 	circlebuf_peek_front(&audio->buffered_timestamps, &ts, sizeof(ts));
 	min_ts = ts.start;
 
@@ -430,12 +666,10 @@ bool audio_callback(void *param, uint64_t start_ts_in, uint64_t end_ts_in,
 	pthread_mutex_unlock(&data->audio_sources_mutex);
 
 	/* ------------------------------------------------ */
-	/* render audio data */
-	for (size_t i = 0; i < audio->render_order.num; i++) {
-		obs_source_t *source = audio->render_order.array[i];
-		obs_source_audio_render(source, mixers, channels, sample_rate,
-					audio_size);
-	}
+	/* render audio data, sources that don't mix each other in parallel.
+	 * mixing below still goes in root order, so the output doesn't
+	 * depend on which thread rendered what */
+	render_audio_sources(audio, mixers, channels, sample_rate, audio_size);
 
 	/* ------------------------------------------------ */
 	/* get minimum audio timestamp */
@@ -462,7 +696,7 @@ bool audio_callback(void *param, uint64_t start_ts_in, uint64_t end_ts_in,
 
 			if (source->audio_output_buf[0][0] && source->audio_ts)
 				mix_audio(mixes, source, channels, sample_rate,
-					  &ts);
+					  &ts, mixers);
 
 			pthread_mutex_unlock(&source->audio_buf_mutex);
 		}
@@ -470,18 +704,8 @@ bool audio_callback(void *param, uint64_t start_ts_in, uint64_t end_ts_in,
 
 	/* ------------------------------------------------ */
 	/* discard audio */
-	pthread_mutex_lock(&data->audio_sources_mutex);
-
-	source = data->first_audio_source;
-	while (source) {
-		pthread_mutex_lock(&source->audio_buf_mutex);
-		discard_audio(audio, source, channels, sample_rate, &ts);
-		pthread_mutex_unlock(&source->audio_buf_mutex);
-
-		source = (struct obs_source *)source->next_audio_source;
-	}
-
-	pthread_mutex_unlock(&data->audio_sources_mutex);
+	int64_t min_slack = INT64_MAX;
+	discard_audio_sources(audio, channels, sample_rate, &ts, &min_slack);
 
 	/* ------------------------------------------------ */
 	/* release audio sources */
@@ -489,6 +713,8 @@ bool audio_callback(void *param, uint64_t start_ts_in, uint64_t end_ts_in,
 
 	circlebuf_pop_front(&audio->buffered_timestamps, NULL, sizeof(ts));
 
+	update_audio_buffering(audio, sample_rate, &ts, min_slack);
+
 	*out_ts = ts.start;
 
 	if (audio->buffering_wait_ticks) {
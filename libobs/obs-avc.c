@@ -15,7 +15,7 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 ******************************************************************************/
 
-#include "obs.h"
+#include "obs-internal.h"
 #include "obs-avc.h"
 #include "util/array-serializer.h"
 
@@ -133,19 +133,21 @@ static void serialize_avc_data(struct serializer *s, const uint8_t *data,
 void obs_parse_avc_packet(struct encoder_packet *avc_packet,
 			  const struct encoder_packet *src)
 {
-	struct array_output_data output;
+	struct buffer_output_data output;
 	struct serializer s;
-	long ref = 1;
 
-	array_output_serializer_init(&s, &output);
+	/* every start code of at least 3 bytes becomes a 4 byte size, and
+	 * every NAL takes at least 4 bytes with its start code */
+	size_t max_size = src->size + src->size / 4 + 4;
+
 	*avc_packet = *src;
+	obs_encoder_packet_alloc_data(avc_packet, max_size);
 
-	serialize(&s, &ref, sizeof(ref));
+	buffer_output_serializer_init(&s, &output, avc_packet->data, max_size);
 	serialize_avc_data(&s, src->data, src->size, &avc_packet->keyframe,
 			   &avc_packet->priority);
 
-	avc_packet->data = output.bytes.array + sizeof(ref);
-	avc_packet->size = output.bytes.num - sizeof(ref);
+	avc_packet->size = output.pos;
 	avc_packet->drop_priority = get_drop_priority(avc_packet->priority);
 }
 
@@ -141,6 +141,7 @@ obs_encoder_t *obs_audio_encoder_create(const char *id, const char *name,
 }
 
 static void receive_video(void *param, struct video_data *frame);
+static void skip_video(void *param, uint32_t frames);
 static void receive_audio(void *param, size_t mix_idx, struct audio_data *data);
 
 static inline void get_audio_info(const struct obs_encoder *encoder,
@@ -209,6 +210,12 @@ static void add_connection(struct obs_encoder *encoder)
 
 		if (gpu_encode_available(encoder)) {
 			start_gpu_encode(encoder);
+		} else if (encoder->info.caps &
+			   OBS_ENCODER_CAP_THREADED_VIDEO) {
+			encoder->skipped_video_frames = 0;
+			start_raw_video_threaded(encoder->media, &info,
+						 receive_video, skip_video,
+						 encoder);
 		} else {
 			start_raw_video(encoder->media, &info, receive_video,
 					encoder);
@@ -855,7 +862,6 @@ static void send_first_video_packet(struct obs_encoder *encoder,
 				    struct encoder_packet *packet)
 {
 	struct encoder_packet first_packet;
-	DARRAY(uint8_t) data;
 	uint8_t *sei;
 	size_t size;
 
@@ -863,25 +869,21 @@ static void send_first_video_packet(struct obs_encoder *encoder,
 	if (!packet->keyframe)
 		return;
 
-	da_init(data);
-
 	if (!get_sei(encoder, &sei, &size) || !sei || !size) {
 		cb->new_packet(cb->param, packet);
 		cb->sent_first_packet = true;
 		return;
 	}
 
-	da_push_back_array(data, sei, size);
-	da_push_back_array(data, packet->data, packet->size);
-
 	first_packet = *packet;
-	first_packet.data = data.array;
-	first_packet.size = data.num;
+	obs_encoder_packet_alloc_data(&first_packet, size + packet->size);
+	memcpy(first_packet.data, sei, size);
+	memcpy(first_packet.data + size, packet->data, packet->size);
 
 	cb->new_packet(cb->param, &first_packet);
 	cb->sent_first_packet = true;
 
-	da_free(data);
+	obs_encoder_packet_release(&first_packet);
 }
 
 static inline void send_packet(struct obs_encoder *encoder,
@@ -921,7 +923,18 @@ void full_stop(struct obs_encoder *encoder)
 void send_off_encoder_packet(obs_encoder_t *encoder, bool success,
 			     bool received, struct encoder_packet *pkt)
 {
+	struct encoder_packet out = {0};
+	struct encoder_packet pooled = {.data = encoder->packet_data};
+
+	/* the packet is handed to the outputs by reference, take over the
+	 * data if the encoder wrote it into a pooled buffer, copy it into one
+	 * otherwise.  the pooled buffer is only released after that copy, as
+	 * pkt->data may still point somewhere into it */
+	encoder->packet_data = NULL;
+
 	if (!success) {
+		obs_encoder_packet_release(&pooled);
+
 		blog(LOG_ERROR, "Error encoding with encoder '%s'",
 		     encoder->context.name);
 		full_stop(encoder);
@@ -944,15 +957,26 @@ void send_off_encoder_packet(obs_encoder_t *encoder, bool success,
 		pkt->sys_dts_usec += encoder->pause.ts_offset / 1000;
 		pthread_mutex_unlock(&encoder->pause.mutex);
 
+		if (pooled.data && pooled.data == pkt->data) {
+			out = *pkt;
+		} else {
+			obs_encoder_packet_create_instance(&out, pkt);
+			obs_encoder_packet_release(&pooled);
+		}
+
 		pthread_mutex_lock(&encoder->callbacks_mutex);
 
 		for (size_t i = encoder->callbacks.num; i > 0; i--) {
 			struct encoder_callback *cb;
 			cb = encoder->callbacks.array + (i - 1);
-			send_packet(encoder, cb, pkt);
+			send_packet(encoder, cb, &out);
 		}
 
 		pthread_mutex_unlock(&encoder->callbacks_mutex);
+
+		obs_encoder_packet_release(&out);
+	} else {
+		obs_encoder_packet_release(&pooled);
 	}
 }
 
@@ -1022,6 +1046,9 @@ static void receive_video(void *param, struct video_data *frame)
 	struct obs_encoder *encoder = param;
 	struct obs_encoder *pair = encoder->paired_encoder;
 	struct encoder_frame enc_frame;
+	uint32_t skipped = encoder->skipped_video_frames;
+
+	encoder->skipped_video_frames = 0;
 
 	if (!encoder->first_received && pair) {
 		if (!pair->first_received ||
@@ -1040,8 +1067,12 @@ static void receive_video(void *param, struct video_data *frame)
 		enc_frame.linesize[i] = frame->linesize[i];
 	}
 
+	/* frames skipped by a threaded input still take up time, otherwise
+	 * video would fall behind audio */
 	if (!encoder->start_ts)
 		encoder->start_ts = frame->timestamp;
+	else
+		encoder->cur_pts += (int64_t)skipped * encoder->timebase_num;
 
 	enc_frame.frames = 1;
 	enc_frame.pts = encoder->cur_pts;
@@ -1053,6 +1084,13 @@ wait_for_audio:
 	profile_end(receive_video_name);
 }
 
+/* called on the encoder's input thread right before receive_video */
+static void skip_video(void *param, uint32_t frames)
+{
+	struct obs_encoder *encoder = param;
+	encoder->skipped_video_frames += frames;
+}
+
 static void clear_audio(struct obs_encoder *encoder)
 {
 	for (size_t i = 0; i < encoder->planes; i++)
@@ -1308,16 +1346,188 @@ void obs_encoder_remove_output(struct obs_encoder *encoder,
 	pthread_mutex_unlock(&encoder->outputs_mutex);
 }
 
+/* ------------------------------------------------------------------------- */
+/* packet buffers
+ *
+ *   Packet data is preceded by a header with its reference count and by
+ * OBS_ENCODER_PACKET_HEADROOM bytes in which muxers can put their container
+ * headers.  Released buffers of up to 4 MiB are kept in a pool by power of
+ * two size, so that steady streams stop allocating altogether. */
+
+#define PACKET_POOL_MIN_SHIFT 10
+#define PACKET_POOL_MAX_BYTES (8 * 1024 * 1024)
+#define PACKET_POOL_MIN_FREE 4
+#define PACKET_POOL_MAX_FREE 64
+#define PACKET_NOT_POOLED -1
+
+struct encoder_packet_buffer {
+	struct encoder_packet_buffer *next; /* while in the pool */
+	size_t capacity;
+	int size_class;
+	volatile long refs;
+};
+
+static inline struct encoder_packet_buffer *get_packet_buffer(uint8_t *data)
+{
+	return (struct encoder_packet_buffer *)(data -
+						OBS_ENCODER_PACKET_HEADROOM) -
+	       1;
+}
+
+static inline uint8_t *get_packet_data(struct encoder_packet_buffer *buf)
+{
+	return (uint8_t *)(buf + 1) + OBS_ENCODER_PACKET_HEADROOM;
+}
+
+static inline bool packet_pool_valid(void)
+{
+	return obs && obs->data.valid;
+}
+
+static inline size_t max_free_packet_buffers(size_t capacity)
+{
+	size_t max = PACKET_POOL_MAX_BYTES / capacity;
+	if (max < PACKET_POOL_MIN_FREE)
+		return PACKET_POOL_MIN_FREE;
+	if (max > PACKET_POOL_MAX_FREE)
+		return PACKET_POOL_MAX_FREE;
+	return max;
+}
+
+static struct encoder_packet_buffer *alloc_packet_buffer(size_t size)
+{
+	struct obs_core_data *data = &obs->data;
+	struct encoder_packet_buffer *buf = NULL;
+	size_t capacity = size + OBS_ENCODER_PACKET_TAILROOM;
+	int size_class = 0;
+
+	while (size_class < ENCODER_PACKET_POOL_CLASSES &&
+	       ((size_t)1 << (size_class + PACKET_POOL_MIN_SHIFT)) < capacity)
+		size_class++;
+
+	if (size_class == ENCODER_PACKET_POOL_CLASSES)
+		size_class = PACKET_NOT_POOLED;
+	else
+		capacity = (size_t)1 << (size_class + PACKET_POOL_MIN_SHIFT);
+
+	if (size_class != PACKET_NOT_POOLED && packet_pool_valid()) {
+		pthread_mutex_lock(&data->packet_pool_mutex);
+		buf = data->packet_pool[size_class];
+		if (buf) {
+			data->packet_pool[size_class] = buf->next;
+			data->packet_pool_free[size_class]--;
+		}
+		pthread_mutex_unlock(&data->packet_pool_mutex);
+	}
+
+	if (!buf) {
+		buf = bmalloc(sizeof(*buf) + OBS_ENCODER_PACKET_HEADROOM +
+			      capacity);
+		buf->capacity = capacity;
+		buf->size_class = size_class;
+	}
+
+	buf->next = NULL;
+	buf->refs = 1;
+	return buf;
+}
+
+static void free_packet_buffer(struct encoder_packet_buffer *buf)
+{
+	struct obs_core_data *data = &obs->data;
+	int size_class = buf->size_class;
+
+	if (size_class != PACKET_NOT_POOLED && packet_pool_valid()) {
+		size_t max = max_free_packet_buffers(buf->capacity);
+
+		pthread_mutex_lock(&data->packet_pool_mutex);
+		if (data->packet_pool_free[size_class] < max) {
+			buf->next = data->packet_pool[size_class];
+			data->packet_pool[size_class] = buf;
+			data->packet_pool_free[size_class]++;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&data->packet_pool_mutex);
+	}
+
+	bfree(buf);
+}
+
+void obs_free_encoder_packet_pool(void)
+{
+	struct obs_core_data *data = &obs->data;
+
+	for (size_t i = 0; i < ENCODER_PACKET_POOL_CLASSES; i++) {
+		struct encoder_packet_buffer *buf = data->packet_pool[i];
+		while (buf) {
+			struct encoder_packet_buffer *next = buf->next;
+			bfree(buf);
+			buf = next;
+		}
+
+		data->packet_pool[i] = NULL;
+		data->packet_pool_free[i] = 0;
+	}
+
+	pthread_mutex_destroy(&data->packet_pool_mutex);
+}
+
+uint8_t *obs_encoder_packet_alloc_data(struct encoder_packet *packet,
+				       size_t size)
+{
+	struct encoder_packet_buffer *buf = alloc_packet_buffer(size);
+
+	packet->data = get_packet_data(buf);
+	packet->size = size;
+	return packet->data;
+}
+
+uint8_t *obs_encoder_alloc_packet(obs_encoder_t *encoder,
+				  struct encoder_packet *packet, size_t size)
+{
+	if (!obs_encoder_valid(encoder, "obs_encoder_alloc_packet"))
+		return NULL;
+	if (!obs_ptr_valid(packet, "obs_encoder_alloc_packet"))
+		return NULL;
+
+	/* only the last buffer is kept if called more than once */
+	if (encoder->packet_data) {
+		struct encoder_packet old = {.data = encoder->packet_data};
+		obs_encoder_packet_release(&old);
+	}
+
+	encoder->packet_data = obs_encoder_packet_alloc_data(packet, size);
+	return packet->data;
+}
+
+uint8_t *obs_encoder_packet_get_headroom(struct encoder_packet *packet,
+					 size_t head_size, size_t tail_size)
+{
+	struct encoder_packet_buffer *buf;
+
+	if (!packet || !packet->data)
+		return NULL;
+	if (head_size > OBS_ENCODER_PACKET_HEADROOM)
+		return NULL;
+
+	buf = get_packet_buffer(packet->data);
+	if (packet->size + tail_size > buf->capacity)
+		return NULL;
+
+	/* with other references, someone else might be using the room */
+	if (os_atomic_load_long(&buf->refs) != 1)
+		return NULL;
+
+	return packet->data - head_size;
+}
+
 void obs_encoder_packet_create_instance(struct encoder_packet *dst,
 					const struct encoder_packet *src)
 {
-	long *p_refs;
-
 	*dst = *src;
-	p_refs = bmalloc(src->size + sizeof(long));
-	dst->data = (void *)(p_refs + 1);
-	*p_refs = 1;
-	memcpy(dst->data, src->data, src->size);
+	obs_encoder_packet_alloc_data(dst, src->size);
+	if (src->size)
+		memcpy(dst->data, src->data, src->size);
 }
 
 /* OBS_DEPRECATED */
@@ -1339,10 +1549,8 @@ void obs_encoder_packet_ref(struct encoder_packet *dst,
 	if (!src)
 		return;
 
-	if (src->data) {
-		long *p_refs = ((long *)src->data) - 1;
-		os_atomic_inc_long(p_refs);
-	}
+	if (src->data)
+		os_atomic_inc_long(&get_packet_buffer(src->data)->refs);
 
 	*dst = *src;
 }
@@ -1353,9 +1561,9 @@ void obs_encoder_packet_release(struct encoder_packet *pkt)
 		return;
 
 	if (pkt->data) {
-		long *p_refs = ((long *)pkt->data) - 1;
-		if (os_atomic_dec_long(p_refs) == 0)
-			bfree(p_refs);
+		struct encoder_packet_buffer *buf = get_packet_buffer(pkt->data);
+		if (os_atomic_dec_long(&buf->refs) == 0)
+			free_packet_buffer(buf);
 	}
 
 	memset(pkt, 0, sizeof(struct encoder_packet));
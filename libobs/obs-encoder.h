@@ -33,6 +33,7 @@ extern "C" {
 #define OBS_ENCODER_CAP_PASS_TEXTURE (1 << 1)
 #define OBS_ENCODER_CAP_DYN_BITRATE (1 << 2)
 #define OBS_ENCODER_CAP_INTERNAL (1 << 3)
+#define OBS_ENCODER_CAP_THREADED_VIDEO (1 << 4)
 
 /** Specifies the encoder type */
 enum obs_encoder_type {
@@ -40,6 +41,14 @@ enum obs_encoder_type {
 	OBS_ENCODER_VIDEO  /**< The encoder provides a video codec */
 };
 
+/**
+ * Packet data allocated by libobs has at least this many bytes free in front
+ * of it, and OBS_ENCODER_PACKET_TAILROOM bytes after it, see
+ * obs_encoder_packet_get_headroom.
+ */
+#define OBS_ENCODER_PACKET_HEADROOM 64
+#define OBS_ENCODER_PACKET_TAILROOM 16
+
 /** Encoder output packet */
 struct encoder_packet {
 	uint8_t *data; /**< Packet data */
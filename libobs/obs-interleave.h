@@ -0,0 +1,126 @@
+/******************************************************************************
+    Copyright (C) 2014 by Hugh Bailey <obs.jim@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#pragma once
+
+#include "util/darray.h"
+#include "obs.h"
+
+/* interleave queues
+ *
+ *   Every track has its own queue sorted by dts, new packets practically
+ * always go to the end of it.  The interleaved order is the merge of the
+ * queues: lowest dts first, video before audio at the same dts, and lower
+ * audio tracks before higher ones. */
+
+#define NUM_INTERLEAVE_QUEUES (MAX_AUDIO_MIXES + 1)
+
+/* packets of one track waiting to be interleaved, sorted by dts */
+struct interleave_queue {
+	DARRAY(struct encoder_packet) packets;
+	size_t head; /* packets before it have been sent */
+};
+
+static inline struct encoder_packet *
+interleave_queue_first(struct interleave_queue *queue)
+{
+	return queue->head < queue->packets.num
+		       ? &queue->packets.array[queue->head]
+		       : NULL;
+}
+
+static inline struct encoder_packet *
+interleave_queue_last(struct interleave_queue *queue)
+{
+	return queue->head < queue->packets.num
+		       ? &queue->packets.array[queue->packets.num - 1]
+		       : NULL;
+}
+
+static inline void interleave_queue_push(struct interleave_queue *queue,
+					 struct encoder_packet *packet)
+{
+	size_t idx = queue->packets.num;
+
+	/* encoders output packets in dts order, so this doesn't move back
+	 * more than a few packets, if at all */
+	while (idx > queue->head &&
+	       queue->packets.array[idx - 1].dts_usec > packet->dts_usec)
+		idx--;
+
+	da_insert(queue->packets, idx, packet);
+}
+
+static inline void interleave_queue_pop(struct interleave_queue *queue,
+					struct encoder_packet *packet)
+{
+	*packet = queue->packets.array[queue->head++];
+
+	/* only move the remaining packets down once the sent ones make up
+	 * half of the array */
+	if (queue->head == queue->packets.num) {
+		da_resize(queue->packets, 0);
+		queue->head = 0;
+	} else if (queue->head >= 32 && queue->head * 2 >= queue->packets.num) {
+		da_erase_range(queue->packets, 0, queue->head);
+		queue->head = 0;
+	}
+}
+
+static inline void interleave_queue_discard(struct interleave_queue *queue,
+					    size_t count)
+{
+	struct encoder_packet packet;
+
+	for (size_t i = 0; i < count; i++) {
+		interleave_queue_pop(queue, &packet);
+		obs_encoder_packet_release(&packet);
+	}
+}
+
+/* whether a comes before b in the interleaved order */
+static inline bool packet_before(const struct encoder_packet *a,
+				 const struct encoder_packet *b)
+{
+	if (a->dts_usec != b->dts_usec)
+		return a->dts_usec < b->dts_usec;
+	if (a->type != b->type)
+		return a->type == OBS_ENCODER_VIDEO;
+	return a->type == OBS_ENCODER_AUDIO && a->track_idx < b->track_idx;
+}
+
+static inline struct interleave_queue *
+next_interleave_queue(struct interleave_queue *queues)
+{
+	struct interleave_queue *next = NULL;
+	struct encoder_packet *next_packet = NULL;
+
+	for (size_t i = 0; i < NUM_INTERLEAVE_QUEUES; i++) {
+		struct interleave_queue *queue = &queues[i];
+		struct encoder_packet *packet = interleave_queue_first(queue);
+
+		if (!packet)
+			continue;
+
+		if (!next_packet || packet_before(packet, next_packet)) {
+			next = queue;
+			next_packet = packet;
+		}
+	}
+
+	return next;
+}
@@ -24,6 +24,7 @@
 #include "util/threading.h"
 #include "util/platform.h"
 #include "util/profiler.h"
+#include "util/task-scheduler.h"
 #include "callback/signal.h"
 #include "callback/proc.h"
 
@@ -35,6 +36,7 @@
 #include "media-io/audio-io.h"
 
 #include "obs.h"
+#include "obs-interleave.h"
 
 #define NUM_TEXTURES 2
 #define NUM_CHANNELS 3
@@ -283,6 +285,17 @@ struct obs_core_video {
 	double video_fps;
 	video_t *video;
 	pthread_t video_thread;
+
+	/* copies downloaded frames to the video output while the graphics
+	 * thread goes on with the next frame, see obs-video.c */
+	pthread_t output_stage_thread;
+	bool output_stage_initialized;
+	os_sem_t *output_stage_sem;
+	os_event_t *output_stage_idle;
+	volatile bool output_stage_stop;
+	struct video_data output_stage_frame;
+	int output_stage_count;
+
 	uint32_t total_frames;
 	uint32_t lagged_frames;
 	bool thread_initialized;
@@ -318,17 +331,36 @@ struct obs_core_video {
 
 struct audio_monitor;
 
+/* render_order indices */
+struct audio_tree_edge {
+	size_t parent;
+	size_t child;
+};
+
 struct obs_core_audio {
 	audio_t *audio;
 
 	DARRAY(struct obs_source *) render_order;
 	DARRAY(struct obs_source *) root_nodes;
 
+	/* sources are rendered in levels, each after the sources it mixes */
+	uint64_t render_tick;
+	DARRAY(struct audio_tree_edge) render_edges;
+	DARRAY(size_t) render_levels; /* per render_order entry */
+	size_t top_render_level;
+	DARRAY(struct obs_source *) render_batch; /* render_order by level */
+	DARRAY(size_t) level_starts; /* render_batch index of each level */
+
 	uint64_t buffered_ts;
 	struct circlebuf buffered_timestamps;
 	int buffering_wait_ticks;
 	int total_buffering_ticks;
 
+	/* buffering is reduced again once all sources stayed ahead of the
+	 * mix by at least a tick for a while */
+	uint64_t slack_window_start;
+	int64_t slack_window_min;
+
 	float user_volume;
 
 	pthread_mutex_t monitoring_mutex;
@@ -337,6 +369,11 @@ struct obs_core_audio {
 	char *monitoring_device_id;
 };
 
+/* 1 KiB to 4 MiB, larger packets aren't pooled */
+#define ENCODER_PACKET_POOL_CLASSES 13
+
+struct encoder_packet_buffer;
+
 /* user sources, output channels, and displays */
 struct obs_core_data {
 	struct obs_source *first_source;
@@ -356,12 +393,22 @@ struct obs_core_data {
 	DARRAY(struct draw_callback) draw_callbacks;
 	DARRAY(struct tick_callback) tick_callbacks;
 
+	/* graphics thread only, kept to reuse the allocations */
+	DARRAY(struct obs_source *) tick_sources;
+	DARRAY(struct obs_source *) async_tick_sources;
+	DARRAY(struct obs_source *) parallel_tick_sources;
+
 	struct obs_view main_view;
 
 	long long unnamed_index;
 
 	obs_data_t *private_data;
 
+	/* released encoder packet buffers, by size class */
+	pthread_mutex_t packet_pool_mutex;
+	struct encoder_packet_buffer *packet_pool[ENCODER_PACKET_POOL_CLASSES];
+	size_t packet_pool_free[ENCODER_PACKET_POOL_CLASSES];
+
 	volatile bool valid;
 };
 
@@ -430,6 +477,9 @@ struct obs_core {
 	struct obs_core_hotkeys hotkeys;
 
 	obs_task_handler_t ui_task_handler;
+
+	/* for work split up between threads, such as source ticks */
+	task_scheduler_t *task_scheduler;
 };
 
 extern struct obs_core *obs;
@@ -446,6 +496,10 @@ extern void
 start_raw_video(video_t *video, const struct video_scale_info *conversion,
 		void (*callback)(void *param, struct video_data *frame),
 		void *param);
+extern void start_raw_video_threaded(
+	video_t *video, const struct video_scale_info *conversion,
+	void (*callback)(void *param, struct video_data *frame),
+	void (*skip_callback)(void *param, uint32_t frames), void *param);
 extern void stop_raw_video(video_t *video,
 			   void (*callback)(void *param,
 					    struct video_data *frame),
@@ -618,10 +672,18 @@ struct obs_source {
 	bool muted;
 	struct obs_source *next_audio_source;
 	struct obs_source **prev_next_audio_source;
+	uint64_t audio_render_tick; /* audio thread, last tick it was listed */
+	size_t audio_render_idx;    /* its render_order entry in that tick */
 	uint64_t audio_ts;
 	struct circlebuf audio_input_buf[MAX_AUDIO_CHANNELS];
 	size_t last_audio_input_buf_size;
 	DARRAY(struct audio_action) audio_actions;
+
+	/* arrival jitter statistics, protected by audio_buf_mutex */
+	bool audio_arrival_set;
+	int64_t audio_arrival_min_delay;
+	uint64_t audio_arrival_adjust;
+	uint64_t audio_jitter[OBS_AUDIO_JITTER_BUCKETS];
 	float *audio_output_buf[MAX_AUDIO_MIXES][MAX_AUDIO_CHANNELS];
 	float *audio_mix_buf[MAX_AUDIO_CHANNELS];
 	struct resample_info sample_info;
@@ -813,7 +875,11 @@ convert_video_format(enum video_format format)
 
 extern void obs_source_activate(obs_source_t *source, enum view_type type);
 extern void obs_source_deactivate(obs_source_t *source, enum view_type type);
+extern void obs_source_select_async_frame(obs_source_t *source);
+/* obs_source_video_tick does everything but the source's own video_tick,
+ * which obs_source_plugin_tick calls afterwards */
 extern void obs_source_video_tick(obs_source_t *source, float seconds);
+extern void obs_source_plugin_tick(obs_source_t *source, float seconds);
 extern float obs_source_get_target_volume(obs_source_t *source,
 					  obs_source_t *target);
 
@@ -905,7 +971,8 @@ struct obs_output {
 	pthread_t end_data_capture_thread;
 	os_event_t *stopping_event;
 	pthread_mutex_t interleaved_mutex;
-	DARRAY(struct encoder_packet) interleaved_packets;
+	/* the video track, followed by the audio tracks */
+	struct interleave_queue interleaved_queues[MAX_AUDIO_MIXES + 1];
 	int stop_code;
 
 	int reconnect_retry_sec;
@@ -998,6 +1065,9 @@ extern void obs_output_remove_encoder(struct obs_output *output,
 extern void
 obs_encoder_packet_create_instance(struct encoder_packet *dst,
 				   const struct encoder_packet *src);
+extern uint8_t *obs_encoder_packet_alloc_data(struct encoder_packet *packet,
+					      size_t size);
+extern void obs_free_encoder_packet_pool(void);
 void obs_output_destroy(obs_output_t *output);
 
 /* ------------------------------------------------------------------------- */
@@ -1047,6 +1117,7 @@ struct obs_encoder {
 	uint32_t timebase_den;
 
 	int64_t cur_pts;
+	uint32_t skipped_video_frames; /* input thread only */
 
 	struct circlebuf audio_input_buffer[MAX_AV_PLANES];
 	uint8_t *audio_output_buffer[MAX_AV_PLANES];
@@ -1077,6 +1148,9 @@ struct obs_encoder {
 
 	const char *profile_encoder_encode_name;
 	char *last_error_message;
+
+	/* data allocated with obs_encoder_alloc_packet during encode */
+	uint8_t *packet_data;
 };
 
 extern struct obs_encoder_info *find_encoder(const char *id);
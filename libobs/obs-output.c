@@ -166,12 +166,26 @@ fail:
 	return NULL;
 }
 
+/* ------------------------------------------------------------------------- */
+
+static inline struct interleave_queue *
+get_interleave_queue(struct obs_output *output, enum obs_encoder_type type,
+		     size_t track_idx)
+{
+	size_t idx = type == OBS_ENCODER_VIDEO ? 0 : track_idx + 1;
+	return &output->interleaved_queues[idx];
+}
+
 static inline void free_packets(struct obs_output *output)
 {
-	for (size_t i = 0; i < output->interleaved_packets.num; i++)
-		obs_encoder_packet_release(output->interleaved_packets.array +
-					   i);
-	da_free(output->interleaved_packets);
+	for (size_t i = 0; i < NUM_INTERLEAVE_QUEUES; i++) {
+		struct interleave_queue *queue = &output->interleaved_queues[i];
+
+		for (size_t j = queue->head; j < queue->packets.num; j++)
+			obs_encoder_packet_release(&queue->packets.array[j]);
+		da_free(queue->packets);
+		queue->head = 0;
+	}
 }
 
 static inline void clear_audio_buffers(obs_output_t *output)
@@ -1213,19 +1227,12 @@ static bool add_caption(struct obs_output *output, struct encoder_packet *out)
 	sei_t sei;
 	uint8_t *data;
 	size_t size;
-	long ref = 1;
-
-	DARRAY(uint8_t) out_data;
 
 	if (out->priority > 1)
 		return false;
 
 	sei_init(&sei, 0.0);
 
-	da_init(out_data);
-	da_push_back_array(out_data, &ref, sizeof(ref));
-	da_push_back_array(out_data, out->data, out->size);
-
 	caption_frame_init(&cf);
 	caption_frame_from_text(&cf, &output->caption_head->text[0]);
 
@@ -1233,16 +1240,15 @@ static bool add_caption(struct obs_output *output, struct encoder_packet *out)
 
 	data = malloc(sei_render_size(&sei));
 	size = sei_render(&sei, data);
+
 	/* TODO SEI should come after AUD/SPS/PPS, but before any VCL */
-	da_push_back_array(out_data, nal_start, 4);
-	da_push_back_array(out_data, data, size);
+	obs_encoder_packet_alloc_data(out, backup.size + 4 + size);
+	memcpy(out->data, backup.data, backup.size);
+	memcpy(out->data + backup.size, nal_start, 4);
+	memcpy(out->data + backup.size + 4, data, size);
 	free(data);
 
-	obs_encoder_packet_release(out);
-
-	*out = backup;
-	out->data = (uint8_t *)out_data.array + sizeof(ref);
-	out->size = out_data.num - sizeof(ref);
+	obs_encoder_packet_release(&backup);
 
 	sei_free(&sei);
 
@@ -1255,15 +1261,19 @@ static bool add_caption(struct obs_output *output, struct encoder_packet *out)
 
 static inline void send_interleaved(struct obs_output *output)
 {
-	struct encoder_packet out = output->interleaved_packets.array[0];
+	struct interleave_queue *queue = next_interleave_queue(output->interleaved_queues);
+	struct encoder_packet out;
+
+	if (!queue)
+		return;
 
 	/* do not send an interleaved packet if there's no packet of the
 	 * opposing type of a higher timestamp in the interleave buffer.
 	 * this ensures that the timestamps are monotonic */
-	if (!has_higher_opposing_ts(output, &out))
+	if (!has_higher_opposing_ts(output, interleave_queue_first(queue)))
 		return;
 
-	da_erase(output->interleaved_packets, 0);
+	interleave_queue_pop(queue, &out);
 
 	if (out.type == OBS_ENCODER_VIDEO) {
 		output->total_frames++;
@@ -1310,184 +1320,169 @@ static inline void set_higher_ts(struct obs_output *output,
 
 static inline struct encoder_packet *
 find_first_packet_type(struct obs_output *output, enum obs_encoder_type type,
-		       size_t audio_idx);
-static int find_first_packet_type_idx(struct obs_output *output,
-				      enum obs_encoder_type type,
-				      size_t audio_idx);
+		       size_t audio_idx)
+{
+	return interleave_queue_first(
+		get_interleave_queue(output, type, audio_idx));
+}
+
+static inline struct encoder_packet *
+find_last_packet_type(struct obs_output *output, enum obs_encoder_type type,
+		      size_t audio_idx)
+{
+	return interleave_queue_last(
+		get_interleave_queue(output, type, audio_idx));
+}
+
+/* discards the packets that come before the given packet in the interleaved
+ * order, and the packet itself if inclusive */
+static void discard_to_packet(struct obs_output *output,
+			      struct encoder_packet *packet, bool inclusive)
+{
+	struct encoder_packet key = *packet;
+	struct interleave_queue *packet_queue =
+		get_interleave_queue(output, key.type, key.track_idx);
+	size_t count = packet - interleave_queue_first(packet_queue);
+
+	if (inclusive)
+		count++;
+
+	for (size_t i = 0; i < NUM_INTERLEAVE_QUEUES; i++) {
+		struct interleave_queue *queue = &output->interleaved_queues[i];
+		struct encoder_packet *first;
+
+		if (queue == packet_queue) {
+			interleave_queue_discard(queue, count);
+			continue;
+		}
+
+		while ((first = interleave_queue_first(queue)) != NULL &&
+		       packet_before(first, &key))
+			interleave_queue_discard(queue, 1);
+	}
+}
 
 /* gets the point where audio and video are closest together */
-static size_t get_interleaved_start_idx(struct obs_output *output)
+static struct encoder_packet *get_interleaved_start(struct obs_output *output)
 {
 	int64_t closest_diff = 0x7FFFFFFFFFFFFFFFLL;
 	struct encoder_packet *first_video =
 		find_first_packet_type(output, OBS_ENCODER_VIDEO, 0);
-	size_t video_idx = DARRAY_INVALID;
-	size_t idx = 0;
+	struct encoder_packet *closest = NULL;
 
-	for (size_t i = 0; i < output->interleaved_packets.num; i++) {
-		struct encoder_packet *packet =
-			&output->interleaved_packets.array[i];
-		int64_t diff;
+	for (size_t i = 0; i < MAX_AUDIO_MIXES; i++) {
+		struct interleave_queue *queue =
+			get_interleave_queue(output, OBS_ENCODER_AUDIO, i);
 
-		if (packet->type != OBS_ENCODER_AUDIO) {
-			if (packet == first_video)
-				video_idx = i;
-			continue;
-		}
+		for (size_t j = queue->head; j < queue->packets.num; j++) {
+			struct encoder_packet *packet =
+				&queue->packets.array[j];
+			int64_t diff = packet->dts_usec - first_video->dts_usec;
+
+			/* only gets further away from here on */
+			if (diff > closest_diff)
+				break;
 
-		diff = llabs(packet->dts_usec - first_video->dts_usec);
-		if (diff < closest_diff) {
-			closest_diff = diff;
-			idx = i;
+			diff = llabs(diff);
+			if (diff < closest_diff ||
+			    (diff == closest_diff &&
+			     packet_before(packet, closest))) {
+				closest_diff = diff;
+				closest = packet;
+			}
 		}
 	}
 
-	return video_idx < idx ? video_idx : idx;
+	if (!closest)
+		return NULL;
+
+	return packet_before(first_video, closest) ? first_video : closest;
 }
 
-static int prune_premature_packets(struct obs_output *output)
+/* gets the last of the first packets of each track if the first packets
+ * need to be pruned, returns false if a track has no packets yet */
+static bool prune_premature_packets(struct obs_output *output,
+				    struct encoder_packet **prune_to)
 {
 	size_t audio_mixes = num_audio_mixes(output);
 	struct encoder_packet *video;
-	int video_idx;
-	int max_idx;
+	struct encoder_packet *last;
 	int64_t duration_usec;
-	int64_t max_diff = 0;
 	int64_t diff = 0;
 
-	video_idx = find_first_packet_type_idx(output, OBS_ENCODER_VIDEO, 0);
-	if (video_idx == -1) {
+	*prune_to = NULL;
+
+	video = find_first_packet_type(output, OBS_ENCODER_VIDEO, 0);
+	if (!video) {
 		output->received_video = false;
-		return -1;
+		return false;
 	}
 
-	max_idx = video_idx;
-	video = &output->interleaved_packets.array[video_idx];
+	last = video;
 	duration_usec = video->timebase_num * 1000000LL / video->timebase_den;
 
 	for (size_t i = 0; i < audio_mixes; i++) {
 		struct encoder_packet *audio;
-		int audio_idx;
 
-		audio_idx = find_first_packet_type_idx(output,
-						       OBS_ENCODER_AUDIO, i);
-		if (audio_idx == -1) {
+		audio = find_first_packet_type(output, OBS_ENCODER_AUDIO, i);
+		if (!audio) {
 			output->received_audio = false;
-			return -1;
+			return false;
 		}
 
-		audio = &output->interleaved_packets.array[audio_idx];
-		if (audio_idx > max_idx)
-			max_idx = audio_idx;
+		if (packet_before(last, audio))
+			last = audio;
 
 		diff = audio->dts_usec - video->dts_usec;
-		if (diff > max_diff)
-			max_diff = diff;
 	}
 
-	return diff > duration_usec ? max_idx + 1 : 0;
-}
-
-static void discard_to_idx(struct obs_output *output, size_t idx)
-{
-	for (size_t i = 0; i < idx; i++) {
-		struct encoder_packet *packet =
-			&output->interleaved_packets.array[i];
-		obs_encoder_packet_release(packet);
-	}
-
-	da_erase_range(output->interleaved_packets, 0, idx);
+	if (diff > duration_usec)
+		*prune_to = last;
+	return true;
 }
 
 #define DEBUG_STARTING_PACKETS 0
 
 static bool prune_interleaved_packets(struct obs_output *output)
 {
-	size_t start_idx = 0;
-	int prune_start = prune_premature_packets(output);
-
-#if DEBUG_STARTING_PACKETS == 1
-	blog(LOG_DEBUG, "--------- Pruning! %d ---------", prune_start);
-	for (size_t i = 0; i < output->interleaved_packets.num; i++) {
-		struct encoder_packet *packet =
-			&output->interleaved_packets.array[i];
-		blog(LOG_DEBUG, "packet: %s %d, ts: %lld, pruned = %s",
-		     packet->type == OBS_ENCODER_AUDIO ? "audio" : "video",
-		     (int)packet->track_idx, packet->dts_usec,
-		     (int)i < prune_start ? "true" : "false");
-	}
-#endif
+	struct encoder_packet *prune_to;
+	struct encoder_packet *start;
 
-	/* prunes the first video packet if it's too far away from audio */
-	if (prune_start == -1)
+	if (!prune_premature_packets(output, &prune_to))
 		return false;
-	else if (prune_start != 0)
-		start_idx = (size_t)prune_start;
-	else
-		start_idx = get_interleaved_start_idx(output);
-
-	if (start_idx)
-		discard_to_idx(output, start_idx);
-
-	return true;
-}
-
-static int find_first_packet_type_idx(struct obs_output *output,
-				      enum obs_encoder_type type,
-				      size_t audio_idx)
-{
-	for (size_t i = 0; i < output->interleaved_packets.num; i++) {
-		struct encoder_packet *packet =
-			&output->interleaved_packets.array[i];
-
-		if (packet->type == type) {
-			if (type == OBS_ENCODER_AUDIO &&
-			    packet->track_idx != audio_idx) {
-				continue;
-			}
 
-			return (int)i;
+#if DEBUG_STARTING_PACKETS == 1
+	blog(LOG_DEBUG, "--------- Pruning! %s ---------",
+	     prune_to ? "premature" : "to start");
+	for (size_t i = 0; i < NUM_INTERLEAVE_QUEUES; i++) {
+		struct interleave_queue *queue = &output->interleaved_queues[i];
+
+		for (size_t j = queue->head; j < queue->packets.num; j++) {
+			struct encoder_packet *packet =
+				&queue->packets.array[j];
+			bool pruned = prune_to &&
+				      (packet == prune_to ||
+				       packet_before(packet, prune_to));
+
+			blog(LOG_DEBUG, "packet: %s %d, ts: %lld, pruned = %s",
+			     packet->type == OBS_ENCODER_AUDIO ? "audio"
+							       : "video",
+			     (int)packet->track_idx, packet->dts_usec,
+			     pruned ? "true" : "false");
 		}
 	}
+#endif
 
-	return -1;
-}
-
-static int find_last_packet_type_idx(struct obs_output *output,
-				     enum obs_encoder_type type,
-				     size_t audio_idx)
-{
-	for (size_t i = output->interleaved_packets.num; i > 0; i--) {
-		struct encoder_packet *packet =
-			&output->interleaved_packets.array[i - 1];
-
-		if (packet->type == type) {
-			if (type == OBS_ENCODER_AUDIO &&
-			    packet->track_idx != audio_idx) {
-				continue;
-			}
-
-			return (int)(i - 1);
-		}
+	/* prunes the first video packet if it's too far away from audio */
+	if (prune_to) {
+		discard_to_packet(output, prune_to, true);
+	} else {
+		start = get_interleaved_start(output);
+		if (start)
+			discard_to_packet(output, start, false);
 	}
 
-	return -1;
-}
-
-static inline struct encoder_packet *
-find_first_packet_type(struct obs_output *output, enum obs_encoder_type type,
-		       size_t audio_idx)
-{
-	int idx = find_first_packet_type_idx(output, type, audio_idx);
-	return (idx != -1) ? &output->interleaved_packets.array[idx] : NULL;
-}
-
-static inline struct encoder_packet *
-find_last_packet_type(struct obs_output *output, enum obs_encoder_type type,
-		      size_t audio_idx)
-{
-	int idx = find_last_packet_type_idx(output, type, audio_idx);
-	return (idx != -1) ? &output->interleaved_packets.array[idx] : NULL;
+	return true;
 }
 
 static bool get_audio_and_video_packets(struct obs_output *output,
@@ -1520,7 +1515,7 @@ static bool initialize_interleaved_packets(struct obs_output *output)
 	struct encoder_packet *audio[MAX_AUDIO_MIXES];
 	struct encoder_packet *last_audio[MAX_AUDIO_MIXES];
 	size_t audio_mixes = num_audio_mixes(output);
-	size_t start_idx;
+	struct encoder_packet *start;
 
 	if (!get_audio_and_video_packets(output, &video, audio, audio_mixes))
 		return false;
@@ -1538,9 +1533,9 @@ static bool initialize_interleaved_packets(struct obs_output *output)
 	}
 
 	/* clear out excess starting audio if it hasn't been already */
-	start_idx = get_interleaved_start_idx(output);
-	if (start_idx) {
-		discard_to_idx(output, start_idx);
+	start = get_interleaved_start(output);
+	if (start) {
+		discard_to_packet(output, start, false);
 		if (!get_audio_and_video_packets(output, &video, audio,
 						 audio_mixes))
 			return false;
@@ -1566,11 +1561,14 @@ static bool initialize_interleaved_packets(struct obs_output *output)
 	output->highest_audio_ts -= audio[0]->dts_usec;
 	output->highest_video_ts -= video->dts_usec;
 
-	/* apply new offsets to all existing packet DTS/PTS values */
-	for (size_t i = 0; i < output->interleaved_packets.num; i++) {
-		struct encoder_packet *packet =
-			&output->interleaved_packets.array[i];
-		apply_interleaved_packet_offset(output, packet);
+	/* apply new offsets to all existing packet DTS/PTS values, which
+	 * leaves every queue in order */
+	for (size_t i = 0; i < NUM_INTERLEAVE_QUEUES; i++) {
+		struct interleave_queue *queue = &output->interleaved_queues[i];
+
+		for (size_t j = queue->head; j < queue->packets.num; j++)
+			apply_interleaved_packet_offset(
+				output, &queue->packets.array[j]);
 	}
 
 	return true;
@@ -1579,51 +1577,21 @@ static bool initialize_interleaved_packets(struct obs_output *output)
 static inline void insert_interleaved_packet(struct obs_output *output,
 					     struct encoder_packet *out)
 {
-	size_t idx;
-	for (idx = 0; idx < output->interleaved_packets.num; idx++) {
-		struct encoder_packet *cur_packet;
-		cur_packet = output->interleaved_packets.array + idx;
-
-		if (out->dts_usec == cur_packet->dts_usec &&
-		    out->type == OBS_ENCODER_VIDEO) {
-			break;
-		} else if (out->dts_usec < cur_packet->dts_usec) {
-			break;
-		}
-	}
-
-	da_insert(output->interleaved_packets, idx, out);
-}
-
-static void resort_interleaved_packets(struct obs_output *output)
-{
-	DARRAY(struct encoder_packet) old_array;
-
-	old_array.da = output->interleaved_packets.da;
-	memset(&output->interleaved_packets, 0,
-	       sizeof(output->interleaved_packets));
-
-	for (size_t i = 0; i < old_array.num; i++)
-		insert_interleaved_packet(output, &old_array.array[i]);
-
-	da_free(old_array);
+	interleave_queue_push(
+		get_interleave_queue(output, out->type, out->track_idx), out);
 }
 
 static void discard_unused_audio_packets(struct obs_output *output,
 					 int64_t dts_usec)
 {
-	size_t idx = 0;
-
-	for (; idx < output->interleaved_packets.num; idx++) {
-		struct encoder_packet *p =
-			&output->interleaved_packets.array[idx];
+	for (size_t i = 0; i < NUM_INTERLEAVE_QUEUES; i++) {
+		struct interleave_queue *queue = &output->interleaved_queues[i];
+		struct encoder_packet *first;
 
-		if (p->dts_usec >= dts_usec)
-			break;
+		while ((first = interleave_queue_first(queue)) != NULL &&
+		       first->dts_usec < dts_usec)
+			interleave_queue_discard(queue, 1);
 	}
-
-	if (idx)
-		discard_to_idx(output, idx);
 }
 
 static void interleave_packets(void *data, struct encoder_packet *packet)
@@ -1656,7 +1624,7 @@ static void interleave_packets(void *data, struct encoder_packet *packet)
 	if (output->active_delay_ns)
 		out = *packet;
 	else
-		obs_encoder_packet_create_instance(&out, packet);
+		obs_encoder_packet_ref(&out, packet);
 
 	if (was_started)
 		apply_interleaved_packet_offset(output, &out);
@@ -1671,10 +1639,8 @@ static void interleave_packets(void *data, struct encoder_packet *packet)
 	if (output->received_audio && output->received_video) {
 		if (!was_started) {
 			if (prune_interleaved_packets(output)) {
-				if (initialize_interleaved_packets(output)) {
-					resort_interleaved_packets(output);
+				if (initialize_interleaved_packets(output))
 					send_interleaved(output);
-				}
 			}
 		} else {
 			send_interleaved(output);
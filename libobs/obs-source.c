@@ -1058,10 +1058,15 @@ static inline struct obs_source_frame *get_closest_frame(obs_source_t *source,
 bool set_async_texture_size(struct obs_source *source,
 			    const struct obs_source_frame *frame);
 
-static void async_tick(obs_source_t *source)
+/* doesn't need the graphics context, so this can run on any thread and for
+ * different sources in parallel */
+void obs_source_select_async_frame(obs_source_t *source)
 {
 	uint64_t sys_time = obs->video.video_time;
 
+	if ((source->info.output_flags & OBS_SOURCE_ASYNC) == 0)
+		return;
+
 	pthread_mutex_lock(&source->async_mutex);
 
 	if (deinterlacing_enabled(source)) {
@@ -1077,7 +1082,10 @@ static void async_tick(obs_source_t *source)
 
 	source->last_sys_timestamp = sys_time;
 	pthread_mutex_unlock(&source->async_mutex);
+}
 
+static void async_tick(obs_source_t *source)
+{
 	if (source->cur_async_frame)
 		source->async_update_texture =
 			set_async_texture_size(source, source->cur_async_frame);
@@ -1093,6 +1101,7 @@ void obs_source_video_tick(obs_source_t *source, float seconds)
 	if (source->info.type == OBS_SOURCE_TYPE_TRANSITION)
 		obs_transition_tick(source, seconds);
 
+	/* the frame was picked by obs_source_select_async_frame already */
 	if ((source->info.output_flags & OBS_SOURCE_ASYNC) != 0)
 		async_tick(source);
 
@@ -1151,13 +1160,16 @@ void obs_source_video_tick(obs_source_t *source, float seconds)
 		source->active = now_active;
 	}
 
-	if (source->context.data && source->info.video_tick)
-		source->info.video_tick(source->context.data, seconds);
-
 	source->async_rendered = false;
 	source->deinterlace_rendered = false;
 }
 
+void obs_source_plugin_tick(obs_source_t *source, float seconds)
+{
+	if (source->context.data && source->info.video_tick)
+		source->info.video_tick(source->context.data, seconds);
+}
+
 /* unless the value is 3+ hours worth of frames, this won't overflow */
 static inline uint64_t conv_frames_to_time(const size_t sample_rate,
 					   const size_t frames)
@@ -1316,6 +1328,36 @@ static inline bool source_muted(obs_source_t *source, uint64_t os_time)
 	       (source->push_to_talk_enabled && !push_to_talk_active);
 }
 
+/* the delay between a packet's timestamp and its arrival is mostly constant,
+ * the jitter is how much more it is than the shortest delay seen since the
+ * source's timing was last reset */
+static void record_audio_arrival(obs_source_t *source, uint64_t os_time,
+				 uint64_t timestamp)
+{
+	int64_t delay = (int64_t)(os_time - timestamp);
+
+	if (!source->audio_arrival_set ||
+	    source->audio_arrival_adjust != source->timing_adjust ||
+	    delay < source->audio_arrival_min_delay) {
+		source->audio_arrival_set = true;
+		source->audio_arrival_adjust = source->timing_adjust;
+		source->audio_arrival_min_delay = delay;
+	}
+
+	uint64_t jitter_ms =
+		(uint64_t)(delay - source->audio_arrival_min_delay) / 1000000;
+	size_t bucket = 0;
+
+	for (uint64_t limit = 5; bucket < OBS_AUDIO_JITTER_BUCKETS - 1;
+	     limit *= 2) {
+		if (jitter_ms < limit)
+			break;
+		bucket++;
+	}
+
+	source->audio_jitter[bucket]++;
+}
+
 static void source_output_audio_data(obs_source_t *source,
 				     const struct audio_data *data)
 {
@@ -1381,6 +1423,8 @@ static void source_output_audio_data(obs_source_t *source,
 		}
 	}
 
+	record_audio_arrival(source, os_time, in.timestamp);
+
 	sync_offset = source->sync_offset;
 	in.timestamp += sync_offset;
 	in.timestamp -= source->resample_offset;
@@ -2583,35 +2627,29 @@ struct obs_source_frame *filter_async_video(obs_source_t *source,
 	return in;
 }
 
-static inline void copy_frame_data_line(struct obs_source_frame *dst,
-					const struct obs_source_frame *src,
-					uint32_t plane, uint32_t y)
+static inline void add_frame_plane(struct video_plane_copy *planes,
+				   size_t *num, struct obs_source_frame *dst,
+				   const struct obs_source_frame *src,
+				   uint32_t plane, uint32_t lines)
 {
-	uint32_t pos_src = y * src->linesize[plane];
-	uint32_t pos_dst = y * dst->linesize[plane];
-	uint32_t bytes = dst->linesize[plane] < src->linesize[plane]
-				 ? dst->linesize[plane]
-				 : src->linesize[plane];
+	struct video_plane_copy *copy = &planes[(*num)++];
 
-	memcpy(dst->data[plane] + pos_dst, src->data[plane] + pos_src, bytes);
-}
-
-static inline void copy_frame_data_plane(struct obs_source_frame *dst,
-					 const struct obs_source_frame *src,
-					 uint32_t plane, uint32_t lines)
-{
-	if (dst->linesize[plane] != src->linesize[plane]) {
-		for (uint32_t y = 0; y < lines; y++)
-			copy_frame_data_line(dst, src, plane, y);
-	} else {
-		memcpy(dst->data[plane], src->data[plane],
-		       (size_t)dst->linesize[plane] * (size_t)lines);
-	}
+	copy->dst = dst->data[plane];
+	copy->src = src->data[plane];
+	copy->dst_linesize = dst->linesize[plane];
+	copy->src_linesize = src->linesize[plane];
+	copy->width = dst->linesize[plane] < src->linesize[plane]
+			      ? dst->linesize[plane]
+			      : src->linesize[plane];
+	copy->height = lines;
 }
 
 static void copy_frame_data(struct obs_source_frame *dst,
 			    const struct obs_source_frame *src)
 {
+	struct video_plane_copy planes[MAX_AV_PLANES];
+	size_t num = 0;
+
 	dst->flip = src->flip;
 	dst->full_range = src->full_range;
 	dst->timestamp = src->timestamp;
@@ -2624,21 +2662,21 @@ static void copy_frame_data(struct obs_source_frame *dst,
 
 	switch (src->format) {
 	case VIDEO_FORMAT_I420:
-		copy_frame_data_plane(dst, src, 0, dst->height);
-		copy_frame_data_plane(dst, src, 1, dst->height / 2);
-		copy_frame_data_plane(dst, src, 2, dst->height / 2);
+		add_frame_plane(planes, &num, dst, src, 0, dst->height);
+		add_frame_plane(planes, &num, dst, src, 1, dst->height / 2);
+		add_frame_plane(planes, &num, dst, src, 2, dst->height / 2);
 		break;
 
 	case VIDEO_FORMAT_NV12:
-		copy_frame_data_plane(dst, src, 0, dst->height);
-		copy_frame_data_plane(dst, src, 1, dst->height / 2);
+		add_frame_plane(planes, &num, dst, src, 0, dst->height);
+		add_frame_plane(planes, &num, dst, src, 1, dst->height / 2);
 		break;
 
 	case VIDEO_FORMAT_I444:
 	case VIDEO_FORMAT_I422:
-		copy_frame_data_plane(dst, src, 0, dst->height);
-		copy_frame_data_plane(dst, src, 1, dst->height);
-		copy_frame_data_plane(dst, src, 2, dst->height);
+		add_frame_plane(planes, &num, dst, src, 0, dst->height);
+		add_frame_plane(planes, &num, dst, src, 1, dst->height);
+		add_frame_plane(planes, &num, dst, src, 2, dst->height);
 		break;
 
 	case VIDEO_FORMAT_YVYU:
@@ -2651,24 +2689,27 @@ static void copy_frame_data(struct obs_source_frame *dst,
 	case VIDEO_FORMAT_Y800:
 	case VIDEO_FORMAT_BGR3:
 	case VIDEO_FORMAT_AYUV:
-		copy_frame_data_plane(dst, src, 0, dst->height);
+		add_frame_plane(planes, &num, dst, src, 0, dst->height);
 		break;
 
 	case VIDEO_FORMAT_I40A:
-		copy_frame_data_plane(dst, src, 0, dst->height);
-		copy_frame_data_plane(dst, src, 1, dst->height / 2);
-		copy_frame_data_plane(dst, src, 2, dst->height / 2);
-		copy_frame_data_plane(dst, src, 3, dst->height);
+		add_frame_plane(planes, &num, dst, src, 0, dst->height);
+		add_frame_plane(planes, &num, dst, src, 1, dst->height / 2);
+		add_frame_plane(planes, &num, dst, src, 2, dst->height / 2);
+		add_frame_plane(planes, &num, dst, src, 3, dst->height);
 		break;
 
 	case VIDEO_FORMAT_I42A:
 	case VIDEO_FORMAT_YUVA:
-		copy_frame_data_plane(dst, src, 0, dst->height);
-		copy_frame_data_plane(dst, src, 1, dst->height);
-		copy_frame_data_plane(dst, src, 2, dst->height);
-		copy_frame_data_plane(dst, src, 3, dst->height);
+		add_frame_plane(planes, &num, dst, src, 0, dst->height);
+		add_frame_plane(planes, &num, dst, src, 1, dst->height);
+		add_frame_plane(planes, &num, dst, src, 2, dst->height);
+		add_frame_plane(planes, &num, dst, src, 3, dst->height);
 		break;
 	}
+
+	/* large frames are copied in slices on the task scheduler */
+	video_planes_copy(obs->task_scheduler, planes, num);
 }
 
 void obs_source_frame_copy(struct obs_source_frame *dst,
@@ -4616,6 +4657,20 @@ void obs_source_audio_render(obs_source_t *source, uint32_t mixers,
 	process_audio_source_tick(source, mixers, channels, sample_rate, size);
 }
 
+void obs_source_get_audio_jitter(obs_source_t *source,
+				 uint64_t counts[OBS_AUDIO_JITTER_BUCKETS])
+{
+	if (!obs_source_valid(source, "obs_source_get_audio_jitter")) {
+		memset(counts, 0, sizeof(uint64_t) * OBS_AUDIO_JITTER_BUCKETS);
+		return;
+	}
+
+	pthread_mutex_lock(&source->audio_buf_mutex);
+	memcpy(counts, source->audio_jitter,
+	       sizeof(uint64_t) * OBS_AUDIO_JITTER_BUCKETS);
+	pthread_mutex_unlock(&source->audio_buf_mutex);
+}
+
 bool obs_source_audio_pending(const obs_source_t *source)
 {
 	if (!obs_source_valid(source, "obs_source_audio_pending"))
@@ -186,6 +186,12 @@ enum obs_media_state {
  */
 #define OBS_SOURCE_CONTROLLABLE_MEDIA (1 << 13)
 
+/**
+ * Source's video_tick can run on a worker thread, at the same time as the
+ * video_tick of other sources.  It must not enter the graphics context.
+ */
+#define OBS_SOURCE_PARALLEL_TICK (1 << 14)
+
 /** @} */
 
 typedef void (*obs_source_enum_proc_t)(obs_source_t *parent,
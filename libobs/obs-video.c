@@ -29,6 +29,27 @@
 #include <windows.h>
 #endif
 
+static const char *select_async_frames_name = "select_async_frames";
+
+static const char *parallel_tick_name = "parallel_tick";
+
+static void select_async_frame_task(void *param, size_t idx)
+{
+	struct obs_source **sources = param;
+	obs_source_select_async_frame(sources[idx]);
+}
+
+struct parallel_tick {
+	struct obs_source **sources;
+	float seconds;
+};
+
+static void parallel_tick_task(void *param, size_t idx)
+{
+	struct parallel_tick *tick = param;
+	obs_source_plugin_tick(tick->sources[idx], tick->seconds);
+}
+
 static uint64_t tick_sources(uint64_t cur_time, uint64_t last_time)
 {
 	struct obs_core_data *data = &obs->data;
@@ -67,11 +88,51 @@ static uint64_t tick_sources(uint64_t cur_time, uint64_t last_time)
 		source = (struct obs_source *)source->context.next;
 
 		if (cur_source) {
-			obs_source_video_tick(cur_source, seconds);
-			obs_source_release(cur_source);
+			da_push_back(data->tick_sources, &cur_source);
+			if (cur_source->info.output_flags & OBS_SOURCE_ASYNC)
+				da_push_back(data->async_tick_sources,
+					     &cur_source);
 		}
 	}
 
+	/* frame selection of async sources is independent of anything else
+	 * and runs in parallel */
+	profile_start(select_async_frames_name);
+	task_scheduler_run(obs->task_scheduler, select_async_frames_name,
+			   data->async_tick_sources.num,
+			   select_async_frame_task,
+			   data->async_tick_sources.array);
+	profile_end(select_async_frames_name);
+
+	/* show/activate callbacks and deferred updates stay on the graphics
+	 * thread, as does the video_tick of sources that don't declare it safe
+	 * to run alongside others */
+	for (size_t i = 0; i < data->tick_sources.num; i++) {
+		struct obs_source *cur_source = data->tick_sources.array[i];
+		obs_source_video_tick(cur_source, seconds);
+
+		if (cur_source->info.output_flags & OBS_SOURCE_PARALLEL_TICK)
+			da_push_back(data->parallel_tick_sources, &cur_source);
+		else
+			obs_source_plugin_tick(cur_source, seconds);
+	}
+
+	struct parallel_tick tick = {data->parallel_tick_sources.array,
+				     seconds};
+
+	profile_start(parallel_tick_name);
+	task_scheduler_run(obs->task_scheduler, parallel_tick_name,
+			   data->parallel_tick_sources.num, parallel_tick_task,
+			   &tick);
+	profile_end(parallel_tick_name);
+
+	for (size_t i = 0; i < data->tick_sources.num; i++)
+		obs_source_release(data->tick_sources.array[i]);
+
+	da_resize(data->tick_sources, 0);
+	da_resize(data->async_tick_sources, 0);
+	da_resize(data->parallel_tick_sources, 0);
+
 	pthread_mutex_unlock(&data->sources_mutex);
 
 	return cur_time;
@@ -353,12 +414,25 @@ static void render_convert_texture(struct obs_core_video *video,
 	profile_end(render_convert_texture_name);
 }
 
+static const char *wait_output_stage_name = "wait_output_stage";
+static inline void wait_output_stage(struct obs_core_video *video)
+{
+	if (!video->output_stage_initialized)
+		return;
+
+	profile_start(wait_output_stage_name);
+	os_event_wait(video->output_stage_idle);
+	profile_end(wait_output_stage_name);
+}
+
 static const char *stage_output_texture_name = "stage_output_texture";
 static inline void stage_output_texture(struct obs_core_video *video,
 					int cur_texture)
 {
 	profile_start(stage_output_texture_name);
 
+	/* the output stage may still be copying from the mapped surfaces */
+	wait_output_stage(video);
 	unmap_last_surface(video);
 
 	if (!video->gpu_conversion) {
@@ -533,24 +607,23 @@ static inline bool download_frame(struct obs_core_video *video,
 	return true;
 }
 
-static const uint8_t *set_gpu_converted_plane(uint32_t width, uint32_t height,
+static const uint8_t *add_gpu_converted_plane(struct video_plane_copy *planes,
+					      size_t *num, uint32_t width,
+					      uint32_t height,
 					      uint32_t linesize_input,
 					      uint32_t linesize_output,
 					      const uint8_t *in, uint8_t *out)
 {
-	if ((width == linesize_input) && (width == linesize_output)) {
-		size_t total = width * height;
-		memcpy(out, in, total);
-		in += total;
-	} else {
-		for (size_t y = 0; y < height; y++) {
-			memcpy(out, in, width);
-			out += linesize_output;
-			in += linesize_input;
-		}
-	}
+	struct video_plane_copy *copy = &planes[(*num)++];
+
+	copy->dst = out;
+	copy->src = in;
+	copy->dst_linesize = linesize_output;
+	copy->src_linesize = linesize_input;
+	copy->width = width;
+	copy->height = height;
 
-	return in;
+	return in + (size_t)linesize_input * height;
 }
 
 static void set_gpu_converted_data(struct obs_core_video *video,
@@ -558,25 +631,28 @@ static void set_gpu_converted_data(struct obs_core_video *video,
 				   const struct video_data *input,
 				   const struct video_output_info *info)
 {
+	struct video_plane_copy planes[MAX_AV_PLANES];
+	size_t num = 0;
+
 	if (video->using_nv12_tex) {
 		const uint32_t width = info->width;
 		const uint32_t height = info->height;
 
-		const uint8_t *const in_uv = set_gpu_converted_plane(
-			width, height, input->linesize[0], output->linesize[0],
-			input->data[0], output->data[0]);
+		const uint8_t *const in_uv = add_gpu_converted_plane(
+			planes, &num, width, height, input->linesize[0],
+			output->linesize[0], input->data[0], output->data[0]);
 
 		const uint32_t height_d2 = height / 2;
-		set_gpu_converted_plane(width, height_d2, input->linesize[0],
-					output->linesize[1], in_uv,
-					output->data[1]);
+		add_gpu_converted_plane(planes, &num, width, height_d2,
+					input->linesize[0], output->linesize[1],
+					in_uv, output->data[1]);
 	} else {
 		switch (info->format) {
 		case VIDEO_FORMAT_I420: {
 			const uint32_t width = info->width;
 			const uint32_t height = info->height;
 
-			set_gpu_converted_plane(width, height,
+			add_gpu_converted_plane(planes, &num, width, height,
 						input->linesize[0],
 						output->linesize[0],
 						input->data[0],
@@ -585,14 +661,14 @@ static void set_gpu_converted_data(struct obs_core_video *video,
 			const uint32_t width_d2 = width / 2;
 			const uint32_t height_d2 = height / 2;
 
-			set_gpu_converted_plane(width_d2, height_d2,
-						input->linesize[1],
+			add_gpu_converted_plane(planes, &num, width_d2,
+						height_d2, input->linesize[1],
 						output->linesize[1],
 						input->data[1],
 						output->data[1]);
 
-			set_gpu_converted_plane(width_d2, height_d2,
-						input->linesize[2],
+			add_gpu_converted_plane(planes, &num, width_d2,
+						height_d2, input->linesize[2],
 						output->linesize[2],
 						input->data[2],
 						output->data[2]);
@@ -603,14 +679,14 @@ static void set_gpu_converted_data(struct obs_core_video *video,
 			const uint32_t width = info->width;
 			const uint32_t height = info->height;
 
-			set_gpu_converted_plane(width, height,
+			add_gpu_converted_plane(planes, &num, width, height,
 						input->linesize[0],
 						output->linesize[0],
 						input->data[0],
 						output->data[0]);
 
 			const uint32_t height_d2 = height / 2;
-			set_gpu_converted_plane(width, height_d2,
+			add_gpu_converted_plane(planes, &num, width, height_d2,
 						input->linesize[1],
 						output->linesize[1],
 						input->data[1],
@@ -622,19 +698,19 @@ static void set_gpu_converted_data(struct obs_core_video *video,
 			const uint32_t width = info->width;
 			const uint32_t height = info->height;
 
-			set_gpu_converted_plane(width, height,
+			add_gpu_converted_plane(planes, &num, width, height,
 						input->linesize[0],
 						output->linesize[0],
 						input->data[0],
 						output->data[0]);
 
-			set_gpu_converted_plane(width, height,
+			add_gpu_converted_plane(planes, &num, width, height,
 						input->linesize[1],
 						output->linesize[1],
 						input->data[1],
 						output->data[1]);
 
-			set_gpu_converted_plane(width, height,
+			add_gpu_converted_plane(planes, &num, width, height,
 						input->linesize[2],
 						output->linesize[2],
 						input->data[2],
@@ -661,25 +737,28 @@ static void set_gpu_converted_data(struct obs_core_video *video,
 			;
 		}
 	}
+
+	video_planes_copy(obs->task_scheduler, planes, num);
 }
 
 static inline void copy_rgbx_frame(struct video_frame *output,
 				   const struct video_data *input,
 				   const struct video_output_info *info)
 {
-	uint8_t *in_ptr = input->data[0];
-	uint8_t *out_ptr = output->data[0];
+	struct video_plane_copy plane = {
+		.dst = output->data[0],
+		.src = input->data[0],
+		.dst_linesize = output->linesize[0],
+		.src_linesize = input->linesize[0],
+		.width = info->width * 4,
+		.height = info->height,
+	};
 
 	/* if the line sizes match, do a single copy */
-	if (input->linesize[0] == output->linesize[0]) {
-		memcpy(out_ptr, in_ptr, input->linesize[0] * info->height);
-	} else {
-		for (size_t y = 0; y < info->height; y++) {
-			memcpy(out_ptr, in_ptr, info->width * 4);
-			in_ptr += input->linesize[0];
-			out_ptr += output->linesize[0];
-		}
-	}
+	if (input->linesize[0] == output->linesize[0])
+		plane.width = input->linesize[0];
+
+	video_planes_copy(obs->task_scheduler, &plane, 1);
 }
 
 static inline void output_video_data(struct obs_core_video *video,
@@ -705,6 +784,105 @@ static inline void output_video_data(struct obs_core_video *video,
 	}
 }
 
+/* ------------------------------------------------------------------------- */
+/* Output stage
+ *
+ *   Copying a downloaded frame into the video output cache takes a
+ * significant part of the frame time for large outputs.  Instead of stalling
+ * the graphics thread, the copy runs on a separate thread while the graphics
+ * thread ticks and renders the next frame.  The mapped staging surfaces stay
+ * valid until the graphics thread unmaps them in stage_output_texture, which
+ * waits for the copy to finish first. */
+
+static const char *output_stage_name = "output_stage";
+static const char *output_stage_output_video_data_name = "output_video_data";
+
+static void *output_stage_thread(void *param)
+{
+	struct obs_core_video *video = param;
+
+	os_set_thread_name("libobs: video output stage");
+
+	for (;;) {
+		os_sem_wait(video->output_stage_sem);
+		if (os_atomic_load_bool(&video->output_stage_stop))
+			break;
+
+		profile_start(output_stage_name);
+		profile_start(output_stage_output_video_data_name);
+		output_video_data(video, &video->output_stage_frame,
+				  video->output_stage_count);
+		profile_end(output_stage_output_video_data_name);
+		profile_end(output_stage_name);
+		profile_reenable_thread();
+
+		os_event_signal(video->output_stage_idle);
+	}
+
+	return NULL;
+}
+
+static void start_output_stage(struct obs_core_video *video)
+{
+	video->output_stage_stop = false;
+
+	if (os_sem_init(&video->output_stage_sem, 0) != 0)
+		goto fail;
+	if (os_event_init(&video->output_stage_idle, OS_EVENT_TYPE_MANUAL) !=
+	    0)
+		goto fail;
+	os_event_signal(video->output_stage_idle);
+
+	if (pthread_create(&video->output_stage_thread, NULL,
+			   output_stage_thread, video) != 0)
+		goto fail;
+
+	video->output_stage_initialized = true;
+	return;
+
+fail:
+	/* frames are output on the graphics thread then */
+	blog(LOG_WARNING, "Failed to start the video output stage thread");
+	os_sem_destroy(video->output_stage_sem);
+	os_event_destroy(video->output_stage_idle);
+	video->output_stage_sem = NULL;
+	video->output_stage_idle = NULL;
+}
+
+static void stop_output_stage(struct obs_core_video *video)
+{
+	if (!video->output_stage_initialized)
+		return;
+
+	os_event_wait(video->output_stage_idle);
+	os_atomic_set_bool(&video->output_stage_stop, true);
+	os_sem_post(video->output_stage_sem);
+	pthread_join(video->output_stage_thread, NULL);
+
+	os_sem_destroy(video->output_stage_sem);
+	os_event_destroy(video->output_stage_idle);
+	video->output_stage_sem = NULL;
+	video->output_stage_idle = NULL;
+	video->output_stage_initialized = false;
+}
+
+static inline void queue_output_video_data(struct obs_core_video *video,
+					   struct video_data *frame, int count)
+{
+	if (!video->output_stage_initialized) {
+		output_video_data(video, frame, count);
+		return;
+	}
+
+	/* only one frame is mapped at a time, so the stage is idle here */
+	os_event_wait(video->output_stage_idle);
+	os_event_reset(video->output_stage_idle);
+
+	video->output_stage_frame = *frame;
+	video->output_stage_count = count;
+	os_sem_post(video->output_stage_sem);
+}
+
 static inline void video_sleep(struct obs_core_video *video, bool raw_active,
 			       const bool gpu_active, uint64_t *p_time,
 			       uint64_t interval_ns)
@@ -782,7 +960,7 @@ static inline void output_frame(bool raw_active, const bool gpu_active)
 
 		frame.timestamp = vframe_info.timestamp;
 		profile_start(output_frame_output_video_data_name);
-		output_video_data(video, &frame, vframe_info.count);
+		queue_output_video_data(video, &frame, vframe_info.count);
 		profile_end(output_frame_output_video_data_name);
 	}
 
@@ -865,6 +1043,8 @@ void *obs_graphics_thread(void *param)
 
 	srand((unsigned int)time(NULL));
 
+	start_output_stage(&obs->video);
+
 	for (;;) {
 		/* defer loop break to clean up sources */
 		const bool stop_requested =
@@ -952,6 +1132,8 @@ void *obs_graphics_thread(void *param)
 			break;
 	}
 
+	stop_output_stage(&obs->video);
+
 	UNUSED_PARAMETER(param);
 	return NULL;
 }
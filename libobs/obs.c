@@ -601,6 +601,10 @@ static void obs_free_audio(void)
 	circlebuf_free(&audio->buffered_timestamps);
 	da_free(audio->render_order);
 	da_free(audio->root_nodes);
+	da_free(audio->render_edges);
+	da_free(audio->render_levels);
+	da_free(audio->render_batch);
+	da_free(audio->level_starts);
 
 	da_free(audio->monitors);
 	bfree(audio->monitoring_device_name);
@@ -610,6 +614,23 @@ static void obs_free_audio(void)
 	memset(audio, 0, sizeof(struct obs_core_audio));
 }
 
+#define MAX_TASK_THREADS 7
+
+static bool obs_init_task_scheduler(void)
+{
+	int cores = os_get_logical_cores();
+	size_t threads = cores > 1 ? (size_t)(cores - 1) : 0;
+	if (threads > MAX_TASK_THREADS)
+		threads = MAX_TASK_THREADS;
+
+	obs->task_scheduler = task_scheduler_create(threads, obs->name_store);
+	if (!obs->task_scheduler)
+		return false;
+
+	blog(LOG_INFO, "Task scheduler using %zu worker threads", threads);
+	return true;
+}
+
 static bool obs_init_data(void)
 {
 	struct obs_core_data *data = &obs->data;
@@ -619,6 +640,7 @@ static bool obs_init_data(void)
 
 	pthread_mutex_init_value(&obs->data.displays_mutex);
 	pthread_mutex_init_value(&obs->data.draw_callbacks_mutex);
+	pthread_mutex_init_value(&obs->data.packet_pool_mutex);
 
 	if (pthread_mutexattr_init(&attr) != 0)
 		return false;
@@ -638,6 +660,8 @@ static bool obs_init_data(void)
 		goto fail;
 	if (pthread_mutex_init(&obs->data.draw_callbacks_mutex, &attr) != 0)
 		goto fail;
+	if (pthread_mutex_init(&data->packet_pool_mutex, NULL) != 0)
+		goto fail;
 	if (!obs_view_init(&data->main_view))
 		goto fail;
 
@@ -698,7 +722,11 @@ static void obs_free_data(void)
 	pthread_mutex_destroy(&data->draw_callbacks_mutex);
 	da_free(data->draw_callbacks);
 	da_free(data->tick_callbacks);
+	da_free(data->tick_sources);
+	da_free(data->async_tick_sources);
+	da_free(data->parallel_tick_sources);
 	obs_data_release(data->private_data);
+	obs_free_encoder_packet_pool();
 }
 
 static const char *obs_signals[] = {
@@ -858,6 +886,8 @@ static bool obs_init(const char *locale, const char *module_config_path,
 
 	log_system_info();
 
+	if (!obs_init_task_scheduler())
+		return false;
 	if (!obs_init_data())
 		return false;
 	if (!obs_init_handlers())
@@ -1032,6 +1062,7 @@ void obs_shutdown(void)
 	obs_free_video();
 	obs_free_hotkeys();
 	obs_free_graphics();
+	task_scheduler_destroy(obs->task_scheduler);
 	proc_handler_destroy(obs->procs);
 	signal_handler_destroy(obs->signals);
 	obs->procs = NULL;
@@ -1060,6 +1091,8 @@ void obs_shutdown(void)
 	bfree(core);
 	bfree(cmdline_args.argv);
 
+	bmem_log_stats();
+
 #ifdef _WIN32
 	if (com_initialized)
 		uninitialize_com();
@@ -2440,6 +2473,16 @@ uint32_t obs_get_lagged_frames(void)
 	return obs ? obs->video.lagged_frames : 0;
 }
 
+uint32_t obs_get_audio_buffering_ms(void)
+{
+	if (!obs || !obs->audio.audio)
+		return 0;
+
+	uint32_t sample_rate = audio_output_get_sample_rate(obs->audio.audio);
+	return (uint32_t)((uint64_t)obs->audio.total_buffering_ticks *
+			  AUDIO_OUTPUT_FRAMES * 1000 / sample_rate);
+}
+
 void start_raw_video(video_t *v, const struct video_scale_info *conversion,
 		     void (*callback)(void *param, struct video_data *frame),
 		     void *param)
@@ -2449,6 +2492,17 @@ void start_raw_video(video_t *v, const struct video_scale_info *conversion,
 	video_output_connect(v, conversion, callback, param);
 }
 
+void start_raw_video_threaded(
+	video_t *v, const struct video_scale_info *conversion,
+	void (*callback)(void *param, struct video_data *frame),
+	void (*skip_callback)(void *param, uint32_t frames), void *param)
+{
+	struct obs_core_video *video = &obs->video;
+	os_atomic_inc_long(&video->raw_active);
+	video_output_connect_threaded(v, conversion, callback, skip_callback,
+				      param);
+}
+
 void stop_raw_video(video_t *v,
 		    void (*callback)(void *param, struct video_data *frame),
 		    void *param)
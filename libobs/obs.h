@@ -739,6 +739,10 @@ EXPORT uint64_t obs_get_frame_interval_ns(void);
 EXPORT uint32_t obs_get_total_frames(void);
 EXPORT uint32_t obs_get_lagged_frames(void);
 
+/** Gets the current audio buffering, i.e. how far the audio output lags
+ * behind the sources, in milliseconds */
+EXPORT uint32_t obs_get_audio_buffering_ms(void);
+
 EXPORT bool obs_nv12_tex_active(void);
 
 EXPORT void obs_apply_private_data(obs_data_t *settings);
@@ -1319,6 +1323,17 @@ EXPORT uint32_t obs_source_get_base_height(obs_source_t *source);
 
 EXPORT bool obs_source_audio_pending(const obs_source_t *source);
 EXPORT uint64_t obs_source_get_audio_timestamp(const obs_source_t *source);
+
+#define OBS_AUDIO_JITTER_BUCKETS 8
+
+/**
+ * Gets how much later than usual the audio packets of the source arrived,
+ * counted into buckets of up to 5, 10, 20, 40, 80, 160, 320 milliseconds and
+ * above.  Sources with a lot of late packets are the ones that make libobs add
+ * audio buffering.
+ */
+EXPORT void obs_source_get_audio_jitter(obs_source_t *source,
+					uint64_t counts[OBS_AUDIO_JITTER_BUCKETS]);
 EXPORT void obs_source_get_audio_mix(const obs_source_t *source,
 				     struct obs_source_audio_mix *audio);
 
@@ -2096,6 +2111,30 @@ EXPORT void obs_encoder_packet_ref(struct encoder_packet *dst,
 				   struct encoder_packet *src);
 EXPORT void obs_encoder_packet_release(struct encoder_packet *packet);
 
+/**
+ * Allocates the data of the packet being encoded from the packet pool and
+ * sets packet->size.  Meant to be called from the encode callback with the
+ * packet passed to it: an encoder that writes its output there is not
+ * copied, all outputs get the same data by reference.  That only applies if
+ * packet->data is still the returned pointer when the callback returns; if
+ * the encoder moves it, even to elsewhere within the buffer, the packet is
+ * copied from it as any other packet, and the buffer released afterwards.
+ */
+EXPORT uint8_t *obs_encoder_alloc_packet(obs_encoder_t *encoder,
+					 struct encoder_packet *packet,
+					 size_t size);
+
+/**
+ * Returns a pointer head_size bytes in front of the packet data, for muxers
+ * to write their container header there and tail_size bytes of trailer after
+ * the data, so that the whole tag is contiguous without copying the data.
+ * Returns NULL if there's not enough room, or if the data is shared with
+ * other references, in which case the packet has to be copied as usual.
+ */
+EXPORT uint8_t *obs_encoder_packet_get_headroom(struct encoder_packet *packet,
+						size_t head_size,
+						size_t tail_size);
+
 EXPORT void *obs_encoder_create_rerouted(obs_encoder_t *encoder,
 					 const char *reroute_id);
 
@@ -44,3 +44,34 @@ void array_output_serializer_free(struct array_output_data *data)
 {
 	da_free(data->bytes);
 }
+
+static size_t buffer_output_write(void *param, const void *data, size_t size)
+{
+	struct buffer_output_data *output = param;
+
+	if (size > output->capacity - output->pos)
+		size = output->capacity - output->pos;
+
+	memcpy(output->buffer + output->pos, data, size);
+	output->pos += size;
+	return size;
+}
+
+static int64_t buffer_output_get_pos(void *param)
+{
+	struct buffer_output_data *data = param;
+	return (int64_t)data->pos;
+}
+
+void buffer_output_serializer_init(struct serializer *s,
+				   struct buffer_output_data *data,
+				   uint8_t *buffer, size_t capacity)
+{
+	memset(s, 0, sizeof(struct serializer));
+	data->buffer = buffer;
+	data->capacity = capacity;
+	data->pos = 0;
+	s->data = data;
+	s->write = buffer_output_write;
+	s->get_pos = buffer_output_get_pos;
+}
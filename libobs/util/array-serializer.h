@@ -26,3 +26,14 @@ struct array_output_data {
 EXPORT void array_output_serializer_init(struct serializer *s,
 					 struct array_output_data *data);
 EXPORT void array_output_serializer_free(struct array_output_data *data);
+
+/* writes into a fixed buffer, anything past its end is dropped */
+struct buffer_output_data {
+	uint8_t *buffer;
+	size_t capacity;
+	size_t pos;
+};
+
+EXPORT void buffer_output_serializer_init(struct serializer *s,
+					  struct buffer_output_data *data,
+					  uint8_t *buffer, size_t capacity);
@@ -61,14 +61,22 @@ static void *a_realloc(void *ptr, size_t size)
 #ifdef ALIGNED_MALLOC
 	return _aligned_realloc(ptr, size, ALIGNMENT);
 #elif ALIGNMENT_HACK
-	long diff;
+	long diff, new_diff;
 
 	if (!ptr)
 		return a_malloc(size);
 	diff = ((char *)ptr)[-1];
-	ptr = realloc((char *)ptr - diff, size + diff);
-	if (ptr)
-		ptr = (char *)ptr + diff;
+	ptr = realloc((char *)ptr - diff, size + ALIGNMENT);
+	if (!ptr)
+		return NULL;
+
+	/* realloc only keeps malloc's alignment, move the data back onto the
+	 * boundary if the block has moved */
+	new_diff = ((~(long)ptr) & (ALIGNMENT - 1)) + 1;
+	if (new_diff != diff)
+		memmove((char *)ptr + new_diff, (char *)ptr + diff, size);
+	ptr = (char *)ptr + new_diff;
+	((char *)ptr)[-1] = (char)new_diff;
 	return ptr;
 #else
 	return realloc(ptr, size);
@@ -87,17 +95,369 @@ static void a_free(void *ptr)
 #endif
 }
 
+/* ------------------------------------------------------------------------- */
+/* slab allocator
+ *
+ *   Used instead of a_malloc when the OBS_BMEM_SLAB environment variable is
+ * set.  Small allocations come from size classes carved out of chunks that
+ * are never given back.  Every thread keeps a magazine of free blocks per
+ * class, so most allocations and frees don't touch shared state, and only
+ * exchange half a magazine with the class's free list when it runs empty or
+ * full.  Each block starts with a header holding its class, so free and
+ * realloc don't need to know the size. */
+
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_MAGAZINE_SIZE 32
+#define SLAB_LARGE UINT32_MAX
+
+static const size_t slab_class_sizes[] = {
+	32,  64,   96,   128,  192,  256,  384,
+	512, 768, 1024, 1536, 2048, 3072, 4096,
+};
+
+#define SLAB_NUM_CLASSES \
+	(sizeof(slab_class_sizes) / sizeof(slab_class_sizes[0]))
+
+/* padded to ALIGNMENT so that the data after it stays aligned */
+union slab_header {
+	struct {
+		uint32_t size_class;
+		size_t capacity;
+		union slab_header *next; /* only while on a free list */
+	};
+	char pad[ALIGNMENT];
+};
+
+struct slab_class {
+	pthread_mutex_t mutex;
+	union slab_header *free_list;
+	long free_blocks;
+	long chunks;
+	long refills;
+	long flushes;
+};
+
+struct thread_cache {
+	volatile long num_allocs;
+	union slab_header *magazines[SLAB_NUM_CLASSES][SLAB_MAGAZINE_SIZE];
+	size_t counts[SLAB_NUM_CLASSES];
+
+	struct thread_cache *next;
+	struct thread_cache **prev_next;
+};
+
+#define SLAB_MAX_SIZE 4096
+#define SLAB_GRANULARITY 32
+
+static pthread_once_t bmem_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static THREAD_LOCAL struct thread_cache *thread_cache = NULL;
+static bool slab_enabled = false;
+static struct slab_class slab_classes[SLAB_NUM_CLASSES];
+
+/* size class of every multiple of SLAB_GRANULARITY up to SLAB_MAX_SIZE */
+static uint8_t slab_class_lookup[SLAB_MAX_SIZE / SLAB_GRANULARITY + 1];
+static volatile long large_allocs = 0;
+
+/* allocation counts of the threads that have exited */
+static volatile long exited_allocs = 0;
+
+/* every live thread cache, for bnum_allocs */
+static pthread_mutex_t caches_mutex;
+static struct thread_cache *first_cache = NULL;
+
+static void *aligned_block(size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, ALIGNMENT);
+#else
+	void *ptr;
+	return posix_memalign(&ptr, ALIGNMENT, size) == 0 ? ptr : NULL;
+#endif
+}
+
+static void free_aligned_block(void *ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+static inline size_t slab_block_size(size_t size_class)
+{
+	return sizeof(union slab_header) + slab_class_sizes[size_class];
+}
+
+static void slab_refill(struct thread_cache *cache, size_t size_class)
+{
+	struct slab_class *sc = &slab_classes[size_class];
+	union slab_header **magazine = cache->magazines[size_class];
+	size_t count = 0;
+
+	pthread_mutex_lock(&sc->mutex);
+
+	if (!sc->free_list) {
+		size_t block_size = slab_block_size(size_class);
+		size_t num_blocks = SLAB_CHUNK_SIZE / block_size;
+		char *chunk = aligned_block(SLAB_CHUNK_SIZE);
+
+		if (!chunk) {
+			pthread_mutex_unlock(&sc->mutex);
+			return;
+		}
+
+		for (size_t i = num_blocks; i > 0; i--) {
+			union slab_header *block =
+				(union slab_header *)(chunk +
+						      (i - 1) * block_size);
+			block->size_class = (uint32_t)size_class;
+			block->capacity = slab_class_sizes[size_class];
+			block->next = sc->free_list;
+			sc->free_list = block;
+		}
+
+		sc->free_blocks += (long)num_blocks;
+		sc->chunks++;
+	}
+
+	while (sc->free_list && count < SLAB_MAGAZINE_SIZE / 2) {
+		magazine[count++] = sc->free_list;
+		sc->free_list = sc->free_list->next;
+	}
+
+	sc->free_blocks -= (long)count;
+	sc->refills++;
+	pthread_mutex_unlock(&sc->mutex);
+
+	cache->counts[size_class] = count;
+}
+
+static void slab_flush(struct thread_cache *cache, size_t size_class,
+		       size_t count)
+{
+	struct slab_class *sc = &slab_classes[size_class];
+	union slab_header **magazine = cache->magazines[size_class];
+	size_t *magazine_count = &cache->counts[size_class];
+
+	pthread_mutex_lock(&sc->mutex);
+	for (size_t i = 0; i < count; i++) {
+		union slab_header *block = magazine[--*magazine_count];
+		block->next = sc->free_list;
+		sc->free_list = block;
+	}
+
+	sc->free_blocks += (long)count;
+	sc->flushes++;
+	pthread_mutex_unlock(&sc->mutex);
+}
+
+static void thread_cache_destroy(void *data)
+{
+	struct thread_cache *cache = data;
+
+	for (size_t i = 0; i < SLAB_NUM_CLASSES; i++)
+		slab_flush(cache, i, cache->counts[i]);
+
+	pthread_mutex_lock(&caches_mutex);
+	*cache->prev_next = cache->next;
+	if (cache->next)
+		cache->next->prev_next = cache->prev_next;
+	os_atomic_set_long(&exited_allocs,
+			   exited_allocs + cache->num_allocs);
+	pthread_mutex_unlock(&caches_mutex);
+
+	thread_cache = NULL;
+	free(cache);
+}
+
 static struct base_allocator alloc = {a_malloc, a_realloc, a_free};
-static long num_allocs = 0;
+static bool custom_allocator = false;
+
+static void *slab_malloc(size_t size);
+static void *slab_realloc(void *ptr, size_t size);
+static void slab_free(void *ptr);
+
+static void bmem_init(void)
+{
+	const char *env = getenv("OBS_BMEM_SLAB");
+	size_t size_class = 0;
+
+	for (size_t i = 0; i < SLAB_NUM_CLASSES; i++)
+		pthread_mutex_init(&slab_classes[i].mutex, NULL);
+	pthread_mutex_init(&caches_mutex, NULL);
+	pthread_key_create(&cache_key, thread_cache_destroy);
+
+	for (size_t i = 0; i <= SLAB_MAX_SIZE / SLAB_GRANULARITY; i++) {
+		while (slab_class_sizes[size_class] < i * SLAB_GRANULARITY)
+			size_class++;
+		slab_class_lookup[i] = (uint8_t)size_class;
+	}
+
+	slab_enabled = !custom_allocator && env && *env &&
+		       strcmp(env, "0") != 0;
+	if (slab_enabled) {
+		alloc.malloc = slab_malloc;
+		alloc.realloc = slab_realloc;
+		alloc.free = slab_free;
+	}
+}
+
+static struct thread_cache *create_thread_cache(void)
+{
+	struct thread_cache *cache;
+
+	pthread_once(&bmem_once, bmem_init);
+
+	cache = calloc(1, sizeof(struct thread_cache));
+	if (!cache)
+		return NULL;
+
+	pthread_setspecific(cache_key, cache);
+	thread_cache = cache;
+
+	pthread_mutex_lock(&caches_mutex);
+	cache->next = first_cache;
+	cache->prev_next = &first_cache;
+	if (first_cache)
+		first_cache->prev_next = &cache->next;
+	first_cache = cache;
+	pthread_mutex_unlock(&caches_mutex);
+
+	return cache;
+}
+
+static inline struct thread_cache *get_thread_cache(void)
+{
+	struct thread_cache *cache = thread_cache;
+	return cache ? cache : create_thread_cache();
+}
+
+static inline size_t slab_size_class(size_t size)
+{
+	if (size > SLAB_MAX_SIZE)
+		return SLAB_NUM_CLASSES;
+	return slab_class_lookup[(size + SLAB_GRANULARITY - 1) /
+				 SLAB_GRANULARITY];
+}
+
+static void *slab_malloc(size_t size)
+{
+	size_t size_class = slab_size_class(size);
+	struct thread_cache *cache;
+	union slab_header *block;
+
+	if (size_class == SLAB_NUM_CLASSES) {
+		if (size > SIZE_MAX - sizeof(union slab_header))
+			return NULL;
+
+		block = aligned_block(sizeof(union slab_header) + size);
+		if (!block)
+			return NULL;
+
+		block->size_class = SLAB_LARGE;
+		block->capacity = size;
+		os_atomic_inc_long(&large_allocs);
+		return block + 1;
+	}
+
+	cache = get_thread_cache();
+	if (!cache)
+		return NULL;
+
+	if (!cache->counts[size_class]) {
+		slab_refill(cache, size_class);
+		if (!cache->counts[size_class])
+			return NULL;
+	}
+
+	block = cache->magazines[size_class][--cache->counts[size_class]];
+	return block + 1;
+}
+
+static void slab_free(void *ptr)
+{
+	union slab_header *block;
+	struct thread_cache *cache;
+	size_t size_class;
+
+	if (!ptr)
+		return;
+
+	block = (union slab_header *)ptr - 1;
+	if (block->size_class == SLAB_LARGE) {
+		os_atomic_dec_long(&large_allocs);
+		free_aligned_block(block);
+		return;
+	}
+
+	size_class = block->size_class;
+	cache = get_thread_cache();
+	if (!cache) {
+		/* no cache to put it into, hand it straight back */
+		struct slab_class *sc = &slab_classes[size_class];
+		pthread_mutex_lock(&sc->mutex);
+		block->next = sc->free_list;
+		sc->free_list = block;
+		sc->free_blocks++;
+		pthread_mutex_unlock(&sc->mutex);
+		return;
+	}
+
+	if (cache->counts[size_class] == SLAB_MAGAZINE_SIZE)
+		slab_flush(cache, size_class, SLAB_MAGAZINE_SIZE / 2);
+
+	cache->magazines[size_class][cache->counts[size_class]++] = block;
+}
+
+static void *slab_realloc(void *ptr, size_t size)
+{
+	union slab_header *block;
+	void *new_ptr;
+
+	if (!ptr)
+		return slab_malloc(size);
+
+	block = (union slab_header *)ptr - 1;
+	if (size <= block->capacity)
+		return ptr;
+
+	new_ptr = slab_malloc(size);
+	if (new_ptr) {
+		memcpy(new_ptr, ptr, block->capacity);
+		slab_free(ptr);
+	}
+	return new_ptr;
+}
+
+/* ------------------------------------------------------------------------- */
 
 void base_set_allocator(struct base_allocator *defs)
 {
+	custom_allocator = true;
+	pthread_once(&bmem_once, bmem_init);
 	memcpy(&alloc, defs, sizeof(struct base_allocator));
 }
 
+/* allocation counts are kept per thread so that threads don't fight over a
+ * single counter, bnum_allocs adds them up */
+static inline void count_alloc(long diff)
+{
+	struct thread_cache *cache = get_thread_cache();
+	if (cache && diff)
+		os_atomic_set_long(&cache->num_allocs,
+				   cache->num_allocs + diff);
+}
+
 void *bmalloc(size_t size)
 {
-	void *ptr = alloc.malloc(size);
+	void *ptr;
+
+	/* makes sure the allocator is set up */
+	count_alloc(1);
+
+	ptr = alloc.malloc(size);
 	if (!ptr && !size)
 		ptr = alloc.malloc(1);
 	if (!ptr) {
@@ -106,14 +466,12 @@ void *bmalloc(size_t size)
 		       (unsigned long)size);
 	}
 
-	os_atomic_inc_long(&num_allocs);
 	return ptr;
 }
 
 void *brealloc(void *ptr, size_t size)
 {
-	if (!ptr)
-		os_atomic_inc_long(&num_allocs);
+	count_alloc(ptr ? 0 : 1);
 
 	ptr = alloc.realloc(ptr, size);
 	if (!ptr && !size)
@@ -129,14 +487,56 @@ void *brealloc(void *ptr, size_t size)
 
 void bfree(void *ptr)
 {
-	if (ptr)
-		os_atomic_dec_long(&num_allocs);
+	count_alloc(ptr ? -1 : 0);
 	alloc.free(ptr);
 }
 
 long bnum_allocs(void)
 {
-	return num_allocs;
+	long num;
+
+	pthread_once(&bmem_once, bmem_init);
+
+	pthread_mutex_lock(&caches_mutex);
+	num = exited_allocs;
+	for (struct thread_cache *cache = first_cache; cache;
+	     cache = cache->next)
+		num += os_atomic_load_long(&cache->num_allocs);
+	pthread_mutex_unlock(&caches_mutex);
+
+	return num;
+}
+
+void bmem_log_stats(void)
+{
+	pthread_once(&bmem_once, bmem_init);
+	if (!slab_enabled || custom_allocator)
+		return;
+
+	blog(LOG_INFO, "bmem slab allocator:");
+	for (size_t i = 0; i < SLAB_NUM_CLASSES; i++) {
+		struct slab_class *sc = &slab_classes[i];
+		long chunks, free_blocks, refills, flushes;
+
+		pthread_mutex_lock(&sc->mutex);
+		chunks = sc->chunks;
+		free_blocks = sc->free_blocks;
+		refills = sc->refills;
+		flushes = sc->flushes;
+		pthread_mutex_unlock(&sc->mutex);
+
+		if (!chunks)
+			continue;
+
+		blog(LOG_INFO,
+		     "\t%4lu bytes: %ld KiB reserved, %ld blocks free, "
+		     "%ld refills, %ld flushes",
+		     (unsigned long)slab_class_sizes[i],
+		     chunks * (SLAB_CHUNK_SIZE / 1024), free_blocks, refills,
+		     flushes);
+	}
+	blog(LOG_INFO, "\tlarge: %ld allocations",
+	     os_atomic_load_long(&large_allocs));
 }
 
 int base_get_alignment(void)
@@ -41,6 +41,13 @@ EXPORT int base_get_alignment(void);
 
 EXPORT long bnum_allocs(void);
 
+/**
+ * Setting the OBS_BMEM_SLAB environment variable makes bmalloc serve small
+ * allocations from per-thread caches of fixed size blocks.  This logs the
+ * usage of each block size, and does nothing when it isn't enabled.
+ */
+EXPORT void bmem_log_stats(void);
+
 EXPORT void *bmemdup(const void *ptr, size_t size);
 
 static inline void *bzalloc(size_t size)
@@ -40,6 +40,16 @@
 #define _mm_andnot_ps simde_mm_andnot_ps
 #define _mm_storeu_ps simde_mm_storeu_ps
 #define _mm_loadu_ps simde_mm_loadu_ps
+#define _mm_cvtepi32_ps simde_mm_cvtepi32_ps
+#define _mm_cvtps_epi32 simde_mm_cvtps_epi32
+#define _mm_sqrt_ps simde_mm_sqrt_ps
+#define _mm_and_ps simde_mm_and_ps
+#define _mm_or_ps simde_mm_or_ps
+#define _mm_cmpeq_ps simde_mm_cmpeq_ps
+#define _mm_cmpneq_ps simde_mm_cmpneq_ps
+#define _mm_cmplt_ps simde_mm_cmplt_ps
+#define _mm_cmple_ps simde_mm_cmple_ps
+#define _mm_cvttps_epi32 simde_mm_cvttps_epi32
 
 #define __m128i simde__m128i
 #define _mm_set1_epi32 simde_mm_set1_epi32
@@ -54,6 +64,26 @@
 #define _mm_srai_epi16 simde_mm_srai_epi16
 #define _mm_shufflelo_epi16 simde_mm_shufflelo_epi16
 #define _mm_storeu_si128 simde_mm_storeu_si128
+#define _mm_setzero_si128 simde_mm_setzero_si128
+#define _mm_set_epi16 simde_mm_set_epi16
+#define _mm_loadu_si128 simde_mm_loadu_si128
+#define _mm_loadl_epi64 simde_mm_loadl_epi64
+#define _mm_storel_epi64 simde_mm_storel_epi64
+#define _mm_cvtsi32_si128 simde_mm_cvtsi32_si128
+#define _mm_cvtsi128_si32 simde_mm_cvtsi128_si32
+#define _mm_unpacklo_epi8 simde_mm_unpacklo_epi8
+#define _mm_unpackhi_epi8 simde_mm_unpackhi_epi8
+#define _mm_unpacklo_epi16 simde_mm_unpacklo_epi16
+#define _mm_unpackhi_epi16 simde_mm_unpackhi_epi16
+#define _mm_unpacklo_epi32 simde_mm_unpacklo_epi32
+#define _mm_unpackhi_epi32 simde_mm_unpackhi_epi32
+#define _mm_srli_epi32 simde_mm_srli_epi32
+#define _mm_add_epi16 simde_mm_add_epi16
+#define _mm_mullo_epi16 simde_mm_mullo_epi16
+#define _mm_srli_epi16 simde_mm_srli_epi16
+#define _mm_sub_epi16 simde_mm_sub_epi16
+#define _mm_or_si128 simde_mm_or_si128
+#define _mm_shufflehi_epi16 simde_mm_shufflehi_epi16
 
 #define _MM_SHUFFLE SIMDE_MM_SHUFFLE
 #define _MM_TRANSPOSE4_PS SIMDE_MM_TRANSPOSE4_PS
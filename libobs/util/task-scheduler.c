@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2020 by thestr4ng3r
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "base.h"
+#include "bmem.h"
+#include "threading.h"
+#include "platform.h"
+#include "task-scheduler.h"
+
+#define INLINE_DEQUES 8
+
+/* tasks [head, tail) of a participant, the owner pops at the head and
+ * thieves steal at the tail */
+struct task_deque {
+	size_t head;
+	size_t tail;
+};
+
+/* one call to task_scheduler_run, lives on the stack of the caller */
+struct task_batch {
+	const char *name;
+	task_func_t func;
+	void *param;
+
+	pthread_mutex_t mutex; /* guards the deques */
+	struct task_deque *deques;
+	struct task_deque inline_deques[INLINE_DEQUES];
+	size_t num_participants;
+
+	/* participant slots handed out so far, guarded by the scheduler */
+	size_t next_slot;
+	struct task_batch *next;
+
+	volatile long busy; /* the caller plus the workers that joined */
+	os_event_t *done;
+};
+
+struct task_worker {
+	struct task_scheduler *sched;
+	pthread_t thread;
+	bool thread_created;
+	const char *profile_name;
+};
+
+struct task_scheduler {
+	size_t num_threads; /* running workers */
+	size_t num_workers;
+	struct task_worker *workers;
+
+	/* batches that still have free participant slots, oldest first */
+	pthread_mutex_t mutex;
+	struct task_batch *first_open;
+	os_sem_t *wake;
+	volatile bool stop;
+};
+
+static bool claim_task(struct task_batch *batch, size_t self, size_t *idx)
+{
+	size_t n = batch->num_participants;
+	bool found = false;
+
+	pthread_mutex_lock(&batch->mutex);
+
+	struct task_deque *own = &batch->deques[self];
+	if (own->head < own->tail) {
+		*idx = own->head++;
+		found = true;
+	}
+
+	for (size_t i = 1; i < n && !found; i++) {
+		struct task_deque *victim = &batch->deques[(self + i) % n];
+		if (victim->head < victim->tail) {
+			*idx = --victim->tail;
+			found = true;
+		}
+	}
+
+	pthread_mutex_unlock(&batch->mutex);
+	return found;
+}
+
+static void run_tasks(struct task_batch *batch, size_t self)
+{
+	size_t idx;
+
+	while (claim_task(batch, self, &idx))
+		batch->func(batch->param, idx);
+}
+
+static void finish_participant(struct task_batch *batch)
+{
+	if (os_atomic_dec_long(&batch->busy) == 0)
+		os_event_signal(batch->done);
+}
+
+static struct task_batch *join_batch(struct task_scheduler *sched,
+				     size_t *slot)
+{
+	pthread_mutex_lock(&sched->mutex);
+
+	struct task_batch *batch = sched->first_open;
+	if (batch) {
+		*slot = batch->next_slot++;
+		os_atomic_inc_long(&batch->busy);
+		if (batch->next_slot == batch->num_participants)
+			sched->first_open = batch->next;
+	}
+
+	pthread_mutex_unlock(&sched->mutex);
+	return batch;
+}
+
+static void open_batch(struct task_scheduler *sched, struct task_batch *batch)
+{
+	struct task_batch **link = &sched->first_open;
+
+	pthread_mutex_lock(&sched->mutex);
+	while (*link)
+		link = &(*link)->next;
+	*link = batch;
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+/* no workers can join once this returns */
+static void close_batch(struct task_scheduler *sched, struct task_batch *batch)
+{
+	struct task_batch **link = &sched->first_open;
+
+	pthread_mutex_lock(&sched->mutex);
+	while (*link && *link != batch)
+		link = &(*link)->next;
+	if (*link)
+		*link = batch->next;
+	pthread_mutex_unlock(&sched->mutex);
+}
+
+static void *worker_thread(void *data)
+{
+	struct task_worker *worker = data;
+	struct task_scheduler *sched = worker->sched;
+
+	os_set_thread_name("libobs: task worker");
+
+	for (;;) {
+		os_sem_wait(sched->wake);
+		if (os_atomic_load_bool(&sched->stop))
+			break;
+
+		/* the batch may have been finished by its other participants
+		 * before this worker got to it */
+		size_t slot;
+		struct task_batch *batch = join_batch(sched, &slot);
+		if (!batch)
+			continue;
+
+		if (worker->profile_name) {
+			profile_start(worker->profile_name);
+			profile_start(batch->name);
+		}
+
+		run_tasks(batch, slot);
+
+		if (worker->profile_name) {
+			profile_end(batch->name);
+			profile_end(worker->profile_name);
+			profile_reenable_thread();
+		}
+
+		finish_participant(batch);
+	}
+
+	return NULL;
+}
+
+task_scheduler_t *task_scheduler_create(size_t num_threads,
+					profiler_name_store_t *store)
+{
+	struct task_scheduler *sched = bzalloc(sizeof(struct task_scheduler));
+
+	sched->num_workers = num_threads;
+	sched->workers = bzalloc(sizeof(struct task_worker) * num_threads);
+
+	pthread_mutex_init_value(&sched->mutex);
+	if (pthread_mutex_init(&sched->mutex, NULL) != 0)
+		goto fail;
+	if (os_sem_init(&sched->wake, 0) != 0)
+		goto fail;
+
+	for (size_t i = 0; i < num_threads; i++) {
+		struct task_worker *worker = &sched->workers[i];
+		worker->sched = sched;
+		if (store)
+			worker->profile_name = profile_store_name(
+				store, "task_scheduler worker %zu", i + 1);
+		if (pthread_create(&worker->thread, NULL, worker_thread,
+				   worker) != 0)
+			goto fail;
+		worker->thread_created = true;
+		sched->num_threads++;
+	}
+
+	return sched;
+
+fail:
+	blog(LOG_ERROR, "task_scheduler_create: Failed to start %zu threads",
+	     num_threads);
+	task_scheduler_destroy(sched);
+	return NULL;
+}
+
+void task_scheduler_destroy(task_scheduler_t *sched)
+{
+	if (!sched)
+		return;
+
+	os_atomic_set_bool(&sched->stop, true);
+
+	for (size_t i = 0; i < sched->num_threads; i++)
+		os_sem_post(sched->wake);
+	for (size_t i = 0; i < sched->num_workers; i++) {
+		struct task_worker *worker = &sched->workers[i];
+		if (worker->thread_created)
+			pthread_join(worker->thread, NULL);
+	}
+
+	pthread_mutex_destroy(&sched->mutex);
+	os_sem_destroy(sched->wake);
+	bfree(sched->workers);
+	bfree(sched);
+}
+
+size_t task_scheduler_num_threads(const task_scheduler_t *sched)
+{
+	return sched ? sched->num_threads : 0;
+}
+
+static void run_serial(size_t count, task_func_t func, void *param)
+{
+	for (size_t i = 0; i < count; i++)
+		func(param, i);
+}
+
+void task_scheduler_run(task_scheduler_t *sched, const char *name,
+			size_t count, task_func_t func, void *param)
+{
+	struct task_batch batch = {0};
+
+	if (!count)
+		return;
+
+	if (!sched || !sched->num_threads || count == 1) {
+		run_serial(count, func, param);
+		return;
+	}
+
+	if (pthread_mutex_init(&batch.mutex, NULL) != 0 ||
+	    os_event_init(&batch.done, OS_EVENT_TYPE_MANUAL) != 0) {
+		blog(LOG_WARNING, "task_scheduler_run: Failed to set up "
+				  "batch, running it serially");
+		pthread_mutex_destroy(&batch.mutex);
+		run_serial(count, func, param);
+		return;
+	}
+
+	/* no point in waking more workers than there are tasks */
+	size_t n = sched->num_threads + 1;
+	if (n > count)
+		n = count;
+
+	batch.name = name;
+	batch.func = func;
+	batch.param = param;
+	batch.num_participants = n;
+	batch.next_slot = 1; /* slot 0 belongs to the calling thread */
+	batch.busy = 1;
+	batch.deques = n > INLINE_DEQUES
+			       ? bmalloc(sizeof(struct task_deque) * n)
+			       : batch.inline_deques;
+
+	/* contiguous ranges keep neighboring tasks on the same thread */
+	size_t begin = 0;
+	for (size_t i = 0; i < n; i++) {
+		size_t end = count * (i + 1) / n;
+		batch.deques[i].head = begin;
+		batch.deques[i].tail = end;
+		begin = end;
+	}
+
+	open_batch(sched, &batch);
+	for (size_t i = 1; i < n; i++)
+		os_sem_post(sched->wake);
+
+	/* once this returns every task has been claimed, so the slots that
+	 * no worker took in the meantime aren't needed anymore */
+	run_tasks(&batch, 0);
+	close_batch(sched, &batch);
+
+	if (os_atomic_dec_long(&batch.busy) != 0)
+		os_event_wait(batch.done);
+
+	if (batch.deques != batch.inline_deques)
+		bfree(batch.deques);
+	os_event_destroy(batch.done);
+	pthread_mutex_destroy(&batch.mutex);
+}
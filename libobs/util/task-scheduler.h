@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2020 by thestr4ng3r
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include "c99defs.h"
+#include "profiler.h"
+
+/*
+ * Task scheduler
+ *
+ *   Runs batches of independent tasks on a pool of worker threads. The
+ * calling thread takes part in running the batch and returns once all tasks
+ * are done.  Every participant has its own deque of tasks which it works
+ * through from the front, and steals from the back of the others' deques
+ * once its own is empty, so uneven tasks still keep all threads busy.
+ *
+ *   Batches started from different threads, or from within a task, run at
+ * the same time.  Idle workers join the oldest batch that still has room for
+ * them, and the calling thread runs whatever no worker picked up, so a busy
+ * pool only means fewer helpers and never blocks a batch.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct task_scheduler;
+typedef struct task_scheduler task_scheduler_t;
+
+typedef void (*task_func_t)(void *param, size_t idx);
+
+/**
+ * Creates a scheduler with the given number of worker threads besides the
+ * calling thread.  0 runs everything on the calling thread.  The profiler
+ * names of the workers go to store, which has to outlive the profiler data,
+ * NULL disables profiling on the workers.
+ */
+EXPORT task_scheduler_t *task_scheduler_create(size_t num_threads,
+					       profiler_name_store_t *store);
+EXPORT void task_scheduler_destroy(task_scheduler_t *sched);
+
+EXPORT size_t task_scheduler_num_threads(const task_scheduler_t *sched);
+
+/**
+ * Calls func(param, idx) for every idx in [0, count) and waits for all of
+ * them to finish.  On the worker threads, the calls are profiled under the
+ * given name, below a root for each worker.
+ */
+EXPORT void task_scheduler_run(task_scheduler_t *sched, const char *name,
+			       size_t count, task_func_t func, void *param);
+
+#ifdef __cplusplus
+}
+#endif
@@ -180,15 +180,17 @@ bool flv_meta_data(obs_output_t *context, uint8_t **output, size_t *size,
 static int32_t last_time = 0;
 #endif
 
-static void flv_video(struct serializer *s, int32_t dts_offset,
-		      struct encoder_packet *packet, bool is_header)
+/* tag type, data size, timestamp, extended timestamp and stream ID */
+#define FLV_TAG_HEADER_SIZE 11
+#define FLV_AUDIO_HEADER_SIZE 2
+#define FLV_TAG_SIZE_SIZE 4
+
+static void flv_video_header(struct serializer *s, int32_t dts_offset,
+			     struct encoder_packet *packet, bool is_header)
 {
 	int64_t offset = packet->pts - packet->dts;
 	int32_t time_ms = get_ms_time(packet, packet->dts) - dts_offset;
 
-	if (!packet->data || !packet->size)
-		return;
-
 	s_w8(s, RTMP_PACKET_TYPE_VIDEO);
 
 #ifdef DEBUG_TIMESTAMPS
@@ -200,7 +202,7 @@ static void flv_video(struct serializer *s, int32_t dts_offset,
 	last_time = time_ms;
 #endif
 
-	s_wb24(s, (uint32_t)packet->size + 5);
+	s_wb24(s, (uint32_t)packet->size + VIDEO_HEADER_SIZE);
 	s_wb24(s, time_ms);
 	s_w8(s, (time_ms >> 24) & 0x7F);
 	s_wb24(s, 0);
@@ -209,20 +211,13 @@ static void flv_video(struct serializer *s, int32_t dts_offset,
 	s_w8(s, packet->keyframe ? 0x17 : 0x27);
 	s_w8(s, is_header ? 0 : 1);
 	s_wb24(s, get_ms_time(packet, offset));
-	s_write(s, packet->data, packet->size);
-
-	/* write tag size (starting byte doesn't count) */
-	s_wb32(s, (uint32_t)serializer_get_pos(s) - 1);
 }
 
-static void flv_audio(struct serializer *s, int32_t dts_offset,
-		      struct encoder_packet *packet, bool is_header)
+static void flv_audio_header(struct serializer *s, int32_t dts_offset,
+			     struct encoder_packet *packet, bool is_header)
 {
 	int32_t time_ms = get_ms_time(packet, packet->dts) - dts_offset;
 
-	if (!packet->data || !packet->size)
-		return;
-
 	s_w8(s, RTMP_PACKET_TYPE_AUDIO);
 
 #ifdef DEBUG_TIMESTAMPS
@@ -234,7 +229,7 @@ static void flv_audio(struct serializer *s, int32_t dts_offset,
 	last_time = time_ms;
 #endif
 
-	s_wb24(s, (uint32_t)packet->size + 2);
+	s_wb24(s, (uint32_t)packet->size + FLV_AUDIO_HEADER_SIZE);
 	s_wb24(s, time_ms);
 	s_w8(s, (time_ms >> 24) & 0x7F);
 	s_wb24(s, 0);
@@ -242,10 +237,22 @@ static void flv_audio(struct serializer *s, int32_t dts_offset,
 	/* these are the two extra bytes mentioned above */
 	s_w8(s, 0xaf);
 	s_w8(s, is_header ? 0 : 1);
-	s_write(s, packet->data, packet->size);
+}
 
-	/* write tag size (starting byte doesn't count) */
-	s_wb32(s, (uint32_t)serializer_get_pos(s) - 1);
+static inline size_t flv_header_size(struct encoder_packet *packet)
+{
+	return FLV_TAG_HEADER_SIZE + (packet->type == OBS_ENCODER_VIDEO
+					      ? VIDEO_HEADER_SIZE
+					      : FLV_AUDIO_HEADER_SIZE);
+}
+
+static void flv_header(struct serializer *s, int32_t dts_offset,
+		       struct encoder_packet *packet, bool is_header)
+{
+	if (packet->type == OBS_ENCODER_VIDEO)
+		flv_video_header(s, dts_offset, packet, is_header);
+	else
+		flv_audio_header(s, dts_offset, packet, is_header);
 }
 
 void flv_packet_mux(struct encoder_packet *packet, int32_t dts_offset,
@@ -256,11 +263,45 @@ void flv_packet_mux(struct encoder_packet *packet, int32_t dts_offset,
 
 	array_output_serializer_init(&s, &data);
 
-	if (packet->type == OBS_ENCODER_VIDEO)
-		flv_video(&s, dts_offset, packet, is_header);
-	else
-		flv_audio(&s, dts_offset, packet, is_header);
+	if (packet->data && packet->size) {
+		flv_header(&s, dts_offset, packet, is_header);
+		s_write(&s, packet->data, packet->size);
+
+		/* write tag size (starting byte doesn't count) */
+		s_wb32(&s, (uint32_t)serializer_get_pos(&s) - 1);
+	}
 
 	*output = data.bytes.array;
 	*size = data.bytes.num;
 }
+
+bool flv_packet_mux_in_place(struct encoder_packet *packet,
+			     int32_t dts_offset, uint8_t **output,
+			     size_t *size, bool is_header)
+{
+	struct buffer_output_data data;
+	struct serializer s;
+	size_t header_size = flv_header_size(packet);
+	size_t tag_size = header_size + packet->size;
+	uint8_t *tag;
+
+	if (!packet->data || !packet->size)
+		return false;
+
+	tag = obs_encoder_packet_get_headroom(packet, header_size,
+					      FLV_TAG_SIZE_SIZE);
+	if (!tag)
+		return false;
+
+	buffer_output_serializer_init(&s, &data, tag,
+				      tag_size + FLV_TAG_SIZE_SIZE);
+	flv_header(&s, dts_offset, packet, is_header);
+
+	/* the packet data is already in place after the header */
+	data.pos = tag_size;
+	s_wb32(&s, (uint32_t)tag_size - 1);
+
+	*output = tag;
+	*size = tag_size + FLV_TAG_SIZE_SIZE;
+	return true;
+}
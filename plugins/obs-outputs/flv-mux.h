@@ -32,3 +32,10 @@ extern bool flv_meta_data(obs_output_t *context, uint8_t **output, size_t *size,
 			  bool write_header, size_t audio_idx);
 extern void flv_packet_mux(struct encoder_packet *packet, int32_t dts_offset,
 			   uint8_t **output, size_t *size, bool is_header);
+
+/* writes the tag around the packet data in its headroom instead of copying
+ * it, the output then points into the packet.  returns false if the packet
+ * has no room or is shared, flv_packet_mux has to be used then. */
+extern bool flv_packet_mux_in_place(struct encoder_packet *packet,
+				    int32_t dts_offset, uint8_t **output,
+				    size_t *size, bool is_header);
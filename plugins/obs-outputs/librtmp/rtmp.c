@@ -4039,18 +4039,37 @@ RTMP_SendChunk(RTMP *r, RTMPChunk *chunk)
     return wrote;
 }
 
-int
-RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
+static int
+EncodeBasicHeader(char *header, int headerType, int channel)
+{
+    char *hptr = header;
+    char c = headerType << 6;
+
+    if (channel > 319)
+        c |= 1;
+    else if (channel <= 63)
+        c |= channel;
+    *hptr++ = c;
+    if (channel > 63)
+    {
+        int tmp = channel - 64;
+        *hptr++ = tmp & 0xff;
+        if (channel > 319)
+            *hptr++ = tmp >> 8;
+    }
+    return hptr - header;
+}
+
+/* picks the header type from the previous packet on the channel and writes
+ * the complete header of the first chunk to hbuf, returns its size or 0 */
+static int
+EncodePacketHeader(RTMP *r, RTMPPacket *packet, char *hbuf)
 {
     const RTMPPacket *prevPacket;
     uint32_t last = 0;
     int nSize;
-    int hSize, cSize;
-    char *header, *hptr, *hend, hbuf[RTMP_MAX_HEADER_SIZE], c;
+    char *hptr, *hend = hbuf + RTMP_MAX_HEADER_SIZE;
     uint32_t t;
-    char *buffer, *tbuf = NULL, *toff = NULL;
-    int nChunkSize;
-    int tlen;
 
     if (packet->m_nChannel >= r->m_channelsAllocatedOut)
     {
@@ -4061,7 +4080,7 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
             free(r->m_vecChannelsOut);
             r->m_vecChannelsOut = NULL;
             r->m_channelsAllocatedOut = 0;
-            return FALSE;
+            return 0;
         }
         r->m_vecChannelsOut = packets;
         memset(r->m_vecChannelsOut + r->m_channelsAllocatedOut, 0, sizeof(RTMPPacket*) * (n - r->m_channelsAllocatedOut));
@@ -4087,62 +4106,13 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
     {
         RTMP_Log(RTMP_LOGERROR, "sanity failed!! trying to send header of type: 0x%02x.",
                  (unsigned char)packet->m_headerType);
-        return FALSE;
+        return 0;
     }
 
     nSize = packetSize[packet->m_headerType];
-    hSize = nSize;
-    cSize = 0;
     t = packet->m_nTimeStamp - last;
 
-    if (packet->m_body)
-    {
-        header = packet->m_body - nSize;
-        hend = packet->m_body;
-    }
-    else
-    {
-        header = hbuf + 6;
-        hend = hbuf + sizeof(hbuf);
-    }
-
-    if (packet->m_nChannel > 319)
-        cSize = 2;
-    else if (packet->m_nChannel > 63)
-        cSize = 1;
-    if (cSize)
-    {
-        header -= cSize;
-        hSize += cSize;
-    }
-
-    if (nSize > 1 && t >= 0xffffff)
-    {
-        header -= 4;
-        hSize += 4;
-    }
-
-    hptr = header;
-    c = packet->m_headerType << 6;
-    switch (cSize)
-    {
-    case 0:
-        c |= packet->m_nChannel;
-        break;
-    case 1:
-        break;
-    case 2:
-        c |= 1;
-        break;
-    }
-    *hptr++ = c;
-    if (cSize)
-    {
-        int tmp = packet->m_nChannel - 64;
-        *hptr++ = tmp & 0xff;
-        if (cSize == 2)
-            *hptr++ = tmp >> 8;
-    }
+    hptr = hbuf + EncodeBasicHeader(hbuf, packet->m_headerType, packet->m_nChannel);
 
     if (nSize > 1)
     {
@@ -4161,6 +4131,43 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
     if (nSize > 1 && t >= 0xffffff)
         hptr = AMF_EncodeInt32(hptr, hend, t);
 
+    return hptr - hbuf;
+}
+
+static void
+StoreSentPacket(RTMP *r, const RTMPPacket *packet)
+{
+    if (!r->m_vecChannelsOut[packet->m_nChannel])
+        r->m_vecChannelsOut[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
+    memcpy(r->m_vecChannelsOut[packet->m_nChannel], packet, sizeof(RTMPPacket));
+}
+
+int
+RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
+{
+    int nSize;
+    int hSize, cSize;
+    char *header, hbuf[RTMP_MAX_HEADER_SIZE];
+    char *buffer, *tbuf = NULL, *toff = NULL;
+    int nChunkSize;
+    int tlen;
+
+    hSize = EncodePacketHeader(r, packet, hbuf);
+    if (!hSize)
+        return FALSE;
+
+    cSize = EncodeBasicHeader(hbuf, packet->m_headerType, packet->m_nChannel) - 1;
+
+    if (packet->m_body)
+    {
+        header = packet->m_body - hSize;
+        memcpy(header, hbuf, hSize);
+    }
+    else
+    {
+        header = hbuf;
+    }
+
     nSize = packet->m_nBodySize;
     buffer = packet->m_body;
     nChunkSize = r->m_outChunkSize;
@@ -4206,21 +4213,9 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 
         if (nSize > 0)
         {
-            header = buffer - 1;
-            hSize = 1;
-            if (cSize)
-            {
-                header -= cSize;
-                hSize += cSize;
-            }
-            *header = (0xc0 | c);
-            if (cSize)
-            {
-                int tmp = packet->m_nChannel - 64;
-                header[1] = tmp & 0xff;
-                if (cSize == 2)
-                    header[2] = tmp >> 8;
-            }
+            header = buffer - 1 - cSize;
+            hSize = EncodeBasicHeader(header, RTMP_PACKET_SIZE_MINIMUM,
+                                      packet->m_nChannel);
         }
     }
     if (tbuf)
@@ -4250,9 +4245,7 @@ RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
         }
     }
 
-    if (!r->m_vecChannelsOut[packet->m_nChannel])
-        r->m_vecChannelsOut[packet->m_nChannel] = malloc(sizeof(RTMPPacket));
-    memcpy(r->m_vecChannelsOut[packet->m_nChannel], packet, sizeof(RTMPPacket));
+    StoreSentPacket(r, packet);
     return TRUE;
 }
 
@@ -4485,6 +4478,47 @@ RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len)
     return rc;
 }
 
+int
+RTMPSockBuf_SendV(RTMPSockBuf *sb, const RTMPIOVec *vec, int count)
+{
+#ifdef _WIN32
+    WSABUF bufs[RTMP_MAX_IOVEC];
+    DWORD sent = 0;
+#else
+    struct iovec bufs[RTMP_MAX_IOVEC];
+    struct msghdr msg;
+#endif
+    int i;
+
+    if (count > RTMP_MAX_IOVEC)
+        count = RTMP_MAX_IOVEC;
+
+    for (i = 0; i < count; i++)
+    {
+#if defined(RTMP_NETSTACK_DUMP)
+        fwrite(vec[i].iov_base, 1, vec[i].iov_len, netstackdump);
+#endif
+#ifdef _WIN32
+        bufs[i].buf = (CHAR *)vec[i].iov_base;
+        bufs[i].len = (ULONG)vec[i].iov_len;
+#else
+        bufs[i].iov_base = (void *)vec[i].iov_base;
+        bufs[i].iov_len = vec[i].iov_len;
+#endif
+    }
+
+#ifdef _WIN32
+    if (WSASend(sb->sb_socket, bufs, count, &sent, 0, NULL, NULL) != 0)
+        return -1;
+    return (int)sent;
+#else
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = bufs;
+    msg.msg_iovlen = count;
+    return (int)sendmsg(sb->sb_socket, &msg, MSG_NOSIGNAL);
+#endif
+}
+
 int
 RTMPSockBuf_Close(RTMPSockBuf *sb)
 {
@@ -5355,3 +5389,132 @@ RTMP_Write(RTMP *r, const char *buf, int size, int streamIdx)
     }
     return size+s2;
 }
+
+void
+RTMP_ChunkTagSize(RTMP *r, const char *buf, int *numVec, int *hdrsSize)
+{
+    int nSize = AMF_DecodeInt24(buf + 1);
+    int chunks = nSize ? (nSize + r->m_outChunkSize - 1) / r->m_outChunkSize : 1;
+
+    *numVec = chunks * 2;
+    *hdrsSize = RTMP_MAX_HEADER_SIZE + (chunks - 1) * 3;
+}
+
+int
+RTMP_ChunkTag(RTMP *r, const char *buf, int size, int streamIdx,
+              RTMPIOVec *vec, char *hdrs)
+{
+    RTMPPacket packet = {0};
+    const char *body = buf + 11;
+    int nSize, hSize;
+    int count = 0;
+
+    if (size < 11)
+        return 0;
+
+    packet.m_nChannel = 0x04;	/* source channel */
+    packet.m_nInfoField2 = r->Link.streams[streamIdx].id;
+    packet.m_packetType = buf[0];
+    packet.m_nBodySize = AMF_DecodeInt24(buf + 1);
+    packet.m_nTimeStamp = AMF_DecodeInt24(buf + 4);
+    packet.m_nTimeStamp |= (uint32_t)(uint8_t)buf[7] << 24;
+
+    if (packet.m_packetType != RTMP_PACKET_TYPE_AUDIO
+            && packet.m_packetType != RTMP_PACKET_TYPE_VIDEO)
+        return 0;
+    if (size < 11 + (int)packet.m_nBodySize)
+        return 0;
+
+    packet.m_headerType = packet.m_nTimeStamp ? RTMP_PACKET_SIZE_MEDIUM
+                                              : RTMP_PACKET_SIZE_LARGE;
+
+    hSize = EncodePacketHeader(r, &packet, hdrs);
+    if (!hSize)
+        return 0;
+
+    nSize = packet.m_nBodySize;
+    for (;;)
+    {
+        int nChunkSize = nSize < r->m_outChunkSize ? nSize : r->m_outChunkSize;
+
+        vec[count].iov_base = hdrs;
+        vec[count++].iov_len = hSize;
+        hdrs += hSize;
+
+        if (nChunkSize)
+        {
+            vec[count].iov_base = body;
+            vec[count++].iov_len = nChunkSize;
+        }
+        nSize -= nChunkSize;
+        body += nChunkSize;
+
+        if (nSize <= 0)
+            break;
+
+        hSize = EncodeBasicHeader(hdrs, RTMP_PACKET_SIZE_MINIMUM,
+                                  packet.m_nChannel);
+    }
+
+    /* the next header is compressed against this one whether or not the
+     * caller manages to send it, a failed send closes the connection */
+    StoreSentPacket(r, &packet);
+    return count;
+}
+
+int
+RTMP_CanWriteV(RTMP *r)
+{
+    if (r->Link.protocol & RTMP_FEATURE_HTTP)
+        return FALSE;
+    if (r->m_bCustomSend && r->m_customSendFunc)
+        return FALSE;
+    if (r->m_sb.sb_ssl)
+        return FALSE;
+#ifdef CRYPTO
+    if (r->Link.rc4keyOut)
+        return FALSE;
+#endif
+    return TRUE;
+}
+
+int
+RTMP_WriteV(RTMP *r, RTMPIOVec *vec, int count)
+{
+    while (count > 0)
+    {
+        int nBytes = RTMPSockBuf_SendV(&r->m_sb, vec, count);
+
+        if (nBytes < 0)
+        {
+            int sockerr = GetSockError();
+            RTMP_Log(RTMP_LOGERROR, "%s, RTMP send error %d (%d buffers)", __FUNCTION__,
+                     sockerr, count);
+
+            if (sockerr == EINTR && !RTMP_ctrlC)
+                continue;
+
+            r->last_error_code = sockerr;
+
+            RTMP_Close(r);
+            return FALSE;
+        }
+
+        if (nBytes == 0)
+            return FALSE;
+
+        /* skip what was sent, partial sends resume mid buffer */
+        while (count > 0 && nBytes >= vec->iov_len)
+        {
+            nBytes -= vec->iov_len;
+            vec++;
+            count--;
+        }
+        if (nBytes)
+        {
+            vec->iov_base += nBytes;
+            vec->iov_len -= nBytes;
+        }
+    }
+    return TRUE;
+}
@@ -249,6 +249,15 @@ extern "C"
         char c_header[RTMP_MAX_HEADER_SIZE];
     } RTMPChunk;
 
+    /* most buffers RTMP_WriteV sends with a single system call */
+#define RTMP_MAX_IOVEC 512
+
+    typedef struct RTMPIOVec
+    {
+        const char *iov_base;
+        int iov_len;
+    } RTMPIOVec;
+
     typedef struct RTMPPacket
     {
         uint8_t m_headerType;
@@ -529,6 +538,7 @@ extern "C"
 
     int RTMPSockBuf_Fill(RTMPSockBuf *sb);
     int RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len);
+    int RTMPSockBuf_SendV(RTMPSockBuf *sb, const RTMPIOVec *vec, int count);
     int RTMPSockBuf_Close(RTMPSockBuf *sb);
 
     int RTMP_SendCreateStream(RTMP *r);
@@ -539,6 +549,21 @@ extern "C"
     int RTMP_Read(RTMP *r, char *buf, int size);
     int RTMP_Write(RTMP *r, const char *buf, int size, int streamIdx);
 
+    /* Vectored writing: RTMP_ChunkTag splits a complete audio or video FLV
+     * tag into chunks like RTMP_Write, but instead of copying the tag it
+     * adds alternating chunk header and body buffers to vec, with the
+     * headers stored in hdrs and the bodies pointing into buf.  It needs
+     * the number of vec entries and hdrs bytes RTMP_ChunkTagSize reports,
+     * and returns the number of vec entries used, or 0 on failure.
+     * RTMP_WriteV then sends the buffers; it is only available if
+     * RTMP_CanWriteV, i.e. on plain, unencrypted sockets. */
+    void RTMP_ChunkTagSize(RTMP *r, const char *buf, int *numVec,
+                           int *hdrsSize);
+    int RTMP_ChunkTag(RTMP *r, const char *buf, int size, int streamIdx,
+                      RTMPIOVec *vec, char *hdrs);
+    int RTMP_CanWriteV(RTMP *r);
+    int RTMP_WriteV(RTMP *r, RTMPIOVec *vec, int count);
+
 #ifdef USE_HASHSWF
     /* hashswf.c */
     int RTMP_HashSWF(const char *url, unsigned int *size, unsigned char *hash,
@@ -0,0 +1,274 @@
+/******************************************************************************
+    Copyright (C) 2014 by Hugh Bailey <obs.jim@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#include <obs-avc.h>
+#include "rtmp-common.h"
+#include "flv-mux.h"
+#include "net-if.h"
+
+#ifndef _WIN32
+#include <sys/ioctl.h>
+#endif
+
+static inline void set_rtmp_dstr(AVal *val, struct dstr *str)
+{
+	bool valid = !dstr_is_empty(str);
+	val->av_val = valid ? str->array : NULL;
+	val->av_len = valid ? (int)str->len : 0;
+}
+
+bool rtmp_setup_link(RTMP *rtmp, obs_output_t *output,
+		     const struct rtmp_link_info *link)
+{
+	// since we don't call RTMP_Init here, there's no other good place
+	// to reset this as doing it in RTMP_Close breaks the ugly RTMP
+	// authentication system
+	memset(&rtmp->Link, 0, sizeof(rtmp->Link));
+	rtmp->last_error_code = 0;
+
+	if (!RTMP_SetupURL(rtmp, link->path->array))
+		return false;
+
+	RTMP_EnableWrite(rtmp);
+
+	set_rtmp_dstr(&rtmp->Link.pubUser, link->username);
+	set_rtmp_dstr(&rtmp->Link.pubPasswd, link->password);
+	set_rtmp_dstr(&rtmp->Link.flashVer, link->encoder_name);
+	rtmp->Link.swfUrl = rtmp->Link.tcUrl;
+
+	RTMP_AddStream(rtmp, link->key->array);
+
+	for (size_t idx = 1;; idx++) {
+		obs_encoder_t *encoder =
+			obs_output_get_audio_encoder(output, idx);
+
+		if (!encoder)
+			break;
+
+		RTMP_AddStream(rtmp, obs_encoder_get_name(encoder));
+	}
+
+	rtmp->m_outChunkSize = 4096;
+	rtmp->m_bSendChunkSizeInfo = true;
+	rtmp->m_bUseNagle = true;
+	return true;
+}
+
+bool rtmp_set_bind_ip(RTMP *rtmp, struct dstr *bind_ip)
+{
+	if (dstr_is_empty(bind_ip) || dstr_cmp(bind_ip, "default") == 0) {
+		memset(&rtmp->m_bindIP, 0, sizeof(rtmp->m_bindIP));
+		return false;
+	}
+
+	return netif_str_to_addr(&rtmp->m_bindIP.addr, &rtmp->m_bindIP.addrLen,
+				 bind_ip->array);
+}
+
+bool rtmp_send_meta_data(RTMP *rtmp, obs_output_t *output)
+{
+	bool next = true;
+
+	for (size_t idx = 0; next; idx++) {
+		uint8_t *meta_data;
+		size_t meta_data_size;
+		bool success = true;
+
+		next = flv_meta_data(output, &meta_data, &meta_data_size, false,
+				     idx);
+		if (next) {
+			success = RTMP_Write(rtmp, (char *)meta_data,
+					     (int)meta_data_size,
+					     (int)idx) >= 0;
+			bfree(meta_data);
+		}
+		if (!success)
+			return false;
+	}
+
+	return true;
+}
+
+static bool send_header_packet(RTMP *rtmp, struct encoder_packet *packet,
+			       size_t idx, uint64_t *bytes_sent)
+{
+	uint8_t *data;
+	size_t size;
+	int ret;
+
+	flv_packet_mux(packet, 0, &data, &size, true);
+	ret = RTMP_Write(rtmp, (char *)data, (int)size, (int)idx);
+	bfree(data);
+	bfree(packet->data);
+
+	*bytes_sent += size;
+	return ret >= 0;
+}
+
+static bool send_audio_header(RTMP *rtmp, obs_output_t *output, size_t idx,
+			      bool *next, uint64_t *bytes_sent)
+{
+	obs_encoder_t *aencoder = obs_output_get_audio_encoder(output, idx);
+	uint8_t *header;
+
+	struct encoder_packet packet = {.type = OBS_ENCODER_AUDIO,
+					.timebase_den = 1};
+
+	if (!aencoder) {
+		*next = false;
+		return true;
+	}
+
+	obs_encoder_get_extra_data(aencoder, &header, &packet.size);
+	packet.data = bmemdup(header, packet.size);
+	return send_header_packet(rtmp, &packet, idx, bytes_sent);
+}
+
+static bool send_video_header(RTMP *rtmp, obs_output_t *output,
+			      uint64_t *bytes_sent)
+{
+	obs_encoder_t *vencoder = obs_output_get_video_encoder(output);
+	uint8_t *header;
+	size_t size;
+
+	struct encoder_packet packet = {
+		.type = OBS_ENCODER_VIDEO, .timebase_den = 1, .keyframe = true};
+
+	obs_encoder_get_extra_data(vencoder, &header, &size);
+	packet.size = obs_parse_avc_header(&packet.data, header, size);
+	return send_header_packet(rtmp, &packet, 0, bytes_sent);
+}
+
+bool rtmp_send_headers(RTMP *rtmp, obs_output_t *output, uint64_t *bytes_sent)
+{
+	size_t i = 0;
+	bool next = true;
+
+	if (!send_audio_header(rtmp, output, i++, &next, bytes_sent))
+		return false;
+	if (!send_video_header(rtmp, output, bytes_sent))
+		return false;
+
+	while (next) {
+		if (!send_audio_header(rtmp, output, i++, &next, bytes_sent))
+			return false;
+	}
+
+	return true;
+}
+
+static bool discard_recv_data(RTMP *rtmp, size_t size)
+{
+	uint8_t buf[512];
+#ifdef _WIN32
+	int ret;
+#else
+	ssize_t ret;
+#endif
+
+	do {
+		size_t bytes = size > 512 ? 512 : size;
+		size -= bytes;
+
+#ifdef _WIN32
+		ret = recv(rtmp->m_sb.sb_socket, buf, (int)bytes, 0);
+#else
+		ret = recv(rtmp->m_sb.sb_socket, buf, bytes, 0);
+#endif
+
+		if (ret <= 0) {
+#ifdef _WIN32
+			int error = WSAGetLastError();
+#else
+			int error = errno;
+#endif
+			if (ret < 0) {
+				blog(LOG_ERROR, "[rtmp] recv error: %d (%d bytes)",
+				     error, (int)size);
+			}
+			return false;
+		}
+	} while (size > 0);
+
+	return true;
+}
+
+bool rtmp_discard_pending_recv_data(RTMP *rtmp)
+{
+	int recv_size = 0;
+	int ret;
+
+#ifdef _WIN32
+	ret = ioctlsocket(rtmp->m_sb.sb_socket, FIONREAD, (u_long *)&recv_size);
+#else
+	ret = ioctl(rtmp->m_sb.sb_socket, FIONREAD, &recv_size);
+#endif
+
+	if (ret >= 0 && recv_size > 0)
+		return discard_recv_data(rtmp, (size_t)recv_size);
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int rtmp_drop_frames(struct circlebuf *queue, size_t item_size,
+		     int highest_priority, void (*release)(void *item))
+{
+	struct circlebuf new_buf = {0};
+	int num_frames_dropped = 0;
+	uint8_t *item = bmalloc(item_size);
+
+	circlebuf_reserve(&new_buf, item_size * 8);
+
+	while (queue->size) {
+		struct encoder_packet *packet = (struct encoder_packet *)item;
+		circlebuf_pop_front(queue, item, item_size);
+
+		/* do not drop audio data or video keyframes */
+		if (packet->type == OBS_ENCODER_AUDIO ||
+		    packet->drop_priority >= highest_priority) {
+			circlebuf_push_back(&new_buf, item, item_size);
+
+		} else {
+			num_frames_dropped++;
+			release(item);
+		}
+	}
+
+	circlebuf_free(queue);
+	*queue = new_buf;
+
+	bfree(item);
+	return num_frames_dropped;
+}
+
+bool rtmp_first_video_dts(struct circlebuf *queue, size_t item_size,
+			  int64_t *dts_usec)
+{
+	size_t count = rtmp_queued_packets(queue, item_size);
+
+	for (size_t i = 0; i < count; i++) {
+		struct encoder_packet *cur =
+			circlebuf_data(queue, i * item_size);
+		if (cur->type == OBS_ENCODER_VIDEO && !cur->keyframe) {
+			*dts_usec = cur->dts_usec;
+			return true;
+		}
+	}
+
+	return false;
+}
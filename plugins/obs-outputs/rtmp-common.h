@@ -0,0 +1,66 @@
+/******************************************************************************
+    Copyright (C) 2014 by Hugh Bailey <obs.jim@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+#pragma once
+
+#include <obs.h>
+#include <util/circlebuf.h>
+#include <util/dstr.h>
+#include "librtmp/rtmp.h"
+
+/* what a connection is set up with.  the RTMP link references the strings,
+ * so they have to outlive the connection */
+struct rtmp_link_info {
+	struct dstr *path;
+	struct dstr *key;
+	struct dstr *username;
+	struct dstr *password;
+	struct dstr *encoder_name;
+};
+
+/* sets up the link and a stream for every audio track of the output,
+ * returns false if the URL is invalid */
+extern bool rtmp_setup_link(RTMP *rtmp, obs_output_t *output,
+			    const struct rtmp_link_info *link);
+
+/* returns true if the connection is bound to a specific address */
+extern bool rtmp_set_bind_ip(RTMP *rtmp, struct dstr *bind_ip);
+
+extern bool rtmp_send_meta_data(RTMP *rtmp, obs_output_t *output);
+extern bool rtmp_send_headers(RTMP *rtmp, obs_output_t *output,
+			      uint64_t *bytes_sent);
+
+extern bool rtmp_discard_pending_recv_data(RTMP *rtmp);
+
+/* ------------------------------------------------------------------------- */
+/* frame dropping on the packet queues of the outputs, whose items start with
+ * the struct encoder_packet they were queued for */
+
+static inline size_t rtmp_queued_packets(const struct circlebuf *queue,
+					 size_t item_size)
+{
+	return queue->size / item_size;
+}
+
+/* drops the queued video below highest_priority, returns the count */
+extern int rtmp_drop_frames(struct circlebuf *queue, size_t item_size,
+			    int highest_priority,
+			    void (*release)(void *item));
+
+/* finds the dts of the first queued video frame that could be dropped */
+extern bool rtmp_first_video_dts(struct circlebuf *queue, size_t item_size,
+				 int64_t *dts_usec);
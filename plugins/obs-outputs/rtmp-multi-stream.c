@@ -0,0 +1,1013 @@
+/******************************************************************************
+    Copyright (C) 2014 by Hugh Bailey <obs.jim@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+******************************************************************************/
+
+/*
+ * RTMP output sending the same encoded stream to several servers.
+ *
+ *   Every packet is muxed to an FLV tag once and the tag is shared by all
+ * targets.  Each target has its own connection, send thread and packet
+ * queue, and chunks the shared tags for its connection without copying
+ * them, so a slow target only drops its own frames and never holds back
+ * the others.
+ */
+
+#include <obs-module.h>
+#include <obs-avc.h>
+#include <util/platform.h>
+#include <util/circlebuf.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <util/threading.h>
+#include <inttypes.h>
+#include "librtmp/rtmp.h"
+#include "librtmp/log.h"
+#include "flv-mux.h"
+#include "rtmp-common.h"
+#include "net-if.h"
+
+#define do_log(level, format, ...)                       \
+	blog(level, "[rtmp multi stream: '%s'] " format, \
+	     obs_output_get_name(stream->output), ##__VA_ARGS__)
+
+#define warn(format, ...) do_log(LOG_WARNING, format, ##__VA_ARGS__)
+#define info(format, ...) do_log(LOG_INFO, format, ##__VA_ARGS__)
+
+#define target_log(level, format, ...)                          \
+	blog(level, "[rtmp multi stream: '%s' #%d] " format,    \
+	     obs_output_get_name(target->stream->output),       \
+	     (int)target->idx, ##__VA_ARGS__)
+
+#define target_warn(format, ...) \
+	target_log(LOG_WARNING, format, ##__VA_ARGS__)
+#define target_info(format, ...) target_log(LOG_INFO, format, ##__VA_ARGS__)
+
+#define OPT_TARGETS "targets"
+#define OPT_DROP_THRESHOLD "drop_threshold_ms"
+#define OPT_PFRAME_DROP_THRESHOLD "pframe_drop_threshold_ms"
+#define OPT_MAX_SHUTDOWN_TIME_SEC "max_shutdown_time_sec"
+#define OPT_BIND_IP "bind_ip"
+
+/* every packet takes at least a header and a body buffer */
+#define MULTI_BATCH_MAX_PACKETS (RTMP_MAX_IOVEC / 2)
+
+/* an encoder packet muxed to an FLV tag, shared by the target queues */
+struct multi_packet {
+	volatile long refs;
+	struct encoder_packet packet;
+	uint8_t *data;
+	size_t size;
+	bool in_place;
+};
+
+/* queued for a target, starts with the packet the shared frame dropping
+ * looks at, which holds no reference of its own */
+struct target_packet {
+	struct encoder_packet packet;
+	struct multi_packet *mp;
+};
+
+struct rtmp_target {
+	struct rtmp_multi_stream *stream;
+	size_t idx;
+
+	struct dstr path, key;
+	struct dstr username, password;
+	RTMP rtmp;
+
+	pthread_t send_thread;
+	bool thread_created;
+	os_sem_t *send_sem;
+	bool sent_headers;
+
+	volatile bool connected;
+	volatile bool disconnected;
+
+	/* queued struct target_packet */
+	pthread_mutex_t packets_mutex;
+	struct circlebuf packets;
+
+	/* frame drop variables */
+	int min_priority;
+	float congestion;
+	int64_t last_dts_usec;
+	int dropped_frames;
+	uint64_t total_bytes_sent;
+
+	RTMPIOVec vec[RTMP_MAX_IOVEC];
+	char hdrs[MULTI_BATCH_MAX_PACKETS * RTMP_MAX_HEADER_SIZE];
+};
+
+struct rtmp_multi_stream {
+	obs_output_t *output;
+
+	/* the stats callbacks can be called during a reconnect */
+	pthread_mutex_t targets_mutex;
+	DARRAY(struct rtmp_target *) targets;
+
+	volatile bool connecting;
+	volatile bool active;
+	volatile bool encode_error;
+	pthread_t stream_thread;
+	os_event_t *connect_done;
+	os_sem_t *connect_sem;
+
+	os_event_t *stop_event;
+	uint64_t stop_ts;
+	uint64_t shutdown_timeout_ts;
+	int max_shutdown_time_sec;
+
+	bool got_first_video;
+	int64_t start_dts_offset;
+
+	int64_t drop_threshold_usec;
+	int64_t pframe_drop_threshold_usec;
+	struct dstr encoder_name;
+	struct dstr bind_ip;
+};
+
+static const char *rtmp_multi_stream_getname(void *unused)
+{
+	UNUSED_PARAMETER(unused);
+	return obs_module_text("RTMPMultiStream");
+}
+
+static inline bool stopping(struct rtmp_multi_stream *stream)
+{
+	return os_event_try(stream->stop_event) != EAGAIN;
+}
+
+static inline bool connecting(struct rtmp_multi_stream *stream)
+{
+	return os_atomic_load_bool(&stream->connecting);
+}
+
+static inline bool active(struct rtmp_multi_stream *stream)
+{
+	return os_atomic_load_bool(&stream->active);
+}
+
+static inline void multi_packet_addref(struct multi_packet *mp)
+{
+	os_atomic_inc_long(&mp->refs);
+}
+
+static void multi_packet_release(struct multi_packet *mp)
+{
+	if (os_atomic_dec_long(&mp->refs) != 0)
+		return;
+
+	if (!mp->in_place)
+		bfree(mp->data);
+	obs_encoder_packet_release(&mp->packet);
+	bfree(mp);
+}
+
+static inline size_t num_buffered_packets(struct rtmp_target *target)
+{
+	return rtmp_queued_packets(&target->packets,
+				   sizeof(struct target_packet));
+}
+
+static void release_target_packet(void *item)
+{
+	struct target_packet *tp = item;
+	multi_packet_release(tp->mp);
+}
+
+static void free_packets(struct rtmp_target *target)
+{
+	pthread_mutex_lock(&target->packets_mutex);
+	while (target->packets.size) {
+		struct target_packet tp;
+		circlebuf_pop_front(&target->packets, &tp, sizeof(tp));
+		multi_packet_release(tp.mp);
+	}
+	pthread_mutex_unlock(&target->packets_mutex);
+}
+
+static void target_destroy(struct rtmp_target *target)
+{
+	if (!target)
+		return;
+
+	free_packets(target);
+	RTMP_TLS_Free(&target->rtmp);
+	dstr_free(&target->path);
+	dstr_free(&target->key);
+	dstr_free(&target->username);
+	dstr_free(&target->password);
+	os_sem_destroy(target->send_sem);
+	pthread_mutex_destroy(&target->packets_mutex);
+	circlebuf_free(&target->packets);
+	bfree(target);
+}
+
+static void free_targets(struct rtmp_multi_stream *stream)
+{
+	DARRAY(struct rtmp_target *) targets;
+	da_init(targets);
+
+	pthread_mutex_lock(&stream->targets_mutex);
+	da_move(targets, stream->targets);
+	pthread_mutex_unlock(&stream->targets_mutex);
+
+	for (size_t i = 0; i < targets.num; i++)
+		target_destroy(targets.array[i]);
+	da_free(targets);
+}
+
+static inline void signal_targets(struct rtmp_multi_stream *stream)
+{
+	for (size_t i = 0; i < stream->targets.num; i++)
+		os_sem_post(stream->targets.array[i]->send_sem);
+}
+
+static void rtmp_multi_stream_destroy(void *data)
+{
+	struct rtmp_multi_stream *stream = data;
+
+	if (stopping(stream) && !connecting(stream)) {
+		pthread_join(stream->stream_thread, NULL);
+
+	} else if (connecting(stream) || active(stream)) {
+		if (connecting(stream))
+			os_event_wait(stream->connect_done);
+
+		/* without any connected target the thread is detached */
+		if (active(stream)) {
+			stream->stop_ts = 0;
+			os_event_signal(stream->stop_event);
+			signal_targets(stream);
+
+			obs_output_end_data_capture(stream->output);
+			pthread_join(stream->stream_thread, NULL);
+		}
+	}
+
+	free_targets(stream);
+	dstr_free(&stream->encoder_name);
+	dstr_free(&stream->bind_ip);
+	os_event_destroy(stream->connect_done);
+	os_sem_destroy(stream->connect_sem);
+	os_event_destroy(stream->stop_event);
+	pthread_mutex_destroy(&stream->targets_mutex);
+	bfree(stream);
+}
+
+static void *rtmp_multi_stream_create(obs_data_t *settings,
+				      obs_output_t *output)
+{
+	struct rtmp_multi_stream *stream =
+		bzalloc(sizeof(struct rtmp_multi_stream));
+	stream->output = output;
+	pthread_mutex_init_value(&stream->targets_mutex);
+
+	if (pthread_mutex_init(&stream->targets_mutex, NULL) != 0)
+		goto fail;
+	if (os_event_init(&stream->stop_event, OS_EVENT_TYPE_MANUAL) != 0)
+		goto fail;
+	if (os_event_init(&stream->connect_done, OS_EVENT_TYPE_MANUAL) != 0)
+		goto fail;
+
+	UNUSED_PARAMETER(settings);
+	return stream;
+
+fail:
+	rtmp_multi_stream_destroy(stream);
+	return NULL;
+}
+
+static void rtmp_multi_stream_stop(void *data, uint64_t ts)
+{
+	struct rtmp_multi_stream *stream = data;
+
+	if (stopping(stream) && ts != 0)
+		return;
+
+	if (connecting(stream))
+		os_event_wait(stream->connect_done);
+
+	stream->stop_ts = ts / 1000ULL;
+
+	if (ts)
+		stream->shutdown_timeout_ts =
+			ts +
+			(uint64_t)stream->max_shutdown_time_sec * 1000000000ULL;
+
+	if (active(stream)) {
+		os_event_signal(stream->stop_event);
+		if (stream->stop_ts == 0)
+			signal_targets(stream);
+	} else {
+		obs_output_signal_stop(stream->output, OBS_OUTPUT_SUCCESS);
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* sending */
+
+static bool send_headers(struct rtmp_target *target)
+{
+	target->sent_headers = true;
+	return rtmp_send_headers(&target->rtmp, target->stream->output,
+				 &target->total_bytes_sent);
+}
+
+/* sends the packets, with as few vectored writes as possible if the
+ * connection allows it */
+static bool send_packets(struct rtmp_target *target,
+			 struct multi_packet **packets, size_t count)
+{
+	RTMP *rtmp = &target->rtmp;
+	bool vectored = RTMP_CanWriteV(rtmp);
+	int num_vec = 0;
+	int hdrs_size = 0;
+
+	if (!rtmp_discard_pending_recv_data(rtmp)) {
+		target_warn("recv error while discarding data");
+		return false;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		struct multi_packet *mp = packets[i];
+		int idx = (int)mp->packet.track_idx;
+		int packet_vec = 0;
+		int packet_hdrs = 0;
+
+		target->total_bytes_sent += mp->size;
+
+		if (vectored) {
+			RTMP_ChunkTagSize(rtmp, (char *)mp->data, &packet_vec,
+					  &packet_hdrs);
+
+			if (num_vec + packet_vec > RTMP_MAX_IOVEC ||
+			    hdrs_size + packet_hdrs >
+				    (int)sizeof(target->hdrs)) {
+				if (!RTMP_WriteV(rtmp, target->vec, num_vec))
+					return false;
+				num_vec = 0;
+				hdrs_size = 0;
+			}
+		}
+
+		if (!vectored || packet_vec > RTMP_MAX_IOVEC ||
+		    packet_hdrs > (int)sizeof(target->hdrs)) {
+			if (RTMP_Write(rtmp, (char *)mp->data, (int)mp->size,
+				       idx) < 0)
+				return false;
+			continue;
+		}
+
+		packet_vec = RTMP_ChunkTag(rtmp, (char *)mp->data,
+					   (int)mp->size, idx,
+					   target->vec + num_vec,
+					   target->hdrs + hdrs_size);
+		if (!packet_vec)
+			return false;
+
+		num_vec += packet_vec;
+		hdrs_size += packet_hdrs;
+	}
+
+	return !num_vec || RTMP_WriteV(rtmp, target->vec, num_vec);
+}
+
+static inline bool can_shutdown_target(struct rtmp_multi_stream *stream,
+				       struct multi_packet *mp)
+{
+	uint64_t cur_time = os_gettime_ns();
+	bool timeout = cur_time >= stream->shutdown_timeout_ts;
+
+	return timeout || mp->packet.sys_dts_usec >= (int64_t)stream->stop_ts;
+}
+
+/* takes up to max queued packets, stops at the first one past the stop
+ * time.  returns false if the target is done. */
+static bool get_next_packets(struct rtmp_target *target,
+			     struct multi_packet **packets, size_t max,
+			     size_t *count)
+{
+	struct rtmp_multi_stream *stream = target->stream;
+	bool shutdown = false;
+
+	*count = 0;
+
+	pthread_mutex_lock(&target->packets_mutex);
+	while (*count < max && target->packets.size) {
+		struct target_packet tp;
+		circlebuf_pop_front(&target->packets, &tp, sizeof(tp));
+
+		if (stopping(stream) && can_shutdown_target(stream, tp.mp)) {
+			multi_packet_release(tp.mp);
+			shutdown = true;
+			break;
+		}
+
+		packets[(*count)++] = tp.mp;
+	}
+	pthread_mutex_unlock(&target->packets_mutex);
+
+	return !shutdown;
+}
+
+static void send_loop(struct rtmp_target *target)
+{
+	struct rtmp_multi_stream *stream = target->stream;
+	struct multi_packet *packets[MULTI_BATCH_MAX_PACKETS];
+
+	while (os_sem_wait(target->send_sem) == 0) {
+		size_t count;
+		bool more;
+		bool success;
+
+		if (stopping(stream) && stream->stop_ts == 0)
+			break;
+		if (os_atomic_load_bool(&stream->encode_error))
+			break;
+
+		/* everything queued up by now goes out together */
+		more = get_next_packets(target, packets,
+					MULTI_BATCH_MAX_PACKETS, &count);
+		if (!count) {
+			if (!more)
+				break;
+			continue;
+		}
+
+		success = target->sent_headers || send_headers(target);
+		if (success)
+			success = send_packets(target, packets, count);
+
+		for (size_t i = 0; i < count; i++)
+			multi_packet_release(packets[i]);
+
+		if (!success) {
+			target_info("Disconnected from %s",
+				    target->path.array);
+			break;
+		}
+		if (!more)
+			break;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* connecting */
+
+static int connect_target(struct rtmp_target *target)
+{
+	struct rtmp_multi_stream *stream = target->stream;
+	RTMP *rtmp = &target->rtmp;
+
+	if (dstr_is_empty(&target->path)) {
+		target_warn("URL is empty");
+		return OBS_OUTPUT_BAD_PATH;
+	}
+
+	target_info("Connecting to RTMP URL %s...", target->path.array);
+
+	struct rtmp_link_info link = {
+		.path = &target->path,
+		.key = &target->key,
+		.username = &target->username,
+		.password = &target->password,
+		.encoder_name = &stream->encoder_name,
+	};
+
+	if (!rtmp_setup_link(rtmp, stream->output, &link))
+		return OBS_OUTPUT_BAD_PATH;
+
+	rtmp_set_bind_ip(rtmp, &stream->bind_ip);
+
+	if (!RTMP_Connect(rtmp, NULL))
+		return OBS_OUTPUT_CONNECT_FAILED;
+
+	if (!RTMP_ConnectStream(rtmp, 0))
+		return OBS_OUTPUT_INVALID_STREAM;
+
+	if (!rtmp_send_meta_data(rtmp, stream->output)) {
+		target_warn("Disconnected while attempting to connect to "
+			    "server.");
+		return OBS_OUTPUT_DISCONNECTED;
+	}
+
+	target_info("Connection to %s successful", target->path.array);
+	return OBS_OUTPUT_SUCCESS;
+}
+
+static void *target_thread(void *data)
+{
+	struct rtmp_target *target = data;
+	struct rtmp_multi_stream *stream = target->stream;
+	int ret;
+
+	os_set_thread_name("rtmp-multi-stream: target_thread");
+
+	ret = connect_target(target);
+	if (ret != OBS_OUTPUT_SUCCESS)
+		target_info("Connection to %s failed: %d", target->path.array,
+			    ret);
+
+	os_atomic_set_bool(&target->connected, ret == OBS_OUTPUT_SUCCESS);
+	os_sem_post(stream->connect_sem);
+
+	if (ret == OBS_OUTPUT_SUCCESS)
+		send_loop(target);
+
+	pthread_mutex_lock(&target->packets_mutex);
+	os_atomic_set_bool(&target->disconnected, true);
+	pthread_mutex_unlock(&target->packets_mutex);
+
+	free_packets(target);
+	RTMP_Close(&target->rtmp);
+	return NULL;
+}
+
+static struct rtmp_target *target_create(struct rtmp_multi_stream *stream,
+					 size_t idx, obs_data_t *settings)
+{
+	struct rtmp_target *target = bzalloc(sizeof(struct rtmp_target));
+	target->stream = stream;
+	target->idx = idx;
+	pthread_mutex_init_value(&target->packets_mutex);
+
+	RTMP_Init(&target->rtmp);
+
+	if (pthread_mutex_init(&target->packets_mutex, NULL) != 0)
+		goto fail;
+	if (os_sem_init(&target->send_sem, 0) != 0)
+		goto fail;
+
+	dstr_copy(&target->path, obs_data_get_string(settings, "server"));
+	dstr_copy(&target->key, obs_data_get_string(settings, "key"));
+	dstr_copy(&target->username,
+		  obs_data_get_string(settings, "username"));
+	dstr_copy(&target->password,
+		  obs_data_get_string(settings, "password"));
+	dstr_depad(&target->path);
+	dstr_depad(&target->key);
+	return target;
+
+fail:
+	target_destroy(target);
+	return NULL;
+}
+
+static bool init_connect(struct rtmp_multi_stream *stream)
+{
+	obs_data_t *settings = obs_output_get_settings(stream->output);
+	obs_data_array_t *targets = obs_data_get_array(settings, OPT_TARGETS);
+	size_t count = obs_data_array_count(targets);
+	DARRAY(struct rtmp_target *) new_targets;
+	int64_t drop_p;
+	int64_t drop_b;
+
+	free_targets(stream);
+	da_init(new_targets);
+
+	for (size_t i = 0; i < count; i++) {
+		obs_data_t *item = obs_data_array_item(targets, i);
+		struct rtmp_target *target =
+			target_create(stream, new_targets.num, item);
+		obs_data_release(item);
+
+		if (target)
+			da_push_back(new_targets, &target);
+	}
+
+	obs_data_array_release(targets);
+
+	pthread_mutex_lock(&stream->targets_mutex);
+	da_move(stream->targets, new_targets);
+	pthread_mutex_unlock(&stream->targets_mutex);
+
+	os_atomic_set_bool(&stream->encode_error, false);
+	stream->got_first_video = false;
+
+	drop_b = (int64_t)obs_data_get_int(settings, OPT_DROP_THRESHOLD);
+	drop_p = (int64_t)obs_data_get_int(settings, OPT_PFRAME_DROP_THRESHOLD);
+	stream->max_shutdown_time_sec =
+		(int)obs_data_get_int(settings, OPT_MAX_SHUTDOWN_TIME_SEC);
+
+	if (drop_p < (drop_b + 200))
+		drop_p = drop_b + 200;
+
+	stream->drop_threshold_usec = 1000 * drop_b;
+	stream->pframe_drop_threshold_usec = 1000 * drop_p;
+
+	dstr_copy(&stream->bind_ip, obs_data_get_string(settings, OPT_BIND_IP));
+	dstr_copy(&stream->encoder_name, "FMLE/3.0 (compatible; FMSc/1.0)");
+
+	obs_data_release(settings);
+
+	if (!stream->targets.num) {
+		warn("No targets to stream to");
+		return false;
+	}
+
+	return true;
+}
+
+/* connects all targets at once and waits until every one of them either
+ * connected or failed, returns the number of connected targets */
+static size_t connect_targets(struct rtmp_multi_stream *stream)
+{
+	size_t started = 0;
+	size_t connected = 0;
+
+	os_sem_destroy(stream->connect_sem);
+	if (os_sem_init(&stream->connect_sem, 0) != 0)
+		return 0;
+
+	for (size_t i = 0; i < stream->targets.num; i++) {
+		struct rtmp_target *target = stream->targets.array[i];
+
+		target->thread_created =
+			pthread_create(&target->send_thread, NULL,
+				       target_thread, target) == 0;
+		if (target->thread_created)
+			started++;
+		else
+			target_warn("Failed to create send thread");
+	}
+
+	for (size_t i = 0; i < started; i++)
+		os_sem_wait(stream->connect_sem);
+
+	for (size_t i = 0; i < stream->targets.num; i++) {
+		if (os_atomic_load_bool(&stream->targets.array[i]->connected))
+			connected++;
+	}
+
+	return connected;
+}
+
+static void join_targets(struct rtmp_multi_stream *stream)
+{
+	for (size_t i = 0; i < stream->targets.num; i++) {
+		struct rtmp_target *target = stream->targets.array[i];
+
+		if (target->thread_created) {
+			pthread_join(target->send_thread, NULL);
+			target->thread_created = false;
+		}
+	}
+}
+
+static void *stream_thread(void *data)
+{
+	struct rtmp_multi_stream *stream = data;
+	size_t connected;
+
+	os_set_thread_name("rtmp-multi-stream: stream_thread");
+
+	connected = connect_targets(stream);
+	if (!connected) {
+		join_targets(stream);
+		obs_output_signal_stop(stream->output,
+				       OBS_OUTPUT_CONNECT_FAILED);
+		pthread_detach(stream->stream_thread);
+
+		os_atomic_set_bool(&stream->connecting, false);
+		os_event_signal(stream->connect_done);
+		return NULL;
+	}
+
+	info("Connected to %d of %d targets", (int)connected,
+	     (int)stream->targets.num);
+
+	os_atomic_set_bool(&stream->active, true);
+	obs_output_begin_data_capture(stream->output, 0);
+
+	os_atomic_set_bool(&stream->connecting, false);
+	os_event_signal(stream->connect_done);
+
+	/* returns once every target disconnected or stopped */
+	join_targets(stream);
+
+	bool encode_error = os_atomic_load_bool(&stream->encode_error);
+
+	if (encode_error) {
+		info("Encoder error, disconnecting");
+	} else if (!stopping(stream)) {
+		info("Disconnected from all targets");
+	} else {
+		info("User stopped the stream");
+	}
+
+	if (!stopping(stream)) {
+		pthread_detach(stream->stream_thread);
+		obs_output_signal_stop(stream->output, OBS_OUTPUT_DISCONNECTED);
+	} else if (encode_error) {
+		obs_output_signal_stop(stream->output, OBS_OUTPUT_ENCODE_ERROR);
+	} else {
+		obs_output_end_data_capture(stream->output);
+	}
+
+	/* the stop event stays set until the thread is joined */
+	os_atomic_set_bool(&stream->active, false);
+	return NULL;
+}
+
+static bool rtmp_multi_stream_start(void *data)
+{
+	struct rtmp_multi_stream *stream = data;
+
+	if (!obs_output_can_begin_data_capture(stream->output, 0))
+		return false;
+	if (!obs_output_initialize_encoders(stream->output, 0))
+		return false;
+
+	if (stopping(stream)) {
+		pthread_join(stream->stream_thread, NULL);
+		os_event_reset(stream->stop_event);
+	}
+
+	if (!init_connect(stream))
+		return false;
+
+	os_event_reset(stream->connect_done);
+	os_atomic_set_bool(&stream->connecting, true);
+	return pthread_create(&stream->stream_thread, NULL, stream_thread,
+			      stream) == 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* queueing and frame dropping */
+
+static inline void add_packet(struct rtmp_target *target,
+			      struct multi_packet *mp)
+{
+	struct target_packet tp = {.packet = mp->packet, .mp = mp};
+
+	multi_packet_addref(mp);
+	circlebuf_push_back(&target->packets, &tp, sizeof(tp));
+}
+
+static void drop_frames(struct rtmp_target *target, int highest_priority)
+{
+	target->dropped_frames += rtmp_drop_frames(
+		&target->packets, sizeof(struct target_packet),
+		highest_priority, release_target_packet);
+
+	if (target->min_priority < highest_priority)
+		target->min_priority = highest_priority;
+}
+
+static void check_to_drop_frames(struct rtmp_target *target, bool pframes)
+{
+	struct rtmp_multi_stream *stream = target->stream;
+	int64_t buffer_duration_usec;
+	int64_t first_dts;
+	int priority = pframes ? OBS_NAL_PRIORITY_HIGHEST
+			       : OBS_NAL_PRIORITY_HIGH;
+	int64_t drop_threshold = pframes ? stream->pframe_drop_threshold_usec
+					 : stream->drop_threshold_usec;
+
+	if (num_buffered_packets(target) < 5) {
+		if (!pframes)
+			target->congestion = 0.0f;
+		return;
+	}
+
+	if (!rtmp_first_video_dts(&target->packets,
+				  sizeof(struct target_packet), &first_dts))
+		return;
+
+	/* if the amount of time stored in the buffered packets waiting to be
+	 * sent is higher than threshold, drop frames */
+	buffer_duration_usec = target->last_dts_usec - first_dts;
+
+	if (!pframes) {
+		target->congestion =
+			(float)buffer_duration_usec / (float)drop_threshold;
+	}
+
+	if (buffer_duration_usec > drop_threshold)
+		drop_frames(target, priority);
+}
+
+static bool add_video_packet(struct rtmp_target *target,
+			     struct multi_packet *mp)
+{
+	check_to_drop_frames(target, false);
+	check_to_drop_frames(target, true);
+
+	/* if currently dropping frames, drop packets until it reaches the
+	 * desired priority */
+	if (mp->packet.drop_priority < target->min_priority) {
+		target->dropped_frames++;
+		return false;
+	} else {
+		target->min_priority = 0;
+	}
+
+	target->last_dts_usec = mp->packet.dts_usec;
+	add_packet(target, mp);
+	return true;
+}
+
+static struct multi_packet *mux_packet(struct rtmp_multi_stream *stream,
+				       struct encoder_packet *packet)
+{
+	struct multi_packet *mp = bzalloc(sizeof(struct multi_packet));
+	mp->refs = 1;
+
+	if (packet->type == OBS_ENCODER_VIDEO)
+		obs_parse_avc_packet(&mp->packet, packet);
+	else
+		obs_encoder_packet_ref(&mp->packet, packet);
+
+	mp->in_place = flv_packet_mux_in_place(&mp->packet,
+					       stream->start_dts_offset,
+					       &mp->data, &mp->size, false);
+	if (!mp->in_place)
+		flv_packet_mux(&mp->packet, stream->start_dts_offset,
+			       &mp->data, &mp->size, false);
+	return mp;
+}
+
+static void rtmp_multi_stream_data(void *data, struct encoder_packet *packet)
+{
+	struct rtmp_multi_stream *stream = data;
+	struct multi_packet *mp;
+
+	if (!active(stream))
+		return;
+
+	/* encoder fail */
+	if (!packet) {
+		os_atomic_set_bool(&stream->encode_error, true);
+		signal_targets(stream);
+		return;
+	}
+
+	if (packet->type == OBS_ENCODER_VIDEO && !stream->got_first_video) {
+		stream->start_dts_offset = get_ms_time(packet, packet->dts);
+		stream->got_first_video = true;
+	}
+
+	/* the tag timestamps are relative to the first video packet, so
+	 * nothing before it can be muxed yet */
+	if (!stream->got_first_video)
+		return;
+
+	mp = mux_packet(stream, packet);
+
+	for (size_t i = 0; i < stream->targets.num; i++) {
+		struct rtmp_target *target = stream->targets.array[i];
+		bool added_packet = false;
+
+		pthread_mutex_lock(&target->packets_mutex);
+
+		if (os_atomic_load_bool(&target->connected) &&
+		    !os_atomic_load_bool(&target->disconnected)) {
+			if (mp->packet.type == OBS_ENCODER_VIDEO) {
+				added_packet = add_video_packet(target, mp);
+			} else {
+				add_packet(target, mp);
+				added_packet = true;
+			}
+		}
+
+		pthread_mutex_unlock(&target->packets_mutex);
+
+		if (added_packet)
+			os_sem_post(target->send_sem);
+	}
+
+	multi_packet_release(mp);
+}
+
+static void rtmp_multi_stream_defaults(obs_data_t *defaults)
+{
+	obs_data_set_default_int(defaults, OPT_DROP_THRESHOLD, 700);
+	obs_data_set_default_int(defaults, OPT_PFRAME_DROP_THRESHOLD, 900);
+	obs_data_set_default_int(defaults, OPT_MAX_SHUTDOWN_TIME_SEC, 30);
+	obs_data_set_default_string(defaults, OPT_BIND_IP, "default");
+}
+
+static obs_properties_t *rtmp_multi_stream_properties(void *unused)
+{
+	UNUSED_PARAMETER(unused);
+
+	obs_properties_t *props = obs_properties_create();
+	struct netif_saddr_data addrs = {0};
+	obs_property_t *p;
+
+	obs_properties_add_int(props, OPT_DROP_THRESHOLD,
+			       obs_module_text("RTMPStream.DropThreshold"), 200,
+			       10000, 100);
+
+	p = obs_properties_add_list(props, OPT_BIND_IP,
+				    obs_module_text("RTMPStream.BindIP"),
+				    OBS_COMBO_TYPE_LIST,
+				    OBS_COMBO_FORMAT_STRING);
+
+	obs_property_list_add_string(p, obs_module_text("Default"), "default");
+
+	netif_get_addrs(&addrs);
+	for (size_t i = 0; i < addrs.addrs.num; i++) {
+		struct netif_saddr_item item = addrs.addrs.array[i];
+		obs_property_list_add_string(p, item.name, item.addr);
+	}
+	netif_saddr_data_free(&addrs);
+
+	return props;
+}
+
+static uint64_t rtmp_multi_stream_total_bytes_sent(void *data)
+{
+	struct rtmp_multi_stream *stream = data;
+	uint64_t total = 0;
+
+	pthread_mutex_lock(&stream->targets_mutex);
+	for (size_t i = 0; i < stream->targets.num; i++)
+		total += stream->targets.array[i]->total_bytes_sent;
+	pthread_mutex_unlock(&stream->targets_mutex);
+	return total;
+}
+
+static int rtmp_multi_stream_dropped_frames(void *data)
+{
+	struct rtmp_multi_stream *stream = data;
+	int dropped = 0;
+
+	pthread_mutex_lock(&stream->targets_mutex);
+	for (size_t i = 0; i < stream->targets.num; i++)
+		dropped += stream->targets.array[i]->dropped_frames;
+	pthread_mutex_unlock(&stream->targets_mutex);
+	return dropped;
+}
+
+/* the most congested target decides */
+static float rtmp_multi_stream_congestion(void *data)
+{
+	struct rtmp_multi_stream *stream = data;
+	float congestion = 0.0f;
+
+	pthread_mutex_lock(&stream->targets_mutex);
+	for (size_t i = 0; i < stream->targets.num; i++) {
+		struct rtmp_target *target = stream->targets.array[i];
+		float cur = target->min_priority > 0 ? 1.0f
+						     : target->congestion;
+
+		if (os_atomic_load_bool(&target->disconnected))
+			continue;
+		if (cur > congestion)
+			congestion = cur;
+	}
+	pthread_mutex_unlock(&stream->targets_mutex);
+
+	return congestion;
+}
+
+static int rtmp_multi_stream_connect_time(void *data)
+{
+	struct rtmp_multi_stream *stream = data;
+	int connect_time = 0;
+
+	pthread_mutex_lock(&stream->targets_mutex);
+	for (size_t i = 0; i < stream->targets.num; i++) {
+		struct rtmp_target *target = stream->targets.array[i];
+
+		if (target->rtmp.connect_time_ms > connect_time)
+			connect_time = target->rtmp.connect_time_ms;
+	}
+	pthread_mutex_unlock(&stream->targets_mutex);
+
+	return connect_time;
+}
+
+struct obs_output_info rtmp_multi_output_info = {
+	.id = "rtmp_multi_output",
+	.flags = OBS_OUTPUT_AV | OBS_OUTPUT_ENCODED | OBS_OUTPUT_MULTI_TRACK,
+	.encoded_video_codecs = "h264",
+	.encoded_audio_codecs = "aac",
+	.get_name = rtmp_multi_stream_getname,
+	.create = rtmp_multi_stream_create,
+	.destroy = rtmp_multi_stream_destroy,
+	.start = rtmp_multi_stream_start,
+	.stop = rtmp_multi_stream_stop,
+	.encoded_packet = rtmp_multi_stream_data,
+	.get_defaults = rtmp_multi_stream_defaults,
+	.get_properties = rtmp_multi_stream_properties,
+	.get_total_bytes = rtmp_multi_stream_total_bytes_sent,
+	.get_congestion = rtmp_multi_stream_congestion,
+	.get_connect_time_ms = rtmp_multi_stream_connect_time,
+	.get_dropped_frames = rtmp_multi_stream_dropped_frames,
+};
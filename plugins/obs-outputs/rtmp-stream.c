@@ -16,6 +16,7 @@
 ******************************************************************************/
 
 #include "rtmp-stream.h"
+#include "rtmp-common.h"
 
 #ifndef SEC_TO_NSEC
 #define SEC_TO_NSEC 1000000000ULL
@@ -219,20 +220,6 @@ static void rtmp_stream_stop(void *data, uint64_t ts)
 	}
 }
 
-static inline void set_rtmp_str(AVal *val, const char *str)
-{
-	bool valid = (str && *str);
-	val->av_val = valid ? (char *)str : NULL;
-	val->av_len = valid ? (int)strlen(str) : 0;
-}
-
-static inline void set_rtmp_dstr(AVal *val, struct dstr *str)
-{
-	bool valid = !dstr_is_empty(str);
-	val->av_val = valid ? str->array : NULL;
-	val->av_len = valid ? (int)str->len : 0;
-}
-
 static inline bool get_next_packet(struct rtmp_stream *stream,
 				   struct encoder_packet *packet)
 {
@@ -249,43 +236,6 @@ static inline bool get_next_packet(struct rtmp_stream *stream,
 	return new_packet;
 }
 
-static bool discard_recv_data(struct rtmp_stream *stream, size_t size)
-{
-	RTMP *rtmp = &stream->rtmp;
-	uint8_t buf[512];
-#ifdef _WIN32
-	int ret;
-#else
-	ssize_t ret;
-#endif
-
-	do {
-		size_t bytes = size > 512 ? 512 : size;
-		size -= bytes;
-
-#ifdef _WIN32
-		ret = recv(rtmp->m_sb.sb_socket, buf, (int)bytes, 0);
-#else
-		ret = recv(rtmp->m_sb.sb_socket, buf, bytes, 0);
-#endif
-
-		if (ret <= 0) {
-#ifdef _WIN32
-			int error = WSAGetLastError();
-#else
-			int error = errno;
-#endif
-			if (ret < 0) {
-				do_log(LOG_ERROR, "recv error: %d (%d bytes)",
-				       error, (int)size);
-			}
-			return false;
-		}
-	} while (size > 0);
-
-	return true;
-}
-
 #ifdef TEST_FRAMEDROPS
 static void droptest_cap_data_rate(struct rtmp_stream *stream, size_t size)
 {
@@ -399,47 +349,163 @@ retry_send:
 }
 
 static int send_packet(struct rtmp_stream *stream,
-		       struct encoder_packet *packet, bool is_header,
-		       size_t idx)
+		       struct encoder_packet *packet, size_t idx)
 {
 	uint8_t *data;
 	size_t size;
-	int recv_size = 0;
+	bool in_place = false;
 	int ret = 0;
 
 	assert(idx < RTMP_MAX_STREAMS);
 
-	if (!stream->new_socket_loop) {
-#ifdef _WIN32
-		ret = ioctlsocket(stream->rtmp.m_sb.sb_socket, FIONREAD,
-				  (u_long *)&recv_size);
-#else
-		ret = ioctl(stream->rtmp.m_sb.sb_socket, FIONREAD, &recv_size);
+	if (!stream->new_socket_loop &&
+	    !rtmp_discard_pending_recv_data(&stream->rtmp))
+		return -1;
+
+	in_place = flv_packet_mux_in_place(packet, stream->start_dts_offset,
+					   &data, &size, false);
+	if (!in_place)
+		flv_packet_mux(packet, stream->start_dts_offset, &data, &size,
+			       false);
+
+#ifdef TEST_FRAMEDROPS
+	droptest_cap_data_rate(stream, size);
 #endif
 
-		if (ret >= 0 && recv_size > 0) {
-			if (!discard_recv_data(stream, (size_t)recv_size))
-				return -1;
+	ret = RTMP_Write(&stream->rtmp, (char *)data, (int)size, (int)idx);
+	if (!in_place)
+		bfree(data);
+
+	obs_encoder_packet_release(packet);
+
+	stream->total_bytes_sent += size;
+	return ret;
+}
+
+static void free_batch(struct rtmp_stream *stream)
+{
+	struct rtmp_batch *batch = &stream->batch;
+
+	for (size_t i = 0; i < batch->num_packets; i++) {
+		obs_encoder_packet_release(&batch->packets[i]);
+		bfree(batch->copies[i]);
+		batch->copies[i] = NULL;
+	}
+
+	batch->num_packets = 0;
+	batch->num_vec = 0;
+	batch->hdrs_size = 0;
+}
+
+static void dbr_add_frame(struct rtmp_stream *stream, struct dbr_frame *back);
+
+/* writes out all batched packets with as few system calls as possible */
+static bool flush_batch(struct rtmp_stream *stream)
+{
+	struct rtmp_batch *batch = &stream->batch;
+	bool success;
+
+	if (!batch->num_packets)
+		return true;
+
+	success = rtmp_discard_pending_recv_data(&stream->rtmp) &&
+		  RTMP_WriteV(&stream->rtmp, batch->vec, batch->num_vec);
+
+	if (success && stream->dbr_enabled) {
+		/* the packets shared the write, so they share its timing */
+		struct dbr_frame dbr_frame = {.send_beg = batch->send_beg,
+					      .send_end = os_gettime_ns()};
+
+		pthread_mutex_lock(&stream->dbr_mutex);
+		for (size_t i = 0; i < batch->num_packets; i++) {
+			dbr_frame.size = batch->packets[i].size;
+			dbr_add_frame(stream, &dbr_frame);
 		}
+		pthread_mutex_unlock(&stream->dbr_mutex);
 	}
 
-	flv_packet_mux(packet, is_header ? 0 : stream->start_dts_offset, &data,
-		       &size, is_header);
+	free_batch(stream);
+	return success;
+}
+
+/* muxes the packet and adds its chunks to the batch, packets with more
+ * chunks than a single write takes are sent on their own */
+static bool batch_packet(struct rtmp_stream *stream,
+			 struct encoder_packet *packet)
+{
+	struct rtmp_batch *batch = &stream->batch;
+	int idx = (int)packet->track_idx;
+	uint8_t *data;
+	size_t size;
+	int num_vec;
+	int hdrs_size;
+
+	assert(idx < RTMP_MAX_STREAMS);
+
+	bool in_place = flv_packet_mux_in_place(
+		packet, stream->start_dts_offset, &data, &size, false);
+	if (!in_place)
+		flv_packet_mux(packet, stream->start_dts_offset, &data, &size,
+			       false);
 
 #ifdef TEST_FRAMEDROPS
 	droptest_cap_data_rate(stream, size);
 #endif
 
-	ret = RTMP_Write(&stream->rtmp, (char *)data, (int)size, (int)idx);
-	bfree(data);
+	stream->total_bytes_sent += size;
+
+	RTMP_ChunkTagSize(&stream->rtmp, (char *)data, &num_vec, &hdrs_size);
+
+	if (batch->num_vec + num_vec > RTMP_MAX_IOVEC ||
+	    batch->hdrs_size + hdrs_size > (int)sizeof(batch->hdrs)) {
+		if (!flush_batch(stream))
+			goto fail;
+	}
+
+	if (num_vec > RTMP_MAX_IOVEC ||
+	    hdrs_size > (int)sizeof(batch->hdrs)) {
+		uint64_t send_beg = os_gettime_ns();
+		int ret = RTMP_Write(&stream->rtmp, (char *)data, (int)size,
+				     idx);
+		if (!in_place)
+			bfree(data);
+
+		if (ret >= 0 && stream->dbr_enabled) {
+			struct dbr_frame dbr_frame = {
+				.send_beg = send_beg,
+				.send_end = os_gettime_ns(),
+				.size = packet->size};
+
+			pthread_mutex_lock(&stream->dbr_mutex);
+			dbr_add_frame(stream, &dbr_frame);
+			pthread_mutex_unlock(&stream->dbr_mutex);
+		}
 
-	if (is_header)
-		bfree(packet->data);
-	else
 		obs_encoder_packet_release(packet);
+		return ret >= 0;
+	}
 
-	stream->total_bytes_sent += size;
-	return ret;
+	num_vec = RTMP_ChunkTag(&stream->rtmp, (char *)data, (int)size, idx,
+				batch->vec + batch->num_vec,
+				batch->hdrs + batch->hdrs_size);
+	if (!num_vec)
+		goto fail;
+
+	if (!batch->num_packets)
+		batch->send_beg = os_gettime_ns();
+
+	batch->packets[batch->num_packets] = *packet;
+	batch->copies[batch->num_packets] = in_place ? NULL : data;
+	batch->num_packets++;
+	batch->num_vec += num_vec;
+	batch->hdrs_size += hdrs_size;
+	return true;
+
+fail:
+	if (!in_place)
+		bfree(data);
+	obs_encoder_packet_release(packet);
+	return false;
 }
 
 static inline bool send_headers(struct rtmp_stream *stream);
@@ -594,12 +660,42 @@ static void *send_thread(void *data)
 			}
 		}
 
+		/* everything queued up by now goes out with one write */
+		if (RTMP_CanWriteV(&stream->rtmp)) {
+			bool shutdown = false;
+			bool success = batch_packet(stream, &packet);
+
+			while (success && get_next_packet(stream, &packet)) {
+				if (stopping(stream) &&
+				    can_shutdown_stream(stream, &packet)) {
+					obs_encoder_packet_release(&packet);
+					shutdown = true;
+					break;
+				}
+
+				success = batch_packet(stream, &packet);
+			}
+
+			if (success)
+				success = flush_batch(stream);
+			else
+				free_batch(stream);
+
+			if (!success) {
+				os_atomic_set_bool(&stream->disconnected, true);
+				break;
+			}
+			if (shutdown)
+				break;
+			continue;
+		}
+
 		if (stream->dbr_enabled) {
 			dbr_frame.send_beg = os_gettime_ns();
 			dbr_frame.size = packet.size;
 		}
 
-		if (send_packet(stream, &packet, false, packet.track_idx) < 0) {
+		if (send_packet(stream, &packet, packet.track_idx) < 0) {
 			os_atomic_set_bool(&stream->disconnected, true);
 			break;
 		}
@@ -659,76 +755,16 @@ static void *send_thread(void *data)
 	return NULL;
 }
 
-static bool send_meta_data(struct rtmp_stream *stream, size_t idx, bool *next)
-{
-	uint8_t *meta_data;
-	size_t meta_data_size;
-	bool success = true;
-
-	*next = flv_meta_data(stream->output, &meta_data, &meta_data_size,
-			      false, idx);
-
-	if (*next) {
-		success = RTMP_Write(&stream->rtmp, (char *)meta_data,
-				     (int)meta_data_size, (int)idx) >= 0;
-		bfree(meta_data);
-	}
-
-	return success;
-}
-
-static bool send_audio_header(struct rtmp_stream *stream, size_t idx,
-			      bool *next)
-{
-	obs_output_t *context = stream->output;
-	obs_encoder_t *aencoder = obs_output_get_audio_encoder(context, idx);
-	uint8_t *header;
-
-	struct encoder_packet packet = {.type = OBS_ENCODER_AUDIO,
-					.timebase_den = 1};
-
-	if (!aencoder) {
-		*next = false;
-		return true;
-	}
-
-	obs_encoder_get_extra_data(aencoder, &header, &packet.size);
-	packet.data = bmemdup(header, packet.size);
-	return send_packet(stream, &packet, true, idx) >= 0;
-}
-
-static bool send_video_header(struct rtmp_stream *stream)
-{
-	obs_output_t *context = stream->output;
-	obs_encoder_t *vencoder = obs_output_get_video_encoder(context);
-	uint8_t *header;
-	size_t size;
-
-	struct encoder_packet packet = {
-		.type = OBS_ENCODER_VIDEO, .timebase_den = 1, .keyframe = true};
-
-	obs_encoder_get_extra_data(vencoder, &header, &size);
-	packet.size = obs_parse_avc_header(&packet.data, header, size);
-	return send_packet(stream, &packet, true, 0) >= 0;
-}
-
 static inline bool send_headers(struct rtmp_stream *stream)
 {
 	stream->sent_headers = true;
-	size_t i = 0;
-	bool next = true;
 
-	if (!send_audio_header(stream, i++, &next))
+	if (!stream->new_socket_loop &&
+	    !rtmp_discard_pending_recv_data(&stream->rtmp))
 		return false;
-	if (!send_video_header(stream))
-		return false;
-
-	while (next) {
-		if (!send_audio_header(stream, i++, &next))
-			return false;
-	}
 
-	return true;
+	return rtmp_send_headers(&stream->rtmp, stream->output,
+				 &stream->total_bytes_sent);
 }
 
 static inline bool reset_semaphore(struct rtmp_stream *stream)
@@ -761,8 +797,6 @@ static void adjust_sndbuf_size(struct rtmp_stream *stream, int new_size)
 static int init_send(struct rtmp_stream *stream)
 {
 	int ret;
-	size_t idx = 0;
-	bool next = true;
 
 #if defined(_WIN32)
 	adjust_sndbuf_size(stream, MIN_SENDBUF_SIZE);
@@ -865,13 +899,10 @@ static int init_send(struct rtmp_stream *stream)
 	}
 
 	os_atomic_set_bool(&stream->active, true);
-	while (next) {
-		if (!send_meta_data(stream, idx++, &next)) {
-			warn("Disconnected while attempting to connect to "
-			     "server.");
-			set_output_error(stream);
-			return OBS_OUTPUT_DISCONNECTED;
-		}
+	if (!rtmp_send_meta_data(&stream->rtmp, stream->output)) {
+		warn("Disconnected while attempting to connect to server.");
+		set_output_error(stream);
+		return OBS_OUTPUT_DISCONNECTED;
 	}
 	obs_output_begin_data_capture(stream->output, 0);
 
@@ -947,57 +978,25 @@ static int try_connect(struct rtmp_stream *stream)
 	// this should have been called already by rtmp_stream_create
 	//RTMP_Init(&stream->rtmp);
 
-	// since we don't call RTMP_Init above, there's no other good place
-	// to reset this as doing it in RTMP_Close breaks the ugly RTMP
-	// authentication system
-	memset(&stream->rtmp.Link, 0, sizeof(stream->rtmp.Link));
-	stream->rtmp.last_error_code = 0;
-
-	if (!RTMP_SetupURL(&stream->rtmp, stream->path.array))
-		return OBS_OUTPUT_BAD_PATH;
-
-	RTMP_EnableWrite(&stream->rtmp);
-
 	dstr_copy(&stream->encoder_name, "FMLE/3.0 (compatible; FMSc/1.0)");
 
-	set_rtmp_dstr(&stream->rtmp.Link.pubUser, &stream->username);
-	set_rtmp_dstr(&stream->rtmp.Link.pubPasswd, &stream->password);
-	set_rtmp_dstr(&stream->rtmp.Link.flashVer, &stream->encoder_name);
-	stream->rtmp.Link.swfUrl = stream->rtmp.Link.tcUrl;
+	struct rtmp_link_info link = {
+		.path = &stream->path,
+		.key = &stream->key,
+		.username = &stream->username,
+		.password = &stream->password,
+		.encoder_name = &stream->encoder_name,
+	};
 
-	if (dstr_is_empty(&stream->bind_ip) ||
-	    dstr_cmp(&stream->bind_ip, "default") == 0) {
-		memset(&stream->rtmp.m_bindIP, 0,
-		       sizeof(stream->rtmp.m_bindIP));
-	} else {
-		bool success = netif_str_to_addr(&stream->rtmp.m_bindIP.addr,
-						 &stream->rtmp.m_bindIP.addrLen,
-						 stream->bind_ip.array);
-		if (success) {
-			int len = stream->rtmp.m_bindIP.addrLen;
-			bool ipv6 = len == sizeof(struct sockaddr_in6);
-			info("Binding to IPv%d", ipv6 ? 6 : 4);
-		}
-	}
-
-	RTMP_AddStream(&stream->rtmp, stream->key.array);
-
-	for (size_t idx = 1;; idx++) {
-		obs_encoder_t *encoder =
-			obs_output_get_audio_encoder(stream->output, idx);
-		const char *encoder_name;
-
-		if (!encoder)
-			break;
+	if (!rtmp_setup_link(&stream->rtmp, stream->output, &link))
+		return OBS_OUTPUT_BAD_PATH;
 
-		encoder_name = obs_encoder_get_name(encoder);
-		RTMP_AddStream(&stream->rtmp, encoder_name);
+	if (rtmp_set_bind_ip(&stream->rtmp, &stream->bind_ip)) {
+		int len = stream->rtmp.m_bindIP.addrLen;
+		bool ipv6 = len == sizeof(struct sockaddr_in6);
+		info("Binding to IPv%d", ipv6 ? 6 : 4);
 	}
 
-	stream->rtmp.m_outChunkSize = 4096;
-	stream->rtmp.m_bSendChunkSizeInfo = true;
-	stream->rtmp.m_bUseNagle = true;
-
 #ifdef _WIN32
 	win32_log_interface_type(stream);
 #endif
@@ -1155,13 +1154,17 @@ static inline size_t num_buffered_packets(struct rtmp_stream *stream)
 	return stream->packets.size / sizeof(struct encoder_packet);
 }
 
+static void release_packet(void *item)
+{
+	obs_encoder_packet_release(item);
+}
+
 static void drop_frames(struct rtmp_stream *stream, const char *name,
 			int highest_priority, bool pframes)
 {
 	UNUSED_PARAMETER(pframes);
 
-	struct circlebuf new_buf = {0};
-	int num_frames_dropped = 0;
+	int num_frames_dropped;
 
 #ifdef _DEBUG
 	int start_packets = (int)num_buffered_packets(stream);
@@ -1169,25 +1172,9 @@ static void drop_frames(struct rtmp_stream *stream, const char *name,
 	UNUSED_PARAMETER(name);
 #endif
 
-	circlebuf_reserve(&new_buf, sizeof(struct encoder_packet) * 8);
-
-	while (stream->packets.size) {
-		struct encoder_packet packet;
-		circlebuf_pop_front(&stream->packets, &packet, sizeof(packet));
-
-		/* do not drop audio data or video keyframes */
-		if (packet.type == OBS_ENCODER_AUDIO ||
-		    packet.drop_priority >= highest_priority) {
-			circlebuf_push_back(&new_buf, &packet, sizeof(packet));
-
-		} else {
-			num_frames_dropped++;
-			obs_encoder_packet_release(&packet);
-		}
-	}
-
-	circlebuf_free(&stream->packets);
-	stream->packets = new_buf;
+	num_frames_dropped = rtmp_drop_frames(&stream->packets,
+					      sizeof(struct encoder_packet),
+					      highest_priority, release_packet);
 
 	if (stream->min_priority < highest_priority)
 		stream->min_priority = highest_priority;
@@ -1201,23 +1188,6 @@ static void drop_frames(struct rtmp_stream *stream, const char *name,
 #endif
 }
 
-static bool find_first_video_packet(struct rtmp_stream *stream,
-				    struct encoder_packet *first)
-{
-	size_t count = stream->packets.size / sizeof(*first);
-
-	for (size_t i = 0; i < count; i++) {
-		struct encoder_packet *cur =
-			circlebuf_data(&stream->packets, i * sizeof(*first));
-		if (cur->type == OBS_ENCODER_VIDEO && !cur->keyframe) {
-			*first = *cur;
-			return true;
-		}
-	}
-
-	return false;
-}
-
 static bool dbr_bitrate_lowered(struct rtmp_stream *stream)
 {
 	long prev_bitrate = stream->dbr_prev_bitrate;
@@ -1310,9 +1280,8 @@ static void dbr_inc_bitrate(struct rtmp_stream *stream)
 
 static void check_to_drop_frames(struct rtmp_stream *stream, bool pframes)
 {
-	struct encoder_packet first;
 	int64_t buffer_duration_usec;
-	size_t num_packets = num_buffered_packets(stream);
+	int64_t first_dts;
 	const char *name = pframes ? "p-frames" : "b-frames";
 	int priority = pframes ? OBS_NAL_PRIORITY_HIGHEST
 			       : OBS_NAL_PRIORITY_HIGH;
@@ -1331,18 +1300,19 @@ static void check_to_drop_frames(struct rtmp_stream *stream, bool pframes)
 		}
 	}
 
-	if (num_packets < 5) {
+	if (num_buffered_packets(stream) < 5) {
 		if (!pframes)
 			stream->congestion = 0.0f;
 		return;
 	}
 
-	if (!find_first_video_packet(stream, &first))
+	if (!rtmp_first_video_dts(&stream->packets,
+				  sizeof(struct encoder_packet), &first_dts))
 		return;
 
 	/* if the amount of time stored in the buffered packets waiting to be
 	 * sent is higher than threshold, drop frames */
-	buffer_duration_usec = stream->last_dts_usec - first.dts_usec;
+	buffer_duration_usec = stream->last_dts_usec - first_dts;
 
 	if (!pframes) {
 		stream->congestion =
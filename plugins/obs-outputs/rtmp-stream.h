@@ -52,6 +52,23 @@ struct dbr_frame {
 	size_t size;
 };
 
+/* every packet takes at least a header and a body buffer */
+#define RTMP_BATCH_MAX_PACKETS (RTMP_MAX_IOVEC / 2)
+
+/* packets waiting to be sent with a single vectored write */
+struct rtmp_batch {
+	struct encoder_packet packets[RTMP_BATCH_MAX_PACKETS];
+	uint8_t *copies[RTMP_BATCH_MAX_PACKETS]; /* muxed data not in place */
+	size_t num_packets;
+
+	RTMPIOVec vec[RTMP_MAX_IOVEC];
+	int num_vec;
+	char hdrs[RTMP_BATCH_MAX_PACKETS * RTMP_MAX_HEADER_SIZE];
+	int hdrs_size;
+
+	uint64_t send_beg;
+};
+
 struct rtmp_stream {
 	obs_output_t *output;
 
@@ -113,6 +130,7 @@ struct rtmp_stream {
 	bool dbr_enabled;
 
 	RTMP rtmp;
+	struct rtmp_batch batch;
 
 	bool new_socket_loop;
 	bool low_latency_mode;
@@ -0,0 +1,128 @@
+/*
+ * Times mixing N sources into 6 mixes of 8 channels and clamping the mixes
+ * afterwards, once per audio tick like the audio thread does, with the
+ * vectorized mix_audio_plane/clamp_audio_plane and with plain loops.
+ */
+
+#include <stdio.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <media-io/audio-io.h>
+#include <media-io/audio-math.h>
+
+#define CHANNELS 8
+#define MAX_SOURCES 64
+#define TICKS 200
+
+struct bench_data {
+	float *mixes[MAX_AUDIO_MIXES][CHANNELS];
+	float *sources[MAX_SOURCES][CHANNELS];
+};
+
+static void mix_scalar(float *mix, const float *aud, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		mix[i] += aud[i];
+}
+
+static void clamp_scalar(float *data, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		float val = data[i];
+		val = (val > 1.0f) ? 1.0f : val;
+		val = (val < -1.0f) ? -1.0f : val;
+		data[i] = val;
+	}
+}
+
+static inline void mix_vector(float *mix, const float *aud, size_t count)
+{
+	mix_audio_plane(mix, aud, count);
+}
+
+static inline void clamp_vector(float *data, size_t count)
+{
+	clamp_audio_plane(data, count);
+}
+
+typedef void (*mix_func)(float *mix, const float *aud, size_t count);
+typedef void (*clamp_func)(float *data, size_t count);
+
+/* returns the mixed samples per second */
+static double run(struct bench_data *data, size_t num_sources, mix_func mix,
+		  clamp_func clamp)
+{
+	uint64_t start = os_gettime_ns();
+	double samples;
+
+	for (int tick = 0; tick < TICKS; tick++) {
+		for (size_t mix_idx = 0; mix_idx < MAX_AUDIO_MIXES; mix_idx++) {
+			for (size_t ch = 0; ch < CHANNELS; ch++)
+				memset(data->mixes[mix_idx][ch], 0,
+				       AUDIO_OUTPUT_FRAMES * sizeof(float));
+		}
+
+		for (size_t i = 0; i < num_sources; i++) {
+			for (size_t mix_idx = 0; mix_idx < MAX_AUDIO_MIXES;
+			     mix_idx++) {
+				for (size_t ch = 0; ch < CHANNELS; ch++)
+					mix(data->mixes[mix_idx][ch],
+					    data->sources[i][ch],
+					    AUDIO_OUTPUT_FRAMES);
+			}
+		}
+
+		for (size_t mix_idx = 0; mix_idx < MAX_AUDIO_MIXES; mix_idx++) {
+			for (size_t ch = 0; ch < CHANNELS; ch++)
+				clamp(data->mixes[mix_idx][ch],
+				      AUDIO_OUTPUT_FRAMES);
+		}
+	}
+
+	samples = (double)TICKS * num_sources * MAX_AUDIO_MIXES * CHANNELS *
+		  AUDIO_OUTPUT_FRAMES;
+	return samples * 1000000000.0 / (double)(os_gettime_ns() - start);
+}
+
+int main(void)
+{
+	struct bench_data data;
+
+	for (size_t mix_idx = 0; mix_idx < MAX_AUDIO_MIXES; mix_idx++) {
+		for (size_t ch = 0; ch < CHANNELS; ch++)
+			data.mixes[mix_idx][ch] =
+				bmalloc(AUDIO_OUTPUT_FRAMES * sizeof(float));
+	}
+
+	for (size_t i = 0; i < MAX_SOURCES; i++) {
+		for (size_t ch = 0; ch < CHANNELS; ch++) {
+			float *buf =
+				bmalloc(AUDIO_OUTPUT_FRAMES * sizeof(float));
+			for (size_t j = 0; j < AUDIO_OUTPUT_FRAMES; j++)
+				buf[j] = (float)((i + ch + j) % 64) / 128.0f;
+			data.sources[i][ch] = buf;
+		}
+	}
+
+	printf("%d mixes x %d channels x %d frames, %d ticks\n",
+	       MAX_AUDIO_MIXES, CHANNELS, AUDIO_OUTPUT_FRAMES, TICKS);
+	printf("sources   plain loops   mix_audio_plane   (Msamples/s)\n");
+
+	for (size_t sources = 1; sources <= MAX_SOURCES; sources *= 4) {
+		double scalar = run(&data, sources, mix_scalar, clamp_scalar);
+		double vector = run(&data, sources, mix_vector, clamp_vector);
+
+		printf("%7d   %11.0f   %15.0f\n", (int)sources,
+		       scalar / 1000000.0, vector / 1000000.0);
+	}
+
+	for (size_t mix_idx = 0; mix_idx < MAX_AUDIO_MIXES; mix_idx++) {
+		for (size_t ch = 0; ch < CHANNELS; ch++)
+			bfree(data.mixes[mix_idx][ch]);
+	}
+	for (size_t i = 0; i < MAX_SOURCES; i++) {
+		for (size_t ch = 0; ch < CHANNELS; ch++)
+			bfree(data.sources[i][ch]);
+	}
+	return 0;
+}
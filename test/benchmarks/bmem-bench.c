@@ -0,0 +1,121 @@
+/*
+ * Times a random mix of small bmalloc/brealloc/bfree calls on 1 to 8
+ * threads, with the default allocator and with OBS_BMEM_SLAB set.  The
+ * allocator is picked once per process, so each one is timed by running
+ * this program again with "--run" and the environment set accordingly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util/bmem.h>
+#include <util/pipe.h>
+#include <util/platform.h>
+#include <util/threading.h>
+
+#define OPS_PER_THREAD 2000000
+#define LIVE_BLOCKS 64
+#define MAX_THREADS 8
+
+static void *bench_thread(void *data)
+{
+	uint32_t seed = (uint32_t)(uintptr_t)data * 31 + 7;
+	void *live[LIVE_BLOCKS] = {0};
+
+	for (int i = 0; i < OPS_PER_THREAD; i++) {
+		uint32_t slot;
+		size_t size;
+
+		seed = seed * 1103515245 + 12345;
+		slot = (seed >> 8) % LIVE_BLOCKS;
+		size = 16 + ((seed >> 16) & 511);
+
+		if (!live[slot]) {
+			live[slot] = bmalloc(size);
+			*(char *)live[slot] = 1;
+		} else if ((seed & 7) == 0) {
+			live[slot] = brealloc(live[slot], size);
+		} else {
+			bfree(live[slot]);
+			live[slot] = NULL;
+		}
+	}
+
+	for (int i = 0; i < LIVE_BLOCKS; i++)
+		bfree(live[i]);
+	return NULL;
+}
+
+static void run(void)
+{
+	for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		pthread_t thread[MAX_THREADS];
+		uint64_t start = os_gettime_ns();
+		double ns_per_op;
+
+		for (int i = 0; i < threads; i++)
+			pthread_create(&thread[i], NULL, bench_thread,
+				       (void *)(uintptr_t)i);
+		for (int i = 0; i < threads; i++)
+			pthread_join(thread[i], NULL);
+
+		ns_per_op = (double)(os_gettime_ns() - start) /
+			    ((double)OPS_PER_THREAD * threads);
+		printf("%d thread%s: %6.1f ns/op, %6.1f Mops/s\n", threads,
+		       threads == 1 ? " " : "s", ns_per_op, 1000.0 / ns_per_op);
+	}
+
+	bmem_log_stats();
+}
+
+static void set_slab(bool slab)
+{
+#ifdef _WIN32
+	_putenv(slab ? "OBS_BMEM_SLAB=1" : "OBS_BMEM_SLAB=");
+#else
+	if (slab)
+		setenv("OBS_BMEM_SLAB", "1", 1);
+	else
+		unsetenv("OBS_BMEM_SLAB");
+#endif
+}
+
+static bool run_child(const char *path, bool slab)
+{
+	char cmd[1024];
+	char buf[256];
+	os_process_pipe_t *pp;
+	size_t len;
+
+	set_slab(slab);
+	snprintf(cmd, sizeof(cmd), "\"%s\" --run", path);
+
+	pp = os_process_pipe_create(cmd, "r");
+	if (!pp)
+		return false;
+
+	printf("%s:\n", slab ? "OBS_BMEM_SLAB" : "default");
+	fflush(stdout);
+
+	while ((len = os_process_pipe_read(pp, (uint8_t *)buf, sizeof(buf))))
+		fwrite(buf, 1, len, stdout);
+
+	return os_process_pipe_destroy(pp) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "--run") == 0) {
+		run();
+		return 0;
+	}
+
+	printf("%d ops per thread, 16-527 bytes, %d live blocks per thread\n",
+	       OPS_PER_THREAD, LIVE_BLOCKS);
+
+	if (!run_child(argv[0], false) || !run_child(argv[0], true)) {
+		printf("failed to run %s\n", argv[0]);
+		return 1;
+	}
+	return 0;
+}
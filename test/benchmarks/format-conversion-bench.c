@@ -0,0 +1,243 @@
+/*
+ * Times decompress_420, decompress_nv12 and decompress_422 from 720p to 4K
+ * against the scalar loops they replaced, which are kept here as the
+ * reference, and checks that both produce the same output.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <media-io/format-conversion.h>
+
+#define FRAMES 100
+
+/* ------------------------------------------------------------------------- */
+/* scalar reference */
+
+static void scalar_420(const uint8_t *const input[],
+		       const uint32_t in_linesize[], uint32_t start_y,
+		       uint32_t end_y, uint8_t *output, uint32_t out_linesize)
+{
+	uint32_t width_d2 = in_linesize[0] / 2;
+
+	for (uint32_t y = start_y / 2; y < end_y / 2; y++) {
+		const uint8_t *chroma0 = input[1] + y * in_linesize[1];
+		const uint8_t *chroma1 = input[2] + y * in_linesize[2];
+		const uint8_t *lum0 = input[0] + y * 2 * in_linesize[0];
+		const uint8_t *lum1 = lum0 + in_linesize[0];
+		uint32_t *output0 = (uint32_t *)(output + y * 2 * out_linesize);
+		uint32_t *output1 =
+			(uint32_t *)((uint8_t *)output0 + out_linesize);
+
+		for (uint32_t x = 0; x < width_d2; x++) {
+			uint32_t out = (*(chroma0++) << 8) | *(chroma1++);
+
+			*(output0++) = (*(lum0++) << 16) | out;
+			*(output0++) = (*(lum0++) << 16) | out;
+			*(output1++) = (*(lum1++) << 16) | out;
+			*(output1++) = (*(lum1++) << 16) | out;
+		}
+	}
+}
+
+static void scalar_nv12(const uint8_t *const input[],
+			const uint32_t in_linesize[], uint32_t start_y,
+			uint32_t end_y, uint8_t *output, uint32_t out_linesize)
+{
+	uint32_t width = in_linesize[0] < out_linesize ? in_linesize[0]
+						       : out_linesize;
+	uint32_t width_d2 = width / 2;
+
+	for (uint32_t y = start_y / 2; y < end_y / 2; y++) {
+		const uint16_t *chroma =
+			(const uint16_t *)(input[1] + y * in_linesize[1]);
+		const uint8_t *lum0 = input[0] + y * 2 * in_linesize[0];
+		const uint8_t *lum1 = lum0 + in_linesize[0];
+		uint32_t *output0 = (uint32_t *)(output + y * 2 * out_linesize);
+		uint32_t *output1 =
+			(uint32_t *)((uint8_t *)output0 + out_linesize);
+
+		for (uint32_t x = 0; x < width_d2; x++) {
+			uint32_t out = *(chroma++) << 8;
+
+			*(output0++) = *(lum0++) | out;
+			*(output0++) = *(lum0++) | out;
+			*(output1++) = *(lum1++) | out;
+			*(output1++) = *(lum1++) | out;
+		}
+	}
+}
+
+static void scalar_422(const uint8_t *input, uint32_t in_linesize,
+		       uint32_t start_y, uint32_t end_y, uint8_t *output,
+		       uint32_t out_linesize, bool leading_lum)
+{
+	uint32_t width_d2 = (in_linesize < out_linesize ? in_linesize
+							: out_linesize) /
+			    2;
+
+	for (uint32_t y = start_y; y < end_y; y++) {
+		const uint32_t *input32 =
+			(const uint32_t *)(input + y * in_linesize);
+		const uint32_t *input32_end = input32 + width_d2;
+		uint32_t *output32 = (uint32_t *)(output + y * out_linesize);
+
+		while (input32 < input32_end) {
+			uint32_t dw = *(input32++);
+
+			output32[0] = dw;
+			if (leading_lum) {
+				dw &= 0xFFFFFF00;
+				dw |= (uint8_t)(dw >> 16);
+			} else {
+				dw &= 0xFFFF00FF;
+				dw |= (dw >> 16) & 0xFF00;
+			}
+			output32[1] = dw;
+			output32 += 2;
+		}
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+
+struct frame {
+	uint32_t width;
+	uint32_t height;
+	uint8_t *planes[3];
+	uint32_t linesize[3];
+	uint8_t *packed;
+	uint32_t packed_linesize;
+	uint8_t *output;
+	uint32_t out_linesize;
+};
+
+enum format { FORMAT_420, FORMAT_NV12, FORMAT_422 };
+
+static const char *format_names[] = {"420", "nv12", "422"};
+
+static void convert(struct frame *frame, enum format format, bool scalar)
+{
+	const uint8_t *const *planes = (const uint8_t *const *)frame->planes;
+
+	switch (format) {
+	case FORMAT_420:
+		(scalar ? scalar_420 : decompress_420)(
+			planes, frame->linesize, 0, frame->height,
+			frame->output, frame->out_linesize);
+		break;
+	case FORMAT_NV12:
+		(scalar ? scalar_nv12 : decompress_nv12)(
+			planes, frame->linesize, 0, frame->height,
+			frame->output, frame->out_linesize);
+		break;
+	case FORMAT_422:
+		(scalar ? scalar_422 : decompress_422)(
+			frame->packed, frame->packed_linesize, 0,
+			frame->height, frame->output, frame->out_linesize,
+			true);
+		break;
+	}
+}
+
+/* returns the milliseconds per frame */
+static double run(struct frame *frame, enum format format, bool scalar)
+{
+	uint64_t start = os_gettime_ns();
+
+	for (int i = 0; i < FRAMES; i++)
+		convert(frame, format, scalar);
+
+	return (double)(os_gettime_ns() - start) / 1000000.0 / FRAMES;
+}
+
+static bool same_output(struct frame *frame, enum format format)
+{
+	size_t size = (size_t)frame->out_linesize * (frame->height + 1);
+	uint8_t *expected = bmalloc(size);
+	bool same;
+
+	convert(frame, format, true);
+	memcpy(expected, frame->output, size);
+	memset(frame->output, 0, size);
+	convert(frame, format, false);
+
+	same = memcmp(expected, frame->output, size) == 0;
+	bfree(expected);
+	return same;
+}
+
+static void fill(uint8_t *data, size_t size, uint32_t seed)
+{
+	for (size_t i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (uint8_t)(seed >> 16);
+	}
+}
+
+static void frame_init(struct frame *frame, uint32_t width, uint32_t height)
+{
+	frame->width = width;
+	frame->height = height;
+
+	/* i420 uses all three planes, nv12 the first two */
+	frame->linesize[0] = width;
+	frame->linesize[1] = width;
+	frame->linesize[2] = width / 2;
+	frame->planes[0] = bmalloc(width * height);
+	frame->planes[1] = bmalloc(width * height / 2);
+	frame->planes[2] = bmalloc(width * height / 4);
+	fill(frame->planes[0], width * height, 1);
+	fill(frame->planes[1], width * height / 2, 2);
+	fill(frame->planes[2], width * height / 4, 3);
+
+	/* decompress_422 converts min(in_linesize, out_linesize) / 2 words
+	 * per row, which with these line sizes goes on into the next row, so
+	 * both buffers get a spare row */
+	frame->packed_linesize = width * 2;
+	frame->packed = bmalloc(width * 2 * (height + 1));
+	fill(frame->packed, width * 2 * (height + 1), 4);
+
+	frame->out_linesize = width * 4;
+	frame->output = bmalloc(width * 4 * (height + 1));
+}
+
+static void frame_free(struct frame *frame)
+{
+	for (size_t i = 0; i < 3; i++)
+		bfree(frame->planes[i]);
+	bfree(frame->packed);
+	bfree(frame->output);
+}
+
+int main(void)
+{
+	static const uint32_t sizes[][2] = {
+		{1280, 720}, {1920, 1080}, {2560, 1440}, {3840, 2160}};
+	bool success = true;
+
+	printf("%d frames each, ms per frame\n", FRAMES);
+	printf("           format   scalar   vectorized\n");
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		struct frame frame;
+
+		frame_init(&frame, sizes[i][0], sizes[i][1]);
+
+		for (int format = FORMAT_420; format <= FORMAT_422; format++) {
+			bool same = same_output(&frame, format);
+			double scalar = run(&frame, format, true);
+			double vector = run(&frame, format, false);
+
+			printf("%4ux%-4u   %6s   %6.2f   %10.2f%s\n",
+			       frame.width, frame.height, format_names[format],
+			       scalar, vector, same ? "" : "   (differs)");
+			success = success && same;
+		}
+
+		frame_free(&frame);
+	}
+
+	return success ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+/*
+ * Times interleaving video with 6 audio tracks while the video runs a given
+ * number of packets ahead of the audio, which is how many packets wait in
+ * the interleave queues.  Like interleave_packets, every incoming packet is
+ * queued and then at most one packet is sent.  The per-track queues are
+ * compared with the single sorted array they replaced.
+ */
+
+#include <stdio.h>
+#include <util/darray.h>
+#include <util/platform.h>
+#include <obs-interleave.h>
+
+#define AUDIO_TRACKS 6
+#define PACKETS 2000000
+#define PACKET_USEC 21333
+
+struct bench_state {
+	int64_t highest_video_ts;
+	int64_t highest_audio_ts;
+	size_t sent;
+};
+
+static inline void set_higher_ts(struct bench_state *state,
+				 const struct encoder_packet *packet)
+{
+	int64_t *highest = packet->type == OBS_ENCODER_VIDEO
+				   ? &state->highest_video_ts
+				   : &state->highest_audio_ts;
+	if (*highest < packet->dts_usec)
+		*highest = packet->dts_usec;
+}
+
+static inline bool has_higher_opposing_ts(struct bench_state *state,
+					  const struct encoder_packet *packet)
+{
+	if (packet->type == OBS_ENCODER_VIDEO)
+		return state->highest_audio_ts > packet->dts_usec;
+	else
+		return state->highest_video_ts > packet->dts_usec;
+}
+
+/* ------------------------------------------------------------------------- */
+/* per-track queues */
+
+static struct interleave_queue queues[NUM_INTERLEAVE_QUEUES];
+
+static void queues_add(struct bench_state *state, struct encoder_packet *packet)
+{
+	size_t idx = packet->type == OBS_ENCODER_VIDEO ? 0
+						       : packet->track_idx + 1;
+	struct interleave_queue *queue;
+	struct encoder_packet out;
+
+	interleave_queue_push(&queues[idx], packet);
+	set_higher_ts(state, packet);
+
+	queue = next_interleave_queue(queues);
+	if (!queue || !has_higher_opposing_ts(state,
+					      interleave_queue_first(queue)))
+		return;
+
+	interleave_queue_pop(queue, &out);
+	state->sent++;
+}
+
+static void queues_free(void)
+{
+	for (size_t i = 0; i < NUM_INTERLEAVE_QUEUES; i++) {
+		da_free(queues[i].packets);
+		queues[i].head = 0;
+	}
+}
+
+/* ------------------------------------------------------------------------- */
+/* one sorted array */
+
+static DARRAY(struct encoder_packet) sorted;
+
+static void sorted_add(struct bench_state *state, struct encoder_packet *packet)
+{
+	size_t idx;
+
+	for (idx = 0; idx < sorted.num; idx++) {
+		struct encoder_packet *cur = sorted.array + idx;
+
+		if (packet->dts_usec == cur->dts_usec &&
+		    packet->type == OBS_ENCODER_VIDEO)
+			break;
+		else if (packet->dts_usec < cur->dts_usec)
+			break;
+	}
+
+	da_insert(sorted, idx, packet);
+	set_higher_ts(state, packet);
+
+	if (!has_higher_opposing_ts(state, sorted.array))
+		return;
+
+	da_erase(sorted, 0);
+	state->sent++;
+}
+
+static void sorted_free(void)
+{
+	da_free(sorted);
+}
+
+/* ------------------------------------------------------------------------- */
+
+typedef void (*add_func)(struct bench_state *state,
+			 struct encoder_packet *packet);
+
+/* returns the packets per second */
+static double run(add_func add, int depth, size_t *sent)
+{
+	struct bench_state state = {0};
+	struct encoder_packet packet = {0};
+	uint64_t start = os_gettime_ns();
+	int steps = PACKETS / (AUDIO_TRACKS + 1);
+
+	for (int i = 0; i < steps; i++) {
+		packet.type = OBS_ENCODER_VIDEO;
+		packet.track_idx = 0;
+		packet.dts_usec = (int64_t)(i + depth) * PACKET_USEC;
+		add(&state, &packet);
+
+		packet.type = OBS_ENCODER_AUDIO;
+		packet.dts_usec = (int64_t)i * PACKET_USEC;
+
+		for (size_t track = 0; track < AUDIO_TRACKS; track++) {
+			packet.track_idx = track;
+			add(&state, &packet);
+		}
+	}
+
+	*sent = state.sent;
+	return (double)steps * (AUDIO_TRACKS + 1) * 1000000000.0 /
+	       (double)(os_gettime_ns() - start);
+}
+
+int main(void)
+{
+	static const int depths[] = {1, 10, 100, 1000};
+
+	printf("video and %d audio tracks, %d packets\n", AUDIO_TRACKS,
+	       PACKETS);
+	printf("  depth   sorted array   per-track queues   (Mpackets/s)\n");
+
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		size_t sorted_sent, queues_sent;
+		double old_rate = run(sorted_add, depths[i], &sorted_sent);
+		double new_rate = run(queues_add, depths[i], &queues_sent);
+
+		sorted_free();
+		queues_free();
+
+		printf("%7d   %12.2f   %16.2f%s\n", depths[i],
+		       old_rate / 1000000.0, new_rate / 1000000.0,
+		       sorted_sent == queues_sent ? "" : "   (sent differs)");
+	}
+
+	return 0;
+}
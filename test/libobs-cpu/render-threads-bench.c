@@ -0,0 +1,146 @@
+/*
+ * Times frames of the CPU renderer at 720p, 1080p and 1440p with 0 to 7
+ * band workers besides the rendering thread.  A frame scales a 1080p RGBA
+ * source over the whole canvas, blends a second one on top of it with
+ * premultiplied alpha, both bilinear, and converts the canvas to NV12 like
+ * an output does.  Worker counts above the number of cores only add
+ * contention.
+ */
+
+#include <stdio.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <media-io/video-io.h>
+#include "cpu-subsystem.h"
+
+#define FRAMES 30
+#define SOURCE_WIDTH 1920
+#define SOURCE_HEIGHT 1080
+
+static gs_texture_t *texture_create(uint32_t width, uint32_t height,
+				    enum gs_color_format format)
+{
+	gs_texture_t *tex = bzalloc(sizeof(gs_texture_t));
+	size_t size;
+
+	tex->type = GS_TEXTURE_2D;
+	tex->width = width;
+	tex->height = height;
+	tex->levels = 1;
+	tex->color_format = format;
+
+	size = cpu_tex_data_size(tex);
+	tex->data = bmalloc(size);
+
+	for (size_t i = 0; i < size; i++)
+		tex->data[i] = (uint8_t)(i * 7 + (i >> 12));
+	return tex;
+}
+
+static void texture_destroy(gs_texture_t *tex)
+{
+	bfree(tex->data);
+	bfree(tex);
+}
+
+static void render_frame(struct cpu_workers *workers, gs_texture_t *canvas,
+			 gs_texture_t *background, gs_texture_t *overlay,
+			 const struct cpu_conversion *conv)
+{
+	static const struct cpu_blend_state premultiplied = {
+		GS_BLEND_ONE, GS_BLEND_INVSRCALPHA, GS_BLEND_ONE,
+		GS_BLEND_INVSRCALPHA};
+	struct cpu_blit_params params = {0};
+
+	params.src_width = SOURCE_WIDTH;
+	params.src_height = SOURCE_HEIGHT;
+	params.dst = canvas;
+	params.dst_width = canvas->width;
+	params.dst_height = canvas->height;
+	params.filter = CPU_BLIT_FILTER_BILINEAR;
+	params.workers = workers;
+
+	params.src = background;
+	cpu_blit_texture(params);
+
+	params.src = overlay;
+	params.blend = &premultiplied;
+	cpu_blit_texture(params);
+
+	cpu_convert_planes(workers, conv);
+}
+
+/* returns the frames per second */
+static double run(struct cpu_workers *workers, uint32_t width,
+		  uint32_t height, gs_texture_t *background,
+		  gs_texture_t *overlay)
+{
+	gs_texture_t *canvas = texture_create(width, height, GS_RGBA);
+	struct cpu_conversion conv = {0};
+	float matrix[16];
+	uint64_t start;
+	double fps;
+
+	video_format_get_parameters(VIDEO_CS_709, VIDEO_RANGE_PARTIAL, matrix,
+				    NULL, NULL);
+
+	conv.format = CPU_CONVERSION_NV12;
+	conv.src = canvas;
+	conv.planes[0] = texture_create(width, height, GS_R8);
+	conv.planes[1] = texture_create(width / 2, height / 2, GS_R8G8);
+	vec4_set(&conv.color_vec[0], matrix[4], matrix[5], matrix[6],
+		 matrix[7]);
+	vec4_set(&conv.color_vec[1], matrix[0], matrix[1], matrix[2],
+		 matrix[3]);
+	vec4_set(&conv.color_vec[2], matrix[8], matrix[9], matrix[10],
+		 matrix[11]);
+	conv.num_planes = 2;
+
+	/* the first frame touches the memory */
+	render_frame(workers, canvas, background, overlay, &conv);
+
+	start = os_gettime_ns();
+	for (int i = 0; i < FRAMES; i++)
+		render_frame(workers, canvas, background, overlay, &conv);
+	fps = FRAMES * 1000000000.0 / (double)(os_gettime_ns() - start);
+
+	texture_destroy(conv.planes[0]);
+	texture_destroy(conv.planes[1]);
+	texture_destroy(canvas);
+	return fps;
+}
+
+int main(void)
+{
+	static const size_t worker_counts[] = {0, 1, 3, 7};
+	static const uint32_t sizes[][2] = {
+		{1280, 720}, {1920, 1080}, {2560, 1440}};
+	gs_texture_t *background;
+	gs_texture_t *overlay;
+
+	background = texture_create(SOURCE_WIDTH, SOURCE_HEIGHT, GS_RGBA);
+	overlay = texture_create(SOURCE_WIDTH, SOURCE_HEIGHT, GS_RGBA);
+
+	printf("%d logical cores, %d frames each, frames per second\n",
+	       os_get_logical_cores(), FRAMES);
+	printf("workers      720p     1080p     1440p\n");
+
+	for (size_t i = 0;
+	     i < sizeof(worker_counts) / sizeof(worker_counts[0]); i++) {
+		struct cpu_workers *workers =
+			cpu_workers_create(worker_counts[i]);
+
+		printf("%7zu", cpu_workers_count(workers));
+		for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+			printf("   %7.1f", run(workers, sizes[j][0],
+						sizes[j][1], background,
+						overlay));
+		printf("\n");
+
+		cpu_workers_destroy(workers);
+	}
+
+	texture_destroy(background);
+	texture_destroy(overlay);
+	return 0;
+}
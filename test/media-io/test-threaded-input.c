@@ -0,0 +1,176 @@
+/*
+ * Encoders that fail an encode disconnect their video input from within the
+ * input's own callback (send_off_encoder_packet -> full_stop ->
+ * video_output_disconnect), which for threaded inputs means from the input
+ * thread itself.  This drives that path directly: inputs "fail" partway
+ * through, disconnect themselves, and are reconnected like a restarting
+ * output would, while other inputs share their scale group.
+ */
+
+#include <stdio.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <media-io/video-frame.h>
+
+#define WIDTH 64
+#define HEIGHT 64
+#define FRAMES 240
+#define FAIL_AFTER 10
+#define RUNS 8
+
+struct test_input {
+	video_t *video;
+	volatile long frames;
+	volatile long skipped;
+	volatile bool failed;
+	volatile bool late_frame;
+	long fail_after;
+};
+
+static void failing_callback(void *param, struct video_data *frame)
+{
+	struct test_input *input = param;
+
+	if (os_atomic_load_bool(&input->failed)) {
+		os_atomic_set_bool(&input->late_frame, true);
+		return;
+	}
+
+	if (os_atomic_inc_long(&input->frames) == input->fail_after) {
+		os_atomic_set_bool(&input->failed, true);
+		video_output_disconnect(input->video, failing_callback, input);
+	}
+
+	UNUSED_PARAMETER(frame);
+}
+
+static void skip_callback(void *param, uint32_t frames)
+{
+	struct test_input *input = param;
+	os_atomic_set_long(&input->skipped,
+			   os_atomic_load_long(&input->skipped) + frames);
+}
+
+static void counting_callback(void *param, struct video_data *frame)
+{
+	struct test_input *input = param;
+	os_atomic_inc_long(&input->frames);
+	UNUSED_PARAMETER(frame);
+}
+
+/* stops early once the input fails if one is given */
+static void output_frames(video_t *video, int count, uint64_t *ts,
+			  struct test_input *until_failed)
+{
+	for (int i = 0; i < count; i++) {
+		if (until_failed && os_atomic_load_bool(&until_failed->failed))
+			break;
+
+		struct video_frame frame;
+
+		if (video_output_lock_frame(video, &frame, 1, *ts)) {
+			memset(frame.data[0], i, frame.linesize[0] * HEIGHT);
+			video_output_unlock_frame(video);
+		}
+
+		*ts += video_output_get_frame_time(video);
+		os_sleep_ms(1);
+	}
+}
+
+static bool run(int idx, bool close_early)
+{
+	struct video_output_info info = {
+		.name = "test-threaded-input",
+		.format = VIDEO_FORMAT_BGRA,
+		.fps_num = 1000,
+		.fps_den = 1,
+		.width = WIDTH,
+		.height = HEIGHT,
+		.cache_size = 8,
+		.colorspace = VIDEO_CS_709,
+		.range = VIDEO_RANGE_PARTIAL,
+	};
+	struct video_scale_info scaled = {
+		.format = VIDEO_FORMAT_NV12,
+		.width = WIDTH / 2,
+		.height = HEIGHT / 2,
+		.colorspace = VIDEO_CS_709,
+		.range = VIDEO_RANGE_PARTIAL,
+	};
+	struct test_input failing = {.fail_after = FAIL_AFTER + idx};
+	struct test_input other = {0};
+	uint64_t ts = 0;
+	video_t *video;
+	bool success = true;
+
+	if (video_output_open(&video, &info) != VIDEO_OUTPUT_SUCCESS) {
+		fprintf(stderr, "run %d: video_output_open failed\n", idx);
+		return false;
+	}
+
+	failing.video = video;
+	other.video = video;
+
+	video_output_connect_threaded(video, &scaled, counting_callback, NULL,
+				      &other);
+
+	for (int restart = 0; restart < 2; restart++) {
+		os_atomic_set_long(&failing.frames, 0);
+		os_atomic_set_bool(&failing.failed, false);
+
+		if (!video_output_connect_threaded(video, &scaled,
+						   failing_callback,
+						   skip_callback, &failing)) {
+			fprintf(stderr, "run %d: connect failed\n", idx);
+			success = false;
+			break;
+		}
+
+		output_frames(video, FRAMES, &ts,
+			      close_early ? &failing : NULL);
+
+		if (!os_atomic_load_bool(&failing.failed)) {
+			fprintf(stderr, "run %d: input never failed\n", idx);
+			success = false;
+		}
+
+		if (close_early)
+			break;
+	}
+
+	if (!close_early) {
+		video_output_disconnect(video, counting_callback, &other);
+		if (!os_atomic_load_long(&other.frames)) {
+			fprintf(stderr, "run %d: other input got no frames\n",
+				idx);
+			success = false;
+		}
+	}
+
+	/* with close_early, the failing input is likely still on its way out */
+	video_output_close(video);
+
+	if (os_atomic_load_bool(&failing.late_frame)) {
+		fprintf(stderr, "run %d: frame delivered after disconnect\n",
+			idx);
+		success = false;
+	}
+
+	return success;
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	for (int i = 0; i < RUNS; i++) {
+		if (!run(i, (i & 1) != 0))
+			failures++;
+	}
+
+	printf("%d/%d runs passed, %ld leaks\n", RUNS - failures, RUNS,
+	       bnum_allocs());
+	return failures || bnum_allocs() ? 1 : 0;
+}
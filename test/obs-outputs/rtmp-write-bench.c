@@ -0,0 +1,355 @@
+/*
+ * Times sending a 60 fps, 6 Mbps video stream with 160 kbps audio to a local
+ * TCP sink, once with RTMP_Write per packet and once with the vectored
+ * RTMP_ChunkTag/RTMP_WriteV path, sending 1 or up to 8 packets per write
+ * like the send thread does depending on how many packets are queued when
+ * it wakes up.  Reports the CPU time of the sending thread per megabit and,
+ * on Linux, the send/sendmsg calls per second of stream.  The sink checks
+ * that every mode sends the same bytes.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <obs.h>
+#include <util/bmem.h>
+#include <util/threading.h>
+#include "librtmp/rtmp_sys.h"
+#include "librtmp/rtmp.h"
+#include "flv-mux.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SECONDS 120
+#define FPS 60
+#define VIDEO_BITRATE 6000000
+#define KEYFRAME_INTERVAL (2 * FPS)
+#define KEYFRAME_SIZE 100000
+#define SAMPLE_RATE 48000
+#define AUDIO_FRAMES 1024
+#define AUDIO_BITRATE 160000
+#define CHUNK_SIZE 4096
+#define MAX_BATCH_PACKETS 8
+
+/* ------------------------------------------------------------------------- */
+/* send call counting, the test is linked with --wrap=send,--wrap=sendmsg */
+
+static long send_calls;
+
+#ifdef COUNT_SEND_CALLS
+extern ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+extern ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags)
+{
+	send_calls++;
+	return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	send_calls++;
+	return __real_sendmsg(fd, msg, flags);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* sink */
+
+struct sink {
+	int listen_fd;
+	pthread_t thread;
+	uint64_t bytes;
+	uint64_t hash;
+};
+
+static void *sink_thread(void *data)
+{
+	struct sink *sink = data;
+	uint8_t buf[65536];
+	ssize_t len;
+	int fd;
+
+	fd = accept(sink->listen_fd, NULL, NULL);
+	if (fd < 0)
+		return NULL;
+
+	/* FNV-1a */
+	sink->hash = 14695981039346656037ULL;
+
+	while ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		for (ssize_t i = 0; i < len; i++)
+			sink->hash = (sink->hash ^ buf[i]) * 1099511628211ULL;
+		sink->bytes += (uint64_t)len;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static int sink_start(struct sink *sink)
+{
+	struct sockaddr_in addr = {0};
+	socklen_t addr_len = sizeof(addr);
+	int fd;
+
+	memset(sink, 0, sizeof(*sink));
+
+	sink->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(sink->listen_fd, (struct sockaddr *)&addr, addr_len) != 0 ||
+	    listen(sink->listen_fd, 1) != 0 ||
+	    getsockname(sink->listen_fd, (struct sockaddr *)&addr,
+			&addr_len) != 0)
+		return -1;
+
+	pthread_create(&sink->thread, NULL, sink_thread, sink);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(fd, (struct sockaddr *)&addr, addr_len) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void sink_stop(struct sink *sink)
+{
+	pthread_join(sink->thread, NULL);
+	close(sink->listen_fd);
+}
+
+/* ------------------------------------------------------------------------- */
+/* packets */
+
+static uint8_t *payload;
+
+static size_t video_frame_size(int64_t frame)
+{
+	size_t frame_size = VIDEO_BITRATE / 8 / FPS;
+	size_t rest = frame_size * KEYFRAME_INTERVAL - KEYFRAME_SIZE;
+
+	return frame % KEYFRAME_INTERVAL == 0
+		       ? KEYFRAME_SIZE
+		       : rest / (KEYFRAME_INTERVAL - 1);
+}
+
+/* fills in the next packet in dts order, returns false at the end */
+static bool next_packet(int64_t *frame, int64_t *audio_frame,
+			struct encoder_packet *packet)
+{
+	int64_t video_ms = *frame * 1000 / FPS;
+	int64_t audio_ms = *audio_frame * AUDIO_FRAMES * 1000 / SAMPLE_RATE;
+
+	if (*frame >= SECONDS * FPS)
+		return false;
+
+	memset(packet, 0, sizeof(*packet));
+	packet->data = payload;
+
+	if (video_ms <= audio_ms) {
+		packet->type = OBS_ENCODER_VIDEO;
+		packet->size = video_frame_size(*frame);
+		packet->keyframe = *frame % KEYFRAME_INTERVAL == 0;
+		packet->timebase_num = 1;
+		packet->timebase_den = FPS;
+		packet->dts = packet->pts = *frame;
+		(*frame)++;
+	} else {
+		packet->type = OBS_ENCODER_AUDIO;
+		packet->size = AUDIO_BITRATE / 8 * AUDIO_FRAMES / SAMPLE_RATE;
+		packet->timebase_num = 1;
+		packet->timebase_den = SAMPLE_RATE;
+		packet->dts = packet->pts = *audio_frame * AUDIO_FRAMES;
+		(*audio_frame)++;
+	}
+
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+/* writers */
+
+struct batch {
+	uint8_t *data[MAX_BATCH_PACKETS];
+	size_t num_packets;
+
+	RTMPIOVec vec[RTMP_MAX_IOVEC];
+	int num_vec;
+	char hdrs[RTMP_MAX_IOVEC * RTMP_MAX_HEADER_SIZE];
+	int hdrs_size;
+};
+
+static bool flush_batch(RTMP *rtmp, struct batch *batch)
+{
+	bool success = !batch->num_vec ||
+		       RTMP_WriteV(rtmp, batch->vec, batch->num_vec);
+
+	for (size_t i = 0; i < batch->num_packets; i++)
+		bfree(batch->data[i]);
+
+	batch->num_packets = 0;
+	batch->num_vec = 0;
+	batch->hdrs_size = 0;
+	return success;
+}
+
+static bool batch_packet(RTMP *rtmp, struct batch *batch, uint8_t *data,
+			 size_t size, size_t max_packets)
+{
+	int num_vec;
+	int hdrs_size;
+
+	RTMP_ChunkTagSize(rtmp, (char *)data, &num_vec, &hdrs_size);
+
+	if (batch->num_vec + num_vec > RTMP_MAX_IOVEC) {
+		if (!flush_batch(rtmp, batch))
+			goto fail;
+	}
+
+	if (num_vec > RTMP_MAX_IOVEC) {
+		bool success = RTMP_Write(rtmp, (char *)data, (int)size, 0) >=
+			       0;
+		bfree(data);
+		return success;
+	}
+
+	num_vec = RTMP_ChunkTag(rtmp, (char *)data, (int)size, 0,
+				batch->vec + batch->num_vec,
+				batch->hdrs + batch->hdrs_size);
+	if (!num_vec)
+		goto fail;
+
+	batch->data[batch->num_packets++] = data;
+	batch->num_vec += num_vec;
+	batch->hdrs_size += hdrs_size;
+
+	return batch->num_packets < max_packets || flush_batch(rtmp, batch);
+
+fail:
+	bfree(data);
+	return false;
+}
+
+/* sends the whole stream, max_packets 0 uses RTMP_Write */
+static bool send_stream(RTMP *rtmp, size_t max_packets)
+{
+	struct encoder_packet packet;
+	struct batch *batch = bzalloc(sizeof(struct batch));
+	int64_t frame = 0;
+	int64_t audio_frame = 0;
+	bool success = true;
+
+	while (success && next_packet(&frame, &audio_frame, &packet)) {
+		uint8_t *data;
+		size_t size;
+
+		flv_packet_mux(&packet, 0, &data, &size, false);
+
+		if (max_packets) {
+			success = batch_packet(rtmp, batch, data, size,
+					       max_packets);
+		} else {
+			success = RTMP_Write(rtmp, (char *)data, (int)size,
+					     0) >= 0;
+			bfree(data);
+		}
+	}
+
+	if (success)
+		success = flush_batch(rtmp, batch);
+
+	bfree(batch);
+	return success;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static bool run(const char *name, size_t max_packets, uint64_t *hash)
+{
+	struct sink sink;
+	RTMP rtmp;
+	uint64_t cpu;
+	double mbits;
+	int fd;
+
+	fd = sink_start(&sink);
+	if (fd < 0) {
+		printf("failed to connect to the sink\n");
+		return false;
+	}
+
+	RTMP_Init(&rtmp);
+	rtmp.m_sb.sb_socket = fd;
+	rtmp.m_outChunkSize = CHUNK_SIZE;
+	rtmp.Link.streams[0].id = 1;
+
+	if (max_packets && !RTMP_CanWriteV(&rtmp)) {
+		printf("vectored writes are not available\n");
+		return false;
+	}
+
+	send_calls = 0;
+	cpu = thread_cpu_ns();
+
+	if (!send_stream(&rtmp, max_packets)) {
+		printf("%s: sending failed\n", name);
+		return false;
+	}
+
+	cpu = thread_cpu_ns() - cpu;
+
+	RTMP_Close(&rtmp);
+	sink_stop(&sink);
+
+	mbits = (double)sink.bytes * 8.0 / 1000000.0;
+
+#ifdef COUNT_SEND_CALLS
+	printf("%-26s %8.1f %16.1f\n", name, (double)send_calls / SECONDS,
+	       (double)cpu / 1000.0 / mbits);
+#else
+	printf("%-26s %8s %16.1f\n", name, "-", (double)cpu / 1000.0 / mbits);
+#endif
+
+	if (*hash && *hash != sink.hash) {
+		printf("%s: the sink received different data\n", name);
+		return false;
+	}
+
+	*hash = sink.hash;
+	return true;
+}
+
+int main(void)
+{
+	uint64_t hash = 0;
+	bool success;
+
+	payload = bzalloc(KEYFRAME_SIZE);
+	for (size_t i = 0; i < KEYFRAME_SIZE; i++)
+		payload[i] = (uint8_t)(i * 7);
+
+	printf("%d s of %d fps video at %d kbps and audio at %d kbps, %d byte chunks\n",
+	       SECONDS, FPS, VIDEO_BITRATE / 1000, AUDIO_BITRATE / 1000,
+	       CHUNK_SIZE);
+	printf("%-26s %8s %16s\n", "", "sends/s", "CPU us per Mbit");
+
+	success = run("RTMP_Write", 0, &hash) &&
+		  run("RTMP_WriteV, 1 packet", 1, &hash) &&
+		  run("RTMP_WriteV, 8 packets", MAX_BATCH_PACKETS, &hash);
+
+	bfree(payload);
+	return success ? 0 : 1;
+}
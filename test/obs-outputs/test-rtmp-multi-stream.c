@@ -0,0 +1,757 @@
+/*
+ * Streams to several local RTMP listeners through the multi stream output
+ * and checks that every listener gets the headers and the video in order
+ * and uncorrupted.  The output is restarted a few times while another
+ * thread keeps polling its stats, like the UI does while it reconnects.
+ *
+ *   The output and encoder functions the output calls are answered here
+ * instead of by libobs, with packets whose payload identifies the frame
+ * they belong to, so the listeners can check what they receive.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <obs-module.h>
+#include <obs-avc.h>
+#include <util/bmem.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include "librtmp/rtmp_sys.h"
+#include "librtmp/rtmp.h"
+#include "librtmp/amf.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define NUM_SERVERS 3
+#define CYCLES 3
+#define FPS 60
+#define FRAMES 60
+#define KEYFRAME_INTERVAL 30
+#define SAMPLE_RATE 48000
+#define AUDIO_FRAMES 1024
+#define HANDSHAKE_SIZE 1536
+
+extern struct obs_output_info rtmp_multi_output_info;
+
+/* ------------------------------------------------------------------------- */
+/* output and encoders */
+
+struct obs_output {
+	obs_data_t *settings;
+	os_event_t *begun;
+	os_event_t *ended;
+	volatile long stop_code;
+};
+
+struct obs_encoder {
+	obs_data_t *settings;
+	bool audio;
+};
+
+static struct obs_encoder video_encoder = {.audio = false};
+static struct obs_encoder audio_encoder = {.audio = true};
+
+/* avcC data without start codes, passed on as is */
+static uint8_t video_header[] = {0x01, 0x64, 0x00, 0x1f, 0xff, 0xe1, 0x00};
+static uint8_t audio_header[] = {0x12, 0x10};
+
+const char *obs_module_text(const char *val)
+{
+	return val;
+}
+
+const char *obs_output_get_name(const obs_output_t *output)
+{
+	UNUSED_PARAMETER(output);
+	return "test";
+}
+
+obs_data_t *obs_output_get_settings(const obs_output_t *output)
+{
+	obs_data_addref(output->settings);
+	return output->settings;
+}
+
+obs_encoder_t *obs_output_get_video_encoder(const obs_output_t *output)
+{
+	UNUSED_PARAMETER(output);
+	return &video_encoder;
+}
+
+obs_encoder_t *obs_output_get_audio_encoder(const obs_output_t *output,
+					    size_t idx)
+{
+	UNUSED_PARAMETER(output);
+	return idx == 0 ? &audio_encoder : NULL;
+}
+
+bool obs_output_can_begin_data_capture(const obs_output_t *output,
+				       uint32_t flags)
+{
+	UNUSED_PARAMETER(output);
+	UNUSED_PARAMETER(flags);
+	return true;
+}
+
+bool obs_output_initialize_encoders(obs_output_t *output, uint32_t flags)
+{
+	UNUSED_PARAMETER(output);
+	UNUSED_PARAMETER(flags);
+	return true;
+}
+
+bool obs_output_begin_data_capture(obs_output_t *output, uint32_t flags)
+{
+	UNUSED_PARAMETER(flags);
+	os_event_signal(output->begun);
+	return true;
+}
+
+void obs_output_end_data_capture(obs_output_t *output)
+{
+	os_atomic_set_long(&output->stop_code, OBS_OUTPUT_SUCCESS);
+	os_event_signal(output->ended);
+}
+
+void obs_output_signal_stop(obs_output_t *output, int code)
+{
+	os_atomic_set_long(&output->stop_code, code);
+	os_event_signal(output->ended);
+}
+
+const char *obs_encoder_get_name(const obs_encoder_t *encoder)
+{
+	return encoder->audio ? "aac" : "h264";
+}
+
+obs_data_t *obs_encoder_get_settings(const obs_encoder_t *encoder)
+{
+	obs_data_addref(encoder->settings);
+	return encoder->settings;
+}
+
+uint32_t obs_encoder_get_width(const obs_encoder_t *encoder)
+{
+	UNUSED_PARAMETER(encoder);
+	return 1280;
+}
+
+uint32_t obs_encoder_get_height(const obs_encoder_t *encoder)
+{
+	UNUSED_PARAMETER(encoder);
+	return 720;
+}
+
+uint32_t obs_encoder_get_sample_rate(const obs_encoder_t *encoder)
+{
+	UNUSED_PARAMETER(encoder);
+	return SAMPLE_RATE;
+}
+
+video_t *obs_encoder_video(const obs_encoder_t *encoder)
+{
+	UNUSED_PARAMETER(encoder);
+	return NULL;
+}
+
+audio_t *obs_encoder_audio(const obs_encoder_t *encoder)
+{
+	UNUSED_PARAMETER(encoder);
+	return NULL;
+}
+
+double video_output_get_frame_rate(const video_t *video)
+{
+	UNUSED_PARAMETER(video);
+	return FPS;
+}
+
+size_t audio_output_get_channels(const audio_t *audio)
+{
+	UNUSED_PARAMETER(audio);
+	return 2;
+}
+
+bool obs_encoder_get_extra_data(const obs_encoder_t *encoder,
+				uint8_t **extra_data, size_t *size)
+{
+	if (encoder->audio) {
+		*extra_data = audio_header;
+		*size = sizeof(audio_header);
+	} else {
+		*extra_data = video_header;
+		*size = sizeof(video_header);
+	}
+	return true;
+}
+
+/* ------------------------------------------------------------------------- */
+/* packets */
+
+struct test_buffer {
+	volatile long refs;
+	uint8_t data[];
+};
+
+static volatile long live_buffers = 0;
+
+static inline struct test_buffer *get_buffer(uint8_t *data)
+{
+	return (struct test_buffer *)(data - offsetof(struct test_buffer, data));
+}
+
+static void alloc_packet(struct encoder_packet *packet, size_t size)
+{
+	struct test_buffer *buf = bmalloc(sizeof(*buf) + size);
+	buf->refs = 1;
+	packet->data = buf->data;
+	packet->size = size;
+	os_atomic_inc_long(&live_buffers);
+}
+
+void obs_encoder_packet_ref(struct encoder_packet *dst,
+			    struct encoder_packet *src)
+{
+	if (src->data)
+		os_atomic_inc_long(&get_buffer(src->data)->refs);
+	*dst = *src;
+}
+
+void obs_encoder_packet_release(struct encoder_packet *packet)
+{
+	if (packet->data) {
+		struct test_buffer *buf = get_buffer(packet->data);
+		if (os_atomic_dec_long(&buf->refs) == 0) {
+			os_atomic_dec_long(&live_buffers);
+			bfree(buf);
+		}
+	}
+
+	memset(packet, 0, sizeof(*packet));
+}
+
+/* the payload isn't annex b, it's sent as it is */
+void obs_parse_avc_packet(struct encoder_packet *avc_packet,
+			  const struct encoder_packet *src)
+{
+	obs_encoder_packet_ref(avc_packet, (struct encoder_packet *)src);
+}
+
+uint8_t *obs_encoder_packet_get_headroom(struct encoder_packet *packet,
+					 size_t head_size, size_t tail_size)
+{
+	UNUSED_PARAMETER(packet);
+	UNUSED_PARAMETER(head_size);
+	UNUSED_PARAMETER(tail_size);
+	return NULL;
+}
+
+static inline uint8_t frame_byte(int frame, size_t i)
+{
+	return (uint8_t)(frame * 31 + (int)i);
+}
+
+static void make_video_packet(struct encoder_packet *packet, int frame,
+			      int64_t base_usec)
+{
+	bool keyframe = frame % KEYFRAME_INTERVAL == 0;
+	size_t size = keyframe ? 40000 : 12000;
+
+	alloc_packet(packet, size);
+	packet->type = OBS_ENCODER_VIDEO;
+	packet->keyframe = keyframe;
+	packet->priority = keyframe ? OBS_NAL_PRIORITY_HIGHEST
+				    : OBS_NAL_PRIORITY_HIGH;
+	packet->drop_priority = packet->priority;
+	packet->timebase_num = 1;
+	packet->timebase_den = FPS;
+	packet->pts = packet->dts = frame;
+	packet->dts_usec = (int64_t)frame * 1000000 / FPS;
+	packet->sys_dts_usec = base_usec + packet->dts_usec;
+
+	/* the frame number first, then bytes that depend on it */
+	memcpy(packet->data, &frame, sizeof(frame));
+	for (size_t i = sizeof(frame); i < size; i++)
+		packet->data[i] = frame_byte(frame, i);
+}
+
+static void make_audio_packet(struct encoder_packet *packet, int frame,
+			      int64_t base_usec)
+{
+	alloc_packet(packet, 400);
+	memset(packet->data, 0, 400);
+	packet->type = OBS_ENCODER_AUDIO;
+	packet->timebase_num = AUDIO_FRAMES;
+	packet->timebase_den = SAMPLE_RATE;
+	packet->pts = packet->dts = frame;
+	packet->dts_usec = (int64_t)frame * AUDIO_FRAMES * 1000000 / SAMPLE_RATE;
+	packet->sys_dts_usec = base_usec + packet->dts_usec;
+}
+
+/* ------------------------------------------------------------------------- */
+/* listeners */
+
+struct test_server {
+	int listen_fd;
+	int port;
+	char url[64];
+	pthread_t thread;
+	os_sem_t *done_sem;
+	volatile bool quit;
+
+	/* of the last connection */
+	long meta;
+	long video_headers;
+	long audio_headers;
+	long video;
+	long audio;
+	long errors;
+	int last_frame;
+};
+
+static bool read_all(int fd, char *buf, size_t size)
+{
+	while (size) {
+		ssize_t ret = recv(fd, buf, size, 0);
+		if (ret <= 0)
+			return false;
+		buf += ret;
+		size -= (size_t)ret;
+	}
+	return true;
+}
+
+static bool send_all(int fd, const char *buf, size_t size)
+{
+	while (size) {
+		ssize_t ret = send(fd, buf, size, 0);
+		if (ret <= 0)
+			return false;
+		buf += ret;
+		size -= (size_t)ret;
+	}
+	return true;
+}
+
+static bool handshake(int fd)
+{
+	char c0c1[HANDSHAKE_SIZE + 1];
+	char s0s1[HANDSHAKE_SIZE + 1] = {3};
+	char c2[HANDSHAKE_SIZE];
+
+	return read_all(fd, c0c1, sizeof(c0c1)) &&
+	       send_all(fd, s0s1, sizeof(s0s1)) &&
+	       send_all(fd, c0c1 + 1, HANDSHAKE_SIZE) &&
+	       read_all(fd, c2, sizeof(c2));
+}
+
+enum reply {
+	REPLY_RESULT,
+	REPLY_STREAM_ID,
+	REPLY_PUBLISH,
+};
+
+static void send_reply(RTMP *rtmp, const char *method, double txn,
+		       enum reply reply)
+{
+	char buf[512];
+	char *enc = buf + RTMP_MAX_HEADER_SIZE;
+	char *end = buf + sizeof(buf);
+	RTMPPacket packet = {0};
+	AVal name = {(char *)method, (int)strlen(method)};
+
+	packet.m_nChannel = 3;
+	packet.m_headerType = RTMP_PACKET_SIZE_MEDIUM;
+	packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
+	packet.m_body = enc;
+
+	enc = AMF_EncodeString(enc, end, &name);
+	enc = AMF_EncodeNumber(enc, end, txn);
+	*enc++ = AMF_NULL;
+
+	if (reply == REPLY_STREAM_ID) {
+		enc = AMF_EncodeNumber(enc, end, 1.0);
+
+	} else if (reply == REPLY_PUBLISH) {
+		AVal level = AVC("level"), status = AVC("status");
+		AVal code = AVC("code"), start = AVC("NetStream.Publish.Start");
+
+		*enc++ = AMF_OBJECT;
+		enc = AMF_EncodeNamedString(enc, end, &level, &status);
+		enc = AMF_EncodeNamedString(enc, end, &code, &start);
+		*enc++ = 0;
+		*enc++ = 0;
+		*enc++ = AMF_OBJECT_END;
+	}
+
+	packet.m_nBodySize = (uint32_t)(enc - packet.m_body);
+	RTMP_SendPacket(rtmp, &packet, false);
+}
+
+static inline bool is_method(const AVal *method, const char *name)
+{
+	return method->av_len == (int)strlen(name) &&
+	       memcmp(method->av_val, name, method->av_len) == 0;
+}
+
+static void handle_invoke(RTMP *rtmp, RTMPPacket *packet)
+{
+	AMFObject obj;
+	AVal method;
+	double txn;
+
+	if (AMF_Decode(&obj, packet->m_body, packet->m_nBodySize, false) < 0)
+		return;
+
+	AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
+	txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
+
+	if (is_method(&method, "connect"))
+		send_reply(rtmp, "_result", txn, REPLY_RESULT);
+	else if (is_method(&method, "createStream"))
+		send_reply(rtmp, "_result", txn, REPLY_STREAM_ID);
+	else if (is_method(&method, "publish"))
+		send_reply(rtmp, "onStatus", 0, REPLY_PUBLISH);
+
+	AMF_Reset(&obj);
+}
+
+static void handle_video(struct test_server *server, RTMPPacket *packet)
+{
+	const uint8_t *body = (const uint8_t *)packet->m_body;
+	const uint8_t *data = body + 5;
+	size_t size = packet->m_nBodySize - 5;
+	int frame;
+
+	if (body[1] == 0) {
+		server->video_headers++;
+		return;
+	}
+
+	if (size < sizeof(frame)) {
+		server->errors++;
+		return;
+	}
+
+	memcpy(&frame, data, sizeof(frame));
+
+	for (size_t i = sizeof(frame); i < size; i++) {
+		if (data[i] != frame_byte(frame, i)) {
+			server->errors++;
+			break;
+		}
+	}
+
+	if (frame <= server->last_frame)
+		server->errors++;
+
+	server->last_frame = frame;
+	server->video++;
+}
+
+static void serve_connection(struct test_server *server, int fd)
+{
+	RTMPPacket packet = {0};
+	RTMP rtmp;
+
+	server->meta = 0;
+	server->video_headers = 0;
+	server->audio_headers = 0;
+	server->video = 0;
+	server->audio = 0;
+	server->errors = 0;
+	server->last_frame = -1;
+
+	if (!handshake(fd))
+		return;
+
+	RTMP_Init(&rtmp);
+	rtmp.m_sb.sb_socket = fd;
+
+	while (RTMP_IsConnected(&rtmp) && RTMP_ReadPacket(&rtmp, &packet)) {
+		if (!RTMPPacket_IsReady(&packet))
+			continue;
+
+		switch (packet.m_packetType) {
+		case RTMP_PACKET_TYPE_CHUNK_SIZE:
+			rtmp.m_inChunkSize = AMF_DecodeInt32(packet.m_body);
+			break;
+		case RTMP_PACKET_TYPE_INVOKE:
+			handle_invoke(&rtmp, &packet);
+			break;
+		case RTMP_PACKET_TYPE_INFO:
+			server->meta++;
+			break;
+		case RTMP_PACKET_TYPE_VIDEO:
+			handle_video(server, &packet);
+			break;
+		case RTMP_PACKET_TYPE_AUDIO:
+			if (packet.m_body[1] == 0)
+				server->audio_headers++;
+			else
+				server->audio++;
+			break;
+		}
+
+		RTMPPacket_Free(&packet);
+	}
+
+	RTMPPacket_Free(&packet);
+}
+
+static void *server_thread(void *data)
+{
+	struct test_server *server = data;
+	int fd;
+
+	while ((fd = accept(server->listen_fd, NULL, NULL)) >= 0) {
+		if (os_atomic_load_bool(&server->quit)) {
+			close(fd);
+			break;
+		}
+
+		serve_connection(server, fd);
+		close(fd);
+		os_sem_post(server->done_sem);
+	}
+
+	return NULL;
+}
+
+static bool server_start(struct test_server *server)
+{
+	struct sockaddr_in addr = {0};
+	socklen_t len = sizeof(addr);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server->listen_fd < 0)
+		return false;
+	if (bind(server->listen_fd, (struct sockaddr *)&addr, len) != 0)
+		return false;
+	if (listen(server->listen_fd, 1) != 0)
+		return false;
+	if (getsockname(server->listen_fd, (struct sockaddr *)&addr, &len))
+		return false;
+
+	server->port = ntohs(addr.sin_port);
+	snprintf(server->url, sizeof(server->url), "rtmp://127.0.0.1:%d/live",
+		 server->port);
+
+	if (os_sem_init(&server->done_sem, 0) != 0)
+		return false;
+	return pthread_create(&server->thread, NULL, server_thread, server) ==
+	       0;
+}
+
+/* wakes the listener up with a connection of its own to let it quit */
+static void server_stop(struct test_server *server)
+{
+	struct sockaddr_in addr = {0};
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons((uint16_t)server->port);
+
+	os_atomic_set_bool(&server->quit, true);
+	connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	pthread_join(server->thread, NULL);
+
+	close(fd);
+	close(server->listen_fd);
+	os_sem_destroy(server->done_sem);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static volatile bool stop_polling = false;
+
+static void *poll_thread(void *data)
+{
+	void *stream = data;
+
+	while (!os_atomic_load_bool(&stop_polling)) {
+		rtmp_multi_output_info.get_total_bytes(stream);
+		rtmp_multi_output_info.get_dropped_frames(stream);
+		rtmp_multi_output_info.get_congestion(stream);
+		rtmp_multi_output_info.get_connect_time_ms(stream);
+		os_sleep_ms(1);
+	}
+
+	return NULL;
+}
+
+static obs_data_t *create_settings(struct test_server *servers)
+{
+	obs_data_t *settings = obs_data_create();
+	obs_data_array_t *targets = obs_data_array_create();
+
+	for (size_t i = 0; i < NUM_SERVERS; i++) {
+		obs_data_t *target = obs_data_create();
+		obs_data_set_string(target, "server", servers[i].url);
+		obs_data_set_string(target, "key", "key");
+		obs_data_array_push_back(targets, target);
+		obs_data_release(target);
+	}
+
+	obs_data_set_array(settings, "targets", targets);
+	obs_data_set_int(settings, "drop_threshold_ms", 700);
+	obs_data_set_int(settings, "pframe_drop_threshold_ms", 900);
+	obs_data_set_int(settings, "max_shutdown_time_sec", 30);
+	obs_data_set_string(settings, "bind_ip", "default");
+	obs_data_array_release(targets);
+	return settings;
+}
+
+/* streams a second of video and stops at its end */
+static bool run_cycle(struct obs_output *output, void *stream, int cycle)
+{
+	uint64_t start_ns;
+	int64_t base_usec;
+	int64_t stop_usec;
+	int video_frame = 0;
+	int audio_frame = 0;
+
+	os_event_reset(output->begun);
+	os_event_reset(output->ended);
+
+	if (!rtmp_multi_output_info.start(stream)) {
+		printf("cycle %d: failed to start\n", cycle);
+		return false;
+	}
+	if (os_event_timedwait(output->begun, 10000) != 0) {
+		printf("cycle %d: never connected, stop code %ld\n", cycle,
+		       os_atomic_load_long(&output->stop_code));
+		return false;
+	}
+
+	start_ns = os_gettime_ns();
+	base_usec = (int64_t)(start_ns / 1000);
+
+	while (video_frame < FRAMES) {
+		struct encoder_packet packet = {0};
+		int64_t video_usec = (int64_t)video_frame * 1000000 / FPS;
+		int64_t audio_usec = (int64_t)audio_frame * AUDIO_FRAMES *
+				     1000000 / SAMPLE_RATE;
+
+		if (video_usec <= audio_usec) {
+			os_sleepto_ns(start_ns + (uint64_t)video_usec * 1000);
+			make_video_packet(&packet, video_frame++, base_usec);
+		} else {
+			make_audio_packet(&packet, audio_frame++, base_usec);
+		}
+
+		rtmp_multi_output_info.encoded_packet(stream, &packet);
+		obs_encoder_packet_release(&packet);
+	}
+
+	/* stop after the last frame, the audio past it lets the targets
+	 * finish */
+	stop_usec = base_usec + (int64_t)video_frame * 1000000 / FPS;
+	rtmp_multi_output_info.stop(stream, (uint64_t)stop_usec * 1000);
+
+	for (int i = 0; i < 4; i++) {
+		struct encoder_packet packet = {0};
+		make_audio_packet(&packet, audio_frame++, base_usec);
+		rtmp_multi_output_info.encoded_packet(stream, &packet);
+		obs_encoder_packet_release(&packet);
+	}
+
+	if (os_event_timedwait(output->ended, 20000) != 0) {
+		printf("cycle %d: never stopped\n", cycle);
+		return false;
+	}
+
+	return os_atomic_load_long(&output->stop_code) == OBS_OUTPUT_SUCCESS;
+}
+
+static bool check_servers(struct test_server *servers, int cycle)
+{
+	bool success = true;
+
+	for (size_t i = 0; i < NUM_SERVERS; i++) {
+		struct test_server *server = &servers[i];
+		bool server_success = server->errors == 0 && server->meta &&
+				      server->video_headers &&
+				      server->audio_headers && server->video;
+
+		printf("cycle %d, server %d: %ld/%d frames, last %d, "
+		       "%ld audio, %ld errors%s\n",
+		       cycle, (int)i, server->video, FRAMES,
+		       server->last_frame, server->audio, server->errors,
+		       server_success ? "" : " - FAILED");
+
+		if (!server_success)
+			success = false;
+	}
+
+	return success;
+}
+
+int main(void)
+{
+	struct test_server servers[NUM_SERVERS] = {0};
+	struct obs_output output = {0};
+	pthread_t poller;
+	void *stream;
+	int failures = 0;
+
+	for (size_t i = 0; i < NUM_SERVERS; i++) {
+		if (!server_start(&servers[i])) {
+			printf("failed to start listener %d\n", (int)i);
+			return 1;
+		}
+	}
+
+	output.settings = create_settings(servers);
+	video_encoder.settings = obs_data_create();
+	obs_data_set_int(video_encoder.settings, "bitrate", 2500);
+	audio_encoder.settings = obs_data_create();
+	obs_data_set_int(audio_encoder.settings, "bitrate", 160);
+	os_event_init(&output.begun, OS_EVENT_TYPE_MANUAL);
+	os_event_init(&output.ended, OS_EVENT_TYPE_MANUAL);
+
+	stream = rtmp_multi_output_info.create(output.settings, &output);
+	if (!stream)
+		return 1;
+
+	pthread_create(&poller, NULL, poll_thread, stream);
+
+	for (int cycle = 0; cycle < CYCLES; cycle++) {
+		bool success = run_cycle(&output, stream, cycle);
+
+		/* every listener is done once its connection closed */
+		if (success) {
+			for (size_t i = 0; i < NUM_SERVERS; i++)
+				os_sem_wait(servers[i].done_sem);
+			success = check_servers(servers, cycle);
+		}
+
+		if (!success)
+			failures++;
+	}
+
+	os_atomic_set_bool(&stop_polling, true);
+	pthread_join(poller, NULL);
+
+	rtmp_multi_output_info.destroy(stream);
+
+	for (size_t i = 0; i < NUM_SERVERS; i++)
+		server_stop(&servers[i]);
+
+	obs_data_release(output.settings);
+	obs_data_release(video_encoder.settings);
+	obs_data_release(audio_encoder.settings);
+	os_event_destroy(output.begun);
+	os_event_destroy(output.ended);
+
+	printf("%d/%d cycles passed, %ld packets and %ld allocations leaked\n",
+	       CYCLES - failures, CYCLES, live_buffers, bnum_allocs());
+	return failures || live_buffers || bnum_allocs() ? 1 : 0;
+}